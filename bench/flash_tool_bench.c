@@ -0,0 +1,684 @@
+/*
+ * Microbenchmarks for the host-side hot paths: packet checksums, mtk_device
+ * buffering and the big-endian helpers (over an in-memory transport), and the
+ * io_handler file I/O used for dumps and flashing. The async_session case
+ * runs a whole mtk_async session against the emulator, so it also checks the
+ * asynchronous state machines end to end.
+ *
+ * Results can be saved as a baseline and compared against by later runs.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flash_tool/io_handler.h"
+#include "flash_tool/progress.h"
+
+#include "mtk_async.h"
+#include "mtk_da.h"
+#include "mtk_device.h"
+#include "mtk_emulator.h"
+#include "mtk_preloader.h"
+#include "src/util.h"
+
+#define BENCH_DEFAULT_SIZE (16 * 1024 * 1024)
+#define BENCH_DEFAULT_ITERATIONS (10)
+#define BENCH_DEFAULT_THRESHOLD (10.0)
+#define BENCH_MAX_BASELINE (64)
+#define BENCH_NAME_MAX (32)
+// DA Stage 1 and 2 sent in the async session; the emulator only checksums them
+#define BENCH_DA_SIZE (0x10000)
+
+struct config {
+    size_t size;
+    unsigned int iterations;
+    const char *filter;
+    const char *dir;
+    const char *save;
+    const char *compare;
+    double threshold;
+    enum io_mode io_mode;
+};
+
+// Device side of the in-memory transport: reads replay the pattern, writes are counted and dropped.
+struct mem_pipe {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    uint64_t written;
+};
+
+struct bench {
+    const struct config *config;
+
+    uint8_t *data;
+    uint8_t *out;
+    struct mem_pipe pipe;
+    mtk_device device;
+
+    int fd;
+    char path[4096];
+};
+
+struct result {
+    char name[BENCH_NAME_MAX];
+    size_t size;
+    double ns_per_byte;
+};
+
+struct bench_case {
+    const char *name;
+    // processes config->size bytes once; returns a negative error code on failure
+    int (*run)(struct bench *bench);
+    // works on the scratch file
+    bool scratch;
+};
+
+// the operation in flight on an async session
+struct async_op {
+    unsigned int started;
+    unsigned int completed;
+    int err;
+};
+
+static volatile uint16_t sink;
+
+static int pipe_bulk_in(void *ctx, uint8_t *buffer, int length, int *transferred, unsigned int timeout_ms) {
+    (void)timeout_ms;
+    struct mem_pipe *pipe = ctx;
+
+    size_t count = MIN((size_t)length, pipe->size - pipe->offset);
+    memcpy(buffer, pipe->data + pipe->offset, count);
+    pipe->offset = (pipe->offset + count) % pipe->size;
+
+    *transferred = (int)count;
+    return 0;
+}
+
+static int pipe_bulk_out(void *ctx, const uint8_t *buffer, int length, int *transferred, unsigned int timeout_ms) {
+    (void)buffer;
+    (void)timeout_ms;
+    struct mem_pipe *pipe = ctx;
+
+    pipe->written += length;
+    *transferred = length;
+    return 0;
+}
+
+static int pipe_clear_halt(void *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+static int pipe_control(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index) {
+    (void)ctx;
+    (void)request_type;
+    (void)request;
+    (void)value;
+    (void)index;
+    return 0;
+}
+
+static const mtk_transport pipe_transport = {
+    .bulk_in = pipe_bulk_in,
+    .bulk_out = pipe_bulk_out,
+    .clear_halt = pipe_clear_halt,
+    .control = pipe_control,
+};
+
+static int bench_da_checksum(struct bench *bench) {
+    sink = mtk_da_checksum(0, bench->data, bench->config->size);
+    return 0;
+}
+
+static int bench_preloader_checksum(struct bench *bench) {
+    sink = mtk_preloader_checksum(0, bench->data, bench->config->size);
+    return 0;
+}
+
+static int bench_device_read(struct bench *bench) {
+    size_t size = bench->config->size;
+
+    for (size_t offset = 0; offset < size; offset += MTK_DA_PACKET_SIZE) {
+        int err;
+        if ((err = mtk_device_read(&bench->device, bench->out + offset, MIN((size_t)MTK_DA_PACKET_SIZE, size - offset))) < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_device_read_be16(struct bench *bench) {
+    uint16_t value = 0;
+
+    for (size_t offset = 0; offset + sizeof(value) <= bench->config->size; offset += sizeof(value)) {
+        int err;
+        if ((err = mtk_device_read16(&bench->device, &value)) < 0) {
+            return err;
+        }
+    }
+
+    sink = value;
+    return 0;
+}
+
+static int bench_device_read_be32(struct bench *bench) {
+    uint32_t value = 0;
+
+    for (size_t offset = 0; offset + sizeof(value) <= bench->config->size; offset += sizeof(value)) {
+        int err;
+        if ((err = mtk_device_read32(&bench->device, &value)) < 0) {
+            return err;
+        }
+    }
+
+    sink = (uint16_t)value;
+    return 0;
+}
+
+static int bench_device_write_be32(struct bench *bench) {
+    for (size_t offset = 0; offset + sizeof(uint32_t) <= bench->config->size; offset += sizeof(uint32_t)) {
+        int err;
+        if ((err = mtk_device_write32(&bench->device, (uint32_t)offset)) < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_io(struct bench *bench, bool flashing) {
+    size_t size = bench->config->size;
+    struct file_info fi = { .fd = bench->fd };
+
+    for (size_t offset = 0; offset < size; offset += MTK_DA_PACKET_SIZE) {
+        size_t count = MIN((size_t)MTK_DA_PACKET_SIZE, size - offset);
+
+        int err;
+        if ((err = io_handler(flashing, offset, size, (flashing ? bench->out : bench->data) + offset, count, &fi)) < 0) {
+            return err;
+        }
+    }
+
+    return fsync(bench->fd) < 0 ? -errno : 0;
+}
+
+// dump path: device data written to the output file
+static int bench_io_write(struct bench *bench) {
+    return bench_io(bench, false);
+}
+
+// flash path: image read from the input file
+static int bench_io_read(struct bench *bench) {
+    return bench_io(bench, true);
+}
+
+static void async_done(mtk_async *async, int err, void *user_data) {
+    (void)async;
+    struct async_op *op = user_data;
+    op->err = err;
+    op->completed++;
+}
+
+// Runs the emulator until the operation whose start call returned err has called back.
+static int async_run(mtk_async *async, struct async_op *op, int err) {
+    op->started++;
+    while (err >= 0 && op->completed < op->started) {
+        err = mtk_async_wait(async, MTK_DEVICE_TMOUT);
+    }
+    return err < 0 ? err : op->err;
+}
+
+// Produces the DA images and the written data from the pattern.
+static int pattern_handler(bool flashing, size_t offset, size_t total, uint8_t *buffer, size_t count, void *user_data) {
+    (void)flashing;
+    (void)total;
+    memcpy(buffer, (const uint8_t *)user_data + offset, count);
+    return 0;
+}
+
+// Preloader handshake, both DA stages, then config->size bytes written and read back.
+static int async_session(struct bench *bench, mtk_async *async) {
+    // the emulated DA needs no settle time
+    static const mtk_soc_timing emulator_timing = {
+        .hw_code = MTK_EMULATOR_HW_CODE, .config_timeout_ms = 1000, .boot_timeout_ms = 2000, .preloader_timeout_ms = 1000
+    };
+    static const uint8_t report_sizes[MTK_DA_FLASH_REPORTS] = { 0x1c, 0x11, 0xe, 0x9, MTK_DA_EMMC_REPORT_SIZE, 0x1c, 0x26 };
+
+    size_t size = bench->config->size;
+    uint32_t da_len = MIN(size, (size_t)BENCH_DA_SIZE);
+    struct async_op op = { 0 };
+    uint16_t hw_code, hw_subcode, hw_ver, sw_ver, status;
+    uint32_t tgt_config;
+    int err;
+
+    mtk_async_set_timing(async, &emulator_timing);
+    if ((err = async_run(async, &op, mtk_async_preloader_start(async, async_done, &op))) < 0 ||
+        (err = async_run(async, &op, mtk_async_preloader_get_hw_code(async, &hw_code, &status, async_done, &op))) < 0) {
+        return err;
+    }
+    if (hw_code != MTK_EMULATOR_HW_CODE || status != 0) {
+        return -EPROTO;
+    }
+    if ((err = async_run(async, &op, mtk_async_preloader_get_hw_sw_ver(async, &hw_subcode, &hw_ver, &sw_ver, &status, async_done, &op))) < 0 ||
+        (err = async_run(async, &op, mtk_async_preloader_get_tgt_config(async, &tgt_config, &status, async_done, &op))) < 0 ||
+        (err = async_run(async, &op, mtk_async_preloader_disable_wdt(async, &status, async_done, &op))) < 0) {
+        return err;
+    }
+    if (status != 0) {
+        return -EPROTO;
+    }
+
+    if ((err = async_run(async, &op, mtk_async_preloader_send_da(async, 0x200000, da_len, 0, &status, pattern_handler, bench->data, async_done, &op))) < 0) {
+        return err;
+    }
+    if (status != 0) {
+        return -EPROTO;
+    }
+    if ((err = async_run(async, &op, mtk_async_preloader_jump_da(async, 0x200000, &status, async_done, &op))) < 0) {
+        return err;
+    }
+    if (status != 0) {
+        return -EPROTO;
+    }
+
+    uint32_t nand_ret, emmc_ret, emmc_id[4];
+    uint8_t da_major_ver, da_minor_ver, retval;
+    if ((err = async_run(async, &op, mtk_async_da_sync(async, &nand_ret, &emmc_ret, emmc_id, &da_major_ver, &da_minor_ver, async_done, &op))) < 0 ||
+        (err = async_run(async, &op, mtk_async_da_send_da(async, 0x40000000, da_len, &retval, pattern_handler, bench->data, async_done, &op))) < 0) {
+        return err;
+    }
+    if (retval != MTK_DA_ACK) {
+        return -EPROTO;
+    }
+
+    mtk_da_emmc_info emmc;
+    for (size_t i = 0; i < MTK_DA_FLASH_REPORTS; i++) {
+        uint8_t report[0x100];
+        if ((err = async_run(async, &op, mtk_async_read(async, report, report_sizes[i], async_done, &op))) < 0) {
+            return err;
+        }
+        if (i == MTK_DA_EMMC_REPORT) {
+            mtk_da_parse_emmc_report(report, &emmc);
+        }
+    }
+    uint8_t passinfo[sizeof(struct passinfo)];
+    if ((err = async_run(async, &op, mtk_async_read(async, passinfo, sizeof(passinfo), async_done, &op))) < 0) {
+        return err;
+    }
+    if (passinfo[0] != MTK_DA_ACK || emmc.area_sizes[MTK_DA_EMMC_PART_USER - 1] != size) {
+        return -EPROTO;
+    }
+
+    if ((err = async_run(async, &op,
+             mtk_async_da_write_data(async, MTK_DA_STORAGE_SDMMC, MTK_DA_EMMC_PART_USER, 0, size, &retval, pattern_handler, bench->data, async_done, &op))) < 0) {
+        return err;
+    }
+    // every packet is acknowledged with CONT_CHAR, the last one too
+    if (retval != MTK_DA_CONT_CHAR) {
+        return -EPROTO;
+    }
+    if ((err = async_run(async, &op, mtk_async_da_read(async, MTK_DA_STORAGE_SDMMC, 0, size, bench->out, &retval, NULL, NULL, async_done, &op))) < 0) {
+        return err;
+    }
+    if (retval != MTK_DA_ACK || memcmp(bench->out, bench->data, size) != 0) {
+        return -EPROTO;
+    }
+
+    // reboots the emulated device, which ends its thread
+    if ((err = async_run(async, &op, mtk_async_da_enable_watchdog(async, 5000, true, true, false, false, &retval, async_done, &op))) < 0) {
+        return err;
+    }
+    return retval == MTK_DA_ACK ? 0 : -EPROTO;
+}
+
+// whole session against an emulator backed by the zeroed scratch file
+static int bench_async_session(struct bench *bench) {
+    if (ftruncate(bench->fd, 0) < 0 || ftruncate(bench->fd, bench->config->size) < 0) {
+        return -errno;
+    }
+
+    mtk_emulator_config emulator_config = { .image = bench->path, .state = MTK_EMULATOR_STATE_NONE };
+    mtk_emulator *emulator;
+    int err;
+    if ((err = mtk_emulator_open(&emulator, &emulator_config)) < 0) {
+        return err;
+    }
+
+    mtk_device device;
+    mtk_emulator_attach(emulator, &device);
+
+    mtk_async *async;
+    if ((err = mtk_async_open(&async, &device)) == 0) {
+        err = async_session(bench, async);
+        mtk_async_close(async);
+    }
+
+    mtk_emulator_close(emulator);
+    return err;
+}
+
+static const struct bench_case cases[] = {
+    { "da_checksum", bench_da_checksum, false },
+    { "preloader_checksum", bench_preloader_checksum, false },
+    { "device_read", bench_device_read, false },
+    { "device_read_be16", bench_device_read_be16, false },
+    { "device_read_be32", bench_device_read_be32, false },
+    { "device_write_be32", bench_device_write_be32, false },
+    { "io_write", bench_io_write, true },
+    { "io_read", bench_io_read, true },
+    { "async_session", bench_async_session, true },
+};
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Runs one case after a warm-up pass and reports the median iteration time.
+static int run_case(struct bench *bench, const struct bench_case *bench_case, struct result *result) {
+    const struct config *config = bench->config;
+
+    uint64_t *times = calloc(config->iterations, sizeof(uint64_t));
+    if (times == NULL) {
+        return -ENOMEM;
+    }
+
+    int err = bench_case->run(bench);
+    for (unsigned int i = 0; i < config->iterations && err >= 0; i++) {
+        uint64_t start = monotonic_us();
+        err = bench_case->run(bench);
+        times[i] = monotonic_us() - start;
+    }
+
+    if (err >= 0) {
+        qsort(times, config->iterations, sizeof(uint64_t), compare_u64);
+        snprintf(result->name, sizeof(result->name), "%s", bench_case->name);
+        result->size = config->size;
+        result->ns_per_byte = times[config->iterations / 2] * 1000.0 / config->size;
+    }
+
+    free(times);
+    return err;
+}
+
+static size_t load_baseline(const char *path, struct result *baseline, size_t max) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open baseline %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+
+    size_t count = 0;
+    char line[256];
+    while (count < max && fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') {
+            continue;
+        }
+
+        struct result *r = &baseline[count];
+        if (sscanf(line, "%31s %zu %lf", r->name, &r->size, &r->ns_per_byte) == 3) {
+            count++;
+        }
+    }
+
+    fclose(f);
+    return count;
+}
+
+static const struct result *find_baseline(const struct result *baseline, size_t count, const char *name) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(baseline[i].name, name) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+static int open_scratch_file(struct bench *bench) {
+    snprintf(bench->path, sizeof(bench->path), "%s/flash_tool_bench.XXXXXX", bench->config->dir);
+
+    bench->fd = mkstemp(bench->path);
+    if (bench->fd < 0) {
+        return -errno;
+    }
+
+    // the read case needs a file to read back before the write case has run
+    struct file_info fi = { .fd = bench->fd };
+    int err = io_transfer(false, 0, bench->data, bench->config->size, &fi);
+    if (err < 0) {
+        close(bench->fd);
+        unlink(bench->path);
+        return err;
+    }
+
+    return 0;
+}
+
+static bool parse_size(const char *arg, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 0);
+    if (errno != 0 || end == arg) {
+        return false;
+    }
+
+    switch (*end) {
+    case 'G':
+        value *= 1024;
+        // fall through
+    case 'M':
+        value *= 1024;
+        // fall through
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    }
+
+    if (*end != '\0' || value == 0) {
+        return false;
+    }
+
+    *size = value;
+    return true;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s, --size SIZE         bytes processed per iteration, K/M/G suffixes allowed (default: 16M)\n");
+    fprintf(stderr, "  -n, --iterations N      timed iterations per benchmark (default: %d)\n", BENCH_DEFAULT_ITERATIONS);
+    fprintf(stderr, "  -f, --filter TEXT       only run benchmarks whose name contains TEXT\n");
+    fprintf(stderr, "  -d, --dir DIR           directory for the I/O scratch file and the emulated eMMC (default: .)\n");
+    fprintf(stderr, "  -o, --io MODE           file I/O mode for the io_* benchmarks: buffered, paced or direct\n");
+    fprintf(stderr, "      --save FILE         write the results as a baseline\n");
+    fprintf(stderr, "      --compare FILE      compare against a saved baseline\n");
+    fprintf(stderr, "      --threshold PCT     slowdown that counts as a regression (default: %.0f)\n", BENCH_DEFAULT_THRESHOLD);
+    fprintf(stderr, "  -h, --help              show this help\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Exits with 1 when --compare finds a regression.\n");
+    exit(2);
+}
+
+static void parse_arguments(int argc, char **argv, struct config *config) {
+    config->size = BENCH_DEFAULT_SIZE;
+    config->iterations = BENCH_DEFAULT_ITERATIONS;
+    config->filter = NULL;
+    config->dir = ".";
+    config->save = NULL;
+    config->compare = NULL;
+    config->threshold = BENCH_DEFAULT_THRESHOLD;
+    config->io_mode = IO_MODE_BUFFERED;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage(argv[0]);
+        }
+
+        if (value == NULL) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            usage(argv[0]);
+        }
+
+        if (strcmp(arg, "-s") == 0 || strcmp(arg, "--size") == 0) {
+            if (!parse_size(value, &config->size)) {
+                fprintf(stderr, "Invalid size: %s\n", value);
+                usage(argv[0]);
+            }
+        } else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--iterations") == 0) {
+            config->iterations = strtoul(value, NULL, 0);
+            if (config->iterations == 0) {
+                fprintf(stderr, "Invalid iteration count: %s\n", value);
+                usage(argv[0]);
+            }
+        } else if (strcmp(arg, "-f") == 0 || strcmp(arg, "--filter") == 0) {
+            config->filter = value;
+        } else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--dir") == 0) {
+            config->dir = value;
+        } else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--io") == 0) {
+            if (strcmp(value, "buffered") == 0) {
+                config->io_mode = IO_MODE_BUFFERED;
+            } else if (strcmp(value, "paced") == 0) {
+                config->io_mode = IO_MODE_PACED;
+            } else if (strcmp(value, "direct") == 0) {
+                config->io_mode = IO_MODE_DIRECT;
+            } else {
+                fprintf(stderr, "Invalid I/O mode: %s\n", value);
+                usage(argv[0]);
+            }
+        } else if (strcmp(arg, "--save") == 0) {
+            config->save = value;
+        } else if (strcmp(arg, "--compare") == 0) {
+            config->compare = value;
+        } else if (strcmp(arg, "--threshold") == 0) {
+            config->threshold = strtod(value, NULL);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            usage(argv[0]);
+        }
+        i++;
+    }
+}
+
+int main(int argc, char **argv) {
+    static struct config config;
+    static struct bench bench;
+    static struct result results[sizeof(cases) / sizeof(cases[0])];
+    static struct result baseline[BENCH_MAX_BASELINE];
+
+    parse_arguments(argc, argv, &config);
+    bench.config = &config;
+    bench.fd = -1;
+
+    int err;
+    if ((err = io_set_mode(config.io_mode)) < 0) {
+        fprintf(stderr, "I/O mode not supported: %s\n", strerror(-err));
+        return 2;
+    }
+    progress_set_terminal(false);
+
+    size_t baseline_count = 0;
+    if (config.compare != NULL) {
+        baseline_count = load_baseline(config.compare, baseline, BENCH_MAX_BASELINE);
+    }
+
+    // page aligned so the direct I/O mode transfers without bouncing
+    if (posix_memalign((void **)&bench.data, 4096, config.size) != 0 || posix_memalign((void **)&bench.out, 4096, config.size) != 0) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", config.size);
+        return 2;
+    }
+
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < config.size; i++) {
+        seed = seed * 1103515245 + 12345;
+        bench.data[i] = seed >> 16;
+    }
+    memset(bench.out, 0, config.size);
+
+    bench.pipe.data = bench.data;
+    bench.pipe.size = config.size;
+    mtk_device_open_transport(&bench.device, &pipe_transport, &bench.pipe);
+
+    printf("%-20s %12s %10s %10s", "benchmark", "bytes", "ns/byte", "MB/s");
+    if (config.compare != NULL) {
+        printf(" %10s %8s", "baseline", "change");
+    }
+    printf("\n");
+
+    size_t count = 0;
+    int regressions = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const struct bench_case *bench_case = &cases[i];
+        if (config.filter != NULL && strstr(bench_case->name, config.filter) == NULL) {
+            continue;
+        }
+
+        if (bench_case->scratch && bench.fd < 0 && (err = open_scratch_file(&bench)) < 0) {
+            fprintf(stderr, "Unable to create scratch file in %s: %s\n", config.dir, strerror(-err));
+            return 2;
+        }
+
+        struct result *result = &results[count];
+        if ((err = run_case(&bench, bench_case, result)) < 0) {
+            fprintf(stderr, "%s failed: %d\n", bench_case->name, err);
+            continue;
+        }
+        count++;
+
+        printf("%-20s %12zu %10.3f %10.1f", result->name, result->size, result->ns_per_byte, 1000.0 / result->ns_per_byte);
+
+        const struct result *base = find_baseline(baseline, baseline_count, result->name);
+        if (base != NULL) {
+            // positive means slower than the baseline
+            double change = (result->ns_per_byte - base->ns_per_byte) * 100.0 / base->ns_per_byte;
+            printf(" %10.3f %+7.1f%%", base->ns_per_byte, change);
+            if (base->size != result->size) {
+                printf(" (baseline size %zu)", base->size);
+            }
+            if (change > config.threshold) {
+                printf(" REGRESSION");
+                regressions++;
+            }
+        }
+        printf("\n");
+    }
+
+    if (bench.fd >= 0) {
+        close(bench.fd);
+        unlink(bench.path);
+    }
+    free(bench.data);
+    free(bench.out);
+
+    if (config.save != NULL) {
+        FILE *f = fopen(config.save, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Unable to write baseline %s: %s\n", config.save, strerror(errno));
+            return 2;
+        }
+        fprintf(f, "# flash_tool_bench baseline: name bytes ns/byte\n");
+        for (size_t i = 0; i < count; i++) {
+            fprintf(f, "%s %zu %.6f\n", results[i].name, results[i].size, results[i].ns_per_byte);
+        }
+        fclose(f);
+    }
+
+    if (regressions > 0) {
+        printf("%d benchmarks slower than the baseline by more than %.0f%%\n", regressions, config.threshold);
+        return 1;
+    }
+
+    return 0;
+}
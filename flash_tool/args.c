@@ -1,17 +1,28 @@
 #include "args.h"
+#include "bmap.h"
+#include "container.h"
+#include "delta.h"
+#include "engine.h"
+#include "patch.h"
+#include "scatter.h"
+#include "store.h"
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "mtk_da.h"
+
 #ifdef _WIN32
 #include <io.h>
 #define open _open
 #define O_RDONLY _O_RDONLY
 #define O_WRONLY _O_WRONLY
+#define O_RDWR _O_RDWR
 #define O_CREAT _O_CREAT
 #define O_TRUNC _O_TRUNC
 #define lseek _lseeki64
@@ -23,6 +34,10 @@
 
 static uint64_t parse_uint64_opt(const char *key, const char *str);
 static void parse_operation(struct arguments *arguments, int key, const char *arg, bool flashing);
+static void parse_patch(struct arguments *arguments, const char *arg);
+static struct bmap *load_bmap(const char *path, uint64_t image_size);
+static int open_operation_file(const char *arg, bool flashing, bool mapped);
+static void parse_scatter(struct arguments *arguments);
 static void validate_arguments(struct arguments *arguments, const char *program_name);
 
 void args_print_usage(const char *program_name) {
@@ -33,13 +48,63 @@ void args_print_usage(const char *program_name) {
     fprintf(stderr, "  -P, --preloader         Device is in Preloader mode\n");
     fprintf(stderr, "  -d, --download-agent FILE\n");
     fprintf(stderr, "                          Path to MediaTek Download Agent binary\n");
+    fprintf(stderr, "  -K, --package FILE      Flash the DA and images of a package built with --make-package\n");
+    fprintf(stderr, "      --make-package FILE Build a package from -d and the -F or -s images, then exit\n");
+    fprintf(stderr, "      --make-delta BASE NEW OUT\n");
+    fprintf(stderr, "                          Write the ranges where image NEW differs from BASE to the delta\n");
+    fprintf(stderr, "                          file OUT, then exit; flash files that are deltas write only those\n");
+    fprintf(stderr, "      --check-base        Before applying a delta, read back samples of the base image\n");
+    fprintf(stderr, "      --make-bmap IMAGE OUT\n");
+    fprintf(stderr, "                          Write the bmap of IMAGE, listing its blocks that hold data, to OUT,\n");
+    fprintf(stderr, "                          then exit\n");
+    fprintf(stderr, "      --bmap FILE         Flash only the blocks the bmap FILE maps for the following -F image,\n");
+    fprintf(stderr, "                          checking each range against its SHA-256\n");
     fprintf(stderr, "  -a, --address ADDRESS   EMMC address to read/write\n");
     fprintf(stderr, "  -l, --length LENGTH     Length of data to read/write\n");
+    fprintf(stderr, "  -p, --partition NAME    GPT partition to read/write instead of -a/-l\n");
     fprintf(stderr, "  -D, --dump FILE         Path to dump data to\n");
     fprintf(stderr, "  -F, --flash FILE        Path to flash data from\n");
+    fprintf(stderr, "      --patch OFFSET:HEX  Write the hex bytes at OFFSET of the -p partition, or at eMMC address\n");
+    fprintf(stderr, "                          OFFSET; only the sectors they change are rewritten\n");
+    fprintf(stderr, "  -E, --erase             Write zeroes over the range, from one packet built on the host\n");
+    fprintf(stderr, "      --fill BYTE         Make the following -E write BYTE instead of zeroes\n");
+    fprintf(stderr, "      --device-erase      Make the following -E erase with the DA FORMAT command (experimental),\n");
+    fprintf(stderr, "                          writing zeroes if the DA does not know the command\n");
+    fprintf(stderr, "  -s, --scatter FILE      Flash all downloadable partitions of an SP Flash Tool scatter file\n");
+    fprintf(stderr, "  -i, --include NAMES     Only flash these comma-separated scatter partitions\n");
+    fprintf(stderr, "  -x, --exclude NAMES     Skip these comma-separated scatter partitions\n");
+    fprintf(stderr, "  -I, --image-dir DIR     Directory with scatter images (default: scatter file directory)\n");
+    fprintf(stderr, "  -M, --mmap              Receive dumps directly into a memory-mapped output file\n");
+    fprintf(stderr, "      --align SIZE        Split writes at SIZE boundaries, the eMMC erase group (default:\n");
+    fprintf(stderr, "                          0x%x); 0 writes ranges as given\n", DEFAULT_WRITE_ALIGN);
+    fprintf(stderr, "      --sparse            Dump only the allocated blocks of ext2/3/4 ranges into sparse files\n");
+    fprintf(stderr, "  -o, --io MODE           File I/O for dumps and flash images: buffered (default), paced\n");
+    fprintf(stderr, "                          (bounded page cache use) or direct (O_DIRECT)\n");
+    fprintf(stderr, "      --progress-fd N     Write progress events as JSON lines to file descriptor N\n");
+    fprintf(stderr, "  -C, --container FILE    Dump every -D range into one indexed container FILE; the -D argument\n");
+    fprintf(stderr, "                          names the range. Flash files that are containers are read by address\n");
+    fprintf(stderr, "  -S, --store DIR         Deduplicate dumps into the chunk store DIR, writing a recipe to the\n");
+    fprintf(stderr, "                          dump file; flash files that are recipes are restored from DIR\n");
+    fprintf(stderr, "  -r, --retries N         Reissue a failed read or write up to N times (default: %d)\n", MTK_DEVICE_RETRIES);
+    fprintf(stderr, "      --pipeline          Send preloader commands without waiting for each echoed word,\n");
+    fprintf(stderr, "                          falling back to lockstep if the preloader drops them\n");
     fprintf(stderr, "  -R, --reboot            Reboot device after completion\n");
     fprintf(stderr, "  -v, --verbose           Produce verbose output\n");
     fprintf(stderr, "  -n, --no-interactive    Don't prompt before exiting\n");
+    fprintf(stderr, "  -U, --daemon SOCKET     Keep DA Stage 2 running and serve jobs on a Unix socket\n");
+    fprintf(stderr, "  -j, --parallel N        Run the operations on N devices at once, one per USB port;\n");
+    fprintf(stderr, "                          dumps are written to FILE.<bus>-<port path>\n");
+    fprintf(stderr, "  -e, --emulate IMAGE     Run against an emulated device whose user area is IMAGE instead of USB\n");
+    fprintf(stderr, "      --emulate-bandwidth MBPS\n");
+    fprintf(stderr, "                          Limit the emulated USB link to MBPS MB/s (default: unlimited)\n");
+    fprintf(stderr, "      --emulate-latency US\n");
+    fprintf(stderr, "                          Add US microseconds to every emulated USB transfer\n");
+    fprintf(stderr, "  -T, --trace FILE        Write a Chrome trace-event timeline of the session to FILE\n");
+    fprintf(stderr, "      --metrics FILE|unix:PATH\n");
+    fprintf(stderr, "                          Write per-chunk latency histograms and transfer counters in the\n");
+    fprintf(stderr, "                          Prometheus text format to FILE or the Unix socket PATH at exit\n");
+    fprintf(stderr, "      --metrics-interval SECONDS\n");
+    fprintf(stderr, "                          Also write the metrics every SECONDS while running\n");
     fprintf(stderr, "  -h, --help              Show this help message\n");
 }
 
@@ -48,23 +113,64 @@ void args_cleanup(struct arguments *arguments) {
         if (arguments->operations[i].fd != -1) {
             close(arguments->operations[i].fd);
         }
+        if (arguments->operations[i].bmap != NULL) {
+            bmap_free(arguments->operations[i].bmap);
+            free(arguments->operations[i].bmap);
+        }
     }
     if (arguments->download_agent_fd != -1) {
         close(arguments->download_agent_fd);
     }
+    if (arguments->package_fd != -1) {
+        close(arguments->package_fd);
+    }
 }
 
 void args_parse(int argc, char **argv, struct arguments *arguments) {
     // Initialize arguments
     arguments->state = DEVICE_STATE_NONE;
     arguments->download_agent = NULL;
+    arguments->package_file = NULL;
+    arguments->make_package = NULL;
+    arguments->make_delta = NULL;
+    arguments->delta_base = NULL;
+    arguments->delta_new = NULL;
+    arguments->check_base = false;
+    arguments->make_bmap = NULL;
+    arguments->bmap_image = NULL;
+    arguments->bmap_file = NULL;
     arguments->address = 0;
     arguments->length = 0;
+    arguments->partition = NULL;
+    arguments->fill = -1;
+    arguments->device_erase = false;
     arguments->reboot = false;
     arguments->verbose = false;
     arguments->interactive = true;
+    arguments->trace_file = NULL;
+    arguments->metrics_target = NULL;
+    arguments->metrics_interval = 0;
+    arguments->daemon_socket = NULL;
+    arguments->parallel = 0;
+    arguments->retries = MTK_DEVICE_RETRIES;
+    arguments->pipeline = false;
+    arguments->mmap_dump = false;
+    arguments->write_align = DEFAULT_WRITE_ALIGN;
+    arguments->sparse_dump = false;
+    arguments->io_mode = IO_MODE_BUFFERED;
+    arguments->progress_fd = -1;
+    arguments->store_dir = NULL;
+    arguments->container_file = NULL;
+    arguments->emulate_image = NULL;
+    arguments->emulate_bandwidth = 0;
+    arguments->emulate_latency_us = 0;
+    arguments->scatter_file = NULL;
+    arguments->scatter_include = NULL;
+    arguments->scatter_exclude = NULL;
+    arguments->image_dir = NULL;
     arguments->operations_count = 0;
     arguments->download_agent_fd = -1;
+    arguments->package_fd = -1;
 
     for (int i = 0; i < MAX_OPERATIONS; i++) {
         arguments->operations[i].fd = -1;
@@ -88,6 +194,46 @@ void args_parse(int argc, char **argv, struct arguments *arguments) {
                 exit(1);
             }
             arguments->download_agent = argv[i];
+        } else if (strcmp(arg, "-K") == 0 || strcmp(arg, "--package") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->package_file = argv[i];
+        } else if (strcmp(arg, "--make-package") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->make_package = argv[i];
+        } else if (strcmp(arg, "--make-delta") == 0) {
+            if (i + 3 >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->delta_base = argv[++i];
+            arguments->delta_new = argv[++i];
+            arguments->make_delta = argv[++i];
+        } else if (strcmp(arg, "--check-base") == 0) {
+            arguments->check_base = true;
+        } else if (strcmp(arg, "--make-bmap") == 0) {
+            if (i + 2 >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->bmap_image = argv[++i];
+            arguments->make_bmap = argv[++i];
+        } else if (strcmp(arg, "--bmap") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->bmap_file = argv[i];
         } else if (strcmp(arg, "-a") == 0 || strcmp(arg, "--address") == 0) {
             if (++i >= argc) {
                 fprintf(stderr, "Error: Missing argument for %s\n", arg);
@@ -95,6 +241,7 @@ void args_parse(int argc, char **argv, struct arguments *arguments) {
                 exit(1);
             }
             arguments->address = parse_uint64_opt(arg, argv[i]);
+            arguments->partition = NULL;
         } else if (strcmp(arg, "-l") == 0 || strcmp(arg, "--length") == 0) {
             if (++i >= argc) {
                 fprintf(stderr, "Error: Missing argument for %s\n", arg);
@@ -102,6 +249,18 @@ void args_parse(int argc, char **argv, struct arguments *arguments) {
                 exit(1);
             }
             arguments->length = parse_uint64_opt(arg, argv[i]);
+        } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--partition") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            if (strlen(argv[i]) >= OPERATION_NAME_MAX) {
+                fprintf(stderr, "Error: Partition name too long: %s\n", argv[i]);
+                exit(1);
+            }
+            arguments->partition = argv[i];
+            arguments->length = 0;
         } else if (strcmp(arg, "-D") == 0 || strcmp(arg, "--dump") == 0) {
             if (++i >= argc) {
                 fprintf(stderr, "Error: Missing argument for %s\n", arg);
@@ -118,12 +277,210 @@ void args_parse(int argc, char **argv, struct arguments *arguments) {
             }
             parse_operation(arguments, 'F', argv[i], true);
             printf("Mode: flashing\n");
+        } else if (strcmp(arg, "--patch") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            parse_patch(arguments, argv[i]);
+            printf("Mode: patching\n");
+        } else if (strcmp(arg, "-E") == 0 || strcmp(arg, "--erase") == 0) {
+            if (arguments->device_erase && arguments->fill >= 0) {
+                fprintf(stderr, "Error: --device-erase and --fill cannot both apply to -E\n");
+                exit(1);
+            }
+            parse_operation(arguments, 'E', NULL, false);
+            printf("Mode: erasing\n");
+        } else if (strcmp(arg, "--fill") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            uint64_t fill = parse_uint64_opt(arg, argv[i]);
+            if (fill > 0xff) {
+                fprintf(stderr, "Error: %s must be a byte value\n", arg);
+                exit(1);
+            }
+            arguments->fill = fill;
+        } else if (strcmp(arg, "--device-erase") == 0) {
+            arguments->device_erase = true;
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            arguments->pipeline = true;
+        } else if (strcmp(arg, "-M") == 0 || strcmp(arg, "--mmap") == 0) {
+            arguments->mmap_dump = true;
+        } else if (strcmp(arg, "--align") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            uint64_t align = parse_uint64_opt(arg, argv[i]);
+            if (align != 0 && (align < 512 || (align & (align - 1)) != 0)) {
+                fprintf(stderr, "Error: %s must be 0 or a power of two of at least 512\n", arg);
+                exit(1);
+            }
+            arguments->write_align = align;
+        } else if (strcmp(arg, "--sparse") == 0) {
+            arguments->sparse_dump = true;
+        } else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--io") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            if (strcmp(argv[i], "buffered") == 0) {
+                arguments->io_mode = IO_MODE_BUFFERED;
+            } else if (strcmp(argv[i], "paced") == 0) {
+                arguments->io_mode = IO_MODE_PACED;
+            } else if (strcmp(argv[i], "direct") == 0) {
+                arguments->io_mode = IO_MODE_DIRECT;
+            } else {
+                fprintf(stderr, "Error: Unknown I/O mode: %s\n", argv[i]);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--progress-fd") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            uint64_t fd = parse_uint64_opt(arg, argv[i]);
+            if (fd > INT32_MAX) {
+                fprintf(stderr, "Error: Invalid file descriptor for %s: %s\n", arg, argv[i]);
+                exit(1);
+            }
+            arguments->progress_fd = fd;
+        } else if (strcmp(arg, "-C") == 0 || strcmp(arg, "--container") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->container_file = argv[i];
+        } else if (strcmp(arg, "-S") == 0 || strcmp(arg, "--store") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->store_dir = argv[i];
+        } else if (strcmp(arg, "-r") == 0 || strcmp(arg, "--retries") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            uint64_t retries = parse_uint64_opt(arg, argv[i]);
+            if (retries > 100) {
+                fprintf(stderr, "Error: %s must be at most 100\n", arg);
+                exit(1);
+            }
+            arguments->retries = retries;
         } else if (strcmp(arg, "-R") == 0 || strcmp(arg, "--reboot") == 0) {
             arguments->reboot = true;
         } else if (strcmp(arg, "-v") == 0 || strcmp(arg, "--verbose") == 0) {
             arguments->verbose = true;
         } else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--no-interactive") == 0) {
             arguments->interactive = false;
+        } else if (strcmp(arg, "-T") == 0 || strcmp(arg, "--trace") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->trace_file = argv[i];
+        } else if (strcmp(arg, "--metrics") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->metrics_target = argv[i];
+        } else if (strcmp(arg, "--metrics-interval") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            uint64_t value = parse_uint64_opt(arg, argv[i]);
+            if (value > UINT32_MAX) {
+                fprintf(stderr, "Error: %s is too large: %s\n", arg, argv[i]);
+                exit(1);
+            }
+            arguments->metrics_interval = value;
+        } else if (strcmp(arg, "-U") == 0 || strcmp(arg, "--daemon") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->daemon_socket = argv[i];
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--parallel") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            uint64_t parallel = parse_uint64_opt(arg, argv[i]);
+            if (parallel == 0 || parallel > ENGINE_MAX_DEVICES) {
+                fprintf(stderr, "Error: %s must be between 1 and %d\n", arg, ENGINE_MAX_DEVICES);
+                exit(1);
+            }
+            arguments->parallel = parallel;
+        } else if (strcmp(arg, "-e") == 0 || strcmp(arg, "--emulate") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->emulate_image = argv[i];
+        } else if (strcmp(arg, "--emulate-bandwidth") == 0 || strcmp(arg, "--emulate-latency") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            uint64_t value = parse_uint64_opt(arg, argv[i]);
+            if (value > UINT32_MAX) {
+                fprintf(stderr, "Error: %s is too large: %s\n", arg, argv[i]);
+                exit(1);
+            }
+            if (strcmp(arg, "--emulate-bandwidth") == 0) {
+                arguments->emulate_bandwidth = value;
+            } else {
+                arguments->emulate_latency_us = value;
+            }
+        } else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--scatter") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->scatter_file = argv[i];
+        } else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--include") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->scatter_include = argv[i];
+        } else if (strcmp(arg, "-x") == 0 || strcmp(arg, "--exclude") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->scatter_exclude = argv[i];
+        } else if (strcmp(arg, "-I") == 0 || strcmp(arg, "--image-dir") == 0) {
+            if (++i >= argc) {
+                fprintf(stderr, "Error: Missing argument for %s\n", arg);
+                args_print_usage(argv[0]);
+                exit(1);
+            }
+            arguments->image_dir = argv[i];
         } else {
             fprintf(stderr, "Error: Unknown option: %s\n", arg);
             args_print_usage(argv[0]);
@@ -139,16 +496,157 @@ static void parse_operation(struct arguments *arguments, int key, const char *ar
         fprintf(stderr, "Error: Too many operations\n");
         exit(1);
     }
-    if (arguments->length == 0) {
+    // named operations default to the whole partition, or the whole file when flashing
+    if (arguments->length == 0 && arguments->partition == NULL) {
         fprintf(stderr, "Error: Cannot perform zero-length operation\n");
         exit(1);
     }
 
     struct operation *operation = &arguments->operations[arguments->operations_count++];
     operation->key = key;
-    operation->address = arguments->address;
+    operation->part = MTK_DA_EMMC_PART_USER;
+    operation->address = arguments->partition != NULL ? 0 : arguments->address;
     operation->length = arguments->length;
+    operation->by_name = arguments->partition != NULL;
+    operation->recipe = false;
+    operation->from_container = false;
+    operation->from_package = false;
+    operation->delta = false;
+    operation->bmap = NULL;
+    operation->device_erase = key == 'E' && arguments->device_erase;
+    operation->fill = arguments->fill >= 0 ? arguments->fill : 0;
+    snprintf(operation->name, sizeof(operation->name), "%s", arguments->partition != NULL ? arguments->partition : "");
+    operation->path = arg;
+
+    if (flashing) {
+        operation->fd = open_operation_file(arg, flashing, false);
+
+        uint64_t recipe_length;
+        int probe = store_recipe_probe(operation->fd, &recipe_length);
+        int container = probe == 0 ? container_probe(operation->fd) : 0;
+        uint64_t delta_length;
+        int delta = probe == 0 && container == 0 ? delta_probe(operation->fd, &delta_length) : 0;
+        if (probe < 0 || container < 0 || delta < 0) {
+            fprintf(stderr, "Error: Unable to read flash file: %s (%s)\n", arg, strerror(probe < 0 ? -probe : container < 0 ? -container : -delta));
+            exit(1);
+        }
+
+        if (arguments->bmap_file != NULL && (probe > 0 || container > 0 || delta > 0)) {
+            fprintf(stderr, "Error: --bmap needs a raw image: %s\n", arg);
+            exit(1);
+        }
+
+        // the range covering the operation is looked up once addresses are resolved
+        if (container > 0) {
+            operation->from_container = true;
+            return;
+        }
+
+        off_t maxlength;
+        if (probe > 0) {
+            // the recipe stands for the stream it rebuilds
+            operation->recipe = true;
+            maxlength = recipe_length;
+        } else if (delta > 0) {
+            // a delta stands for the whole new image, and cannot be cut short
+            operation->delta = true;
+            maxlength = delta_length;
+            if (operation->length != 0 && operation->length != delta_length) {
+                fprintf(stderr, "Error: Length does not match the delta image (0x%" PRIx64 "): %s\n", delta_length, arg);
+                exit(1);
+            }
+        } else if ((maxlength = lseek(operation->fd, 0, SEEK_END)) < 0) {
+            fprintf(stderr, "Error: Unable to seek file descriptor: %s (%s)\n", arg, strerror(errno));
+            exit(1);
+        }
+        if (arguments->bmap_file != NULL) {
+            // a bmap covers the whole image, like a delta
+            operation->bmap = load_bmap(arguments->bmap_file, maxlength);
+            arguments->bmap_file = NULL;
+            if (operation->length != 0 && operation->length != (uint64_t)maxlength) {
+                fprintf(stderr, "Error: Length does not match the bmap image (0x%" PRIx64 "): %s\n", (uint64_t)maxlength, arg);
+                exit(1);
+            }
+        }
+        if (operation->length == 0) {
+            operation->length = maxlength;
+        }
+        if (operation->length == 0) {
+            fprintf(stderr, "Error: Cannot flash empty file: %s\n", arg);
+            exit(1);
+        }
+        if ((uint64_t)maxlength < operation->length) {
+            fprintf(stderr, "Error: Write length is greater than file size: %s\n", arg);
+            exit(1);
+        }
+    }
+}
+
+static struct bmap *load_bmap(const char *path, uint64_t image_size) {
+    int fd = open_operation_file(path, true, false);
 
+    struct bmap *bmap = malloc(sizeof(struct bmap));
+    if (bmap == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+
+    int err = bmap_load(fd, bmap);
+    close(fd);
+    if (err < 0) {
+        fprintf(stderr, "Error: Invalid bmap file: %s (%s)\n", path, err == -EIO ? "checksum mismatch" : strerror(-err));
+        exit(1);
+    }
+    if (bmap->image_size != image_size) {
+        fprintf(stderr, "Error: The bmap describes an image of 0x%" PRIx64 " bytes, not 0x%" PRIx64 ": %s\n", bmap->image_size, image_size, path);
+        exit(1);
+    }
+
+    return bmap;
+}
+
+// Patches carry their bytes as the hex string, decoded again when applied.
+static void parse_patch(struct arguments *arguments, const char *arg) {
+    if (arguments->operations_count == MAX_OPERATIONS) {
+        fprintf(stderr, "Error: Too many operations\n");
+        exit(1);
+    }
+
+    const char *hex = strchr(arg, ':');
+    char offset[32];
+    if (hex == NULL || (size_t)(hex - arg) >= sizeof(offset)) {
+        fprintf(stderr, "Error: Patch must be OFFSET:HEX: %s\n", arg);
+        exit(1);
+    }
+    snprintf(offset, sizeof(offset), "%.*s", (int)(hex - arg), arg);
+    hex++;
+
+    int length = patch_decode(hex, NULL);
+    if (length < 0) {
+        fprintf(stderr, "Error: Patch bytes must be a non-empty, even-length hex string: %s\n", arg);
+        exit(1);
+    }
+
+    struct operation *operation = &arguments->operations[arguments->operations_count++];
+    operation->key = 'P';
+    operation->part = MTK_DA_EMMC_PART_USER;
+    // relative to the partition until it is resolved
+    operation->address = parse_uint64_opt("--patch", offset);
+    operation->length = length;
+    operation->by_name = arguments->partition != NULL;
+    operation->recipe = false;
+    operation->from_container = false;
+    operation->from_package = false;
+    operation->delta = false;
+    operation->bmap = NULL;
+    operation->device_erase = false;
+    operation->fill = 0;
+    snprintf(operation->name, sizeof(operation->name), "%s", arguments->partition != NULL ? arguments->partition : "");
+    operation->path = hex;
+}
+
+// Mapped dump files are opened read-write, as a shared writable mapping requires.
+static int open_operation_file(const char *arg, bool flashing, bool mapped) {
     int flags;
     const char *verb;
 
@@ -159,33 +657,245 @@ static void parse_operation(struct arguments *arguments, int key, const char *ar
 #endif
         verb = "flashing";
     } else {
-        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        flags = (mapped ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
 #if _WIN32
         flags |= O_BINARY;
 #endif
         verb = "dumping";
     }
 
-    if ((operation->fd = open(arg, flags, 0666)) < 0) {
+    int fd;
+    if ((fd = open(arg, flags, 0666)) < 0) {
         fprintf(stderr, "Error: Unable to open file for %s: %s (%s)\n", verb, arg, strerror(errno));
         exit(1);
     }
 
-    if (flashing) {
-        off_t maxlength;
-        if ((maxlength = lseek(operation->fd, 0, SEEK_END)) < 0) {
-            fprintf(stderr, "Error: Unable to seek file descriptor: %s (%s)\n", arg, strerror(errno));
+    return fd;
+}
+
+// Matches a partition name against a comma-separated, case-insensitive list
+static bool name_in_list(const char *name, const char *list) {
+    size_t len = strlen(name);
+
+    while (list != NULL && *list != '\0') {
+        const char *comma = strchr(list, ',');
+        size_t item_len = comma != NULL ? (size_t)(comma - list) : strlen(list);
+
+        if (item_len == len && strncasecmp(list, name, len) == 0) {
+            return true;
+        }
+
+        list = comma != NULL ? comma + 1 : NULL;
+    }
+
+    return false;
+}
+
+static int compare_operations(const void *a, const void *b) {
+    const struct operation *op_a = a;
+    const struct operation *op_b = b;
+
+    if (op_a->part != op_b->part) {
+        return op_a->part < op_b->part ? -1 : 1;
+    }
+    if (op_a->address != op_b->address) {
+        return op_a->address < op_b->address ? -1 : 1;
+    }
+    return 0;
+}
+
+static void scatter_image_dir(const struct arguments *arguments, char *dir, size_t size) {
+    if (arguments->image_dir != NULL) {
+        snprintf(dir, size, "%s", arguments->image_dir);
+        return;
+    }
+
+    snprintf(dir, size, "%s", arguments->scatter_file);
+    char *slash = strrchr(dir, '/');
+#ifdef _WIN32
+    char *backslash = strrchr(dir, '\\');
+    if (backslash != NULL && (slash == NULL || backslash > slash)) {
+        slash = backslash;
+    }
+#endif
+    if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        snprintf(dir, size, ".");
+    }
+}
+
+// Appends one flash operation per selected scatter partition, ordered by region and address
+static void parse_scatter(struct arguments *arguments) {
+    static struct scatter scatter;
+
+    size_t error_line = 0;
+    int err = scatter_load(arguments->scatter_file, &scatter, &error_line);
+    if (err < 0) {
+        if (error_line != 0) {
+            fprintf(stderr, "Error: Invalid scatter file: %s:%zu (%s)\n", arguments->scatter_file, error_line, strerror(-err));
+        } else {
+            fprintf(stderr, "Error: Unable to read scatter file: %s (%s)\n", arguments->scatter_file, strerror(-err));
+        }
+        exit(1);
+    }
+
+    char image_dir[1024];
+    scatter_image_dir(arguments, image_dir, sizeof(image_dir));
+
+    size_t first = arguments->operations_count;
+
+    printf("Scatter plan:\n");
+    for (size_t i = 0; i < scatter.count; i++) {
+        const struct scatter_partition *partition = &scatter.partitions[i];
+
+        bool included = arguments->scatter_include != NULL && name_in_list(partition->name, arguments->scatter_include);
+        if (arguments->scatter_include != NULL && !included) {
+            continue;
+        }
+        if (name_in_list(partition->name, arguments->scatter_exclude)) {
+            continue;
+        }
+        if (!partition->is_download || partition->file_name[0] == '\0') {
+            if (included) {
+                fprintf(stderr, "Error: Scatter partition %s has no image to download\n", partition->name);
+                exit(1);
+            }
+            continue;
+        }
+
+        char path[sizeof(image_dir) + sizeof(partition->file_name) + 1];
+        snprintf(path, sizeof(path), "%s/%s", image_dir, partition->file_name);
+
+        if (access(path, F_OK) != 0) {
+            if (included) {
+                fprintf(stderr, "Error: Image for %s not found: %s\n", partition->name, path);
+                exit(1);
+            }
+            printf("  %-16s skipped, %s not found\n", partition->name, partition->file_name);
+            continue;
+        }
+
+        if (arguments->operations_count == MAX_OPERATIONS) {
+            fprintf(stderr, "Error: Too many operations\n");
             exit(1);
         }
-        if ((uint64_t)maxlength < arguments->length) {
-            fprintf(stderr, "Error: Write length is greater than file size: %s\n", arg);
+
+        int fd = open_operation_file(path, true, false);
+
+        uint32_t magic = 0;
+        if (read(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == 0xed26ff3a) {
+            fprintf(stderr, "Error: Android sparse images are not supported, unsparse %s first\n", path);
+            exit(1);
+        }
+
+        off_t size;
+        if ((size = lseek(fd, 0, SEEK_END)) < 0) {
+            fprintf(stderr, "Error: Unable to seek file descriptor: %s (%s)\n", path, strerror(errno));
+            exit(1);
+        }
+        if (size == 0) {
+            close(fd);
+            printf("  %-16s skipped, %s is empty\n", partition->name, partition->file_name);
+            continue;
+        }
+        if (partition->size != 0 && (uint64_t)size > partition->size) {
+            fprintf(stderr, "Error: Image for %s is larger than the partition: %s\n", partition->name, path);
+            exit(1);
+        }
+
+        struct operation *operation = &arguments->operations[arguments->operations_count++];
+        operation->key = 'F';
+        operation->part = partition->part;
+        operation->address = partition->address;
+        operation->length = size;
+        operation->fd = fd;
+        operation->path = NULL;
+        operation->by_name = false;
+        operation->recipe = false;
+        operation->from_container = false;
+        operation->from_package = false;
+        operation->delta = false;
+        operation->bmap = NULL;
+        operation->device_erase = false;
+        operation->fill = 0;
+        snprintf(operation->name, sizeof(operation->name), "%s", partition->name);
+    }
+
+    qsort(&arguments->operations[first], arguments->operations_count - first, sizeof(struct operation), compare_operations);
+
+    for (size_t i = first; i < arguments->operations_count; i++) {
+        const struct operation *operation = &arguments->operations[i];
+        printf("  %-16s part %" PRIu8 "  0x%012" PRIx64 "  0x%012" PRIx64 "\n", operation->name, operation->part, operation->address, operation->length);
+    }
+    printf("\n");
+}
+
+// Packages only hold images with a known place; the device is not involved in building them.
+static void validate_make_package(const struct arguments *arguments) {
+    if (arguments->package_file != NULL) {
+        fprintf(stderr, "Error: --make-package and --package cannot be combined\n");
+        exit(1);
+    }
+
+    size_t images = 0;
+    for (size_t i = 0; i < arguments->operations_count; i++) {
+        const struct operation *operation = &arguments->operations[i];
+        if (operation->key != 'F') {
+            fprintf(stderr, "Error: --make-package only takes flash operations\n");
+            exit(1);
+        }
+        if (operation->by_name || operation->recipe || operation->from_container || operation->delta || operation->bmap != NULL) {
+            fprintf(stderr, "Error: Package images need an address and a plain image file: %s\n", operation->path != NULL ? operation->path : operation->name);
             exit(1);
         }
+        images++;
+    }
+    if (images == 0) {
+        fprintf(stderr, "Error: No images for the package (use -F or -s)\n");
+        exit(1);
     }
 }
 
 static void validate_arguments(struct arguments *arguments, const char *program_name) {
-    if (arguments->state != DEVICE_STATE_DA_STAGE2) {
+    // comparing images needs neither a device nor a DA
+    if (arguments->make_delta != NULL) {
+        if (arguments->operations_count > 0 || arguments->scatter_file != NULL || arguments->package_file != NULL || arguments->make_package != NULL
+            || arguments->make_bmap != NULL) {
+            fprintf(stderr, "Error: --make-delta cannot be combined with operations or packages\n");
+            exit(1);
+        }
+        return;
+    }
+
+    if (arguments->make_bmap != NULL) {
+        if (arguments->operations_count > 0 || arguments->scatter_file != NULL || arguments->package_file != NULL || arguments->make_package != NULL) {
+            fprintf(stderr, "Error: --make-bmap cannot be combined with operations or packages\n");
+            exit(1);
+        }
+        return;
+    }
+
+    if (arguments->bmap_file != NULL) {
+        fprintf(stderr, "Error: --bmap must come before the -F image it describes\n");
+        exit(1);
+    }
+
+    if (arguments->package_file != NULL) {
+        if (arguments->download_agent != NULL) {
+            fprintf(stderr, "Error: The package brings its own Download Agent, -d cannot be combined with --package\n");
+            exit(1);
+        }
+
+        int flag = O_RDONLY;
+#if _WIN32
+        flag |= O_BINARY;
+#endif
+        if ((arguments->package_fd = open(arguments->package_file, flag)) < 0) {
+            fprintf(stderr, "Error: Unable to open package: %s (%s)\n", arguments->package_file, strerror(errno));
+            exit(1);
+        }
+    } else if (arguments->state != DEVICE_STATE_DA_STAGE2 || arguments->make_package != NULL) {
         if (arguments->download_agent == NULL) {
             fprintf(stderr, "Error: MediaTek Download Agent binary is mandatory, unless device is in DA Stage 2\n");
             args_print_usage(program_name);
@@ -202,11 +912,61 @@ static void validate_arguments(struct arguments *arguments, const char *program_
         }
     }
 
-    if (arguments->operations_count == 0) {
-        fprintf(stderr, "Error: No operations specified (use -D or -F)\n");
+    if (arguments->scatter_file != NULL) {
+        parse_scatter(arguments);
+    }
+
+    if (arguments->make_package != NULL) {
+        validate_make_package(arguments);
+    }
+
+    if (arguments->operations_count == 0 && arguments->daemon_socket == NULL && arguments->package_file == NULL) {
+        fprintf(stderr, "Error: No operations specified (use -D, -F, -E, --patch or -s)\n");
         args_print_usage(program_name);
         exit(1);
     }
+
+    for (size_t i = 0; i < arguments->operations_count; i++) {
+        if (arguments->operations[i].recipe && arguments->store_dir == NULL) {
+            fprintf(stderr, "Error: Flash file is a chunk store recipe, --store is required: %s\n", arguments->operations[i].path);
+            exit(1);
+        }
+    }
+
+    if (arguments->store_dir != NULL && arguments->container_file != NULL) {
+        fprintf(stderr, "Error: --store and --container cannot be combined\n");
+        exit(1);
+    }
+
+    if (arguments->store_dir != NULL && arguments->mmap_dump) {
+        fprintf(stderr, "Error: --store and --mmap cannot be combined\n");
+        exit(1);
+    }
+
+    if (arguments->sparse_dump && (arguments->store_dir != NULL || arguments->container_file != NULL)) {
+        fprintf(stderr, "Error: --sparse cannot be combined with --store or --container\n");
+        exit(1);
+    }
+
+    if (arguments->metrics_interval > 0 && arguments->metrics_target == NULL) {
+        fprintf(stderr, "Error: --metrics-interval requires --metrics\n");
+        exit(1);
+    }
+
+    if (arguments->parallel > 0 && arguments->daemon_socket != NULL) {
+        fprintf(stderr, "Error: --parallel and --daemon cannot be combined\n");
+        exit(1);
+    }
+
+    // parallel sessions open their own dump files, one per device; containers are opened by the session
+    if (arguments->parallel == 0 && arguments->container_file == NULL) {
+        for (size_t i = 0; i < arguments->operations_count; i++) {
+            struct operation *operation = &arguments->operations[i];
+            if (operation->key == 'D') {
+                operation->fd = open_operation_file(operation->path, false, arguments->mmap_dump);
+            }
+        }
+    }
 }
 
 static uint64_t parse_uint64_opt(const char *key, const char *str) {
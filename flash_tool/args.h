@@ -5,7 +5,14 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "io_handler.h"
+
+struct bmap;
+
 #define MAX_OPERATIONS (64)
+// eMMC erase group size writes are aligned to unless --align says otherwise; the DA does not report the card's
+#define DEFAULT_WRITE_ALIGN (512 * 1024)
+#define OPERATION_NAME_MAX (64)
 
 enum device_state {
     DEVICE_STATE_NONE,
@@ -15,24 +22,95 @@ enum device_state {
 
 struct operation {
     int key;
+    uint8_t part;
     uint64_t address;
     uint64_t length;
     int fd;
+    // dump files are opened per device in parallel mode
+    const char *path;
+    char name[OPERATION_NAME_MAX];
+    // address and length are resolved from the GPT entry called name
+    bool by_name;
+    // the flash file is a chunk store recipe, restored from --store
+    bool recipe;
+    // the flash file is a dump container; data comes from the range covering the address
+    bool from_container;
+    // the data is image package_image of --package
+    bool from_package;
+    size_t package_image;
+    // the flash file is a delta; only its ranges are written
+    bool delta;
+    // only the blocks this bmap maps are written
+    struct bmap *bmap;
+    // erase operations send the DA FORMAT command instead of writing fill from the host
+    bool device_erase;
+    uint8_t fill;
 };
 
 struct arguments {
     enum device_state state;
     const char *download_agent;
+    // DA and flash images come from this package instead of -d and -F
+    const char *package_file;
+    // build a package from -d and the flash operations instead of running a session
+    const char *make_package;
+    // compare two images into a delta file instead of running a session
+    const char *make_delta;
+    const char *delta_base;
+    const char *delta_new;
+    // read back the base samples of a delta before applying it
+    bool check_base;
+    // write the bmap of an image instead of running a session
+    const char *make_bmap;
+    const char *bmap_image;
+    // bmap for the next -F image
+    const char *bmap_file;
     uint64_t address;
     uint64_t length;
+    const char *partition;
+    // byte the following -E operations write from the host, -1 for zeroes
+    int fill;
+    // the following -E operations use the DA FORMAT command, whose wire layout is unverified on real DAs
+    bool device_erase;
     bool reboot;
     bool verbose;
     bool interactive;
+    const char *trace_file;
+    // Prometheus text metrics go to this file or unix:PATH socket, at exit and every metrics_interval seconds
+    const char *metrics_target;
+    unsigned int metrics_interval;
+    const char *daemon_socket;
+    unsigned int parallel;
+    unsigned int retries;
+    // send preloader command words ahead of their echoes when the preloader allows it
+    bool pipeline;
+    bool mmap_dump;
+    // writes off this boundary are split there, 0 to write as given
+    uint64_t write_align;
+    // dumps of ext2/3/4 ranges read only allocated blocks and leave holes for the rest
+    bool sparse_dump;
+    enum io_mode io_mode;
+    int progress_fd;
+    // dumps go to this deduplicating chunk store and leave a recipe in the dump file
+    const char *store_dir;
+    // all dumps go to this container, named by their -D argument
+    const char *container_file;
+    // talk to an in-process emulated device backed by this image instead of USB
+    const char *emulate_image;
+    // emulated link: MB/s (0 for unlimited) and microseconds per transfer
+    unsigned int emulate_bandwidth;
+    unsigned int emulate_latency_us;
+
+    const char *scatter_file;
+    const char *scatter_include;
+    const char *scatter_exclude;
+    const char *image_dir;
 
     struct operation operations[MAX_OPERATIONS];
     size_t operations_count;
 
     int download_agent_fd;
+    int package_fd;
 };
 
 void args_parse(int argc, char **argv, struct arguments *arguments);
@@ -0,0 +1,618 @@
+// SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
+#include "bmap.h"
+
+#include "ext4.h"
+#include "io_handler.h"
+#include "progress.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "src/util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// every range line, with its checksum, fits in this
+#define BMAP_RANGE_LINE_MAX (160)
+#define BMAP_HEADER_MAX (2048)
+
+struct hash_job {
+    const struct mapped_file *image;
+    struct bmap *bmap;
+    pthread_mutex_t lock;
+    size_t next;
+    uint64_t hashed;
+    uint64_t mapped;
+};
+
+static int workers_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > BMAP_MAX_WORKERS) {
+        return BMAP_MAX_WORKERS;
+    }
+    return cpus > 0 ? cpus : 1;
+#else
+    return BMAP_MAX_WORKERS / 4;
+#endif
+}
+
+void bmap_range_bytes(const struct bmap *bmap, const struct bmap_range *range, uint64_t *offset, uint64_t *length) {
+    *offset = range->first * bmap->block_size;
+    *length = MIN((range->last + 1) * bmap->block_size, bmap->image_size) - *offset;
+}
+
+// Adds the blocks covering [offset, offset + length); calls come in ascending order and may overlap the last range.
+static int add_bytes(struct bmap *bmap, size_t *capacity, uint64_t offset, uint64_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    uint64_t first = offset / bmap->block_size;
+    uint64_t last = MIN((offset + length - 1) / bmap->block_size, bmap->blocks - 1);
+
+    struct bmap_range *previous = bmap->count > 0 ? &bmap->ranges[bmap->count - 1] : NULL;
+    if (previous != NULL && first <= previous->last + 1) {
+        previous->last = last > previous->last ? last : previous->last;
+        return 0;
+    }
+
+    if (bmap->count == *capacity) {
+        size_t grown = *capacity > 0 ? *capacity * 2 : 64;
+        struct bmap_range *ranges = realloc(bmap->ranges, grown * sizeof(*ranges));
+        if (ranges == NULL) {
+            return -ENOMEM;
+        }
+        bmap->ranges = ranges;
+        *capacity = grown;
+    }
+
+    bmap->ranges[bmap->count++] = (struct bmap_range){ .first = first, .last = last };
+    return 0;
+}
+
+// Adds the data regions of the file from start on; without SEEK_DATA all of it is data.
+static int map_data(int fd, uint64_t start, uint64_t size, struct bmap *bmap, size_t *capacity) {
+#ifdef SEEK_DATA
+    for (uint64_t offset = start; offset < size;) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            // only a hole is left
+            return 0;
+        }
+        if (data < 0) {
+            return errno == EINVAL || errno == ENOTSUP ? add_bytes(bmap, capacity, offset, size - offset) : -errno;
+        }
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            return -errno;
+        }
+
+        uint64_t end = MIN((uint64_t)hole, size);
+        int err = add_bytes(bmap, capacity, data, end - data);
+        if (err < 0) {
+            return err;
+        }
+        offset = end;
+    }
+    return 0;
+#else
+    (void)fd;
+    return add_bytes(bmap, capacity, start, size - start);
+#endif
+}
+
+// Fills bmap->ranges from the filesystem allocation map, or from the file's data regions.
+static int map_image(int fd, const struct mapped_file *image, struct bmap *bmap, bool *ext4) {
+    size_t capacity = 0;
+    uint64_t mapped_end = 0;
+    int err = 0;
+
+    struct ext4_map map;
+    const char *unsupported;
+    if ((err = ext4_map_load_image(image, &map, &unsupported)) < 0) {
+        return err;
+    }
+
+    *ext4 = unsupported == NULL;
+    if (*ext4) {
+        for (size_t i = 0; i < map.count && err == 0; i++) {
+            err = add_bytes(bmap, &capacity, map.extents[i].offset, map.extents[i].length);
+        }
+        mapped_end = (uint64_t)map.blocks * map.block_size;
+        ext4_map_free(&map);
+    } else {
+        verboseLog("No filesystem allocation map (%s), mapping the file's data\n", unsupported);
+    }
+
+    // an image may be larger than its filesystem
+    if (err == 0) {
+        err = map_data(fd, mapped_end, image->size, bmap, &capacity);
+    }
+    return err;
+}
+
+// Cuts the ranges into pieces of at most BMAP_RANGE_MAX_BLOCKS.
+static int split_ranges(struct bmap *bmap) {
+    size_t count = 0;
+    for (size_t i = 0; i < bmap->count; i++) {
+        count += (bmap->ranges[i].last - bmap->ranges[i].first) / BMAP_RANGE_MAX_BLOCKS + 1;
+    }
+
+    struct bmap_range *ranges = malloc((count > 0 ? count : 1) * sizeof(*ranges));
+    if (ranges == NULL) {
+        return -ENOMEM;
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < bmap->count; i++) {
+        for (uint64_t first = bmap->ranges[i].first; first <= bmap->ranges[i].last; first += BMAP_RANGE_MAX_BLOCKS) {
+            ranges[j++] = (struct bmap_range){
+                .first = first,
+                .last = MIN(first + BMAP_RANGE_MAX_BLOCKS - 1, bmap->ranges[i].last),
+                .has_sha256 = true,
+            };
+        }
+    }
+
+    free(bmap->ranges);
+    bmap->ranges = ranges;
+    bmap->count = count;
+    bmap->mapped_blocks = 0;
+    for (size_t i = 0; i < count; i++) {
+        bmap->mapped_blocks += ranges[i].last - ranges[i].first + 1;
+    }
+    return 0;
+}
+
+// Hashes ranges until none are left; the calling thread also renders the progress.
+static void hash_ranges(struct hash_job *job, bool report) {
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next++;
+        uint64_t hashed = job->hashed;
+        pthread_mutex_unlock(&job->lock);
+
+        if (report) {
+            progress_update("Hashing", hashed, job->mapped);
+        }
+        if (i >= job->bmap->count) {
+            return;
+        }
+
+        struct bmap_range *range = &job->bmap->ranges[i];
+        uint64_t offset, length;
+        bmap_range_bytes(job->bmap, range, &offset, &length);
+        sha256(job->image->data + offset, length, range->sha256);
+
+        pthread_mutex_lock(&job->lock);
+        job->hashed += length;
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+static void *hash_worker(void *arg) {
+    hash_ranges(arg, false);
+    return NULL;
+}
+
+static void hash_image(const struct mapped_file *image, struct bmap *bmap) {
+    struct hash_job job = {
+        .image = image,
+        .bmap = bmap,
+        .next = 0,
+        .hashed = 0,
+        .mapped = 0,
+    };
+    for (size_t i = 0; i < bmap->count; i++) {
+        uint64_t offset, length;
+        bmap_range_bytes(bmap, &bmap->ranges[i], &offset, &length);
+        job.mapped += length;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+
+    pthread_t workers[BMAP_MAX_WORKERS];
+    int started = 0;
+    for (int count = workers_count(); started < count - 1; started++) {
+        if (pthread_create(&workers[started], NULL, hash_worker, &job) != 0) {
+            break;
+        }
+    }
+
+    hash_ranges(&job, true);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    progress_update("Hashing", job.hashed, job.mapped);
+}
+
+// Formats the bmap with BmapFileChecksum zeroed, then fills in the checksum of that text.
+static char *format_bmap(const struct bmap *bmap, size_t *size) {
+    size_t capacity = BMAP_HEADER_MAX + bmap->count * BMAP_RANGE_LINE_MAX;
+    char *text = malloc(capacity);
+    if (text == NULL) {
+        return NULL;
+    }
+
+    char zero[SHA256_HEX_SIZE];
+    memset(zero, '0', SHA256_HEX_SIZE - 1);
+    zero[SHA256_HEX_SIZE - 1] = '\0';
+
+    size_t used = snprintf(text, capacity,
+        "<?xml version=\"1.0\" ?>\n"
+        "<!-- Block map of an image: only the mapped blocks hold data and have to\n"
+        "     be written to the target device. -->\n"
+        "<bmap version=\"" BMAP_VERSION "\">\n"
+        "    <!-- Image size in bytes: %.1f MiB -->\n"
+        "    <ImageSize> %" PRIu64 " </ImageSize>\n"
+        "    <BlockSize> %" PRIu32 " </BlockSize>\n"
+        "    <BlocksCount> %" PRIu64 " </BlocksCount>\n"
+        "    <!-- Count of mapped blocks: %.1f MiB or %.1f%% -->\n"
+        "    <MappedBlocksCount> %" PRIu64 " </MappedBlocksCount>\n"
+        "    <ChecksumType> sha256 </ChecksumType>\n"
+        "    <!-- SHA-256 of this file with this value set to all zeroes -->\n"
+        "    <BmapFileChecksum> ",
+        bmap->image_size / 1048576.0, bmap->image_size, bmap->block_size, bmap->blocks,
+        bmap->mapped_blocks * (double)bmap->block_size / 1048576.0, bmap->blocks > 0 ? 100.0 * bmap->mapped_blocks / bmap->blocks : 0.0,
+        bmap->mapped_blocks);
+    size_t checksum = used;
+    used += snprintf(text + used, capacity - used, "%s </BmapFileChecksum>\n    <BlockMap>\n", zero);
+
+    for (size_t i = 0; i < bmap->count; i++) {
+        const struct bmap_range *range = &bmap->ranges[i];
+        char hex[SHA256_HEX_SIZE];
+        sha256_hex(range->sha256, hex);
+
+        if (range->first == range->last) {
+            used += snprintf(text + used, capacity - used, "        <Range chksum=\"%s\"> %" PRIu64 " </Range>\n", hex, range->first);
+        } else {
+            used += snprintf(text + used, capacity - used, "        <Range chksum=\"%s\"> %" PRIu64 "-%" PRIu64 " </Range>\n", hex, range->first,
+                range->last);
+        }
+    }
+    used += snprintf(text + used, capacity - used, "    </BlockMap>\n</bmap>\n");
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    sha256(text, used, digest);
+    sha256_hex(digest, hex);
+    memcpy(text + checksum, hex, SHA256_HEX_SIZE - 1);
+
+    *size = used;
+    return text;
+}
+
+static int write_file(const char *path, const char *text, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    struct file_info fi = {
+        .fd = fd,
+        .offset = 0,
+        .err = 0,
+    };
+    io_transfer(false, 0, (uint8_t *)text, size, &fi);
+
+    int err = -fi.err;
+    if (close(fd) < 0 && err == 0) {
+        err = -errno;
+    }
+    if (err < 0) {
+        unlink(path);
+    }
+    return err;
+}
+
+int bmap_build(const char *image_path, const char *out_path, struct bmap_stats *stats) {
+    struct mapped_file image = { 0 };
+    struct bmap bmap = { 0 };
+
+    int fd = open(image_path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int err = map_file(fd, &image);
+    if (err == 0 && image.size == 0) {
+        err = -EINVAL;
+    }
+
+    if (err == 0) {
+        bmap.image_size = image.size;
+        bmap.block_size = BMAP_BLOCK_SIZE;
+        bmap.blocks = (image.size + BMAP_BLOCK_SIZE - 1) / BMAP_BLOCK_SIZE;
+        if ((err = map_image(fd, &image, &bmap, &stats->ext4)) == 0) {
+            err = split_ranges(&bmap);
+        }
+    }
+
+    if (err == 0) {
+        hash_image(&image, &bmap);
+
+        size_t size;
+        char *text = format_bmap(&bmap, &size);
+        err = text != NULL ? write_file(out_path, text, size) : -ENOMEM;
+        free(text);
+    }
+
+    if (err == 0) {
+        stats->image_size = image.size;
+        stats->mapped = 0;
+        for (size_t i = 0; i < bmap.count; i++) {
+            uint64_t offset, length;
+            bmap_range_bytes(&bmap, &bmap.ranges[i], &offset, &length);
+            stats->mapped += length;
+        }
+        stats->ranges = bmap.count;
+    }
+
+    bmap_free(&bmap);
+    unmap_file(&image);
+    close(fd);
+    return err;
+}
+
+// Points value at the trimmed text of <name>...</name> inside [xml, end); returns its length, or -1.
+static int element(const char *xml, const char *end, const char *name, const char **value) {
+    char open_tag[64];
+    char close_tag[64];
+    snprintf(open_tag, sizeof(open_tag), "<%s>", name);
+    snprintf(close_tag, sizeof(close_tag), "</%s>", name);
+
+    const char *start = strstr(xml, open_tag);
+    if (start == NULL || start >= end) {
+        return -1;
+    }
+    start += strlen(open_tag);
+    const char *stop = strstr(start, close_tag);
+    if (stop == NULL || stop > end) {
+        return -1;
+    }
+
+    while (start < stop && strchr(" \t\r\n", *start) != NULL) {
+        start++;
+    }
+    while (stop > start && strchr(" \t\r\n", stop[-1]) != NULL) {
+        stop--;
+    }
+
+    *value = start;
+    return stop - start;
+}
+
+static bool parse_number(const char *text, int length, uint64_t *value) {
+    char *end;
+    if (length <= 0 || *text < '0' || *text > '9') {
+        return false;
+    }
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    return errno == 0 && end == text + length;
+}
+
+static bool number_element(const char *xml, const char *end, const char *name, uint64_t *value) {
+    const char *text;
+    int length = element(xml, end, name, &text);
+    return parse_number(text, length, value);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool parse_digest(const char *hex, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    for (size_t i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        int high = hex_value(hex[2 * i]);
+        int low = high >= 0 ? hex_value(hex[2 * i + 1]) : -1;
+        if (low < 0) {
+            return false;
+        }
+        digest[i] = high << 4 | low;
+    }
+    return true;
+}
+
+// Checks BmapFileChecksum: the SHA-256 of the file with the value replaced by zeroes.
+static int check_file_checksum(char *xml, size_t size) {
+    const char *value;
+    if (element(xml, xml + size, "BmapFileChecksum", &value) != SHA256_HEX_SIZE - 1) {
+        return -EINVAL;
+    }
+
+    uint8_t expected[SHA256_DIGEST_SIZE];
+    if (!parse_digest(value, expected)) {
+        return -EINVAL;
+    }
+
+    char *field = xml + (value - xml);
+    char saved[SHA256_HEX_SIZE - 1];
+    memcpy(saved, field, sizeof(saved));
+    memset(field, '0', sizeof(saved));
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(xml, size, digest);
+    memcpy(field, saved, sizeof(saved));
+
+    return memcmp(digest, expected, SHA256_DIGEST_SIZE) == 0 ? 0 : -EIO;
+}
+
+// Parses one <Range ...> element starting at tag; returns the text after it, or NULL.
+static const char *parse_range(const char *tag, const char *end, struct bmap_range *range) {
+    const char *close = strchr(tag, '>');
+    if (close == NULL || close >= end) {
+        return NULL;
+    }
+
+    range->has_sha256 = false;
+    const char *chksum = strstr(tag, "chksum=\"");
+    if (chksum != NULL && chksum < close) {
+        chksum += strlen("chksum=\"");
+        if (chksum + SHA256_HEX_SIZE - 1 >= close || chksum[SHA256_HEX_SIZE - 1] != '"' || !parse_digest(chksum, range->sha256)) {
+            return NULL;
+        }
+        range->has_sha256 = true;
+    }
+
+    const char *stop = strstr(close, "</Range>");
+    if (stop == NULL || stop > end) {
+        return NULL;
+    }
+
+    const char *text = close + 1;
+    while (text < stop && strchr(" \t\r\n", *text) != NULL) {
+        text++;
+    }
+    const char *text_end = stop;
+    while (text_end > text && strchr(" \t\r\n", text_end[-1]) != NULL) {
+        text_end--;
+    }
+
+    const char *dash = memchr(text, '-', text_end - text);
+    if (dash == NULL) {
+        if (!parse_number(text, text_end - text, &range->first)) {
+            return NULL;
+        }
+        range->last = range->first;
+    } else if (!parse_number(text, dash - text, &range->first) || !parse_number(dash + 1, text_end - dash - 1, &range->last)) {
+        return NULL;
+    }
+
+    return stop + strlen("</Range>");
+}
+
+static int parse_ranges(const char *xml, const char *end, struct bmap *bmap) {
+    const char *map = strstr(xml, "<BlockMap>");
+    const char *map_end = map != NULL ? strstr(map, "</BlockMap>") : NULL;
+    if (map_end == NULL || map_end > end) {
+        return -EINVAL;
+    }
+
+    size_t capacity = 0;
+    uint64_t mapped = 0;
+    for (const char *tag = strstr(map, "<Range"); tag != NULL && tag < map_end; tag = strstr(tag, "<Range")) {
+        if (bmap->count == capacity) {
+            size_t grown = capacity > 0 ? capacity * 2 : 64;
+            struct bmap_range *ranges = realloc(bmap->ranges, grown * sizeof(*ranges));
+            if (ranges == NULL) {
+                return -ENOMEM;
+            }
+            bmap->ranges = ranges;
+            capacity = grown;
+        }
+
+        struct bmap_range *range = &bmap->ranges[bmap->count];
+        if ((tag = parse_range(tag, map_end, range)) == NULL) {
+            return -EINVAL;
+        }
+
+        // ranges are sorted and disjoint, and lie inside the image
+        const struct bmap_range *previous = bmap->count > 0 ? &bmap->ranges[bmap->count - 1] : NULL;
+        if (range->first > range->last || range->last >= bmap->blocks || (previous != NULL && range->first <= previous->last)) {
+            return -EINVAL;
+        }
+        mapped += range->last - range->first + 1;
+        bmap->count++;
+    }
+
+    return mapped == bmap->mapped_blocks ? 0 : -EINVAL;
+}
+
+static int parse_bmap(char *xml, size_t size, struct bmap *bmap) {
+    const char *end = xml + size;
+
+    const char *root = strstr(xml, "<bmap");
+    const char *version = root != NULL ? strstr(root, "version=\"") : NULL;
+    if (version == NULL) {
+        return -EINVAL;
+    }
+    // 1.x files use other checksums; minor versions stay compatible
+    if (strtoul(version + strlen("version=\""), NULL, 10) != 2) {
+        return -ENOTSUP;
+    }
+
+    const char *type;
+    int type_length = element(xml, end, "ChecksumType", &type);
+    if (type_length != 6 || memcmp(type, "sha256", 6) != 0) {
+        return -ENOTSUP;
+    }
+
+    uint64_t block_size;
+    if (!number_element(xml, end, "ImageSize", &bmap->image_size) || !number_element(xml, end, "BlockSize", &block_size)
+        || !number_element(xml, end, "BlocksCount", &bmap->blocks) || !number_element(xml, end, "MappedBlocksCount", &bmap->mapped_blocks)) {
+        return -EINVAL;
+    }
+    if (block_size == 0 || block_size > UINT32_MAX || bmap->blocks != (bmap->image_size + block_size - 1) / block_size) {
+        return -EINVAL;
+    }
+    bmap->block_size = block_size;
+
+    int err = check_file_checksum(xml, size);
+    if (err < 0) {
+        return err;
+    }
+    return parse_ranges(xml, end, bmap);
+}
+
+int bmap_load(int fd, struct bmap *bmap) {
+    memset(bmap, 0, sizeof(*bmap));
+
+    struct mapped_file file = { 0 };
+    int err = map_file(fd, &file);
+    if (err < 0) {
+        return err;
+    }
+
+    // terminated copy for the string functions; the checksum is computed over the original bytes
+    char *xml = malloc(file.size + 1);
+    if (xml == NULL) {
+        unmap_file(&file);
+        return -ENOMEM;
+    }
+    memcpy(xml, file.data, file.size);
+    xml[file.size] = '\0';
+    size_t size = file.size;
+    unmap_file(&file);
+
+    if (strlen(xml) != size) {
+        err = -EINVAL;
+    } else {
+        err = parse_bmap(xml, size, bmap);
+    }
+    if (err < 0) {
+        bmap_free(bmap);
+    }
+
+    free(xml);
+    return err;
+}
+
+void bmap_free(struct bmap *bmap) {
+    free(bmap->ranges);
+    bmap->ranges = NULL;
+    bmap->count = 0;
+}
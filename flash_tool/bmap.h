@@ -0,0 +1,62 @@
+#ifndef BMAP_H
+#define BMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * Block maps in the bmaptool format, version 2.0, for flashing only the blocks
+ * of a raw image that hold data. The generator maps the allocated blocks of an
+ * ext2/3/4 image, and the data (non-hole) regions of the file elsewhere, and
+ * splits runs longer than BMAP_RANGE_MAX_BLOCKS so they are hashed on several
+ * threads. Loaded bmaps keep their ranges as written, which for bmaptool can be
+ * gigabytes; flashing streams every range in pieces of at most BMAP_PIECE_SIZE
+ * and checks its SHA-256 before writing the last piece. Unmapped blocks keep
+ * whatever the device holds.
+ */
+
+#define BMAP_VERSION "2.0"
+#define BMAP_BLOCK_SIZE (4096)
+#define BMAP_RANGE_MAX_BLOCKS (8192)
+#define BMAP_PIECE_SIZE ((uint64_t)BMAP_RANGE_MAX_BLOCKS * BMAP_BLOCK_SIZE)
+#define BMAP_MAX_WORKERS (16)
+
+struct bmap_range {
+    uint64_t first;
+    // inclusive, as in the file
+    uint64_t last;
+    bool has_sha256;
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+};
+
+struct bmap {
+    uint64_t image_size;
+    uint32_t block_size;
+    uint64_t blocks;
+    uint64_t mapped_blocks;
+    struct bmap_range *ranges;
+    size_t count;
+};
+
+struct bmap_stats {
+    uint64_t image_size;
+    uint64_t mapped;
+    size_t ranges;
+    // the image holds an ext2/3/4 filesystem whose allocation map was used
+    bool ext4;
+};
+
+// Maps the image and writes its bmap to out; returns 0 or a negative errno.
+int bmap_build(const char *image_path, const char *out_path, struct bmap_stats *stats);
+
+// Parses a bmap file, checking its BmapFileChecksum; returns 0 or a negative errno.
+int bmap_load(int fd, struct bmap *bmap);
+void bmap_free(struct bmap *bmap);
+
+// Byte range of the blocks in the image; the last block of the image may be short.
+void bmap_range_bytes(const struct bmap *bmap, const struct bmap_range *range, uint64_t *offset, uint64_t *length);
+
+#endif /* BMAP_H */
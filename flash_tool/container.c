@@ -0,0 +1,222 @@
+#include "container.h"
+#include "io_handler.h"
+#include "progress.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+static void put_le(uint8_t *data, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t get_le(const uint8_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = size; i > 0; i--) {
+        value = value << 8 | data[i - 1];
+    }
+    return value;
+}
+
+static uint64_t align_up(uint64_t value) { return (value + CONTAINER_ALIGN - 1) / CONTAINER_ALIGN * CONTAINER_ALIGN; }
+
+static int write_index(struct container *container) {
+    uint8_t *index = calloc(1, CONTAINER_DATA_START);
+    if (index == NULL) {
+        return -ENOMEM;
+    }
+
+    memcpy(index, CONTAINER_MAGIC, 8);
+    put_le(index + 8, CONTAINER_VERSION, 4);
+    put_le(index + 12, CONTAINER_DATA_START, 4);
+    put_le(index + 16, CONTAINER_ENTRY_SIZE, 4);
+    put_le(index + 20, container->count, 4);
+
+    for (size_t i = 0; i < container->count; i++) {
+        const struct container_range *range = &container->ranges[i];
+        uint8_t *entry = index + CONTAINER_HEADER_SIZE + i * CONTAINER_ENTRY_SIZE;
+
+        put_le(entry, range->address, 8);
+        put_le(entry + 8, range->length, 8);
+        put_le(entry + 16, range->data_offset, 8);
+        entry[24] = range->part;
+        memcpy(entry + 32, range->sha256, SHA256_DIGEST_SIZE);
+        memcpy(entry + 64, range->name, CONTAINER_NAME_MAX);
+    }
+
+    struct file_info fi = {
+        .fd = container->fd,
+        .offset = 0,
+        .err = 0,
+    };
+    io_transfer(false, 0, index, CONTAINER_DATA_START, &fi);
+    free(index);
+
+    return -fi.err;
+}
+
+int container_create(struct container *container, int fd) {
+    memset(container, 0, sizeof(*container));
+    container->fd = fd;
+    container->end = CONTAINER_DATA_START;
+
+    return write_index(container);
+}
+
+int container_begin(struct container *container, const struct plan_step *step, size_t *first) {
+    if (container->count + step->operations_count > CONTAINER_MAX_RANGES) {
+        return -ENOSPC;
+    }
+
+    *first = container->count;
+    uint64_t end = container->end;
+    for (size_t i = 0; i < step->operations_count; i++) {
+        const struct operation *operation = step->operations[i];
+        size_t index = container->count++;
+        struct container_range *range = &container->ranges[index];
+
+        memset(range, 0, sizeof(*range));
+        range->part = operation->part;
+        range->address = operation->address;
+        range->length = operation->length;
+        range->data_offset = container->end;
+        // the -D argument names the range; names that do not fit leave the index unchanged
+        int n = snprintf(range->name, sizeof(range->name), "%s", operation->path != NULL ? operation->path : operation->name);
+        if (n < 0 || (size_t)n >= sizeof(range->name)) {
+            container->count = *first;
+            container->end = end;
+            return -ENAMETOOLONG;
+        }
+
+        sha256_init(&container->hash[index]);
+        container->hashed[index] = 0;
+        container->end = align_up(container->end + operation->length);
+    }
+
+    return 0;
+}
+
+int container_commit(struct container *container, size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        if (container->hashed[i] != container->ranges[i].length) {
+            return -EIO;
+        }
+        sha256_final(&container->hash[i], container->ranges[i].sha256);
+    }
+
+    return write_index(container);
+}
+
+// Writes each chunk of a (merged) read into the ranges it overlaps and hashes it.
+int container_dump_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    struct container_dump_info *info = user_data;
+    struct container *container = info->container;
+    const struct plan_step *step = info->step;
+
+    uint64_t chunk_start = step->address + offset;
+    uint64_t chunk_end = chunk_start + count;
+
+    for (size_t i = 0; i < step->operations_count; i++) {
+        const struct operation *operation = step->operations[i];
+        size_t index = info->first + i;
+
+        uint64_t start = operation->address > chunk_start ? operation->address : chunk_start;
+        uint64_t end = operation->address + operation->length < chunk_end ? operation->address + operation->length : chunk_end;
+        if (start >= end) {
+            continue;
+        }
+
+        struct file_info fi = {
+            .fd = container->fd,
+            .offset = container->ranges[index].data_offset,
+            .err = 0,
+        };
+
+        int err;
+        if ((err = io_transfer(flashing, start - operation->address, buffer + (start - chunk_start), end - start, &fi)) < 0) {
+            info->err = fi.err;
+            return err;
+        }
+
+        // only bytes past the hashed prefix count, in case a packet is delivered again
+        uint64_t hashed = operation->address + container->hashed[index];
+        if (hashed >= start && hashed < end) {
+            sha256_update(&container->hash[index], buffer + (hashed - chunk_start), end - hashed);
+            container->hashed[index] += end - hashed;
+        }
+    }
+
+    progress_update(flashing ? "Flashing" : "Dumping", offset + count, total_length);
+    return 0;
+}
+
+int container_probe(int fd) {
+    char magic[8];
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+    ssize_t n = read(fd, magic, sizeof(magic));
+    if (n < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+
+    return n == sizeof(magic) && memcmp(magic, CONTAINER_MAGIC, sizeof(magic)) == 0;
+}
+
+int container_load(const struct mapped_file *map, struct container_range *ranges, size_t *count) {
+    const uint8_t *data = map->data;
+
+    if (map->size < CONTAINER_DATA_START || memcmp(data, CONTAINER_MAGIC, 8) != 0) {
+        return -EINVAL;
+    }
+    if (get_le(data + 8, 4) != CONTAINER_VERSION) {
+        return -ENOTSUP;
+    }
+
+    uint64_t header_size = get_le(data + 12, 4);
+    uint64_t entry_size = get_le(data + 16, 4);
+    uint64_t entries = get_le(data + 20, 4);
+    if (entry_size < CONTAINER_ENTRY_SIZE || entries > CONTAINER_MAX_RANGES || header_size > map->size
+        || CONTAINER_HEADER_SIZE + entries * entry_size > header_size) {
+        return -EINVAL;
+    }
+
+    for (size_t i = 0; i < entries; i++) {
+        const uint8_t *entry = data + CONTAINER_HEADER_SIZE + i * entry_size;
+        struct container_range *range = &ranges[i];
+
+        range->address = get_le(entry, 8);
+        range->length = get_le(entry + 8, 8);
+        range->data_offset = get_le(entry + 16, 8);
+        range->part = entry[24];
+        memcpy(range->sha256, entry + 32, SHA256_DIGEST_SIZE);
+        memcpy(range->name, entry + 64, CONTAINER_NAME_MAX);
+        range->name[CONTAINER_NAME_MAX - 1] = '\0';
+
+        if (range->data_offset < header_size || range->data_offset > map->size || range->length > map->size - range->data_offset) {
+            return -EINVAL;
+        }
+    }
+
+    *count = entries;
+    return 0;
+}
+
+const uint8_t *container_find(const struct mapped_file *map, const struct container_range *ranges, size_t count, uint8_t part, uint64_t address,
+    uint64_t length) {
+    for (size_t i = 0; i < count; i++) {
+        const struct container_range *range = &ranges[i];
+        if (range->part == part && address >= range->address && length <= range->length && address - range->address <= range->length - length) {
+            return map->data + range->data_offset + (address - range->address);
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,87 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "args.h"
+#include "plan.h"
+#include "sha256.h"
+#include "util.h"
+
+/*
+ * Multi-range dump container. One file holds every range dumped in a
+ * session, each at a 4 KiB aligned data offset, behind a fixed-size index at
+ * the start of the file:
+ *
+ *   0x0000  header: magic, version, header size, entry size, entry count
+ *   0x0040  CONTAINER_MAX_RANGES index entries
+ *   0x3000  range data, in dump order
+ *
+ * All integers are little-endian. The index is rewritten after every
+ * completed dump, so an interrupted session leaves a valid container with the
+ * ranges finished so far. Readers map the file and point straight into it.
+ */
+
+#define CONTAINER_MAGIC "MTKCTR01"
+#define CONTAINER_VERSION (1)
+#define CONTAINER_ALIGN (4096)
+#define CONTAINER_MAX_RANGES (MAX_OPERATIONS)
+
+#define CONTAINER_HEADER_SIZE (64)
+#define CONTAINER_ENTRY_SIZE (128)
+#define CONTAINER_NAME_MAX (56)
+// header and index, rounded up to CONTAINER_ALIGN
+#define CONTAINER_DATA_START (0x3000)
+
+struct container_range {
+    uint8_t part;
+    uint64_t address;
+    uint64_t length;
+    uint64_t data_offset;
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    char name[CONTAINER_NAME_MAX];
+};
+
+struct container {
+    int fd;
+    struct container_range ranges[CONTAINER_MAX_RANGES];
+    size_t count;
+    // end of the data reserved so far
+    uint64_t end;
+
+    // digests of the ranges being dumped, fed in order
+    struct sha256 hash[CONTAINER_MAX_RANGES];
+    uint64_t hashed[CONTAINER_MAX_RANGES];
+};
+
+// All container functions return 0 or a negative errno.
+int container_create(struct container *container, int fd);
+
+// Reserves a range for each operation of a dump step, in order; -ENOSPC when the index is full, -ENAMETOOLONG when a -D
+// argument does not fit CONTAINER_NAME_MAX.
+int container_begin(struct container *container, const struct plan_step *step, size_t *first);
+// Stores the range digests and rewrites the index.
+int container_commit(struct container *container, size_t first, size_t count);
+
+struct container_dump_info {
+    const struct plan_step *step;
+    struct container *container;
+    size_t first;
+    int err;
+};
+
+int container_dump_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+// Returns 1 when the file starts with the container magic, 0 when it does not.
+int container_probe(int fd);
+
+// Parses the index of a mapped container.
+int container_load(const struct mapped_file *map, struct container_range *ranges, size_t *count);
+
+// Returns the stored bytes for [address, address + length) of part, or NULL when no single range covers them.
+const uint8_t *container_find(const struct mapped_file *map, const struct container_range *ranges, size_t count, uint8_t part, uint64_t address,
+    uint64_t length);
+
+#endif /* CONTAINER_H */
@@ -0,0 +1,316 @@
+#include "daemon.h"
+#include "io_handler.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+#include "mtk_da.h"
+#include "mtk_trace.h"
+#include "src/util.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+/*
+ * Line protocol, one job per line, one reply line per job:
+ *
+ *   dump ADDRESS LENGTH FILE
+ *   flash ADDRESS LENGTH FILE
+ *   verify ADDRESS LENGTH FILE
+ *   ping
+ *   quit
+ *
+ * Replies are "OK ..." or "ERR message". FILE is opened by the daemon, so
+ * relative paths are relative to the daemon's working directory.
+ */
+
+#ifdef _WIN32
+
+int daemon_run(mtk_device *device, const char *socket_path) {
+    (void)device;
+    (void)socket_path;
+    errx(1, "Daemon mode is not supported on Windows");
+    return -1;
+}
+
+#else
+
+enum job_result {
+    JOB_OK,
+    JOB_FAILED,
+    // device protocol state is unknown, the session can't be reused
+    JOB_SESSION_LOST,
+    JOB_QUIT,
+};
+
+static enum job_result run_transfer(mtk_device *device, int key, uint64_t address, uint64_t length, const char *path, char *reply, size_t size) {
+    int err;
+    uint8_t retval;
+
+    int flags = key == 'D' ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    int fd = open(path, flags, 0666);
+    if (fd < 0) {
+        snprintf(reply, size, "ERR unable to open %s: %s", path, strerror(errno));
+        return JOB_FAILED;
+    }
+
+    if (key != 'D') {
+        off_t maxlength = lseek(fd, 0, SEEK_END);
+        if (maxlength < 0 || (uint64_t)maxlength < length) {
+            close(fd);
+            snprintf(reply, size, "ERR %s is shorter than 0x%" PRIx64 " bytes", path, length);
+            return JOB_FAILED;
+        }
+    }
+
+    MTK_TRACE_SCOPE_RANGE(key == 'D' ? "dump" : key == 'F' ? "flash" : "verify", address, length);
+    uint64_t start = monotonic_us();
+
+    err = mtk_da_sdmmc_switch_part(device, MTK_DA_EMMC_PART_USER, &retval);
+    if (err < 0 || retval != MTK_DA_ACK) {
+        close(fd);
+        snprintf(reply, size, "ERR unable to switch partition to EMMC_USER: %s", err < 0 ? libusb_strerror(err) : "no ACK");
+        return err < 0 ? JOB_SESSION_LOST : JOB_FAILED;
+    }
+
+    struct verify_info vi = {
+        .file = { .fd = fd, .offset = 0, .err = 0 },
+        .scratch = NULL,
+        .scratch_size = 0,
+        .mismatched_bytes = 0,
+        .first_mismatch = 0,
+    };
+
+    uint8_t expected;
+    switch (key) {
+    case 'D':
+        err = mtk_da_read(device, MTK_DA_STORAGE_SDMMC, address, length, &retval, io_handler, &vi.file);
+        expected = MTK_DA_ACK;
+        break;
+    case 'F':
+        err = mtk_da_sdmmc_write_data(device, MTK_DA_STORAGE_SDMMC, MTK_DA_EMMC_PART_USER, address, length, &retval, io_handler, &vi.file);
+        expected = MTK_DA_CONT_CHAR;
+        break;
+    default:
+        err = mtk_da_read(device, MTK_DA_STORAGE_SDMMC, address, length, &retval, verify_handler, &vi);
+        expected = MTK_DA_ACK;
+        break;
+    }
+    free(vi.scratch);
+    close(fd);
+
+    if (vi.file.err != 0) {
+        snprintf(reply, size, "ERR %s: %s", path, strerror(vi.file.err));
+        return JOB_SESSION_LOST;
+    }
+    if (err < 0) {
+        snprintf(reply, size, "ERR transfer failed: %s", libusb_strerror(err));
+        return JOB_SESSION_LOST;
+    }
+    if (retval != expected) {
+        snprintf(reply, size, "ERR DA returned 0x%02" PRIx8, retval);
+        return JOB_FAILED;
+    }
+
+    double seconds = (monotonic_us() - start) / 1e6;
+    if (key == 'V' && vi.mismatched_bytes != 0) {
+        snprintf(reply, size, "ERR mismatch: %" PRIu64 " bytes differ, first at 0x%" PRIx64, vi.mismatched_bytes, address + vi.first_mismatch);
+        return JOB_FAILED;
+    }
+
+    snprintf(reply, size, "OK %" PRIu64 " bytes %.3f s", length, seconds);
+    return JOB_OK;
+}
+
+static enum job_result run_job(mtk_device *device, char *line, char *reply, size_t size) {
+    char *save = NULL;
+    const char *verb = strtok_r(line, " \t", &save);
+
+    if (verb == NULL) {
+        snprintf(reply, size, "ERR empty command");
+        return JOB_FAILED;
+    }
+    if (strcmp(verb, "ping") == 0) {
+        snprintf(reply, size, "OK");
+        return JOB_OK;
+    }
+    if (strcmp(verb, "quit") == 0) {
+        snprintf(reply, size, "OK");
+        return JOB_QUIT;
+    }
+
+    int key;
+    if (strcmp(verb, "dump") == 0) {
+        key = 'D';
+    } else if (strcmp(verb, "flash") == 0) {
+        key = 'F';
+    } else if (strcmp(verb, "verify") == 0) {
+        key = 'V';
+    } else {
+        snprintf(reply, size, "ERR unknown command: %s", verb);
+        return JOB_FAILED;
+    }
+
+    const char *address_str = strtok_r(NULL, " \t", &save);
+    const char *length_str = strtok_r(NULL, " \t", &save);
+    const char *path = save;
+    while (path != NULL && (*path == ' ' || *path == '\t')) {
+        path++;
+    }
+    if (address_str == NULL || length_str == NULL || path == NULL || *path == '\0') {
+        snprintf(reply, size, "ERR usage: %s ADDRESS LENGTH FILE", verb);
+        return JOB_FAILED;
+    }
+
+    char *end;
+    errno = 0;
+    uint64_t address = strtoull(address_str, &end, 0);
+    if (errno != 0 || *end != '\0') {
+        snprintf(reply, size, "ERR invalid address: %s", address_str);
+        return JOB_FAILED;
+    }
+    uint64_t length = strtoull(length_str, &end, 0);
+    if (errno != 0 || *end != '\0' || length == 0) {
+        snprintf(reply, size, "ERR invalid length: %s", length_str);
+        return JOB_FAILED;
+    }
+
+    return run_transfer(device, key, address, length, path, reply, size);
+}
+
+static bool send_reply(int fd, const char *reply) {
+    size_t len = strlen(reply);
+    char buf[DAEMON_LINE_MAX + 2];
+    memcpy(buf, reply, len);
+    buf[len++] = '\n';
+
+    size_t offset = 0;
+    while (offset < len) {
+        ssize_t n = write(fd, buf + offset, len - offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        offset += n;
+    }
+
+    return true;
+}
+
+// Serves one client until it disconnects; returns JOB_OK to keep accepting clients.
+static enum job_result serve_client(mtk_device *device, int fd) {
+    char line[DAEMON_LINE_MAX];
+    size_t used = 0;
+
+    for (;;) {
+        char *newline = memchr(line, '\n', used);
+        if (newline == NULL) {
+            if (used == sizeof(line)) {
+                send_reply(fd, "ERR line too long");
+                return JOB_OK;
+            }
+
+            ssize_t n = read(fd, line + used, sizeof(line) - used);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return JOB_OK;
+            }
+            used += n;
+            continue;
+        }
+
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+
+        char reply[DAEMON_LINE_MAX];
+        printf("Job: %s\n", line);
+        enum job_result result = run_job(device, line, reply, sizeof(reply));
+        printf("%s\n", reply);
+
+        send_reply(fd, reply);
+
+        if (result == JOB_QUIT || result == JOB_SESSION_LOST) {
+            return result;
+        }
+
+        used -= newline + 1 - line;
+        memmove(line, newline + 1, used);
+    }
+}
+
+int daemon_run(mtk_device *device, const char *socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    // only a stale socket from an earlier daemon is replaced, never another file
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(EEXIST));
+            close(sock);
+            return LIBUSB_ERROR_ACCESS;
+        }
+        unlink(socket_path);
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+        close(sock);
+        return LIBUSB_ERROR_ACCESS;
+    }
+
+    printf("Listening on %s\n", socket_path);
+
+    enum job_result result = JOB_OK;
+    while (result == JOB_OK) {
+        int client = accept(sock, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Unable to accept client: %s\n", strerror(errno));
+            close(sock);
+            unlink(socket_path);
+            return LIBUSB_ERROR_OTHER;
+        }
+
+        result = serve_client(device, client);
+        close(client);
+    }
+
+    close(sock);
+    unlink(socket_path);
+    return result == JOB_SESSION_LOST ? LIBUSB_ERROR_IO : 0;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "mtk_device.h"
+
+#define DAEMON_LINE_MAX (4096)
+
+int daemon_run(mtk_device *device, const char *socket_path);
+
+#endif /* DAEMON_H */
@@ -0,0 +1,320 @@
+#include "delta.h"
+
+#include "io_handler.h"
+#include "progress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mtk_da.h"
+#include "src/util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static void put_le(uint8_t *data, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t get_le(const uint8_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = size; i > 0; i--) {
+        value = value << 8 | data[i - 1];
+    }
+    return value;
+}
+
+static bool in_bounds(const struct mapped_file *map, uint64_t offset, uint64_t length) { return offset <= map->size && length <= map->size - offset; }
+
+// Positional file I/O through io_transfer, so --io applies to delta builds too.
+static int transfer_at(bool reading, int fd, uint64_t offset, const uint8_t *data, size_t size) {
+    struct file_info fi = {
+        .fd = fd,
+        .offset = 0,
+        .err = 0,
+    };
+    io_transfer(reading, offset, (uint8_t *)data, size, &fi);
+    return -fi.err;
+}
+
+static int map_path(const char *path, struct mapped_file *map) {
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int err = map_file(fd, map);
+    close(fd);
+    return err;
+}
+
+// Chunk by chunk; memcmp is vectorized by the C library and stops at the first difference.
+static bool chunk_changed(const struct mapped_file *base, const struct mapped_file *new, uint64_t offset, size_t count) {
+    if (offset >= base->size || count > base->size - offset) {
+        return true;
+    }
+    return memcmp(base->data + offset, new->data + offset, count) != 0;
+}
+
+static int add_range(struct delta *delta, size_t *capacity, uint64_t offset, uint64_t length) {
+    struct delta_range *last = delta->count > 0 ? &delta->ranges[delta->count - 1] : NULL;
+    if (last != NULL && offset - (last->offset + last->length) < DELTA_MERGE_GAP) {
+        last->length = offset + length - last->offset;
+        return 0;
+    }
+
+    if (delta->count == *capacity) {
+        size_t grown = *capacity > 0 ? *capacity * 2 : 64;
+        struct delta_range *ranges = realloc(delta->ranges, grown * sizeof(*ranges));
+        if (ranges == NULL) {
+            return -ENOMEM;
+        }
+        delta->ranges = ranges;
+        *capacity = grown;
+    }
+
+    delta->ranges[delta->count++] = (struct delta_range){ .offset = offset, .length = length };
+    return 0;
+}
+
+static int compare(const struct mapped_file *base, const struct mapped_file *new, struct delta *delta) {
+    size_t capacity = 0;
+
+    for (uint64_t offset = 0; offset < new->size; offset += DELTA_CHUNK_SIZE) {
+        size_t count = MIN((uint64_t)DELTA_CHUNK_SIZE, new->size - offset);
+        if (chunk_changed(base, new, offset, count)) {
+            int err = add_range(delta, &capacity, offset, count);
+            if (err < 0) {
+                return err;
+            }
+        }
+
+        if (offset % MTK_DA_PACKET_SIZE == 0 || offset + count == new->size) {
+            progress_update("Comparing", offset + count, new->size);
+        }
+    }
+
+    return 0;
+}
+
+// Spreads the samples over the part of the base that both images share and the delta does not write.
+static void pick_samples(const struct mapped_file *base, const struct mapped_file *new, struct delta *delta) {
+    uint64_t slots = MIN(base->size, new->size) / DELTA_SAMPLE_SIZE;
+
+    delta->sample_size = DELTA_SAMPLE_SIZE;
+    delta->samples_count = 0;
+    for (uint64_t i = 0; i < DELTA_SAMPLES && i < slots; i++) {
+        uint64_t offset = (slots <= DELTA_SAMPLES ? i : i * slots / DELTA_SAMPLES) * DELTA_SAMPLE_SIZE;
+
+        bool written = false;
+        for (size_t j = 0; j < delta->count && !written; j++) {
+            const struct delta_range *range = &delta->ranges[j];
+            written = offset < range->offset + range->length && range->offset < offset + DELTA_SAMPLE_SIZE;
+        }
+        if (written) {
+            continue;
+        }
+
+        struct delta_sample *sample = &delta->samples[delta->samples_count++];
+        sample->offset = offset;
+        sha256(base->data + offset, DELTA_SAMPLE_SIZE, sample->sha256);
+    }
+}
+
+static int write_delta(int out, const struct mapped_file *base, const struct mapped_file *new, const struct delta *delta) {
+    uint64_t ranges_offset = DELTA_HEADER_SIZE + DELTA_SAMPLES * DELTA_SAMPLE_ENTRY_SIZE;
+    uint64_t index_size = ranges_offset + delta->count * DELTA_RANGE_ENTRY_SIZE;
+
+    uint8_t *index = calloc(1, index_size);
+    if (index == NULL) {
+        return -ENOMEM;
+    }
+
+    memcpy(index, DELTA_MAGIC, 8);
+    put_le(index + 8, DELTA_VERSION, 4);
+    put_le(index + 12, DELTA_CHUNK_SIZE, 4);
+    put_le(index + 16, new->size, 8);
+    put_le(index + 24, base->size, 8);
+    put_le(index + 32, delta->samples_count, 4);
+    put_le(index + 36, delta->count, 4);
+    put_le(index + 40, delta->sample_size, 4);
+
+    for (size_t i = 0; i < delta->samples_count; i++) {
+        uint8_t *entry = index + DELTA_HEADER_SIZE + i * DELTA_SAMPLE_ENTRY_SIZE;
+        put_le(entry, delta->samples[i].offset, 8);
+        memcpy(entry + 8, delta->samples[i].sha256, SHA256_DIGEST_SIZE);
+    }
+
+    int err = 0;
+    uint64_t data_offset = index_size;
+    for (size_t i = 0; i < delta->count && err == 0; i++) {
+        const struct delta_range *range = &delta->ranges[i];
+        uint8_t *entry = index + ranges_offset + i * DELTA_RANGE_ENTRY_SIZE;
+
+        put_le(entry, range->offset, 8);
+        put_le(entry + 8, range->length, 8);
+        put_le(entry + 16, data_offset, 8);
+        sha256(new->data + range->offset, range->length, entry + 24);
+
+        err = transfer_at(false, out, data_offset, new->data + range->offset, range->length);
+        data_offset += range->length;
+    }
+
+    // the index goes last, so an interrupted build leaves no valid delta behind
+    if (err == 0) {
+        err = transfer_at(false, out, 0, index, index_size);
+    }
+
+    free(index);
+    return err;
+}
+
+int delta_build(const char *base_path, const char *new_path, const char *out_path, struct delta_stats *stats) {
+    struct mapped_file base = { 0 };
+    struct mapped_file new = { 0 };
+    struct delta delta = { 0 };
+
+    int err = map_path(base_path, &base);
+    if (err == 0) {
+        err = map_path(new_path, &new);
+    }
+    if (err == 0 && new.size == 0) {
+        err = -EINVAL;
+    }
+    if (err == 0) {
+        err = compare(&base, &new, &delta);
+    }
+
+    if (err == 0) {
+        pick_samples(&base, &new, &delta);
+
+        int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (out < 0) {
+            err = -errno;
+        } else {
+            err = write_delta(out, &base, &new, &delta);
+            if (close(out) < 0 && err == 0) {
+                err = -errno;
+            }
+            if (err < 0) {
+                unlink(out_path);
+            }
+        }
+    }
+
+    if (err == 0) {
+        stats->length = new.size;
+        stats->changed = 0;
+        for (size_t i = 0; i < delta.count; i++) {
+            stats->changed += delta.ranges[i].length;
+        }
+        stats->ranges = delta.count;
+        stats->samples = delta.samples_count;
+    }
+
+    delta_free(&delta);
+    unmap_file(&new);
+    unmap_file(&base);
+    return err;
+}
+
+int delta_probe(int fd, uint64_t *length) {
+    uint8_t header[24];
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+    ssize_t n = read(fd, header, sizeof(header));
+    if (n < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+
+    if (n != sizeof(header) || memcmp(header, DELTA_MAGIC, 8) != 0) {
+        return 0;
+    }
+    *length = get_le(header + 16, 8);
+    return 1;
+}
+
+int delta_load(const struct mapped_file *map, struct delta *delta) {
+    const uint8_t *data = map->data;
+
+    memset(delta, 0, sizeof(*delta));
+
+    if (map->size < DELTA_HEADER_SIZE || memcmp(data, DELTA_MAGIC, 8) != 0) {
+        return -EINVAL;
+    }
+    if (get_le(data + 8, 4) != DELTA_VERSION) {
+        return -ENOTSUP;
+    }
+
+    delta->length = get_le(data + 16, 8);
+    delta->base_length = get_le(data + 24, 8);
+    delta->samples_count = get_le(data + 32, 4);
+    uint64_t count = get_le(data + 36, 4);
+    delta->sample_size = get_le(data + 40, 4);
+
+    uint64_t ranges_offset = DELTA_HEADER_SIZE + DELTA_SAMPLES * DELTA_SAMPLE_ENTRY_SIZE;
+    if (delta->samples_count > DELTA_SAMPLES || delta->sample_size > DELTA_SAMPLE_SIZE || !in_bounds(map, ranges_offset, count * DELTA_RANGE_ENTRY_SIZE)) {
+        return -EINVAL;
+    }
+
+    for (size_t i = 0; i < delta->samples_count; i++) {
+        const uint8_t *entry = data + DELTA_HEADER_SIZE + i * DELTA_SAMPLE_ENTRY_SIZE;
+        struct delta_sample *sample = &delta->samples[i];
+
+        sample->offset = get_le(entry, 8);
+        memcpy(sample->sha256, entry + 8, SHA256_DIGEST_SIZE);
+        if (sample->offset > delta->length || delta->sample_size > delta->length - sample->offset) {
+            return -EINVAL;
+        }
+    }
+
+    if (count > 0 && (delta->ranges = malloc(count * sizeof(*delta->ranges))) == NULL) {
+        return -ENOMEM;
+    }
+
+    uint64_t end = 0;
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *entry = data + ranges_offset + i * DELTA_RANGE_ENTRY_SIZE;
+        struct delta_range *range = &delta->ranges[i];
+
+        range->offset = get_le(entry, 8);
+        range->length = get_le(entry + 8, 8);
+        uint64_t data_offset = get_le(entry + 16, 8);
+        delta->count++;
+
+        // ranges are sorted and disjoint, and lie inside the image
+        if (range->length == 0 || range->offset < end || range->offset > delta->length || range->length > delta->length - range->offset
+            || !in_bounds(map, data_offset, range->length)) {
+            delta_free(delta);
+            return -EINVAL;
+        }
+        range->data = data + data_offset;
+        end = range->offset + range->length;
+
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256(range->data, range->length, digest);
+        if (memcmp(digest, entry + 24, SHA256_DIGEST_SIZE) != 0) {
+            verboseLog("Delta range at 0x%" PRIx64 " does not match its SHA-256\n", range->offset);
+            delta_free(delta);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+void delta_free(struct delta *delta) {
+    free(delta->ranges);
+    delta->ranges = NULL;
+    delta->count = 0;
+}
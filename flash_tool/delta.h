@@ -0,0 +1,77 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+#include "util.h"
+
+/*
+ * Binary delta between a base image and a new one, for flashing units that
+ * already hold the base. The images are compared in DELTA_CHUNK_SIZE chunks;
+ * changed chunks become ranges, and ranges closer than DELTA_MERGE_GAP are
+ * merged since resending the gap is cheaper than another WRITE_DATA command:
+ *
+ *   0x0000  header: magic, version, chunk size, image and base length,
+ *           sample and range counts, sample size
+ *   0x0080  samples: offset and SHA-256 of DELTA_SAMPLE_SIZE bytes of the base
+ *           that the delta leaves alone, for checking the device before applying
+ *   ...     ranges: offset into the image, length, data offset, SHA-256
+ *   ...     range data, back to back
+ *
+ * All integers are little-endian. The index is written last.
+ */
+
+#define DELTA_MAGIC "MTKDLT01"
+#define DELTA_VERSION (1)
+#define DELTA_CHUNK_SIZE (4096)
+#define DELTA_MERGE_GAP (32 * 1024)
+#define DELTA_SAMPLES (16)
+#define DELTA_SAMPLE_SIZE (64 * 1024)
+
+#define DELTA_HEADER_SIZE (128)
+#define DELTA_SAMPLE_ENTRY_SIZE (8 + SHA256_DIGEST_SIZE)
+#define DELTA_RANGE_ENTRY_SIZE (24 + SHA256_DIGEST_SIZE)
+
+struct delta_range {
+    uint64_t offset;
+    uint64_t length;
+    const uint8_t *data;
+};
+
+struct delta_sample {
+    uint64_t offset;
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+};
+
+struct delta {
+    // length of the new image, which is what the delta writes
+    uint64_t length;
+    uint64_t base_length;
+    size_t sample_size;
+    struct delta_sample samples[DELTA_SAMPLES];
+    size_t samples_count;
+    struct delta_range *ranges;
+    size_t count;
+};
+
+struct delta_stats {
+    uint64_t length;
+    uint64_t changed;
+    size_t ranges;
+    size_t samples;
+};
+
+// Compares base and new and writes the delta to out; returns 0 or a negative errno.
+int delta_build(const char *base_path, const char *new_path, const char *out_path, struct delta_stats *stats);
+
+// Returns 1 and the new image length when the file starts with the delta magic, 0 when it does not.
+int delta_probe(int fd, uint64_t *length);
+
+// Parses a mapped delta, checking every range against its SHA-256; returns 0 or a negative errno.
+int delta_load(const struct mapped_file *map, struct delta *delta);
+void delta_free(struct delta *delta);
+
+#endif /* DELTA_H */
@@ -0,0 +1,284 @@
+#include "engine.h"
+#include "progress.h"
+#include "session.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "mtk_device.h"
+#include "mtk_trace.h"
+#include "src/util.h"
+
+// mtk_da_read and mtk_da_write_data keep their 1 MiB transfer buffers on the stack
+#define ENGINE_STACK_SIZE (4 * 1024 * 1024)
+
+struct worker {
+    pthread_t thread;
+    bool started;
+    uint32_t id;
+
+    uint8_t bus;
+    uint8_t ports[MTK_DEVICE_MAX_PORTS];
+    int ports_count;
+
+    struct session *session;
+    int err;
+    uint64_t elapsed_us;
+};
+
+struct engine {
+    const struct arguments *arguments;
+    const mtk_da_info *info;
+    const struct package *package;
+
+    struct mapped_file download_agent;
+    struct mapped_file images[MAX_OPERATIONS];
+
+    struct worker workers[ENGINE_MAX_DEVICES];
+    size_t count;
+};
+
+static void set_log_level(libusb_context *ctx) {
+    int level = verbose ? LIBUSB_LOG_LEVEL_DEBUG : LIBUSB_LOG_LEVEL_INFO;
+#if LIBUSB_API_VERSION >= 0x01000106
+    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, level);
+#else
+    libusb_set_debug(ctx, level);
+#endif
+}
+
+static void worker_done(struct worker *worker, int err, uint64_t start) {
+    struct session *session = worker->session;
+
+    worker->err = err;
+    worker->elapsed_us = monotonic_us() - start;
+
+    if (err < 0) {
+        fprintf(stderr, "[%s] Failed: %s\n", session->label, session->error);
+    } else {
+        session_printf(session, "Done in %.1f s\n", worker->elapsed_us / 1e6);
+    }
+}
+
+static void *worker_run(void *user_data) {
+    struct worker *worker = user_data;
+    struct session *session = worker->session;
+
+    mtk_trace_set_thread(worker->id + 2);
+    progress_set_label(session->label);
+    MTK_TRACE_SCOPE("session");
+    uint64_t start = monotonic_us();
+
+    int err;
+    if (session->arguments->emulate_image != NULL) {
+        err = session_attach_emulator(session);
+        if (err == 0) {
+            err = session_run(session);
+            mtk_emulator_close(session->emulator);
+        }
+        worker_done(worker, err, start);
+        return NULL;
+    }
+
+    // a context per device keeps event handling and transfers of one port from stalling the others
+    libusb_context *ctx;
+    err = libusb_init(&ctx);
+    if (err < 0) {
+        snprintf(session->error, sizeof(session->error), "libusb_init failed: %s", libusb_strerror(err));
+        worker->err = err;
+        return NULL;
+    }
+    set_log_level(ctx);
+
+    err = mtk_device_open_path(&session->device, ctx, worker->bus, worker->ports, worker->ports_count);
+    if (err < 0) {
+        snprintf(session->error, sizeof(session->error), "Unable to open MediaTek device: %s", libusb_strerror(err));
+    } else {
+        err = session_run(session);
+        mtk_device_close(&session->device);
+    }
+    libusb_exit(ctx);
+
+    worker_done(worker, err, start);
+    return NULL;
+}
+
+static int hotplug_callback_fn(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) {
+    (void)ctx;
+    (void)event;
+
+    struct engine *engine = user_data;
+    if (engine->count == engine->arguments->parallel) {
+        return 0;
+    }
+
+    uint8_t bus = libusb_get_bus_number(device);
+    uint8_t ports[MTK_DEVICE_MAX_PORTS];
+    int ports_count = libusb_get_port_numbers(device, ports, sizeof(ports));
+    if (ports_count < 0) {
+        return 0;
+    }
+
+    // the device comes back on the same port after a reboot; each port is only handled once
+    for (size_t i = 0; i < engine->count; i++) {
+        const struct worker *worker = &engine->workers[i];
+        if (worker->bus == bus && worker->ports_count == ports_count && memcmp(worker->ports, ports, ports_count) == 0) {
+            return 0;
+        }
+    }
+
+    struct worker *worker = &engine->workers[engine->count];
+    worker->id = engine->count++;
+    worker->bus = bus;
+    memcpy(worker->ports, ports, ports_count);
+    worker->ports_count = ports_count;
+
+    return 0;
+}
+
+static int start_worker(struct engine *engine, struct worker *worker) {
+    worker->session = calloc(1, sizeof(struct session));
+    if (worker->session == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    struct session *session = worker->session;
+    session_init(session, engine->arguments, engine->info);
+    session->download_agent = engine->download_agent.data != NULL ? &engine->download_agent : NULL;
+    session->images = engine->images;
+    if (engine->package != NULL) {
+        session->package = engine->package;
+        session->download_agent = &engine->package->da;
+    }
+
+    if (engine->arguments->emulate_image != NULL) {
+        snprintf(session->label, sizeof(session->label), "emu%" PRIu32, worker->id);
+    } else {
+        int n = snprintf(session->label, sizeof(session->label), "%" PRIu8 "-", worker->bus);
+        for (int i = 0; i < worker->ports_count; i++) {
+            n += snprintf(session->label + n, sizeof(session->label) - n, i == 0 ? "%" PRIu8 : ".%" PRIu8, worker->ports[i]);
+        }
+    }
+
+    printf("[%s] Device attached, starting session %zu of %u\n", session->label, (size_t)worker->id + 1, engine->arguments->parallel);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, ENGINE_STACK_SIZE);
+    int err = pthread_create(&worker->thread, &attr, worker_run, worker);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    worker->started = true;
+    return 0;
+}
+
+// The DA and flash images are mapped once; every session transfers from the same pages.
+static void map_inputs(struct engine *engine) {
+    const struct arguments *arguments = engine->arguments;
+    int err;
+
+    // a package is mapped already
+    if (arguments->state != DEVICE_STATE_DA_STAGE2 && engine->package == NULL) {
+        err = map_file(arguments->download_agent_fd, &engine->download_agent);
+        check_errnum(-err, "Unable to map Download Agent binary");
+    }
+
+    for (size_t i = 0; i < arguments->operations_count; i++) {
+        if (arguments->operations[i].key == 'F' && !arguments->operations[i].from_package) {
+            err = map_file(arguments->operations[i].fd, &engine->images[i]);
+            check_errnum(-err, "Unable to map flash file");
+        }
+    }
+}
+
+// Waits for all sessions and prints the per-device summary; returns the number of failed devices.
+static int engine_finish(struct engine *engine) {
+    const struct arguments *arguments = engine->arguments;
+
+    int failed = 0;
+    for (size_t i = 0; i < engine->count; i++) {
+        struct worker *worker = &engine->workers[i];
+        if (worker->started) {
+            pthread_join(worker->thread, NULL);
+        }
+    }
+
+    printf("\n");
+    for (size_t i = 0; i < engine->count; i++) {
+        struct worker *worker = &engine->workers[i];
+        if (worker->err < 0) {
+            printf("%-16s FAILED  %s\n", worker->session->label, worker->session->error);
+            failed++;
+        } else {
+            printf("%-16s OK      %.1f s, %" PRIu32 " retries\n", worker->session->label, worker->elapsed_us / 1e6, worker->session->device.stats.retries);
+        }
+        free(worker->session);
+    }
+    printf("%zu devices, %d failed\n", engine->count, failed);
+
+    unmap_file(&engine->download_agent);
+    for (size_t i = 0; i < arguments->operations_count; i++) {
+        unmap_file(&engine->images[i]);
+    }
+
+    return failed;
+}
+
+int engine_run(const struct arguments *arguments, const mtk_da_info *info, const struct package *package) {
+    static struct engine engine;
+    engine.arguments = arguments;
+    engine.info = info;
+    engine.package = package;
+    engine.count = 0;
+
+    // progress bars of several devices would overwrite each other; JSON progress is still tagged per device
+    progress_set_terminal(false);
+
+    map_inputs(&engine);
+
+    if (arguments->emulate_image != NULL) {
+        // emulated devices are all present from the start and share the image
+        for (; engine.count < arguments->parallel; engine.count++) {
+            engine.workers[engine.count].id = engine.count;
+            int err = start_worker(&engine, &engine.workers[engine.count]);
+            check_libusb(err, "Unable to start device session");
+        }
+        return engine_finish(&engine);
+    }
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        errx(2, "libusb has no hotplug capabilities\n");
+    }
+
+    libusb_hotplug_callback_handle handle;
+    int err = libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE, MTK_DEVICE_VID, MTK_DEVICE_PID,
+        LIBUSB_CLASS_COMM, hotplug_callback_fn, &engine, &handle);
+    check_libusb(err, "Unable to register hotplug callback");
+
+    printf("Waiting for %u devices\n", arguments->parallel);
+
+    size_t started = 0;
+    while (started < arguments->parallel) {
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+        err = libusb_handle_events_timeout(NULL, &tv);
+        check_libusb(err, "wait failed");
+
+        for (; started < engine.count; started++) {
+            err = start_worker(&engine, &engine.workers[started]);
+            check_libusb(err, "Unable to start device session");
+        }
+    }
+
+    libusb_hotplug_deregister_callback(NULL, handle);
+
+    return engine_finish(&engine);
+}
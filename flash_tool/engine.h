@@ -0,0 +1,15 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "args.h"
+#include "package.h"
+
+#include "mtk_da.h"
+
+#define ENGINE_MAX_DEVICES (32)
+
+// Runs the operations on arguments->parallel devices, each in its own thread; returns the number of failed devices.
+// A package, when given, replaces the DA and image files.
+int engine_run(const struct arguments *arguments, const mtk_da_info *info, const struct package *package);
+
+#endif /* ENGINE_H */
@@ -0,0 +1,408 @@
+#include "ext4.h"
+#include "io_handler.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "mtk_da.h"
+#include "src/util.h"
+
+#define COMPAT_SPARSE_SUPER2 (0x200)
+#define INCOMPAT_META_BG (0x10)
+#define INCOMPAT_64BIT (0x80)
+#define RO_COMPAT_SPARSE_SUPER (0x1)
+#define RO_COMPAT_GDT_CSUM (0x10)
+#define RO_COMPAT_BIGALLOC (0x200)
+#define RO_COMPAT_METADATA_CSUM (0x400)
+
+#define BG_BLOCK_UNINIT (0x2)
+
+// bitmaps of neighbouring groups, contiguous with flex_bg, are read together up to this size
+#define BITMAP_READ_MAX (1024 * 1024)
+
+struct fs {
+    uint32_t block_size;
+    uint64_t blocks;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t inode_size;
+    uint32_t desc_size;
+    uint32_t reserved_gdt_blocks;
+    uint32_t compat;
+    uint32_t incompat;
+    uint32_t ro_compat;
+    uint32_t backup_bgs[2];
+    uint64_t groups;
+    uint64_t gdt_blocks;
+};
+
+struct group {
+    uint64_t block_bitmap;
+    uint64_t inode_bitmap;
+    uint64_t inode_table;
+    uint16_t flags;
+};
+
+struct bitmap_location {
+    uint64_t block;
+    uint64_t group;
+};
+
+// Filesystem on the device at address, or in a mapped image when image is set.
+struct source {
+    mtk_device *device;
+    uint64_t address;
+    const uint8_t *image;
+    uint64_t length;
+};
+
+static uint64_t get_le(const uint8_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = size; i > 0; i--) {
+        value = value << 8 | data[i - 1];
+    }
+    return value;
+}
+
+static int read_fs(const struct source *source, uint64_t offset, uint8_t *buffer, size_t length) {
+    if (source->image != NULL) {
+        if (offset > source->length || length > source->length - offset) {
+            return LIBUSB_ERROR_OVERFLOW;
+        }
+        memcpy(buffer, source->image + offset, length);
+        return 0;
+    }
+
+    struct mem_info mi = {
+        .buffer = buffer,
+        .size = length,
+    };
+
+    uint8_t retval;
+    int err = mtk_da_read(source->device, MTK_DA_STORAGE_SDMMC, source->address + offset, length, &retval, mem_handler, &mi);
+    if (err < 0) {
+        return err;
+    }
+    if (retval != MTK_DA_ACK) {
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    return 0;
+}
+
+// Returns NULL, or why the filesystem cannot be mapped.
+static const char *parse_superblock(const uint8_t *sb, uint64_t length, struct fs *fs) {
+    if (get_le(sb + 0x38, 2) != EXT4_MAGIC) {
+        return "no ext2/3/4 superblock";
+    }
+
+    uint32_t log_block_size = get_le(sb + 0x18, 4);
+    if (log_block_size > 6) {
+        return "unsupported block size";
+    }
+    fs->block_size = 1024u << log_block_size;
+
+    fs->compat = get_le(sb + 0x5c, 4);
+    fs->incompat = get_le(sb + 0x60, 4);
+    fs->ro_compat = get_le(sb + 0x64, 4);
+    if (fs->incompat & INCOMPAT_META_BG) {
+        return "meta_bg filesystems are not supported";
+    }
+    if (fs->ro_compat & RO_COMPAT_BIGALLOC) {
+        return "bigalloc filesystems are not supported";
+    }
+
+    bool is_64bit = fs->incompat & INCOMPAT_64BIT;
+    fs->blocks = get_le(sb + 0x04, 4) | (is_64bit ? get_le(sb + 0x150, 4) << 32 : 0);
+    fs->first_data_block = get_le(sb + 0x14, 4);
+    fs->blocks_per_group = get_le(sb + 0x20, 4);
+    fs->inodes_per_group = get_le(sb + 0x28, 4);
+    // revision 0 has fixed-size inodes
+    fs->inode_size = get_le(sb + 0x4c, 4) >= 1 ? get_le(sb + 0x58, 2) : 128;
+    fs->desc_size = is_64bit ? get_le(sb + 0xfe, 2) : 32;
+    fs->reserved_gdt_blocks = get_le(sb + 0xce, 2);
+    fs->backup_bgs[0] = get_le(sb + 0x24c, 4);
+    fs->backup_bgs[1] = get_le(sb + 0x250, 4);
+
+    if (fs->blocks_per_group == 0 || fs->blocks_per_group > fs->block_size * 8 || fs->desc_size < 32 || fs->desc_size > fs->block_size
+        || fs->inode_size == 0 || fs->blocks <= fs->first_data_block) {
+        return "malformed superblock";
+    }
+    if (fs->blocks > length / fs->block_size) {
+        return "filesystem is larger than the range";
+    }
+
+    fs->groups = (fs->blocks - fs->first_data_block + fs->blocks_per_group - 1) / fs->blocks_per_group;
+    fs->gdt_blocks = (fs->groups * fs->desc_size + fs->block_size - 1) / fs->block_size;
+    return NULL;
+}
+
+static bool is_power_of(uint64_t value, uint64_t base) {
+    while (value > 1 && value % base == 0) {
+        value /= base;
+    }
+    return value == 1;
+}
+
+// Whether the group starts with a superblock and descriptor backup.
+static bool has_super(const struct fs *fs, uint64_t group) {
+    if (group == 0) {
+        return true;
+    }
+    if (fs->compat & COMPAT_SPARSE_SUPER2) {
+        return group == fs->backup_bgs[0] || group == fs->backup_bgs[1];
+    }
+    if (!(fs->ro_compat & RO_COMPAT_SPARSE_SUPER)) {
+        return true;
+    }
+    return is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+static void mark(uint8_t *used, const struct fs *fs, uint64_t block, uint64_t count) {
+    for (uint64_t b = block; b < block + count && b < fs->blocks; b++) {
+        used[b / 8] |= 1 << (b % 8);
+    }
+}
+
+static bool test(const uint8_t *used, uint64_t block) { return used[block / 8] & (1 << (block % 8)); }
+
+static uint64_t group_start(const struct fs *fs, uint64_t group) { return fs->first_data_block + group * fs->blocks_per_group; }
+
+static const char *parse_groups(const struct fs *fs, const uint8_t *gdt, struct group *groups) {
+    uint64_t itable_blocks = ((uint64_t)fs->inodes_per_group * fs->inode_size + fs->block_size - 1) / fs->block_size;
+
+    for (uint64_t g = 0; g < fs->groups; g++) {
+        const uint8_t *desc = gdt + g * fs->desc_size;
+        struct group *group = &groups[g];
+
+        bool wide = fs->desc_size >= 64;
+        group->block_bitmap = get_le(desc + 0x00, 4) | (wide ? get_le(desc + 0x20, 4) << 32 : 0);
+        group->inode_bitmap = get_le(desc + 0x04, 4) | (wide ? get_le(desc + 0x24, 4) << 32 : 0);
+        group->inode_table = get_le(desc + 0x08, 4) | (wide ? get_le(desc + 0x28, 4) << 32 : 0);
+        group->flags = get_le(desc + 0x12, 2);
+
+        if (group->block_bitmap >= fs->blocks || group->inode_bitmap >= fs->blocks || group->inode_table >= fs->blocks
+            || itable_blocks > fs->blocks - group->inode_table) {
+            return "malformed group descriptors";
+        }
+    }
+
+    return NULL;
+}
+
+static int compare_locations(const void *a, const void *b) {
+    const struct bitmap_location *la = a;
+    const struct bitmap_location *lb = b;
+    return la->block < lb->block ? -1 : la->block > lb->block;
+}
+
+// Ors the block bitmap of a group into used; padding bits past the end of the filesystem are ignored.
+static void apply_bitmap(const struct fs *fs, uint64_t group, const uint8_t *bitmap, uint8_t *used) {
+    uint64_t start = group_start(fs, group);
+    uint64_t count = MIN((uint64_t)fs->blocks_per_group, fs->blocks - start);
+
+    for (uint64_t b = 0; b < count; b++) {
+        if (bitmap[b / 8] & (1 << (b % 8))) {
+            used[(start + b) / 8] |= 1 << ((start + b) % 8);
+        }
+    }
+}
+
+// Reads the initialized block bitmaps, neighbouring ones in one command.
+static int read_bitmaps(const struct source *source, const struct fs *fs, struct bitmap_location *locations, size_t count, uint8_t *used) {
+    qsort(locations, count, sizeof(*locations), compare_locations);
+
+    size_t max_run = BITMAP_READ_MAX / fs->block_size;
+    uint8_t *buffer = malloc(max_run * fs->block_size);
+    if (buffer == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    int err = 0;
+    for (size_t i = 0; i < count && err == 0;) {
+        size_t j = i + 1;
+        while (j < count && j - i < max_run && locations[j].block == locations[j - 1].block + 1) {
+            j++;
+        }
+
+        if ((err = read_fs(source, locations[i].block * fs->block_size, buffer, (j - i) * fs->block_size)) == 0) {
+            for (size_t k = i; k < j; k++) {
+                apply_bitmap(fs, locations[k].group, buffer + (k - i) * fs->block_size, used);
+            }
+        }
+        i = j;
+    }
+
+    free(buffer);
+    return err;
+}
+
+static int mark_allocated(const struct source *source, const struct fs *fs, const struct group *groups, uint8_t *used) {
+    // without group descriptor checksums the uninit flags are not trusted
+    bool uninit_valid = fs->ro_compat & (RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM);
+    uint64_t itable_blocks = ((uint64_t)fs->inodes_per_group * fs->inode_size + fs->block_size - 1) / fs->block_size;
+
+    struct bitmap_location *locations = malloc(fs->groups * sizeof(*locations));
+    if (locations == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    size_t count = 0;
+
+    // boot block and primary superblock
+    mark(used, fs, 0, fs->first_data_block + 1);
+
+    for (uint64_t g = 0; g < fs->groups; g++) {
+        const struct group *group = &groups[g];
+
+        if (has_super(fs, g)) {
+            mark(used, fs, group_start(fs, g), 1 + fs->gdt_blocks + fs->reserved_gdt_blocks);
+        }
+        mark(used, fs, group->block_bitmap, 1);
+        mark(used, fs, group->inode_bitmap, 1);
+        mark(used, fs, group->inode_table, itable_blocks);
+
+        if (!uninit_valid || !(group->flags & BG_BLOCK_UNINIT)) {
+            locations[count++] = (struct bitmap_location){ .block = group->block_bitmap, .group = g };
+        }
+    }
+
+    int err = read_bitmaps(source, fs, locations, count, used);
+    free(locations);
+    return err;
+}
+
+static int add_extent(struct ext4_map *map, size_t *capacity, uint64_t offset, uint64_t length) {
+    struct ext4_extent *last = map->count > 0 ? &map->extents[map->count - 1] : NULL;
+    if (last != NULL && offset - (last->offset + last->length) < EXT4_MERGE_GAP) {
+        map->allocated += offset + length - (last->offset + last->length);
+        last->length = offset + length - last->offset;
+        return 0;
+    }
+
+    if (map->count == *capacity) {
+        size_t grown = *capacity > 0 ? *capacity * 2 : 256;
+        struct ext4_extent *extents = realloc(map->extents, grown * sizeof(*extents));
+        if (extents == NULL) {
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        map->extents = extents;
+        *capacity = grown;
+    }
+
+    map->extents[map->count++] = (struct ext4_extent){ .offset = offset, .length = length };
+    map->allocated += length;
+    return 0;
+}
+
+static int build_extents(const struct fs *fs, const uint8_t *used, struct ext4_map *map) {
+    size_t capacity = 0;
+
+    for (uint64_t b = 0; b < fs->blocks;) {
+        if (b % 8 == 0 && used[b / 8] == 0) {
+            b += 8;
+            continue;
+        }
+        if (!test(used, b)) {
+            b++;
+            continue;
+        }
+
+        uint64_t start = b;
+        while (b < fs->blocks && test(used, b)) {
+            b++;
+        }
+
+        int err = add_extent(map, &capacity, start * fs->block_size, (b - start) * fs->block_size);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int load(const struct source *source, struct ext4_map *map, const char **unsupported) {
+    uint64_t length = source->length;
+
+    memset(map, 0, sizeof(*map));
+    *unsupported = NULL;
+
+    if (length < EXT4_SUPERBLOCK_OFFSET + EXT4_SUPERBLOCK_SIZE) {
+        *unsupported = "range too small for a filesystem";
+        return 0;
+    }
+
+    uint8_t sb[EXT4_SUPERBLOCK_SIZE];
+    int err = read_fs(source, EXT4_SUPERBLOCK_OFFSET, sb, sizeof(sb));
+    if (err < 0) {
+        return err;
+    }
+
+    struct fs fs;
+    if ((*unsupported = parse_superblock(sb, length, &fs)) != NULL) {
+        return 0;
+    }
+
+    // descriptors follow the block holding the primary superblock
+    uint64_t gdt_length = fs.groups * fs.desc_size;
+    uint8_t *gdt = malloc(gdt_length);
+    struct group *groups = malloc(fs.groups * sizeof(*groups));
+    uint8_t *used = calloc(1, (fs.blocks + 7) / 8);
+    if (gdt == NULL || groups == NULL || used == NULL) {
+        err = LIBUSB_ERROR_NO_MEM;
+    } else {
+        err = read_fs(source, (uint64_t)(fs.first_data_block + 1) * fs.block_size, gdt, gdt_length);
+    }
+
+    if (err == 0 && (*unsupported = parse_groups(&fs, gdt, groups)) == NULL) {
+        err = mark_allocated(source, &fs, groups, used);
+        if (err == 0) {
+            err = build_extents(&fs, used, map);
+        }
+        map->block_size = fs.block_size;
+        map->blocks = fs.blocks;
+        map->groups = fs.groups;
+    }
+
+    if (err < 0 || *unsupported != NULL) {
+        ext4_map_free(map);
+    }
+    free(gdt);
+    free(groups);
+    free(used);
+    return err;
+}
+
+int ext4_map_load(mtk_device *device, uint64_t address, uint64_t length, struct ext4_map *map, const char **unsupported) {
+    struct source source = {
+        .device = device,
+        .address = address,
+        .image = NULL,
+        .length = length,
+    };
+    return load(&source, map, unsupported);
+}
+
+int ext4_map_load_image(const struct mapped_file *image, struct ext4_map *map, const char **unsupported) {
+    struct source source = {
+        .device = NULL,
+        .address = 0,
+        .image = image->data,
+        .length = image->size,
+    };
+    // reads stay inside the image once the superblock fits, so only allocations fail
+    int err = load(&source, map, unsupported);
+    return err == LIBUSB_ERROR_NO_MEM ? -ENOMEM : err < 0 ? -EINVAL : 0;
+}
+
+void ext4_map_free(struct ext4_map *map) {
+    free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+    map->allocated = 0;
+}
@@ -0,0 +1,48 @@
+#ifndef EXT4_H
+#define EXT4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+#include "util.h"
+
+/*
+ * Allocation map of an ext2/3/4 filesystem on the device, for dumps that skip
+ * free space, or in an image, for bmap files. The superblock, the group descriptors and the block bitmaps are
+ * read first; a group whose bitmap is still uninitialized (BLOCK_UNINIT) only
+ * holds its superblock and descriptor backups. Bitmaps, inode bitmaps and
+ * inode tables of every group are always counted as allocated, wherever
+ * flex_bg placed them. Free runs shorter than EXT4_MERGE_GAP are read along
+ * with their neighbours instead of costing another command.
+ */
+
+#define EXT4_SUPERBLOCK_OFFSET (1024)
+#define EXT4_SUPERBLOCK_SIZE (1024)
+#define EXT4_MAGIC (0xef53)
+#define EXT4_MERGE_GAP (256 * 1024)
+
+// byte ranges relative to the start of the filesystem
+struct ext4_extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct ext4_map {
+    uint32_t block_size;
+    uint64_t blocks;
+    uint64_t groups;
+    // bytes in extents, including merged free runs
+    uint64_t allocated;
+    struct ext4_extent *extents;
+    size_t count;
+};
+
+// Returns a libusb error code. When [address, address + length) holds no filesystem this reader handles, returns 0 with
+// *unsupported set to the reason and an empty map.
+int ext4_map_load(mtk_device *device, uint64_t address, uint64_t length, struct ext4_map *map, const char **unsupported);
+// The same for a filesystem image; returns 0 or a negative errno.
+int ext4_map_load_image(const struct mapped_file *image, struct ext4_map *map, const char **unsupported);
+void ext4_map_free(struct ext4_map *map);
+
+#endif /* EXT4_H */
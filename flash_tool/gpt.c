@@ -0,0 +1,314 @@
+#include "gpt.h"
+#include "io_handler.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+#include <sys/stat.h>
+
+#include "mtk_da.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+/*
+ * Primary GPT, read once per session and cached on the host. The cache is
+ * keyed by the EMMC ID (or the disk GUID when the device was attached in DA
+ * Stage 2 and the ID is unknown) and holds LBA 1 followed by the partition
+ * entry array. A cached table is only used when the header on the device is
+ * byte-identical to the cached one, which also pins the entry array CRC.
+ */
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_CACHE_MAGIC "FTGPTC01"
+
+struct gpt_header {
+    char signature[8];
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;
+    uint32_t reserved;
+    uint64_t current_lba;
+    uint64_t backup_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba;
+    uint32_t entries_count;
+    uint32_t entry_size;
+    uint32_t entries_crc32;
+} __attribute__((packed));
+
+struct gpt_entry {
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;
+    uint64_t attributes;
+    uint16_t name[36];
+} __attribute__((packed));
+
+static int read_device(mtk_device *device, uint64_t address, uint8_t *buffer, size_t length) {
+    struct mem_info mi = {
+        .buffer = buffer,
+        .size = length,
+    };
+
+    uint8_t retval;
+    int err = mtk_da_read(device, MTK_DA_STORAGE_SDMMC, address, length, &retval, mem_handler, &mi);
+    if (err < 0) {
+        return err;
+    }
+    if (retval != MTK_DA_ACK) {
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    return 0;
+}
+
+static const char *gpt_strerror(int err) {
+    switch (err) {
+    case -EBADMSG:
+        return "CRC mismatch";
+    case -E2BIG:
+        return "too many entries";
+    default:
+        return "malformed table";
+    }
+}
+
+static int parse_header(const uint8_t *lba1, struct gpt_header *header) {
+    memcpy(header, lba1, sizeof(*header));
+
+    if (memcmp(header->signature, GPT_SIGNATURE, sizeof(header->signature)) != 0) {
+        return -EINVAL;
+    }
+    if (header->header_size < sizeof(*header) || header->header_size > GPT_SECTOR_SIZE) {
+        return -EINVAL;
+    }
+    if (header->entry_size < sizeof(struct gpt_entry) || header->entries_count == 0) {
+        return -EINVAL;
+    }
+    if ((uint64_t)header->entries_count * header->entry_size > GPT_MAX_ENTRIES * GPT_ENTRY_SIZE * 4) {
+        return -E2BIG;
+    }
+
+    uint8_t copy[GPT_SECTOR_SIZE];
+    memcpy(copy, lba1, header->header_size);
+    memset(copy + offsetof(struct gpt_header, header_crc32), 0, sizeof(uint32_t));
+    if (crc32(0, copy, header->header_size) != header->header_crc32) {
+        return -EBADMSG;
+    }
+
+    return 0;
+}
+
+static int parse_entries(const struct gpt_header *header, const uint8_t *entries, struct gpt *gpt) {
+    size_t length = (size_t)header->entries_count * header->entry_size;
+    if (crc32(0, entries, length) != header->entries_crc32) {
+        return -EBADMSG;
+    }
+
+    gpt->count = 0;
+    for (size_t i = 0; i < header->entries_count; i++) {
+        struct gpt_entry entry;
+        memcpy(&entry, entries + i * header->entry_size, sizeof(entry));
+
+        static const uint8_t unused[16] = { 0 };
+        if (memcmp(entry.type_guid, unused, sizeof(unused)) == 0) {
+            continue;
+        }
+        if (gpt->count == GPT_MAX_ENTRIES) {
+            return -E2BIG;
+        }
+        if (entry.last_lba < entry.first_lba) {
+            return -EINVAL;
+        }
+
+        struct gpt_partition *partition = &gpt->partitions[gpt->count++];
+        partition->first_lba = entry.first_lba;
+        partition->last_lba = entry.last_lba;
+
+        size_t n;
+        for (n = 0; n < GPT_NAME_MAX - 1 && entry.name[n] != 0; n++) {
+            partition->name[n] = entry.name[n] < 0x80 ? (char)entry.name[n] : '?';
+        }
+        partition->name[n] = '\0';
+    }
+
+    return 0;
+}
+
+// snprintf result check; a cache path that does not fit disables the cache rather than pointing elsewhere
+static bool fits(int n, size_t size) {
+    return n >= 0 && (size_t)n < size;
+}
+
+static bool cache_dir(char *dir, size_t size) {
+    const char *env;
+
+    if ((env = getenv("FLASH_TOOL_CACHE")) != NULL && *env != '\0') {
+        if (!fits(snprintf(dir, size, "%s", env), size)) {
+            return false;
+        }
+#ifdef _WIN32
+    } else if ((env = getenv("LOCALAPPDATA")) != NULL && *env != '\0') {
+        if (!fits(snprintf(dir, size, "%s\\flash_tool", env), size)) {
+            return false;
+        }
+#else
+    } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env != '\0') {
+        if (!fits(snprintf(dir, size, "%s/flash_tool", env), size)) {
+            return false;
+        }
+    } else if ((env = getenv("HOME")) != NULL && *env != '\0') {
+        if (!fits(snprintf(dir, size, "%s/.cache", env), size)) {
+            return false;
+        }
+        mkdir(dir, 0755);
+        size_t length = strlen(dir);
+        if (!fits(snprintf(dir + length, size - length, "/flash_tool"), size - length)) {
+            return false;
+        }
+#endif
+    } else {
+        return false;
+    }
+
+    return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
+
+static bool cache_path(const uint32_t emmc_id[4], const struct gpt_header *header, char *path, size_t size) {
+    char dir[1024];
+    if (!cache_dir(dir, sizeof(dir))) {
+        return false;
+    }
+
+    if (emmc_id != NULL && (emmc_id[0] | emmc_id[1] | emmc_id[2] | emmc_id[3]) != 0) {
+        return fits(snprintf(path, size, "%s/gpt-%08" PRIX32 "%08" PRIX32 "%08" PRIX32 "%08" PRIX32 ".bin", dir, emmc_id[0], emmc_id[1], emmc_id[2],
+                        emmc_id[3]),
+            size);
+    }
+
+    char guid[2 * sizeof(header->disk_guid) + 1];
+    for (size_t i = 0; i < sizeof(header->disk_guid); i++) {
+        snprintf(guid + 2 * i, sizeof(guid) - 2 * i, "%02x", header->disk_guid[i]);
+    }
+    return fits(snprintf(path, size, "%s/gpt-guid-%s.bin", dir, guid), size);
+}
+
+// Returns the cached entry array when the cached header matches the device's byte for byte
+static uint8_t *cache_load(const char *path, const uint8_t *lba1, size_t entries_length) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    char magic[8];
+    uint8_t cached_lba1[GPT_SECTOR_SIZE];
+    uint8_t *entries = malloc(entries_length);
+
+    bool ok = entries != NULL && fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, GPT_CACHE_MAGIC, sizeof(magic)) == 0
+        && fread(cached_lba1, sizeof(cached_lba1), 1, f) == 1 && memcmp(cached_lba1, lba1, sizeof(cached_lba1)) == 0
+        && fread(entries, entries_length, 1, f) == 1;
+    fclose(f);
+
+    if (!ok) {
+        free(entries);
+        return NULL;
+    }
+
+    return entries;
+}
+
+static void cache_store(const char *path, const uint8_t *lba1, const uint8_t *entries, size_t entries_length) {
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        verboseLog("Unable to write GPT cache %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    bool ok = fwrite(GPT_CACHE_MAGIC, 8, 1, f) == 1 && fwrite(lba1, GPT_SECTOR_SIZE, 1, f) == 1 && fwrite(entries, entries_length, 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+
+#ifdef _WIN32
+    remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        verboseLog("Unable to write GPT cache %s\n", path);
+        remove(tmp);
+    }
+}
+
+// Returns a libusb error code; malformed tables are reported on stderr and returned as LIBUSB_ERROR_OTHER.
+int gpt_load(mtk_device *device, const uint32_t emmc_id[4], struct gpt *gpt, bool *from_cache) {
+    int err;
+
+    if ((err = read_device(device, GPT_HEADER_LBA * GPT_SECTOR_SIZE, gpt->header, sizeof(gpt->header))) < 0) {
+        return err;
+    }
+
+    struct gpt_header header;
+    if ((err = parse_header(gpt->header, &header)) < 0) {
+        fprintf(stderr, "Invalid GPT header: %s\n", gpt_strerror(err));
+        return LIBUSB_ERROR_OTHER;
+    }
+    memcpy(gpt->disk_guid, header.disk_guid, sizeof(gpt->disk_guid));
+    gpt->header_crc32 = header.header_crc32;
+
+    size_t entries_length = (size_t)header.entries_count * header.entry_size;
+
+    char path[1024];
+    bool cacheable = cache_path(emmc_id, &header, path, sizeof(path));
+
+    uint8_t *entries = cacheable ? cache_load(path, gpt->header, entries_length) : NULL;
+    *from_cache = entries != NULL;
+
+    if (entries == NULL) {
+        // the DA reads whole sectors
+        size_t padded = (entries_length + GPT_SECTOR_SIZE - 1) / GPT_SECTOR_SIZE * GPT_SECTOR_SIZE;
+        if ((entries = malloc(padded)) == NULL) {
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        if ((err = read_device(device, header.entries_lba * GPT_SECTOR_SIZE, entries, padded)) < 0) {
+            free(entries);
+            return err;
+        }
+    }
+
+    err = parse_entries(&header, entries, gpt);
+    if (err == 0 && cacheable && !*from_cache) {
+        cache_store(path, gpt->header, entries, entries_length);
+    }
+    free(entries);
+
+    if (err < 0) {
+        fprintf(stderr, "Invalid GPT entries: %s\n", gpt_strerror(err));
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    return 0;
+}
+
+const struct gpt_partition *gpt_find(const struct gpt *gpt, const char *name) {
+    for (size_t i = 0; i < gpt->count; i++) {
+        if (strcasecmp(gpt->partitions[i].name, name) == 0) {
+            return &gpt->partitions[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef GPT_H
+#define GPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+
+#define GPT_SECTOR_SIZE (512)
+#define GPT_HEADER_LBA (1)
+#define GPT_MAX_ENTRIES (128)
+#define GPT_ENTRY_SIZE (128)
+#define GPT_NAME_MAX (37)
+
+struct gpt_partition {
+    char name[GPT_NAME_MAX];
+    uint64_t first_lba;
+    uint64_t last_lba;
+};
+
+struct gpt {
+    uint8_t header[GPT_SECTOR_SIZE];
+    uint8_t disk_guid[16];
+    uint32_t header_crc32;
+    struct gpt_partition partitions[GPT_MAX_ENTRIES];
+    size_t count;
+};
+
+int gpt_load(mtk_device *device, const uint32_t emmc_id[4], struct gpt *gpt, bool *from_cache);
+
+const struct gpt_partition *gpt_find(const struct gpt *gpt, const char *name);
+
+static inline uint64_t gpt_partition_address(const struct gpt_partition *partition) { return partition->first_lba * GPT_SECTOR_SIZE; }
+
+static inline uint64_t gpt_partition_length(const struct gpt_partition *partition) {
+    return (partition->last_lba - partition->first_lba + 1) * GPT_SECTOR_SIZE;
+}
+
+#endif /* GPT_H */
@@ -1,83 +1,331 @@
+// O_DIRECT and sync_file_range
+#define _GNU_SOURCE
+
 #include "io_handler.h"
+#include "progress.h"
 #include "util.h"
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define PROGRESS_BAR_WIDTH (48)
-#define SI_UNITS_BUFSIZ (16)
+#include <libusb.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// logical block size O_DIRECT transfers are aligned to
+#define IO_DIRECT_ALIGN (4096)
+// distance behind the newest dumped chunk at which paced mode waits for writeback and drops the pages
+#define IO_PACE_LAG (8 * 1024 * 1024)
 
-static void print_progress(bool flashing, size_t offset, size_t length);
-static void format_si_units(size_t length, char *str, size_t size);
+static enum io_mode io_mode = IO_MODE_BUFFERED;
 
+// File errors are stored in fi->err and abort the transfer; callers report them with check_errnum.
 int io_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
-    const struct file_info *fi = user_data;
+    int err;
+    if ((err = io_transfer(flashing, offset, buffer, count, user_data)) < 0) {
+        return err;
+    }
 
-    if (lseek(fi->fd, fi->offset + offset, SEEK_SET) < 0) {
-        errx(1, "Unable to seek file descriptor: %s", strerror(errno));
+    progress_update(flashing ? "Flashing" : "Dumping", offset + count, total_length);
+    return 0;
+}
+
+#ifdef O_DIRECT
+// Second descriptor of the file last transferred on this thread, opened with O_DIRECT; the caller's descriptor stays buffered.
+static __thread int direct_fd = -1;
+static __thread dev_t direct_dev;
+static __thread ino_t direct_ino;
+
+// Returns an O_DIRECT descriptor for the same file as fd, or -1 when it cannot be opened, e.g. on tmpfs.
+static int direct_descriptor(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (direct_fd != -1 && direct_dev == st.st_dev && direct_ino == st.st_ino) {
+        return direct_fd;
     }
 
-    if (flashing) {
-        ssize_t n;
-        if ((n = read(fi->fd, buffer, count)) < 0) {
-            errx(1, "Unable to read from file descriptor: %s", strerror(errno));
-        }
-        if ((size_t) n != count) {
-            errx(1, "Not enough data read from file descriptor");
+    io_release_direct();
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int reopened = open(path, (flags & O_ACCMODE) | O_DIRECT | O_CLOEXEC);
+    if (reopened < 0) {
+        return -1;
+    }
+
+    direct_fd = reopened;
+    direct_dev = st.st_dev;
+    direct_ino = st.st_ino;
+    return direct_fd;
+}
+
+// O_DIRECT needs buffer, file offset and length aligned; anything else goes through the page cache.
+static ssize_t direct_transfer(bool flashing, int fd, off_t position, uint8_t *buffer, size_t count) {
+    static __thread uint8_t *bounce;
+    static __thread size_t bounce_size;
+
+    bool aligned = position % IO_DIRECT_ALIGN == 0 && count % IO_DIRECT_ALIGN == 0;
+    if (aligned) {
+        int direct = direct_descriptor(fd);
+        if (direct < 0) {
+            aligned = false;
+        } else {
+            fd = direct;
         }
-    } else {
-        ssize_t n;
-        if ((n = write(fi->fd, buffer, count)) < 0) {
-            errx(1, "Unable to write to file descriptor: %s", strerror(errno));
+    }
+
+    uint8_t *data = buffer;
+    if (aligned && (uintptr_t)buffer % IO_DIRECT_ALIGN != 0) {
+        if (bounce_size < count) {
+            free(bounce);
+            bounce_size = 0;
+            if (posix_memalign((void **)&bounce, IO_DIRECT_ALIGN, count) != 0) {
+                bounce = NULL;
+                errno = ENOMEM;
+                return -1;
+            }
+            bounce_size = count;
         }
-        if ((size_t) n != count) {
-            errx(1, "Not enough data written to file descriptor");
+        data = bounce;
+        if (!flashing) {
+            memcpy(data, buffer, count);
         }
     }
 
-    print_progress(flashing, offset + count, total_length);
+    ssize_t n = flashing ? pread(fd, data, count, position) : pwrite(fd, data, count, position);
+    if (flashing && data != buffer && n > 0) {
+        memcpy(buffer, data, n);
+    }
+    return n;
+}
+#endif
+
+#ifndef _WIN32
+// Starts writeback of every dumped chunk at once and drops the chunk IO_PACE_LAG behind once it is on disk, so
+// dirty and cached pages stay bounded instead of growing with the dump. Flash data is dropped once it was read.
+static void pace(bool flashing, int fd, off_t position, size_t count) {
+#ifdef POSIX_FADV_DONTNEED
+    if (flashing) {
+        posix_fadvise(fd, position, count, POSIX_FADV_DONTNEED);
+        return;
+    }
+#ifdef __linux__
+    sync_file_range(fd, position, count, SYNC_FILE_RANGE_WRITE);
+    if (position >= IO_PACE_LAG) {
+        sync_file_range(fd, position - IO_PACE_LAG, count, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, position - IO_PACE_LAG, count, POSIX_FADV_DONTNEED);
+    }
+#endif
+#endif
+}
+#endif
+
+void io_release_direct(void) {
+#ifdef O_DIRECT
+    if (direct_fd != -1) {
+        close(direct_fd);
+        direct_fd = -1;
+    }
+#endif
+}
+
+int io_set_mode(enum io_mode mode) {
+#ifdef _WIN32
+    if (mode == IO_MODE_PACED) {
+        return -ENOTSUP;
+    }
+#endif
+#ifndef O_DIRECT
+    if (mode == IO_MODE_DIRECT) {
+        return -ENOTSUP;
+    }
+#endif
+
+    io_mode = mode;
     return 0;
 }
 
-static void print_progress(bool flashing, size_t offset, size_t length) {
-    double progress = (double) offset / length;
-    int percent = progress * 100;
+int io_transfer(bool flashing, size_t offset, uint8_t *buffer, size_t count, struct file_info *fi) {
+    off_t position = fi->offset + offset;
+    ssize_t n;
 
-    if (!isatty(STDERR_FILENO)) {
-        printf("Progress: %d%%\n", percent);
-        return;
+#ifdef _WIN32
+    if (lseek(fi->fd, position, SEEK_SET) < 0) {
+        fi->err = errno;
+        return LIBUSB_ERROR_IO;
+    }
+    n = flashing ? read(fi->fd, buffer, count) : write(fi->fd, buffer, count);
+#else
+#ifdef O_DIRECT
+    if (io_mode == IO_MODE_DIRECT) {
+        n = direct_transfer(flashing, fi->fd, position, buffer, count);
+    } else
+#endif
+    {
+        n = flashing ? pread(fi->fd, buffer, count, position) : pwrite(fi->fd, buffer, count, position);
     }
+#endif
 
-    char progress_bar[PROGRESS_BAR_WIDTH + 1];
+    if (n < 0) {
+        fi->err = errno;
+        return LIBUSB_ERROR_IO;
+    }
+    if ((size_t) n != count) {
+        fi->err = flashing ? EIO : ENOSPC;
+        return LIBUSB_ERROR_IO;
+    }
 
-    size_t progress_bar_fill = progress * PROGRESS_BAR_WIDTH;
-    memset(progress_bar, '#', progress_bar_fill);
-    memset(progress_bar + progress_bar_fill, '-', PROGRESS_BAR_WIDTH - progress_bar_fill);
-    progress_bar[PROGRESS_BAR_WIDTH] = '\0';
+#ifndef _WIN32
+    if (io_mode == IO_MODE_PACED) {
+        pace(flashing, fi->fd, position, count);
+    }
+#endif
 
-    const char *verb = flashing ? "Flashing" : "Dumping";
+    return 0;
+}
+
+// Transfers to or from a host buffer, for small metadata reads that don't need progress output.
+int mem_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    const struct mem_info *mi = user_data;
+    (void)total_length;
 
-    char offset_str[SI_UNITS_BUFSIZ];
-    format_si_units(offset, offset_str, sizeof(offset_str));
-    char length_str[SI_UNITS_BUFSIZ];
-    format_si_units(length, length_str, sizeof(length_str));
+    if (offset + count > mi->size) {
+        return LIBUSB_ERROR_OVERFLOW;
+    }
 
-    fprintf(stderr, "%s %-8s of %-8s  [%s]  %3d%%%c", verb, offset_str, length_str, progress_bar, percent, (offset == length) ? '\n' : '\r');
-    fflush(stderr);
+    if (flashing) {
+        memcpy(buffer, mi->buffer + offset, count);
+    } else {
+        memcpy(mi->buffer + offset, buffer, count);
+    }
+
+    return 0;
 }
 
-static void format_si_units(size_t length, char *str, size_t size) {
-    static const char *suffix = "BKMG";
+// Progress only, for transfers that land in their destination without a copy.
+int progress_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void)buffer;
+    (void)user_data;
 
-    double dbl = length;
-    const char *ptr = suffix;
+    progress_update(flashing ? "Flashing" : "Dumping", offset + count, total_length);
+    return 0;
+}
 
-    while (dbl > 1024 && *(ptr + 1) != '\0') {
-        dbl /= 1024;
-        ptr++;
+// Progress of an erase, on the device or written from the host.
+int erase_progress_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void)flashing;
+    (void)buffer;
+    (void)user_data;
+
+    progress_update("Erasing", offset + count, total_length);
+    return 0;
+}
+
+// Sizes the dump file up front and maps it, so received data goes straight into the page cache and is written back
+// by the kernel while the next chunk arrives. Returns 0 or a negative errno; -ENOSYS where mapping is unavailable.
+int io_map_output(int fd, uint64_t size, uint8_t **data) {
+#ifdef _WIN32
+    (void)fd;
+    (void)size;
+    (void)data;
+    return -ENOSYS;
+#else
+    if ((uint64_t)(size_t)size != size) {
+        return -EFBIG;
+    }
+
+    // allocating the blocks now keeps the stores into the mapping from faulting on a full disk
+    int err = posix_fallocate(fd, 0, size);
+    if (err == EOPNOTSUPP || err == EINVAL) {
+        err = ftruncate(fd, size) < 0 ? errno : 0;
+    }
+    if (err != 0) {
+        return -err;
     }
 
-    snprintf(str, size, "%.5g %c", dbl, *ptr);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    *data = map;
+    return 0;
+#endif
+}
+
+// Extends the file without writing, so ranges that are never transferred stay holes.
+int io_set_size(int fd, uint64_t size) {
+#ifdef _WIN32
+    int err = _chsize_s(fd, size);
+    return err != 0 ? -err : 0;
+#else
+    if (ftruncate(fd, size) < 0) {
+        return -errno;
+    }
+    return 0;
+#endif
+}
+
+int io_unmap_output(uint8_t *data, uint64_t size) {
+#ifdef _WIN32
+    (void)data;
+    (void)size;
+    return -ENOSYS;
+#else
+    if (munmap(data, size) < 0) {
+        return -errno;
+    }
+    return 0;
+#endif
+}
+
+// Compares dumped data against the file; mismatches are counted rather than aborting so the DA stream stays in sync.
+int verify_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void)flashing;
+    struct verify_info *vi = user_data;
+
+    if (vi->scratch_size < count) {
+        uint8_t *scratch = realloc(vi->scratch, count);
+        if (scratch == NULL) {
+            vi->file.err = ENOMEM;
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        vi->scratch = scratch;
+        vi->scratch_size = count;
+    }
+
+    int err;
+    if ((err = io_transfer(true, offset, vi->scratch, count, &vi->file)) < 0) {
+        return err;
+    }
+
+    if (memcmp(vi->scratch, buffer, count) != 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (vi->scratch[i] != buffer[i]) {
+                if (vi->mismatched_bytes++ == 0) {
+                    vi->first_mismatch = offset + i;
+                }
+            }
+        }
+    }
+
+    progress_update("Verifying", offset + count, total_length);
+    return 0;
 }
@@ -5,11 +5,47 @@
 #include <stddef.h>
 #include <stdint.h>
 
+enum io_mode {
+    IO_MODE_BUFFERED,
+    // writeback started per chunk, old chunks dropped from the page cache
+    IO_MODE_PACED,
+    // O_DIRECT for aligned chunks
+    IO_MODE_DIRECT,
+};
+
 struct file_info {
     int fd;
     size_t offset;
+    int err;
 };
 
+struct verify_info {
+    struct file_info file;
+    uint8_t *scratch;
+    size_t scratch_size;
+    uint64_t mismatched_bytes;
+    uint64_t first_mismatch;
+};
+
+struct mem_info {
+    uint8_t *buffer;
+    size_t size;
+};
+
+int io_set_mode(enum io_mode mode);
+// Closes the O_DIRECT descriptor the calling thread keeps open for the file it transferred last.
+void io_release_direct(void);
+
+int io_transfer(bool flashing, size_t offset, uint8_t *buffer, size_t count, struct file_info *fi);
+
+int io_map_output(int fd, uint64_t size, uint8_t **data);
+int io_unmap_output(uint8_t *data, uint64_t size);
+int io_set_size(int fd, uint64_t size);
+
+int progress_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+int erase_progress_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
 int io_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+int mem_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+int verify_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
 
 #endif /* IO_HANDLER_H */
@@ -0,0 +1,173 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mtk_metrics.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+static const char *metrics_target;
+static unsigned int metrics_interval_s;
+
+static pthread_t metrics_thread;
+static bool metrics_thread_running;
+static bool metrics_stopping;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metrics_cond = PTHREAD_COND_INITIALIZER;
+// serializes exports from the interval thread and the final one
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int write_stream(FILE *f) {
+    int err = mtk_metrics_write(f);
+    if (fclose(f) != 0 && err == 0) {
+        err = -errno;
+    }
+    return err;
+}
+
+#ifdef _WIN32
+
+static int export_socket(const char *path) {
+    (void)path;
+    return -ENOTSUP;
+}
+
+#else
+
+static int export_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+
+    return write_stream(f);
+}
+
+#endif
+
+static int export_file(const char *path) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return -ENAMETOOLONG;
+    }
+
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        return -errno;
+    }
+
+    int err = write_stream(f);
+    if (err < 0) {
+        unlink(tmp);
+        return err;
+    }
+
+#ifdef _WIN32
+    // rename does not replace an existing file here
+    unlink(path);
+#endif
+    if (rename(tmp, path) < 0) {
+        err = -errno;
+        unlink(tmp);
+        return err;
+    }
+
+    return 0;
+}
+
+int metrics_export(const char *target) {
+    pthread_mutex_lock(&export_lock);
+
+    int err;
+    if (strncmp(target, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX)) == 0) {
+        err = export_socket(target + strlen(METRICS_UNIX_PREFIX));
+    } else {
+        err = export_file(target);
+    }
+
+    pthread_mutex_unlock(&export_lock);
+    return err;
+}
+
+static void *metrics_run(void *user_data) {
+    (void)user_data;
+
+    pthread_mutex_lock(&metrics_lock);
+    while (!metrics_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += metrics_interval_s;
+
+        if (pthread_cond_timedwait(&metrics_cond, &metrics_lock, &deadline) == ETIMEDOUT && !metrics_stopping) {
+            pthread_mutex_unlock(&metrics_lock);
+            int err = metrics_export(metrics_target);
+            if (err < 0) {
+                // a collector that is not listening yet must not end the session
+                fprintf(stderr, "Unable to export metrics to %s: %s\n", metrics_target, strerror(-err));
+            }
+            pthread_mutex_lock(&metrics_lock);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    return NULL;
+}
+
+int metrics_start(const char *target, unsigned int interval_s) {
+    metrics_target = target;
+    metrics_interval_s = interval_s;
+    mtk_metrics_enable();
+
+    if (interval_s == 0) {
+        return 0;
+    }
+
+    int err = pthread_create(&metrics_thread, NULL, metrics_run, NULL);
+    if (err != 0) {
+        return -err;
+    }
+    metrics_thread_running = true;
+
+    return 0;
+}
+
+int metrics_stop(void) {
+    if (metrics_thread_running) {
+        pthread_mutex_lock(&metrics_lock);
+        metrics_stopping = true;
+        pthread_cond_signal(&metrics_cond);
+        pthread_mutex_unlock(&metrics_lock);
+
+        pthread_join(metrics_thread, NULL);
+        metrics_thread_running = false;
+    }
+
+    return metrics_export(metrics_target);
+}
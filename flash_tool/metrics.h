@@ -0,0 +1,19 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * Exports the library metrics (mtk_metrics.h) in the Prometheus text format,
+ * either to a file, replaced atomically so a textfile collector never sees
+ * half of it, or as one write to the Unix stream socket unix:PATH.
+ */
+
+#define METRICS_UNIX_PREFIX "unix:"
+
+// Enables metrics and exports them every interval_s seconds (0 for only at exit) until metrics_stop().
+int metrics_start(const char *target, unsigned int interval_s);
+// Stops the periodic export and exports once more; returns 0 or a negative errno.
+int metrics_stop(void);
+
+int metrics_export(const char *target);
+
+#endif /* METRICS_H */
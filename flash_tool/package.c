@@ -0,0 +1,362 @@
+#include "package.h"
+
+#include "io_handler.h"
+#include "progress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mtk_preloader.h"
+#include "src/util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static void put_le(uint8_t *data, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t get_le(const uint8_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = size; i > 0; i--) {
+        value = value << 8 | data[i - 1];
+    }
+    return value;
+}
+
+static uint64_t align_up(uint64_t value) { return (value + PACKAGE_ALIGN - 1) / PACKAGE_ALIGN * PACKAGE_ALIGN; }
+
+static uint64_t chunk_count(uint64_t length, size_t chunk_size) { return (length + chunk_size - 1) / chunk_size; }
+
+static bool in_bounds(const struct mapped_file *map, uint64_t offset, uint64_t length) { return offset <= map->size && length <= map->size - offset; }
+
+// Positional file I/O through io_transfer, so --io applies to package builds too.
+static int transfer_at(bool reading, int fd, uint64_t offset, const uint8_t *data, size_t size) {
+    struct file_info fi = {
+        .fd = fd,
+        .offset = 0,
+        .err = 0,
+    };
+    io_transfer(reading, offset, (uint8_t *)data, size, &fi);
+    return -fi.err;
+}
+
+static uint16_t region_chksum(const struct mapped_file *da, const mtk_da_entry *entry, size_t region) {
+    if (region >= entry->load_regions_count || region >= MTK_DA_ENTRY_LOAD_REGIONS) {
+        return 0;
+    }
+
+    const mtk_da_load_region *load_region = &entry->load_regions[region];
+    if (!in_bounds(da, load_region->offset, load_region->len)) {
+        return 0;
+    }
+
+    return mtk_preloader_checksum(0, da->data + load_region->offset, load_region->len);
+}
+
+// Copies one image into the package and fills its chunk table.
+static int build_image(int out, const struct operation *operation, uint64_t data_offset, uint8_t *table, uint8_t *buffer, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    struct sha256 whole;
+    sha256_init(&whole);
+
+    int err;
+    for (uint64_t offset = 0; offset < operation->length; offset += PACKAGE_CHUNK_SIZE) {
+        size_t count = MIN((uint64_t)PACKAGE_CHUNK_SIZE, operation->length - offset);
+        if ((err = transfer_at(true, operation->fd, offset, buffer, count)) < 0) {
+            return err;
+        }
+
+        uint8_t *entry = table + offset / PACKAGE_CHUNK_SIZE * PACKAGE_CHUNK_ENTRY_SIZE;
+        put_le(entry, mtk_da_checksum(0, buffer, count), 2);
+        sha256(buffer, count, entry + 4);
+        sha256_update(&whole, buffer, count);
+
+        if ((err = transfer_at(false, out, data_offset + offset, buffer, count)) < 0) {
+            return err;
+        }
+
+        progress_update("Packing", offset + count, operation->length);
+    }
+
+    sha256_final(&whole, digest);
+    return 0;
+}
+
+static int build(int out, const struct arguments *arguments, const mtk_da_info *info, const struct mapped_file *da) {
+    const struct operation *operations[PACKAGE_MAX_IMAGES];
+    size_t count = 0;
+    for (size_t i = 0; i < arguments->operations_count; i++) {
+        if (arguments->operations[i].key == 'F') {
+            operations[count++] = &arguments->operations[i];
+        }
+    }
+
+    // index, region checksums and chunk tables sit in front of the data
+    uint64_t regions_offset = PACKAGE_HEADER_SIZE + count * PACKAGE_ENTRY_SIZE;
+    uint64_t regions_size = (uint64_t)info->da_count * MTK_DA_ENTRY_LOAD_REGIONS * 2;
+    uint64_t tables_offset = regions_offset + regions_size;
+    uint64_t tables_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        tables_size += chunk_count(operations[i]->length, PACKAGE_CHUNK_SIZE) * PACKAGE_CHUNK_ENTRY_SIZE;
+    }
+    uint64_t index_size = tables_offset + tables_size;
+    uint64_t da_offset = align_up(index_size);
+
+    uint8_t *index = calloc(1, index_size);
+    uint8_t *buffer = malloc(PACKAGE_CHUNK_SIZE);
+    if (index == NULL || buffer == NULL) {
+        free(index);
+        free(buffer);
+        return -ENOMEM;
+    }
+
+    memcpy(index, PACKAGE_MAGIC, 8);
+    put_le(index + 8, PACKAGE_VERSION, 4);
+    put_le(index + 12, PACKAGE_CHUNK_SIZE, 4);
+    put_le(index + 16, count, 4);
+    put_le(index + 20, info->da_count, 4);
+    put_le(index + 24, da_offset, 8);
+    put_le(index + 32, da->size, 8);
+    put_le(index + 40, regions_offset, 8);
+    sha256(da->data, da->size, index + 56);
+
+    for (size_t i = 0; i < info->da_count; i++) {
+        for (size_t j = 0; j < MTK_DA_ENTRY_LOAD_REGIONS; j++) {
+            put_le(index + regions_offset + (i * MTK_DA_ENTRY_LOAD_REGIONS + j) * 2, region_chksum(da, &info->DA[i], j), 2);
+        }
+    }
+
+    int err = transfer_at(false, out, da_offset, da->data, da->size);
+
+    uint64_t data_offset = da_offset + da->size;
+    uint64_t table_offset = tables_offset;
+    for (size_t i = 0; i < count && err == 0; i++) {
+        const struct operation *operation = operations[i];
+        uint8_t *entry = index + PACKAGE_HEADER_SIZE + i * PACKAGE_ENTRY_SIZE;
+        data_offset = align_up(data_offset);
+
+        // scatter partitions are named, plain -F operations go by file name
+        const char *name = operation->name[0] != '\0' ? operation->name : operation->path;
+        const char *slash = strrchr(name, '/');
+        int n = snprintf((char *)entry, PACKAGE_NAME_MAX, "%s", slash != NULL ? slash + 1 : name);
+        if (n < 0 || n >= PACKAGE_NAME_MAX) {
+            err = -ENAMETOOLONG;
+            break;
+        }
+        entry[48] = operation->part;
+        put_le(entry + 56, operation->address, 8);
+        put_le(entry + 64, operation->length, 8);
+        put_le(entry + 72, data_offset, 8);
+        put_le(entry + 80, table_offset, 8);
+
+        err = build_image(out, operation, data_offset, index + table_offset, buffer, entry + 88);
+
+        data_offset += operation->length;
+        table_offset += chunk_count(operation->length, PACKAGE_CHUNK_SIZE) * PACKAGE_CHUNK_ENTRY_SIZE;
+    }
+
+    // the index goes last, so an interrupted build leaves no valid package behind
+    if (err == 0) {
+        err = transfer_at(false, out, 0, index, index_size);
+    }
+
+    free(index);
+    free(buffer);
+    return err;
+}
+
+int package_build(const char *path, const struct arguments *arguments, const mtk_da_info *info) {
+    struct mapped_file da;
+    int err = map_file(arguments->download_agent_fd, &da);
+    if (err < 0) {
+        return err;
+    }
+
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (out < 0) {
+        err = -errno;
+        unmap_file(&da);
+        return err;
+    }
+
+    err = build(out, arguments, info, &da);
+    if (close(out) < 0 && err == 0) {
+        err = -errno;
+    }
+    if (err < 0) {
+        unlink(path);
+    }
+
+    unmap_file(&da);
+    return err;
+}
+
+static int load_da(struct package *package, const uint8_t *header) {
+    const struct mapped_file *map = &package->map;
+
+    uint64_t da_offset = get_le(header + 24, 8);
+    uint64_t da_length = get_le(header + 32, 8);
+    if (!in_bounds(map, da_offset, da_length) || da_length < offsetof(mtk_da_info, DA)) {
+        return -EINVAL;
+    }
+    package->da.data = map->data + da_offset;
+    package->da.size = da_length;
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(package->da.data, da_length, digest);
+    if (memcmp(digest, header + 56, SHA256_DIGEST_SIZE) != 0) {
+        verboseLog("Package DA does not match its SHA-256\n");
+        return -EIO;
+    }
+
+    const mtk_da_info *info = (const mtk_da_info *)package->da.data;
+    if (info->da_info_magic != MTK_DA_INFO_MAGIC || info->da_info_ver != MTK_DA_INFO_VER || info->da_count != get_le(header + 20, 4)
+        || (da_length - offsetof(mtk_da_info, DA)) / sizeof(mtk_da_entry) < info->da_count) {
+        return -EINVAL;
+    }
+    package->info = info;
+
+    uint64_t regions_offset = get_le(header + 40, 8);
+    if (!in_bounds(map, regions_offset, (uint64_t)info->da_count * MTK_DA_ENTRY_LOAD_REGIONS * 2)) {
+        return -EINVAL;
+    }
+    package->region_chksums = map->data + regions_offset;
+
+    for (size_t i = 0; i < info->da_count; i++) {
+        for (size_t j = 0; j < MTK_DA_ENTRY_LOAD_REGIONS; j++) {
+            if (get_le(package->region_chksums + (i * MTK_DA_ENTRY_LOAD_REGIONS + j) * 2, 2) != region_chksum(&package->da, &info->DA[i], j)) {
+                verboseLog("Package DA entry %zu region %zu does not match its checksum\n", i, j);
+                return -EIO;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int load_image(struct package *package, const uint8_t *entry, struct package_image *image) {
+    const struct mapped_file *map = &package->map;
+
+    memcpy(image->name, entry, PACKAGE_NAME_MAX);
+    image->name[PACKAGE_NAME_MAX - 1] = '\0';
+    image->part = entry[48];
+    image->address = get_le(entry + 56, 8);
+    image->length = get_le(entry + 64, 8);
+
+    uint64_t data_offset = get_le(entry + 72, 8);
+    uint64_t table_offset = get_le(entry + 80, 8);
+    uint64_t chunks = chunk_count(image->length, package->chunk_size);
+    if (image->length == 0 || !in_bounds(map, data_offset, image->length) || !in_bounds(map, table_offset, chunks * PACKAGE_CHUNK_ENTRY_SIZE)) {
+        return -EINVAL;
+    }
+    image->data = map->data + data_offset;
+
+    image->chksums = malloc(chunks * sizeof(uint16_t));
+    if (image->chksums == NULL) {
+        return -ENOMEM;
+    }
+
+    // every chunk is checked here once, so sessions can send them without looking at the bytes again
+    for (uint64_t i = 0; i < chunks; i++) {
+        const uint8_t *table = map->data + table_offset + i * PACKAGE_CHUNK_ENTRY_SIZE;
+        const uint8_t *chunk = image->data + i * package->chunk_size;
+        size_t count = MIN((uint64_t)package->chunk_size, image->length - i * package->chunk_size);
+
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256(chunk, count, digest);
+        image->chksums[i] = get_le(table, 2);
+        if (memcmp(digest, table + 4, SHA256_DIGEST_SIZE) != 0 || image->chksums[i] != mtk_da_checksum(0, chunk, count)) {
+            verboseLog("Package image %s: chunk %" PRIu64 " does not match its hash\n", image->name, i);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+int package_open(struct package *package, int fd) {
+    memset(package, 0, sizeof(*package));
+
+    int err = map_file(fd, &package->map);
+    if (err < 0) {
+        return err;
+    }
+
+    const uint8_t *header = package->map.data;
+    if (package->map.size < PACKAGE_HEADER_SIZE || memcmp(header, PACKAGE_MAGIC, 8) != 0) {
+        package_close(package);
+        return -EINVAL;
+    }
+    if (get_le(header + 8, 4) != PACKAGE_VERSION) {
+        package_close(package);
+        return -ENOTSUP;
+    }
+
+    package->chunk_size = get_le(header + 12, 4);
+    uint64_t count = get_le(header + 16, 4);
+    if (package->chunk_size == 0 || count > PACKAGE_MAX_IMAGES || !in_bounds(&package->map, PACKAGE_HEADER_SIZE, count * PACKAGE_ENTRY_SIZE)) {
+        package_close(package);
+        return -EINVAL;
+    }
+
+    if ((err = load_da(package, header)) < 0) {
+        package_close(package);
+        return err;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        package->count++;
+        if ((err = load_image(package, header + PACKAGE_HEADER_SIZE + i * PACKAGE_ENTRY_SIZE, &package->images[i])) < 0) {
+            package_close(package);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+void package_close(struct package *package) {
+    for (size_t i = 0; i < package->count; i++) {
+        free(package->images[i].chksums);
+    }
+    package->count = 0;
+    unmap_file(&package->map);
+}
+
+int package_add_operations(const struct package *package, struct arguments *arguments) {
+    if (arguments->operations_count + package->count > MAX_OPERATIONS) {
+        return -ENOSPC;
+    }
+
+    for (size_t i = 0; i < package->count; i++) {
+        const struct package_image *image = &package->images[i];
+        struct operation *operation = &arguments->operations[arguments->operations_count++];
+
+        memset(operation, 0, sizeof(*operation));
+        operation->key = 'F';
+        operation->part = image->part;
+        operation->address = image->address;
+        operation->length = image->length;
+        operation->fd = -1;
+        operation->path = image->name;
+        snprintf(operation->name, sizeof(operation->name), "%s", image->name);
+        operation->from_package = true;
+        operation->package_image = i;
+    }
+
+    return 0;
+}
+
+uint16_t package_region_chksum(const struct package *package, const mtk_da_entry *entry, const mtk_da_load_region *region) {
+    size_t i = entry - package->info->DA;
+    size_t j = region - entry->load_regions;
+    return get_le(package->region_chksums + (i * MTK_DA_ENTRY_LOAD_REGIONS + j) * 2, 2);
+}
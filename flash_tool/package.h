@@ -0,0 +1,81 @@
+#ifndef PACKAGE_H
+#define PACKAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "args.h"
+#include "sha256.h"
+#include "util.h"
+
+#include "mtk_da.h"
+
+/*
+ * Self-contained flash package: the Download Agent, the images and where they
+ * go, with everything the host would otherwise compute per unit done once at
+ * build time:
+ *
+ *   0x0000  header: magic, version, chunk size, counts, DA offset and SHA-256
+ *   0x0080  PACKAGE_ENTRY_SIZE image entries: name, part, address, length,
+ *           data offset, chunk table offset, SHA-256
+ *   ...     preloader checksum of every DA load region, per DA entry
+ *   ...     chunk tables: DA checksum and SHA-256 of every chunk_size chunk
+ *   ...     DA and image data, each PACKAGE_ALIGN aligned
+ *
+ * All integers are little-endian. The chunk size is the DA packet size, so
+ * the precomputed checksums are exactly the ones the DA asks for. A package
+ * is mapped and fully validated once per process; devices are then fed
+ * straight from the mapping.
+ */
+
+#define PACKAGE_MAGIC "MTKPKG01"
+#define PACKAGE_VERSION (1)
+#define PACKAGE_ALIGN (4096)
+#define PACKAGE_CHUNK_SIZE (MTK_DA_PACKET_SIZE)
+#define PACKAGE_MAX_IMAGES (MAX_OPERATIONS)
+
+#define PACKAGE_HEADER_SIZE (128)
+#define PACKAGE_ENTRY_SIZE (128)
+#define PACKAGE_NAME_MAX (48)
+// DA checksum, reserved, SHA-256
+#define PACKAGE_CHUNK_ENTRY_SIZE (4 + SHA256_DIGEST_SIZE)
+
+struct package_image {
+    char name[PACKAGE_NAME_MAX];
+    uint8_t part;
+    uint64_t address;
+    uint64_t length;
+    const uint8_t *data;
+    // DA checksum of every chunk_size chunk
+    uint16_t *chksums;
+};
+
+struct package {
+    struct mapped_file map;
+    size_t chunk_size;
+
+    // view of the DA inside the mapping
+    struct mapped_file da;
+    const mtk_da_info *info;
+    // preloader checksums, MTK_DA_ENTRY_LOAD_REGIONS per DA entry
+    const uint8_t *region_chksums;
+
+    struct package_image images[PACKAGE_MAX_IMAGES];
+    size_t count;
+};
+
+// Builds a package from the DA and the -F operations, which need explicit addresses; returns 0 or a negative errno,
+// -ENAMETOOLONG when an image name does not fit PACKAGE_NAME_MAX.
+int package_build(const char *path, const struct arguments *arguments, const mtk_da_info *info);
+
+// Maps the package and checks every checksum and hash in it; returns 0 or a negative errno.
+int package_open(struct package *package, int fd);
+void package_close(struct package *package);
+
+// Appends a flash operation for every image; returns 0 or -ENOSPC.
+int package_add_operations(const struct package *package, struct arguments *arguments);
+
+// Preloader checksum of a load region of a DA entry, both part of package->info.
+uint16_t package_region_chksum(const struct package *package, const mtk_da_entry *entry, const mtk_da_load_region *region);
+
+#endif /* PACKAGE_H */
@@ -0,0 +1,43 @@
+#include "patch.h"
+
+#include <errno.h>
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+int patch_decode(const char *hex, uint8_t *data) {
+    int count = 0;
+
+    while (hex[0] != '\0') {
+        int high = hex_digit(hex[0]);
+        int low = high >= 0 ? hex_digit(hex[1]) : -1;
+        if (low < 0) {
+            return -EINVAL;
+        }
+        if (data != NULL) {
+            data[count] = high << 4 | low;
+        }
+        count++;
+        hex += 2;
+    }
+
+    return count > 0 ? count : -EINVAL;
+}
+
+void patch_apply(const struct plan_step *step, uint64_t start, uint8_t *buffer) {
+    // operations of a step are in scheduling order, which keeps overlapping edits in command-line order
+    for (size_t i = 0; i < step->operations_count; i++) {
+        const struct operation *operation = step->operations[i];
+        patch_decode(operation->path, buffer + (operation->address - start));
+    }
+}
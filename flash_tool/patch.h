@@ -0,0 +1,25 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "plan.h"
+
+/*
+ * In-place byte edits (--patch OFFSET:HEX). Edits of one partition that lie
+ * within PATCH_MERGE_GAP of each other become one plan step; the step's
+ * sector-aligned span is read, the edits are applied in command-line order,
+ * and only the sectors that actually changed are written back.
+ */
+
+#define PATCH_SECTOR_SIZE (512)
+#define PATCH_MERGE_GAP (64 * 1024)
+
+// Decodes hex into data, which may be NULL to only validate; returns the byte count or -EINVAL.
+int patch_decode(const char *hex, uint8_t *data);
+
+// Applies the edits of a patch step to buffer, which holds the device bytes from address start.
+void patch_apply(const struct plan_step *step, uint64_t start, uint8_t *buffer);
+
+#endif /* PATCH_H */
@@ -0,0 +1,151 @@
+#include "plan.h"
+#include "io_handler.h"
+#include "patch.h"
+#include "progress.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <libusb.h>
+
+/*
+ * Operation scheduler. Operations are reordered by eMMC partition and
+ * address, staying on the current partition for as long as possible so
+ * switch_part is only needed when the partition changes. Two operations
+ * depend on each other when they touch overlapping bytes of the same
+ * partition and at least one of them is a flash; their command-line order
+ * is always kept. Dumps that end up next to each other and overlap or touch
+ * are merged into one read, fanned out to each output file; patches that end
+ * up within PATCH_MERGE_GAP of each other share one read-modify-write.
+ */
+
+static bool conflicts(const struct operation *a, const struct operation *b) {
+    if (a->part != b->part) {
+        return false;
+    }
+    if (a->key == 'D' && b->key == 'D') {
+        return false;
+    }
+
+    return a->address < b->address + b->length && b->address < a->address + a->length;
+}
+
+static bool mergeable(const struct plan_step *last, const struct operation *next) {
+    if (last->key != next->key || last->part != next->part) {
+        return false;
+    }
+
+    uint64_t gap = 0;
+    if (next->key == 'P') {
+        gap = PATCH_MERGE_GAP;
+    } else if (next->key != 'D') {
+        return false;
+    }
+    return next->address <= last->address + last->length + gap && last->address <= next->address + next->length + gap;
+}
+
+static bool precedes(const struct operation *a, uint8_t current_part, const struct operation *b) {
+    bool a_current = a->part == current_part;
+    bool b_current = b->part == current_part;
+
+    if (a_current != b_current) {
+        return a_current;
+    }
+    if (a->part != b->part) {
+        return a->part < b->part;
+    }
+    return a->address < b->address;
+}
+
+void plan_build(const struct operation *operations, size_t count, uint8_t current_part, struct plan *plan) {
+    bool scheduled[MAX_OPERATIONS] = { false };
+
+    plan->count = 0;
+    plan->switches = 0;
+
+    for (size_t n = 0; n < count; n++) {
+        const struct operation *next = NULL;
+        size_t next_index = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            if (scheduled[i]) {
+                continue;
+            }
+
+            bool ready = true;
+            for (size_t j = 0; j < i && ready; j++) {
+                if (!scheduled[j] && conflicts(&operations[j], &operations[i])) {
+                    ready = false;
+                }
+            }
+
+            // ties keep command-line order
+            if (ready && (next == NULL || precedes(&operations[i], current_part, next))) {
+                next = &operations[i];
+                next_index = i;
+            }
+        }
+
+        scheduled[next_index] = true;
+        if (next->part != current_part) {
+            current_part = next->part;
+            plan->switches++;
+        }
+
+        struct plan_step *last = plan->count > 0 ? &plan->steps[plan->count - 1] : NULL;
+        if (last != NULL && mergeable(last, next)) {
+            uint64_t end = last->address + last->length;
+            if (next->address + next->length > end) {
+                end = next->address + next->length;
+            }
+            if (next->address < last->address) {
+                last->address = next->address;
+            }
+            last->length = end - last->address;
+            last->operations[last->operations_count++] = next;
+            continue;
+        }
+
+        struct plan_step *step = &plan->steps[plan->count++];
+        step->key = next->key;
+        step->part = next->part;
+        step->address = next->address;
+        step->length = next->length;
+        step->operations[0] = next;
+        step->operations_count = 1;
+    }
+}
+
+// Writes each chunk of a merged read to every dump file it overlaps
+int plan_dump_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    struct plan_dump_info *info = user_data;
+    const struct plan_step *step = info->step;
+
+    uint64_t chunk_start = step->address + offset;
+    uint64_t chunk_end = chunk_start + count;
+
+    for (size_t i = 0; i < step->operations_count; i++) {
+        const struct operation *operation = step->operations[i];
+
+        uint64_t start = operation->address > chunk_start ? operation->address : chunk_start;
+        uint64_t end = operation->address + operation->length < chunk_end ? operation->address + operation->length : chunk_end;
+        if (start >= end) {
+            continue;
+        }
+
+        struct file_info fi = {
+            .fd = operation->fd,
+            .offset = 0,
+            .err = 0,
+        };
+
+        int err;
+        if ((err = io_transfer(flashing, start - operation->address, buffer + (start - chunk_start), end - start, &fi)) < 0) {
+            info->err = fi.err;
+            return err;
+        }
+    }
+
+    progress_update(flashing ? "Flashing" : "Dumping", offset + count, total_length);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "args.h"
+
+// One device command; merged dumps and patches cover several operations
+struct plan_step {
+    int key;
+    uint8_t part;
+    uint64_t address;
+    uint64_t length;
+
+    const struct operation *operations[MAX_OPERATIONS];
+    size_t operations_count;
+};
+
+struct plan {
+    struct plan_step steps[MAX_OPERATIONS];
+    size_t count;
+    size_t switches;
+};
+
+// current_part is the partition the DA is already switched to, or 0
+void plan_build(const struct operation *operations, size_t count, uint8_t current_part, struct plan *plan);
+
+int plan_dump_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+struct plan_dump_info {
+    const struct plan_step *step;
+    int err;
+};
+
+#endif /* PLAN_H */
@@ -0,0 +1,153 @@
+#include "progress.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "src/util.h"
+
+#define PROGRESS_BAR_WIDTH (32)
+#define SI_UNITS_BUFSIZ (16)
+
+// One transfer per thread; parallel sessions each track their own.
+struct progress {
+    const char *verb;
+    size_t length;
+    size_t done;
+
+    uint64_t start_us;
+    uint64_t rendered_us;
+    uint64_t reported_us;
+    uint64_t sample_us;
+    size_t sample_done;
+    double rate;
+};
+
+static bool terminal_enabled = true;
+static int json_fd = -1;
+
+static __thread struct progress state;
+static __thread const char *label = "";
+
+static void format_si_units(size_t length, char *str, size_t size);
+
+static bool stderr_is_tty(void) {
+    static int tty = -1;
+    if (tty < 0) {
+        tty = isatty(STDERR_FILENO);
+    }
+    return tty;
+}
+
+void progress_set_terminal(bool enabled) { terminal_enabled = enabled; }
+
+// JSON lines for line-control software; one event per render plus the final one of each transfer
+void progress_set_fd(int fd) { json_fd = fd; }
+
+void progress_set_label(const char *name) { label = name; }
+
+static void render_terminal(const struct progress *p, bool done, double eta) {
+    int percent = (double)p->done / p->length * 100;
+
+    char done_str[SI_UNITS_BUFSIZ];
+    format_si_units(p->done, done_str, sizeof(done_str));
+    char length_str[SI_UNITS_BUFSIZ];
+    format_si_units(p->length, length_str, sizeof(length_str));
+    char rate_str[SI_UNITS_BUFSIZ];
+    format_si_units(p->rate, rate_str, sizeof(rate_str));
+
+    if (!stderr_is_tty()) {
+        printf("%s %s of %s, %d%%, %s/s\n", p->verb, done_str, length_str, percent, rate_str);
+        return;
+    }
+
+    char progress_bar[PROGRESS_BAR_WIDTH + 1];
+    size_t progress_bar_fill = (double)p->done / p->length * PROGRESS_BAR_WIDTH;
+    memset(progress_bar, '#', progress_bar_fill);
+    memset(progress_bar + progress_bar_fill, '-', PROGRESS_BAR_WIDTH - progress_bar_fill);
+    progress_bar[PROGRESS_BAR_WIDTH] = '\0';
+
+    char eta_str[16] = "--:--";
+    if (done) {
+        double elapsed = (p->rendered_us - p->start_us) / 1e6;
+        snprintf(eta_str, sizeof(eta_str), "%u:%02u", (unsigned)elapsed / 60, (unsigned)elapsed % 60);
+    } else if (eta >= 0) {
+        snprintf(eta_str, sizeof(eta_str), "%u:%02u", (unsigned)eta / 60, (unsigned)eta % 60);
+    }
+
+    fprintf(stderr, "%s %-8s of %-8s  [%s]  %3d%%  %8s/s  %s %s%c", p->verb, done_str, length_str, progress_bar, percent, rate_str,
+        done ? "took" : "ETA", eta_str, done ? '\n' : '\r');
+    fflush(stderr);
+}
+
+static void render_json(const struct progress *p, bool done, double eta) {
+    char line[256];
+    int n = snprintf(line, sizeof(line),
+        "{\"device\":\"%s\",\"op\":\"%s\",\"done\":%zu,\"total\":%zu,\"rate\":%.0f,\"eta\":%.1f,\"elapsed\":%.3f,\"finished\":%s}\n", label, p->verb, p->done,
+        p->length, p->rate, eta, (p->reported_us - p->start_us) / 1e6, done ? "true" : "false");
+
+    // a single write keeps lines of parallel sessions from interleaving on a pipe
+    if (n > 0 && (size_t)n < sizeof(line) && write(json_fd, line, n) < 0) {
+        json_fd = -1;
+    }
+}
+
+// Called after every chunk; the throughput average is updated at most every PROGRESS_REFRESH_MS
+// and output is only produced at that rate, whatever the chunk size.
+void progress_update(const char *verb, size_t offset, size_t length) {
+    if (!terminal_enabled && json_fd < 0) {
+        return;
+    }
+
+    struct progress *p = &state;
+    uint64_t now = monotonic_us();
+
+    if (p->verb != verb || p->length != length || offset < p->done) {
+        memset(p, 0, sizeof(*p));
+        p->verb = verb;
+        p->length = length;
+        p->start_us = now;
+        p->sample_us = now;
+    }
+    p->done = offset;
+
+    bool done = offset == length;
+    uint64_t since_sample = now - p->sample_us;
+    if (since_sample >= PROGRESS_REFRESH_MS * 1000 || (done && p->rate == 0)) {
+        if (since_sample > 0) {
+            double rate = (double)(p->done - p->sample_done) * 1e6 / since_sample;
+            p->rate = p->rate == 0 ? rate : PROGRESS_EWMA_ALPHA * rate + (1 - PROGRESS_EWMA_ALPHA) * p->rate;
+        }
+        p->sample_us = now;
+        p->sample_done = p->done;
+    }
+
+    double eta = p->rate > 0 ? (p->length - p->done) / p->rate : -1;
+
+    // log lines are kept sparse; the bar and JSON events follow the refresh rate
+    unsigned int interval_ms = stderr_is_tty() ? PROGRESS_REFRESH_MS : PROGRESS_LINE_REFRESH_MS;
+    if (terminal_enabled && (done || p->rendered_us == 0 || now - p->rendered_us >= interval_ms * 1000)) {
+        p->rendered_us = now;
+        render_terminal(p, done, eta);
+    }
+    if (json_fd >= 0 && (done || p->reported_us == 0 || now - p->reported_us >= PROGRESS_REFRESH_MS * 1000)) {
+        p->reported_us = now;
+        render_json(p, done, eta);
+    }
+}
+
+static void format_si_units(size_t length, char *str, size_t size) {
+    static const char *suffix = "BKMG";
+
+    double dbl = length;
+    const char *ptr = suffix;
+
+    while (dbl > 1024 && *(ptr + 1) != '\0') {
+        dbl /= 1024;
+        ptr++;
+    }
+
+    snprintf(str, size, "%.5g %c", dbl, *ptr);
+}
@@ -0,0 +1,20 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// minimum time between two renders of the same transfer
+#define PROGRESS_REFRESH_MS (100)
+#define PROGRESS_LINE_REFRESH_MS (2000)
+
+// weight of the newest throughput sample in the moving average
+#define PROGRESS_EWMA_ALPHA (0.3)
+
+void progress_set_terminal(bool enabled);
+void progress_set_fd(int fd);
+void progress_set_label(const char *label);
+
+void progress_update(const char *verb, size_t offset, size_t length);
+
+#endif /* PROGRESS_H */
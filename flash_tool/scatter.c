@@ -0,0 +1,160 @@
+#include "scatter.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mtk_da.h"
+
+/*
+ * Parser for the YAML-style scatter files written by SP Flash Tool
+ * (config_version V1.x). Only the keys needed to build a flash plan are
+ * read, everything else is ignored:
+ *
+ *   - partition_index: SYS7
+ *     partition_name: BOOTIMG
+ *     file_name: boot.img
+ *     is_download: true
+ *     physical_start_addr: 0x1d80000
+ *     partition_size: 0x1000000
+ *     region: EMMC_USER
+ */
+
+static char *trim(char *str) {
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+
+    return str;
+}
+
+static int parse_region(const char *value, uint8_t *part) {
+    static const struct {
+        const char *name;
+        uint8_t part;
+    } regions[] = {
+        { "EMMC_BOOT_1", MTK_DA_EMMC_PART_BOOT1 },
+        { "EMMC_BOOT1", MTK_DA_EMMC_PART_BOOT1 },
+        { "EMMC_BOOT_2", MTK_DA_EMMC_PART_BOOT2 },
+        { "EMMC_BOOT2", MTK_DA_EMMC_PART_BOOT2 },
+        { "EMMC_RPMB", MTK_DA_EMMC_PART_RPMB },
+        { "EMMC_GP1", MTK_DA_EMMC_PART_GP1 },
+        { "EMMC_GP2", MTK_DA_EMMC_PART_GP2 },
+        { "EMMC_GP3", MTK_DA_EMMC_PART_GP3 },
+        { "EMMC_GP4", MTK_DA_EMMC_PART_GP4 },
+        { "EMMC_USER", MTK_DA_EMMC_PART_USER },
+    };
+
+    for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        if (strcmp(value, regions[i].name) == 0) {
+            *part = regions[i].part;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static int parse_u64(const char *value, uint64_t *out) {
+    char *end;
+    errno = 0;
+    *out = strtoull(value, &end, 0);
+    if (errno != 0 || end == value || *end != '\0') {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int scatter_load(const char *path, struct scatter *scatter, size_t *error_line) {
+    *error_line = 0;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -errno;
+    }
+
+    scatter->count = 0;
+
+    struct scatter_partition *partition = NULL;
+    char line[512];
+    size_t lineno = 0;
+    int err = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+
+        char *str = trim(line);
+        bool new_item = false;
+        if (*str == '-') {
+            new_item = true;
+            str = trim(str + 1);
+        }
+
+        char *colon = strchr(str, ':');
+        if (colon == NULL) {
+            continue;
+        }
+        *colon = '\0';
+        const char *key = trim(str);
+        char *value = trim(colon + 1);
+
+        if (new_item) {
+            partition = NULL;
+            if (strcmp(key, "partition_index") == 0) {
+                if (scatter->count == SCATTER_MAX_PARTITIONS) {
+                    err = -E2BIG;
+                    break;
+                }
+                partition = &scatter->partitions[scatter->count++];
+                memset(partition, 0, sizeof(*partition));
+                partition->part = MTK_DA_EMMC_PART_USER;
+            }
+            continue;
+        }
+        if (partition == NULL) {
+            continue;
+        }
+
+        if (strcmp(key, "partition_name") == 0) {
+            snprintf(partition->name, sizeof(partition->name), "%s", value);
+        } else if (strcmp(key, "file_name") == 0) {
+            if (strcmp(value, "NONE") != 0) {
+                snprintf(partition->file_name, sizeof(partition->file_name), "%s", value);
+            }
+        } else if (strcmp(key, "is_download") == 0) {
+            partition->is_download = strcmp(value, "true") == 0;
+        } else if (strcmp(key, "physical_start_addr") == 0) {
+            err = parse_u64(value, &partition->address);
+        } else if (strcmp(key, "partition_size") == 0) {
+            err = parse_u64(value, &partition->size);
+        } else if (strcmp(key, "region") == 0) {
+            err = parse_region(value, &partition->part);
+        }
+
+        if (err < 0) {
+            break;
+        }
+    }
+
+    if (err == 0 && ferror(f)) {
+        err = -EIO;
+    }
+    if (err < 0) {
+        *error_line = lineno;
+    }
+
+    fclose(f);
+    return err;
+}
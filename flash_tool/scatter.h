@@ -0,0 +1,27 @@
+#ifndef SCATTER_H
+#define SCATTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SCATTER_NAME_MAX (64)
+#define SCATTER_MAX_PARTITIONS (128)
+
+struct scatter_partition {
+    char name[SCATTER_NAME_MAX];
+    char file_name[256];
+    bool is_download;
+    uint8_t part;
+    uint64_t address;
+    uint64_t size;
+};
+
+struct scatter {
+    struct scatter_partition partitions[SCATTER_MAX_PARTITIONS];
+    size_t count;
+};
+
+int scatter_load(const char *path, struct scatter *scatter, size_t *error_line);
+
+#endif /* SCATTER_H */
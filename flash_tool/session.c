@@ -0,0 +1,1426 @@
+#include "session.h"
+#include "bmap.h"
+#include "daemon.h"
+#include "delta.h"
+#include "ext4.h"
+#include "io_handler.h"
+#include "patch.h"
+#include "progress.h"
+#include "store.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+#ifdef _WIN32
+#include <winsock.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include "mtk_preloader.h"
+#include "mtk_trace.h"
+#include "src/util.h"
+
+static int handle_state_none(struct session *session);
+static int handle_state_preloader(struct session *session);
+static int handle_state_da_stage2(struct session *session);
+static int resolve_partitions(struct session *session, uint8_t *current_part);
+
+static int fail(struct session *session, int status, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(session->error, sizeof(session->error), format, args);
+    va_end(args);
+
+    session->status = status;
+    return -1;
+}
+
+static int fail_errnum(struct session *session, int errnum, const char *s) { return fail(session, 1, "%s: %s", s, strerror(errnum)); }
+
+static int fail_libusb(struct session *session, int err, const char *s) { return fail(session, 1, "%s: %s", s, libusb_strerror(err)); }
+
+static int fail_preloader(struct session *session, uint16_t status, const char *cmd) {
+    return fail(session, 2, "%s failed: 0x%04" PRIx16, cmd, status);
+}
+
+static int fail_da_ack(struct session *session, uint8_t retval) { return fail(session, 2, "DA did not ACK: 0x%02" PRIx8, retval); }
+
+void session_init(struct session *session, const struct arguments *arguments, const mtk_da_info *info) {
+    memset(session, 0, sizeof(*session));
+    session->arguments = arguments;
+    session->info = info;
+
+    memcpy(session->operations, arguments->operations, arguments->operations_count * sizeof(struct operation));
+    session->operations_count = arguments->operations_count;
+}
+
+int session_attach_emulator(struct session *session) {
+    const struct arguments *arguments = session->arguments;
+
+    mtk_emulator_config config = {
+        .image = arguments->emulate_image,
+        .hw_code = MTK_EMULATOR_HW_CODE,
+        .bandwidth = (uint64_t)arguments->emulate_bandwidth * 1000000,
+        .latency_us = arguments->emulate_latency_us,
+    };
+    switch (arguments->state) {
+    case DEVICE_STATE_NONE:
+        config.state = MTK_EMULATOR_STATE_NONE;
+        break;
+    case DEVICE_STATE_PRELOADER:
+        config.state = MTK_EMULATOR_STATE_PRELOADER;
+        break;
+    case DEVICE_STATE_DA_STAGE2:
+        config.state = MTK_EMULATOR_STATE_DA_STAGE2;
+        break;
+    }
+
+    int err = mtk_emulator_open(&session->emulator, &config);
+    if (err < 0) {
+        return fail_errnum(session, -err, "Unable to start emulated device");
+    }
+
+    mtk_emulator_attach(session->emulator, &session->device);
+    return 0;
+}
+
+void session_printf(const struct session *session, const char *format, ...) {
+    char line[512];
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (session->label[0] == '\0') {
+        fputs(line, stdout);
+        return;
+    }
+
+    // blank separator lines only make sense for a single device
+    const char *text = line;
+    while (*text == '\n') {
+        text++;
+    }
+    if (*text != '\0') {
+        printf("[%s] %s", session->label, text);
+    }
+}
+
+// Sessions with a label write their own dump files, named after the device's port.
+static int open_dump_files(struct session *session) {
+    for (size_t i = 0; i < session->operations_count; i++) {
+        struct operation *operation = &session->operations[i];
+        if (operation->key != 'D') {
+            continue;
+        }
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.%s", operation->path, session->label);
+
+        int flags = (session->arguments->mmap_dump ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+#if _WIN32
+        flags |= O_BINARY;
+#endif
+        if ((operation->fd = open(path, flags, 0666)) < 0) {
+            return fail(session, 1, "Unable to open file for dumping: %s (%s)", path, strerror(errno));
+        }
+    }
+
+    return 0;
+}
+
+// Sessions with a label get their own container, named like their dump files.
+static int open_container(struct session *session) {
+    const char *file = session->arguments->container_file;
+
+    char path[4096];
+    if (session->label[0] != '\0') {
+        snprintf(path, sizeof(path), "%s.%s", file, session->label);
+    } else {
+        snprintf(path, sizeof(path), "%s", file);
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if _WIN32
+    flags |= O_BINARY;
+#endif
+    int fd = open(path, flags, 0666);
+    if (fd < 0) {
+        return fail(session, 1, "Unable to open container: %s (%s)", path, strerror(errno));
+    }
+
+    session->container = malloc(sizeof(struct container));
+    if (session->container == NULL) {
+        close(fd);
+        return fail_errnum(session, ENOMEM, "Unable to open container");
+    }
+
+    int err = container_create(session->container, fd);
+    if (err < 0) {
+        return fail_errnum(session, -err, "Unable to write container");
+    }
+    return 0;
+}
+
+static void close_container(struct session *session) {
+    if (session->container != NULL) {
+        close(session->container->fd);
+        free(session->container);
+        session->container = NULL;
+    }
+}
+
+static void close_dump_files(struct session *session) {
+    for (size_t i = 0; i < session->operations_count; i++) {
+        struct operation *operation = &session->operations[i];
+        if (operation->key == 'D' && operation->fd != -1) {
+            close(operation->fd);
+            operation->fd = -1;
+        }
+    }
+}
+
+int session_run(struct session *session) {
+    int err = 0;
+
+    session->device.retry_budget = session->arguments->retries;
+
+    if (session->label[0] != '\0' && session->arguments->container_file == NULL) {
+        err = open_dump_files(session);
+    }
+    if (err == 0 && session->arguments->container_file != NULL) {
+        err = open_container(session);
+    }
+
+    if (err == 0) {
+        switch (session->arguments->state) {
+        case DEVICE_STATE_NONE:
+            if ((err = handle_state_none(session)) < 0) {
+                break;
+            }
+            /* fallthrough */
+        case DEVICE_STATE_PRELOADER:
+            if ((err = handle_state_preloader(session)) < 0) {
+                break;
+            }
+            /* fallthrough */
+        case DEVICE_STATE_DA_STAGE2:
+            err = handle_state_da_stage2(session);
+            break;
+        }
+    }
+
+    if (session->label[0] != '\0') {
+        close_dump_files(session);
+    }
+    close_container(session);
+    io_release_direct();
+
+    return err;
+}
+
+// Data comes from the shared mapping when the session has one, from the file otherwise.
+static int select_source(const struct mapped_file *map, int fd, size_t offset, size_t length, struct file_info *fi, struct mem_info *mi,
+    mtk_io_handler *handler, void **user_data) {
+    if (map == NULL) {
+        fi->fd = fd;
+        fi->offset = offset;
+        fi->err = 0;
+        *handler = io_handler;
+        *user_data = fi;
+        return 0;
+    }
+
+    if (offset > map->size || length > map->size - offset) {
+        return -EINVAL;
+    }
+
+    mi->buffer = (uint8_t *)map->data + offset;
+    mi->size = length;
+    *handler = mem_handler;
+    *user_data = mi;
+    return 0;
+}
+
+// Points mi at the container range covering the operation; the container is mapped into local unless the engine shares a mapping.
+static int container_source(struct session *session, const struct operation *operation, const struct mapped_file *image, struct mapped_file *local,
+    struct mem_info *mi) {
+    int err;
+
+    if (image == NULL) {
+        if ((err = map_file(operation->fd, local)) < 0) {
+            return fail_errnum(session, -err, "Unable to map container");
+        }
+        image = local;
+    }
+
+    struct container_range ranges[CONTAINER_MAX_RANGES];
+    size_t count;
+    if ((err = container_load(image, ranges, &count)) < 0) {
+        unmap_file(local);
+        return fail_errnum(session, -err, "Invalid container");
+    }
+
+    const uint8_t *data = container_find(image, ranges, count, operation->part, operation->address, operation->length);
+    if (data == NULL) {
+        unmap_file(local);
+        return fail(session, 1, "No container range covers 0x%" PRIx64 " + 0x%" PRIx64, operation->address, operation->length);
+    }
+
+    mi->buffer = (uint8_t *)data;
+    mi->size = operation->length;
+    return 0;
+}
+
+static int handle_state_none(struct session *session) {
+    session_printf(session, "Syncing with MediaTek Preloader...\n");
+
+    int err = mtk_preloader_start(&session->device);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to sync with MediaTek Preloader");
+    }
+
+    return 0;
+}
+
+// Product name and sizes from the eMMC flash info report; the name is CID bits 103:56.
+static void print_emmc_info(const struct session *session) {
+    const mtk_da_emmc_info *emmc = &session->emmc;
+
+    char name[7];
+    uint8_t pnm[6] = { emmc->cid[0], emmc->cid[1] >> 24, emmc->cid[1] >> 16, emmc->cid[1] >> 8, emmc->cid[1], emmc->cid[2] >> 24 };
+    for (size_t i = 0; i < sizeof(pnm); i++) {
+        name[i] = isprint(pnm[i]) ? pnm[i] : '?';
+    }
+    name[sizeof(pnm)] = '\0';
+
+    char fw_ver[sizeof(emmc->fw_ver) + 1];
+    for (size_t i = 0; i < sizeof(emmc->fw_ver); i++) {
+        fw_ver[i] = isprint((uint8_t)emmc->fw_ver[i]) ? emmc->fw_ver[i] : '?';
+    }
+    fw_ver[sizeof(emmc->fw_ver)] = '\0';
+
+    session_printf(session, "EMMC:        %s, manufacturer 0x%02" PRIX32 ", firmware %s\n", name, emmc->cid[0] >> 24, fw_ver);
+    session_printf(session, "EMMC sizes:  user 0x%" PRIx64 ", boot 0x%" PRIx64 " + 0x%" PRIx64 ", rpmb 0x%" PRIx64 "\n",
+        emmc->area_sizes[MTK_DA_EMMC_PART_USER - 1], emmc->area_sizes[MTK_DA_EMMC_PART_BOOT1 - 1], emmc->area_sizes[MTK_DA_EMMC_PART_BOOT2 - 1],
+        emmc->area_sizes[MTK_DA_EMMC_PART_RPMB - 1]);
+}
+
+static int handle_state_preloader(struct session *session) {
+    mtk_device *device = &session->device;
+    const mtk_da_info *info = session->info;
+    int download_agent_fd = session->arguments->download_agent_fd;
+
+    int err;
+    uint16_t status;
+    struct file_info fi;
+    struct mem_info mi;
+    mtk_io_handler handler;
+    void *user_data;
+
+    mtk_trace_span span = mtk_trace_begin("preloader_versions");
+
+    uint16_t hw_code;
+    err = mtk_preloader_get_hw_code(device, &hw_code, &status);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to get chip code");
+    }
+    if (status != 0) {
+        return fail_preloader(session, status, "GET_HW_CODE");
+    }
+
+    session_printf(session, "\nHW code:     0x%04" PRIx16 "\n", hw_code);
+
+    device->timing = mtk_soc_timing_get(hw_code);
+    verboseLog("SoC timing: %s\n", device->timing->hw_code == hw_code ? "table entry" : "default");
+
+    uint16_t hw_subcode, hw_ver, sw_ver;
+    err = mtk_preloader_get_hw_sw_ver(device, &hw_subcode, &hw_ver, &sw_ver, &status);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to get hardware/software version");
+    }
+    if (status != 0) {
+        return fail_preloader(session, status, "GET_HW_SW_VER");
+    }
+
+    session_printf(session, "HW subcode:  0x%04" PRIx16 "\n", hw_subcode);
+    session_printf(session, "HW version:  0x%04" PRIx16 "\n", hw_ver);
+    session_printf(session, "SW version:  0x%04" PRIx16 "\n", sw_ver);
+
+    uint32_t tgt_config;
+    err = mtk_preloader_get_tgt_config(device, &tgt_config, &status);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to get target config");
+    }
+    if (status != 0) {
+        return fail_preloader(session, status, "GET_TARGET_CONFIG");
+    }
+
+    session_printf(session, "\nTarget config:  0x%08" PRIx32 "\n", tgt_config);
+    mtk_trace_end(&span);
+
+    if (session->arguments->pipeline) {
+        err = mtk_preloader_probe_pipeline(device);
+        if (err < 0) {
+            return fail_libusb(session, err, "Unable to probe pipelined echoes");
+        }
+        session_printf(session, "Pipelined echoes: %s\n", err > 0 ? "enabled" : "dropped by preloader, using lockstep");
+    }
+
+    const mtk_da_entry *entry = NULL;
+    for (size_t i = 0; i < info->da_count; i++) {
+        if (info->DA[i].magic != MTK_DA_ENTRY_MAGIC) {
+            return fail(session, 1, "DA entry has invalid magic");
+        }
+        verboseLog(
+            "code 0x%x, hw 0x%x, sw 0x%x, addr 0x%x\n", info->DA[i].hw_code, info->DA[i].hw_ver, info->DA[i].sw_ver, info->DA[i].load_regions[0].start_addr);
+        if (info->DA[i].hw_code == hw_code && info->DA[i].hw_ver <= hw_ver && info->DA[i].sw_ver <= sw_ver) {
+            entry = &info->DA[i];
+            verboseLog("found\n");
+            break;
+        }
+    }
+    if (entry == NULL) {
+        return fail(session, 1, "Unable to find DA entry for HW code");
+    }
+    if (entry->load_regions_count > MTK_DA_ENTRY_LOAD_REGIONS) {
+        return fail(session, 1, "Invalid load regions count in DA entry");
+    }
+    if (entry->entry_region_index >= entry->load_regions_count) {
+        return fail(session, 1, "Invalid entry region index");
+    }
+
+    const mtk_da_load_region *da_stage1 = NULL;
+    for (size_t i = entry->entry_region_index; i + 1 < entry->load_regions_count; i++) {
+        if (entry->load_regions[i].sig_len > 0) {
+            da_stage1 = &entry->load_regions[i];
+            break;
+        }
+    }
+    if (da_stage1 == NULL) {
+        return fail(session, 1, "Unable to find valid load region for DA entry");
+    }
+    if (da_stage1->sig_offset + da_stage1->sig_len != da_stage1->len) {
+        return fail(session, 1, "DA Stage 1 signature is not at end of load region");
+    }
+
+    const mtk_da_load_region *da_stage2 = da_stage1 + 1;
+    if (da_stage2->sig_offset + da_stage2->sig_len != da_stage2->len) {
+        return fail(session, 1, "DA Stage 2 signature is not at end of load region");
+    }
+
+    session_printf(session, "\nDisabling watchdog timer...\n");
+    span = mtk_trace_begin("preloader_disable_wdt");
+    err = mtk_preloader_disable_wdt(device, &status);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to disable WDT");
+    }
+    if (status != 0) {
+        return fail_preloader(session, status, "WRITE32");
+    }
+    mtk_trace_end(&span);
+
+    span = mtk_trace_begin("preloader_bl_queries");
+
+    // target config
+    mtk_device_echo8(device, 0xd8);
+    uint8_t targetConf[6];
+    mtk_device_read(device, targetConf, 6);
+
+    verboseLog("Getting BLver\n");
+    uint8_t blver;
+    uint8_t getBLver = 0xfe;
+    mtk_device_write(device, &getBLver, 1);
+    mtk_device_read(device, &blver, 1);
+
+    verboseLog("Getting BROMver\n");
+    uint8_t bromver;
+    uint8_t getver = 0xff;
+    mtk_device_write(device, &getver, 1);
+    mtk_device_read(device, &bromver, 1);
+
+    verboseLog("Getting HW,SW\n");
+    uint8_t hwsw;
+    uint8_t getHWSWver = 0xfc;
+    mtk_device_write(device, &getHWSWver, 1);
+    mtk_device_read(device, &hwsw, 1);
+    unsigned int waited;
+    err = mtk_device_wait(device, device->timing->preloader_timeout_ms, &waited);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to get HW/SW version");
+    }
+    verboseLog("HW/SW version reply after %u ms\n", waited);
+    uint8_t hwsw_ver[8];
+    mtk_device_read(device, hwsw_ver, sizeof(hwsw_ver));
+
+    verboseLog("Getting meID\n");
+    getBLver = 0xfe;
+    mtk_device_write(device, &getBLver, 1);
+    mtk_device_read(device, &blver, 1);
+    mtk_trace_end(&span);
+
+    if (select_source(session->download_agent, download_agent_fd, da_stage1->offset, da_stage1->len, &fi, &mi, &handler, &user_data) < 0) {
+        return fail(session, 1, "DA Stage 1 is outside of the Download Agent binary");
+    }
+
+    session_printf(session, "Sending DA Stage 1...\n");
+    if (session->package != NULL) {
+        // checked and checksummed when the package was opened
+        err = mtk_preloader_send_da_from(device, da_stage1->start_addr, da_stage1->len, da_stage1->sig_len, mi.buffer,
+            package_region_chksum(session->package, entry, da_stage1), &status);
+    } else {
+        err = mtk_preloader_send_da(device, da_stage1->start_addr, da_stage1->len, da_stage1->sig_len, &status, handler, user_data);
+    }
+    if (handler == io_handler && fi.err != 0) {
+        return fail_errnum(session, fi.err, "Unable to read Download Agent binary");
+    }
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to send DA");
+    }
+    if (status != 0) {
+        return fail_preloader(session, status, "SEND_DA");
+    }
+
+    session_printf(session, "\nJumping to DA Stage 1... (0x%x)\n", da_stage1->start_addr);
+    err = mtk_preloader_jump_da(device, da_stage1->start_addr, &status);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to jump to DA");
+    }
+    if (status != 0) {
+        return fail_preloader(session, status, "JUMP_DA");
+    }
+
+    uint32_t nand_ret, emmc_ret;
+    uint8_t da_major_ver, da_minor_ver;
+    uint32_t *emmc_id = session->emmc_id;
+
+    err = mtk_da_sync(device, &nand_ret, &emmc_ret, emmc_id, &da_major_ver, &da_minor_ver);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to sync with DA Stage 1");
+    }
+    if (nand_ret != MTK_DA_NAND_NOT_FOUND) {
+        return fail(session, 2, "NAND controller did not return NAND_NOT_FOUND: 0x%x", nand_ret);
+    }
+    if (emmc_ret != 0) {
+        return fail(session, 2, "EMMC controller returned error: 0x%x", emmc_ret);
+    }
+
+    session_printf(session, "EMMC ID:     %08" PRIX32 " %08" PRIX32 " %08" PRIX32 " %08" PRIX32 "\n", emmc_id[0], emmc_id[1], emmc_id[2], emmc_id[3]);
+    session_printf(session, "DA version:  DA_v%" PRIu8 ".%" PRIu8 "\n", da_major_ver, da_minor_ver);
+
+    if (select_source(session->download_agent, download_agent_fd, da_stage2->offset, da_stage2->len, &fi, &mi, &handler, &user_data) < 0) {
+        return fail(session, 1, "DA Stage 2 is outside of the Download Agent binary");
+    }
+
+    session_printf(session, "\nSending DA Stage 2...\n");
+    verboseLog("DA stage 2 offset: 0x%x\n", da_stage2->offset);
+    uint8_t retval;
+    err = mtk_da_send_da(device, da_stage2->start_addr, da_stage2->len, &retval, handler, user_data);
+    verboseLog("Send DA stage 2, err 0x%x\n", err);
+    if (handler == io_handler && fi.err != 0) {
+        return fail_errnum(session, fi.err, "Unable to read Download Agent binary");
+    }
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to send DA");
+    }
+    if (retval != MTK_DA_ACK) {
+        return fail_da_ack(session, retval);
+    }
+    session_printf(session, "Successfully uploaded stage 2\n");
+
+    verboseLog("Reading flash info\n");
+    span = mtk_trace_begin("da_flash_info");
+    uint32_t reports[MTK_DA_FLASH_REPORTS] = {0x1c, 0x11, 0xE, 0x9, MTK_DA_EMMC_REPORT_SIZE, 0x1c, 0x26};
+    for (int i = 0; i < MTK_DA_FLASH_REPORTS; i++) {
+        verboseLog("Reading 0x%02x\n", reports[i]);
+        uint8_t buf[reports[i]];
+        err = mtk_device_read(device, buf, reports[i]);
+        if (err < 0) {
+            return fail_libusb(session, err, "Unable to read DA report");
+        }
+        if (i == MTK_DA_EMMC_REPORT) {
+            mtk_da_parse_emmc_report(buf, &session->emmc);
+            session->emmc_known = session->emmc.ret == 0;
+        }
+    }
+    if (session->emmc_known) {
+        print_emmc_info(session);
+    }
+
+    uint8_t buf[0xA];
+    err = mtk_device_read(device, buf, 0xA);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to read DA return value");
+    }
+    struct passinfo pi;
+    memcpy(&pi, buf, sizeof pi);
+    pi.download_status = htonl(pi.download_status);
+    pi.boot_style = htonl(pi.boot_style);
+    mtk_trace_end(&span);
+
+    if (pi.ack == MTK_DA_ACK) {
+        verboseLog("%s, ack ok\n", __FUNCTION__);
+        return 0;
+    }
+    verboseLog("PI status: ack: 0x%x, download_status: 0x%x, boot_style: 0x%x, soc_ok: 0x%x\n", pi.ack, pi.download_status, pi.boot_style, pi.soc_ok);
+
+    if (pi.download_status == MTK_DA_ACK) {
+        verboseLog("Get DA return value\n");
+        for (int i = 0; i < 4; i++) {
+            err = mtk_device_read8(device, &retval);
+            if (err < 0) {
+                return fail_libusb(session, err, "Unable to read DA return value");
+            }
+        }
+        verboseLog("Check SOC\n");
+        if (retval != MTK_DA_SOC_OK) {
+            return fail(session, 2, "SOC DA did not return OK: 0x%02" PRIx8, retval);
+        }
+    }
+
+    verboseLog("%s done\n", __FUNCTION__);
+    return 0;
+}
+
+// Package images were checked when the package was opened and go out straight from the mapping with their precomputed checksums.
+static int flash_from_package(struct session *session, const struct plan_step *step, const struct operation *operation) {
+    const struct package *package = session->package;
+    const struct package_image *image = &package->images[operation->package_image];
+
+    uint8_t retval;
+    int err = mtk_da_sdmmc_write_data_from(&session->device, MTK_DA_STORAGE_SDMMC, step->part, step->address, step->length, image->data, image->chksums,
+        package->chunk_size, &retval, progress_handler, NULL);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to perform flash operation");
+    }
+    if (retval != MTK_DA_CONT_CHAR) {
+        return fail(session, 2, "DA did not return continuation character: 0x%02" PRIx8, retval);
+    }
+
+    return 0;
+}
+
+// Writes the fill byte from one host-side packet, or with --device-erase erases on the device when the DA takes FORMAT.
+// Only a refused command byte falls back to writing: once the parameters were sent, the DA's state is unknown.
+static int erase(struct session *session, const struct plan_step *step, const struct operation *operation) {
+    mtk_device *device = &session->device;
+
+    int err;
+    uint8_t retval;
+    if (operation->device_erase && !session->no_format) {
+        uint32_t status;
+        err = mtk_da_format(device, MTK_DA_STORAGE_SDMMC, step->part, step->address, step->length, &status, &retval, erase_progress_handler, NULL);
+        if (err == LIBUSB_ERROR_INVALID_PARAM) {
+            return fail(session, 2, "DA refused to erase 0x%016" PRIx64 " + 0x%" PRIx64, step->address, step->length);
+        }
+        if (err < 0) {
+            return fail_libusb(session, err, "Unable to perform erase operation");
+        }
+        if (retval == MTK_DA_ACK && status != 0) {
+            return fail(session, 2, "DA could not erase: status 0x%08" PRIx32, status);
+        }
+        if (retval == MTK_DA_ACK) {
+            return 0;
+        }
+
+        session_printf(session, "DA does not support erasing, writing zeroes instead\n");
+        session->no_format = true;
+    }
+
+    err = mtk_da_sdmmc_fill(device, MTK_DA_STORAGE_SDMMC, step->part, step->address, step->length, operation->fill, &retval, erase_progress_handler, NULL);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to perform erase operation");
+    }
+    if (retval != MTK_DA_CONT_CHAR) {
+        return fail(session, 2, "DA did not return continuation character: 0x%02" PRIx8, retval);
+    }
+
+    return 0;
+}
+
+struct shifted_info {
+    mtk_io_handler handler;
+    void *user_data;
+    uint64_t offset;
+    uint64_t total_length;
+};
+
+// Presents one piece of a split transfer to the handler as part of the whole.
+static int shifted_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void)total_length;
+    struct shifted_info *info = user_data;
+    return info->handler(flashing, info->offset + offset, info->total_length, buffer, count, info->user_data);
+}
+
+static int write_timed(struct session *session, uint8_t part, uint64_t address, uint64_t length, const uint8_t *src, uint8_t *retval,
+    mtk_io_handler handler, void *user_data) {
+    uint64_t start = monotonic_us();
+    int err = src != NULL ? mtk_da_sdmmc_write_data_from(&session->device, MTK_DA_STORAGE_SDMMC, part, address, length, src, NULL, 0, retval, handler,
+                                user_data)
+                          : mtk_da_sdmmc_write_data(&session->device, MTK_DA_STORAGE_SDMMC, part, address, length, retval, handler, user_data);
+    uint64_t elapsed = monotonic_us() - start;
+
+    // with --align 0 there is no boundary to classify against, and no throughput split is reported
+    uint64_t align = session->arguments->write_align;
+    if (align == 0) {
+        return err;
+    }
+    if (address % align == 0) {
+        session->aligned_bytes += length;
+        session->aligned_us += elapsed;
+    } else {
+        session->unaligned_bytes += length;
+        session->unaligned_us += elapsed;
+    }
+    return err;
+}
+
+/*
+ * WRITE_DATA from src, or from handler when src is NULL. An address off the
+ * --align boundary gets a command of its own up to the next boundary, so the
+ * packets of the rest each cover whole erase groups instead of straddling two
+ * and making the card read, merge and rewrite both.
+ */
+static int write_aligned(struct session *session, uint8_t part, uint64_t address, uint64_t length, const uint8_t *src, uint8_t *retval,
+    mtk_io_handler handler, void *user_data) {
+    uint64_t align = session->arguments->write_align;
+    uint64_t head = align > 0 && address % align != 0 ? MIN(align - address % align, length) : 0;
+    if (head == 0 || head == length) {
+        return write_timed(session, part, address, length, src, retval, handler, user_data);
+    }
+
+    verboseLog("Writing 0x%" PRIx64 " bytes up to the 0x%" PRIx64 " boundary separately\n", head, align);
+    struct shifted_info info = {
+        .handler = handler,
+        .user_data = user_data,
+        .offset = 0,
+        .total_length = length,
+    };
+    mtk_io_handler shifted = handler != NULL ? shifted_handler : NULL;
+
+    int err = write_timed(session, part, address, head, src, retval, shifted, &info);
+    if (err < 0 || *retval != MTK_DA_CONT_CHAR) {
+        return err;
+    }
+
+    info.offset = head;
+    return write_timed(session, part, address + head, length - head, src != NULL ? src + head : NULL, retval, shifted, &info);
+}
+
+static void print_write_throughput(const struct session *session) {
+    if (session->aligned_bytes > 0) {
+        session_printf(session, "Writes:   %.1f MiB/s from erase group boundaries (%.1f MiB)\n",
+            session->aligned_bytes / 1048576.0 / (MAX(session->aligned_us, 1) / 1e6), session->aligned_bytes / 1048576.0);
+    }
+    if (session->unaligned_bytes > 0) {
+        session_printf(session, "Writes:   %.1f MiB/s unaligned (%.1f MiB)\n", session->unaligned_bytes / 1048576.0 / (MAX(session->unaligned_us, 1) / 1e6),
+            session->unaligned_bytes / 1048576.0);
+    }
+}
+
+// Reads back the base samples of a delta; a device that does not hold the base would end up with a mix of both images.
+static int check_delta_base(struct session *session, const struct plan_step *step, const struct delta *delta) {
+    if (delta->samples_count == 0) {
+        session_printf(session, "Base:     no samples to check, the images share no unchanged area\n");
+        return 0;
+    }
+
+    uint8_t *sample = malloc(delta->sample_size);
+    if (sample == NULL) {
+        return fail_errnum(session, ENOMEM, "Unable to check delta base");
+    }
+
+    int err = 0;
+    for (size_t i = 0; i < delta->samples_count && err == 0; i++) {
+        uint64_t address = step->address + delta->samples[i].offset;
+
+        uint8_t retval;
+        err = mtk_da_read_into(&session->device, MTK_DA_STORAGE_SDMMC, address, delta->sample_size, sample, &retval, NULL, NULL);
+        if (err < 0) {
+            err = fail_libusb(session, err, "Unable to read delta base sample");
+        } else if (retval != MTK_DA_ACK) {
+            err = fail_da_ack(session, retval);
+        } else {
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            sha256(sample, delta->sample_size, digest);
+            if (memcmp(digest, delta->samples[i].sha256, SHA256_DIGEST_SIZE) != 0) {
+                err = fail(session, 1, "Device does not hold the delta base: sample at 0x%" PRIx64 " differs", address);
+            }
+        }
+    }
+
+    free(sample);
+    if (err == 0) {
+        session_printf(session, "Base:     %zu samples match\n", delta->samples_count);
+    }
+    return err;
+}
+
+// Writes only the ranges of a delta, straight from the mapping; the delta is mapped into local unless the engine shares a mapping.
+static int flash_delta(struct session *session, const struct plan_step *step, const struct operation *operation, const struct mapped_file *image) {
+    int err;
+    struct mapped_file local = { 0 };
+    if (image == NULL) {
+        if ((err = map_file(operation->fd, &local)) < 0) {
+            return fail_errnum(session, -err, "Unable to map delta");
+        }
+        image = &local;
+    }
+
+    struct delta delta;
+    if ((err = delta_load(image, &delta)) < 0) {
+        unmap_file(&local);
+        return fail_errnum(session, -err, "Invalid delta");
+    }
+
+    uint64_t changed = 0;
+    for (size_t i = 0; i < delta.count; i++) {
+        changed += delta.ranges[i].length;
+    }
+    session_printf(session, "Delta:    %zu ranges, 0x%" PRIx64 " of 0x%" PRIx64 " bytes\n", delta.count, changed, delta.length);
+
+    if (session->arguments->check_base) {
+        err = check_delta_base(session, step, &delta);
+    }
+
+    for (size_t i = 0; i < delta.count && err == 0; i++) {
+        const struct delta_range *range = &delta.ranges[i];
+
+        uint8_t retval;
+        err = write_aligned(session, step->part, step->address + range->offset, range->length, range->data, &retval, progress_handler, NULL);
+        if (err < 0) {
+            err = fail_libusb(session, err, "Unable to perform flash operation");
+        } else if (retval != MTK_DA_CONT_CHAR) {
+            err = fail(session, 2, "DA did not return continuation character: 0x%02" PRIx8, retval);
+        }
+    }
+
+    delta_free(&delta);
+    unmap_file(&local);
+    return err;
+}
+
+struct bmap_progress_info {
+    uint64_t done;
+    uint64_t mapped;
+};
+
+// Reports the mapped bytes written so far, across all ranges.
+static int bmap_progress_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void)flashing;
+    (void)total_length;
+    (void)buffer;
+    struct bmap_progress_info *info = user_data;
+    progress_update("Flashing", info->done + offset + count, info->mapped);
+    return 0;
+}
+
+// Writes only the mapped ranges of the image, each in pieces of at most BMAP_PIECE_SIZE from the engine's shared mapping or
+// from a buffer of that size read from the flash file. Every piece goes into the range's SHA-256 before it is written, and the
+// digest is checked before the last piece of the range is, so a range that does not match never completes on the device.
+static int flash_bmap(struct session *session, const struct plan_step *step, const struct operation *operation, const struct mapped_file *image) {
+    const struct bmap *bmap = operation->bmap;
+
+    struct bmap_progress_info info = {
+        .done = 0,
+        .mapped = 0,
+    };
+    uint64_t largest = 0;
+    for (size_t i = 0; i < bmap->count; i++) {
+        uint64_t offset, length;
+        bmap_range_bytes(bmap, &bmap->ranges[i], &offset, &length);
+        info.mapped += length;
+        largest = MAX(largest, length);
+    }
+    if (image != NULL && image->size < bmap->image_size) {
+        return fail(session, 1, "Flash file is shorter than the operation");
+    }
+
+    uint8_t *buffer = NULL;
+    if (image == NULL && largest > 0 && (buffer = malloc(MIN(largest, BMAP_PIECE_SIZE))) == NULL) {
+        return fail_errnum(session, ENOMEM, "Unable to allocate bmap buffer");
+    }
+    struct file_info fi = {
+        .fd = operation->fd,
+        .offset = 0,
+        .err = 0,
+    };
+
+    session_printf(session, "Bmap:     %zu ranges, 0x%" PRIx64 " of 0x%" PRIx64 " bytes\n", bmap->count, info.mapped, bmap->image_size);
+
+    int err = 0;
+    for (size_t i = 0; i < bmap->count && err == 0; i++) {
+        const struct bmap_range *range = &bmap->ranges[i];
+        uint64_t offset, length;
+        bmap_range_bytes(bmap, range, &offset, &length);
+
+        struct sha256 sha256;
+        sha256_init(&sha256);
+        for (uint64_t done = 0; done < length && err == 0;) {
+            uint64_t count = MIN(length - done, BMAP_PIECE_SIZE);
+
+            const uint8_t *data = image != NULL ? image->data + offset + done : buffer;
+            if (image == NULL && io_transfer(true, offset + done, buffer, count, &fi) < 0) {
+                err = fail_errnum(session, fi.err, "Unable to read flash file");
+                break;
+            }
+
+            sha256_update(&sha256, data, count);
+            if (range->has_sha256 && done + count == length) {
+                uint8_t digest[SHA256_DIGEST_SIZE];
+                sha256_final(&sha256, digest);
+                if (memcmp(digest, range->sha256, SHA256_DIGEST_SIZE) != 0) {
+                    err = fail(session, 1, "Image blocks %" PRIu64 "-%" PRIu64 " do not match the bmap checksum", range->first, range->last);
+                    break;
+                }
+            }
+
+            uint8_t retval;
+            err = write_aligned(session, step->part, step->address + offset + done, count, data, &retval, bmap_progress_handler, &info);
+            if (err < 0) {
+                err = fail_libusb(session, err, "Unable to perform flash operation");
+            } else if (retval != MTK_DA_CONT_CHAR) {
+                err = fail(session, 2, "DA did not return continuation character: 0x%02" PRIx8, retval);
+            }
+            done += count;
+            info.done += count;
+        }
+    }
+
+    free(buffer);
+    return err;
+}
+
+// Writes back each run of sectors that differ between patched and original.
+static int write_changed_sectors(struct session *session, const struct plan_step *step, uint64_t start, const uint8_t *patched, const uint8_t *original,
+    uint64_t length) {
+    size_t sectors = 0;
+    size_t writes = 0;
+
+    for (uint64_t offset = 0; offset < length;) {
+        if (memcmp(patched + offset, original + offset, PATCH_SECTOR_SIZE) == 0) {
+            offset += PATCH_SECTOR_SIZE;
+            continue;
+        }
+
+        uint64_t end = offset + PATCH_SECTOR_SIZE;
+        while (end < length && memcmp(patched + end, original + end, PATCH_SECTOR_SIZE) != 0) {
+            end += PATCH_SECTOR_SIZE;
+        }
+
+        uint8_t retval;
+        int err = mtk_da_sdmmc_write_data_from(
+            &session->device, MTK_DA_STORAGE_SDMMC, step->part, start + offset, end - offset, patched + offset, NULL, 0, &retval, NULL, NULL);
+        if (err < 0) {
+            return fail_libusb(session, err, "Unable to write patched sectors");
+        }
+        if (retval != MTK_DA_CONT_CHAR) {
+            return fail(session, 2, "DA did not return continuation character: 0x%02" PRIx8, retval);
+        }
+
+        sectors += (end - offset) / PATCH_SECTOR_SIZE;
+        writes++;
+        offset = end;
+    }
+
+    if (sectors == 0) {
+        session_printf(session, "Patched:  already applied, nothing written\n");
+    } else {
+        session_printf(session, "Patched:  %zu of %" PRIu64 " sectors rewritten in %zu writes\n", sectors, length / PATCH_SECTOR_SIZE, writes);
+    }
+    return 0;
+}
+
+// Reads the sector-aligned span of a patch step, applies its edits and writes back only the sectors they changed.
+static int patch(struct session *session, const struct plan_step *step) {
+    uint64_t start = step->address / PATCH_SECTOR_SIZE * PATCH_SECTOR_SIZE;
+    uint64_t end = (step->address + step->length + PATCH_SECTOR_SIZE - 1) / PATCH_SECTOR_SIZE * PATCH_SECTOR_SIZE;
+    uint64_t length = end - start;
+
+    uint8_t *patched = malloc(length);
+    uint8_t *original = malloc(length);
+    if (patched == NULL || original == NULL) {
+        free(patched);
+        free(original);
+        return fail_errnum(session, ENOMEM, "Unable to patch");
+    }
+
+    uint8_t retval;
+    int err = mtk_da_read_into(&session->device, MTK_DA_STORAGE_SDMMC, start, length, patched, &retval, NULL, NULL);
+    if (err < 0) {
+        err = fail_libusb(session, err, "Unable to read sectors to patch");
+    } else if (retval != MTK_DA_ACK) {
+        err = fail_da_ack(session, retval);
+    } else {
+        memcpy(original, patched, length);
+        patch_apply(step, start, patched);
+        err = write_changed_sectors(session, step, start, patched, original, length);
+    }
+
+    free(patched);
+    free(original);
+    return err;
+}
+
+static int read_into_store(struct session *session, struct store_dump_info *info) {
+    const struct plan_step *step = info->step;
+
+    uint8_t retval;
+    int err = mtk_da_read(&session->device, MTK_DA_STORAGE_SDMMC, step->address, step->length, &retval, store_dump_handler, info);
+    if (info->err != 0) {
+        return fail_errnum(session, info->err, "Unable to write to chunk store");
+    }
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to perform dump operation");
+    }
+    if (retval != MTK_DA_ACK) {
+        return fail_da_ack(session, retval);
+    }
+
+    for (size_t i = 0; i < step->operations_count; i++) {
+        struct store_stats stats;
+        if ((err = store_writer_finish(info->writers[i], step->operations[i]->fd, &stats)) < 0) {
+            return fail_errnum(session, -err, "Unable to write store recipe");
+        }
+        session_printf(session, "Store:    %" PRIu64 " chunks, %" PRIu64 " new, %.1f of %.1f MiB written\n", stats.chunks, stats.new_chunks,
+            stats.new_bytes / 1048576.0, stats.bytes / 1048576.0);
+    }
+
+    return 0;
+}
+
+// Dumps every operation of the step into its own range of the container.
+static int dump_to_container(struct session *session, const struct plan_step *step) {
+    struct container_dump_info info = {
+        .step = step,
+        .container = session->container,
+        .err = 0,
+    };
+
+    int err = container_begin(session->container, step, &info.first);
+    if (err == -ENAMETOOLONG) {
+        return fail(session, 1, "Range name too long for the container index (at most %d bytes)", CONTAINER_NAME_MAX - 1);
+    }
+    if (err < 0) {
+        return fail(session, 1, "Too many ranges for one container (at most %d)", CONTAINER_MAX_RANGES);
+    }
+
+    uint8_t retval;
+    err = mtk_da_read(&session->device, MTK_DA_STORAGE_SDMMC, step->address, step->length, &retval, container_dump_handler, &info);
+    if (info.err != 0) {
+        return fail_errnum(session, info.err, "Unable to write container");
+    }
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to perform dump operation");
+    }
+    if (retval != MTK_DA_ACK) {
+        return fail_da_ack(session, retval);
+    }
+
+    if ((err = container_commit(session->container, info.first, step->operations_count)) < 0) {
+        return fail_errnum(session, -err, "Unable to write container index");
+    }
+    return 0;
+}
+
+// Splits a dump into the chunk store, leaving one recipe per operation in its dump file.
+static int dump_to_store(struct session *session, const struct plan_step *step) {
+    struct store_dump_info info = {
+        .step = step,
+        .err = 0,
+    };
+
+    int err = 0;
+    for (size_t i = 0; i < step->operations_count && err == 0; i++) {
+        err = store_writer_open(&info.writers[i], session->arguments->store_dir, step->operations[i]->length);
+    }
+
+    if (err < 0) {
+        err = fail_errnum(session, -err, "Unable to open chunk store");
+    } else {
+        err = read_into_store(session, &info);
+    }
+
+    for (size_t i = 0; i < step->operations_count; i++) {
+        store_writer_close(info.writers[i]);
+    }
+    return err;
+}
+
+struct sparse_dump_info {
+    struct plan_dump_info dump;
+    uint64_t offset;
+};
+
+// Shifts chunks of one extent to their place in the step.
+static int sparse_dump_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void)total_length;
+    struct sparse_dump_info *info = user_data;
+    return plan_dump_handler(flashing, info->offset + offset, info->dump.step->length, buffer, count, &info->dump);
+}
+
+// Dumps only the allocated blocks of an ext2/3/4 filesystem into a sparse file. Sets *done to false, leaving the full
+// dump to the caller, when the range holds no filesystem that can be mapped.
+static int dump_allocated(struct session *session, const struct plan_step *step, bool *done) {
+    mtk_device *device = &session->device;
+    const struct operation *operation = step->operations[0];
+
+    *done = false;
+
+    struct ext4_map map;
+    const char *unsupported;
+    int err = ext4_map_load(device, step->address, step->length, &map, &unsupported);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to read filesystem metadata");
+    }
+    if (unsupported != NULL) {
+        session_printf(session, "Sparse:   %s, dumping the whole range\n", unsupported);
+        return 0;
+    }
+
+    session_printf(session, "Sparse:   %" PRIu64 " groups of %" PRIu32 "-byte blocks, %.1f of %.1f MiB in %zu extents\n", map.groups,
+        map.block_size, map.allocated / 1048576.0, step->length / 1048576.0, map.count);
+
+    if ((err = io_set_size(operation->fd, operation->length)) < 0) {
+        ext4_map_free(&map);
+        return fail_errnum(session, -err, "Unable to size dump file");
+    }
+
+    struct sparse_dump_info info = {
+        .dump = {
+            .step = step,
+            .err = 0,
+        },
+    };
+
+    uint8_t retval = MTK_DA_ACK;
+    for (size_t i = 0; i < map.count && err == 0 && retval == MTK_DA_ACK && info.dump.err == 0; i++) {
+        info.offset = map.extents[i].offset;
+        err = mtk_da_read(device, MTK_DA_STORAGE_SDMMC, step->address + map.extents[i].offset, map.extents[i].length, &retval, sparse_dump_handler,
+            &info);
+    }
+    ext4_map_free(&map);
+
+    if (info.dump.err != 0) {
+        return fail_errnum(session, info.dump.err, "Unable to write dump file");
+    }
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to perform dump operation");
+    }
+    if (retval != MTK_DA_ACK) {
+        return fail_da_ack(session, retval);
+    }
+
+    *done = true;
+    return 0;
+}
+
+static int handle_state_da_stage2(struct session *session) {
+    mtk_device *device = &session->device;
+    const struct arguments *arguments = session->arguments;
+    struct plan *plan = &session->plan;
+
+    int err;
+    uint8_t retval;
+
+    size_t count = session->operations_count;
+
+    verboseLog("%s\n", __FUNCTION__);
+
+    uint8_t usb_status;
+    err = mtk_da_usb_check_status(device, &usb_status, &retval);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to check USB status");
+    }
+    if (retval != MTK_DA_ACK) {
+        return fail_da_ack(session, retval);
+    }
+    if (usb_status != 1) {
+        return fail(session, 2, "DA did not return valid USB status: %02" PRIx8, usb_status);
+    }
+
+    // the partition the DA is switched to; 0 until the first switch
+    uint8_t current_part = 0;
+
+    if ((err = resolve_partitions(session, &current_part)) < 0) {
+        return err;
+    }
+
+    plan_build(session->operations, count, current_part, plan);
+    verboseLog("Plan: %zu operations in %zu steps, %zu partition switches\n", count, plan->count, plan->switches);
+
+    session_printf(session, "\n");
+    for (size_t i = 0; i < plan->count; i++) {
+        const struct plan_step *step = &plan->steps[i];
+        MTK_TRACE_SCOPE_RANGE(step->key == 'D' ? "dump" : step->key == 'E' ? "erase" : step->key == 'P' ? "patch" : "flash", step->address, step->length);
+
+        for (size_t j = 0; j < step->operations_count; j++) {
+            const struct operation *operation = step->operations[j];
+            if (operation->name[0] != '\0') {
+                session_printf(session, "Partition: %s\n", operation->name);
+            }
+            session_printf(session, "Address:  0x%016" PRIx64 "\n", operation->address);
+            session_printf(session, "Length:   0x%016" PRIx64 "\n", operation->length);
+        }
+        if (step->operations_count > 1) {
+            session_printf(session, "Merged:   0x%016" PRIx64 " + 0x%" PRIx64 "\n", step->address, step->length);
+        }
+
+        // GPT entries and scatter files can disagree with the card; stop before the DA refuses midway
+        if (session->emmc_known && step->part >= MTK_DA_EMMC_PART_BOOT1 && step->part <= MTK_DA_EMMC_PART_USER) {
+            uint64_t size = session->emmc.area_sizes[step->part - 1];
+            if (size > 0 && (step->address > size || step->length > size - step->address)) {
+                return fail(session, 1, "Range 0x%016" PRIx64 " + 0x%" PRIx64 " is beyond the end of the eMMC area (0x%" PRIx64 " bytes)", step->address,
+                    step->length, size);
+            }
+        }
+
+        if (step->part != current_part) {
+            verboseLog("switchpart\n");
+            err = mtk_da_sdmmc_switch_part(device, step->part, &retval);
+            if (err < 0) {
+                return fail_libusb(session, err, "Unable to switch EMMC partition");
+            }
+            if (retval != MTK_DA_ACK) {
+                return fail_da_ack(session, retval);
+            }
+            current_part = step->part;
+        }
+
+        verboseLog("operation\n");
+        switch (step->key) {
+        case 'D': {
+            if (arguments->store_dir != NULL || session->container != NULL) {
+                if ((err = session->container != NULL ? dump_to_container(session, step) : dump_to_store(session, step)) < 0) {
+                    return err;
+                }
+                break;
+            }
+
+            // like --mmap, only a step of one dump file; a merged step may span several filesystems
+            if (arguments->sparse_dump && step->operations_count == 1) {
+                bool done;
+                if ((err = dump_allocated(session, step, &done)) < 0) {
+                    return err;
+                }
+                if (done) {
+                    break;
+                }
+            }
+
+            struct plan_dump_info info = {
+                .step = step,
+                .err = 0,
+            };
+
+            // merged steps span several files and take the copying path
+            uint8_t *map = NULL;
+            if (arguments->mmap_dump && step->operations_count == 1) {
+                int map_err = io_map_output(step->operations[0]->fd, step->length, &map);
+                if (map_err < 0 && map_err != -ENOSYS) {
+                    return fail_errnum(session, -map_err, "Unable to map dump file");
+                }
+            }
+
+            if (map != NULL) {
+                err = mtk_da_read_into(device, MTK_DA_STORAGE_SDMMC, step->address, step->length, map, &retval, progress_handler, NULL);
+                int unmap_err = io_unmap_output(map, step->length);
+                if (unmap_err < 0) {
+                    info.err = -unmap_err;
+                }
+            } else {
+                err = mtk_da_read(device, MTK_DA_STORAGE_SDMMC, step->address, step->length, &retval, plan_dump_handler, &info);
+            }
+            if (info.err != 0) {
+                return fail_errnum(session, info.err, "Unable to write dump file");
+            }
+            if (err < 0) {
+                return fail_libusb(session, err, "Unable to perform dump operation");
+            }
+            if (retval != MTK_DA_ACK) {
+                return fail_da_ack(session, retval);
+            }
+            break;
+        }
+
+        case 'F': {
+            const struct operation *operation = step->operations[0];
+            if (operation->from_package) {
+                if ((err = flash_from_package(session, step, operation)) < 0) {
+                    return err;
+                }
+                break;
+            }
+
+            const struct mapped_file *image = session->images != NULL ? &session->images[operation - session->operations] : NULL;
+            if (operation->delta) {
+                if ((err = flash_delta(session, step, operation, image)) < 0) {
+                    return err;
+                }
+                break;
+            }
+            if (operation->bmap != NULL) {
+                if ((err = flash_bmap(session, step, operation, image)) < 0) {
+                    return err;
+                }
+                break;
+            }
+
+            struct file_info fi;
+            struct mem_info mi;
+            struct store_reader *reader = NULL;
+            mtk_io_handler handler;
+            void *user_data;
+            struct mapped_file local = { 0 };
+            if (operation->from_container) {
+                if ((err = container_source(session, operation, image, &local, &mi)) < 0) {
+                    return err;
+                }
+                handler = mem_handler;
+                user_data = &mi;
+            } else if (operation->recipe) {
+                int store_err = store_reader_open(&reader, arguments->store_dir, operation->fd);
+                if (store_err < 0) {
+                    return fail_errnum(session, -store_err, "Unable to load store recipe");
+                }
+                handler = store_restore_handler;
+                user_data = reader;
+            } else if (select_source(image, operation->fd, 0, step->length, &fi, &mi, &handler, &user_data) < 0) {
+                return fail(session, 1, "Flash file is shorter than the operation");
+            }
+
+            err = write_aligned(session, step->part, step->address, step->length, NULL, &retval, handler, user_data);
+            unmap_file(&local);
+            if (reader != NULL) {
+                int store_err = store_reader_error(reader);
+                store_reader_close(reader);
+                if (store_err != 0) {
+                    return fail_errnum(session, store_err, "Unable to restore from chunk store");
+                }
+            }
+            if (handler == io_handler && fi.err != 0) {
+                return fail_errnum(session, fi.err, "Unable to read flash file");
+            }
+            if (err < 0) {
+                return fail_libusb(session, err, "Unable to perform flash operation");
+            }
+            if (retval != MTK_DA_CONT_CHAR) {
+                return fail(session, 2, "DA did not return continuation character: 0x%02" PRIx8, retval);
+            }
+            break;
+        }
+
+        case 'E':
+            if ((err = erase(session, step, step->operations[0])) < 0) {
+                return err;
+            }
+            break;
+
+        case 'P':
+            if ((err = patch(session, step)) < 0) {
+                return err;
+            }
+            break;
+        }
+
+        session_printf(session, "\n");
+    }
+
+    const mtk_device_stats *stats = &device->stats;
+    verboseLog("Transferred %" PRIu64 " bytes in, %" PRIu64 " bytes out\n", stats->bytes_read, stats->bytes_written);
+    if (stats->retries > 0) {
+        session_printf(session, "Retries:  %" PRIu32 " (%" PRIu32 " timeouts, %" PRIu32 " checksum errors)\n", stats->retries, stats->timeouts, stats->checksum_errors);
+    }
+    print_write_throughput(session);
+
+    if (arguments->daemon_socket != NULL) {
+        err = daemon_run(device, arguments->daemon_socket);
+        if (err < 0) {
+            return fail_libusb(session, err, "Daemon stopped");
+        }
+    }
+
+    if (arguments->reboot) {
+        session_printf(session, "Enabling WDT to reboot device...\n");
+        err = mtk_da_enable_watchdog(device, 0, false, false, false, true, &retval);
+        if (err < 0) {
+            return fail_libusb(session, err, "Unable to enable WDT");
+        }
+        if (retval != MTK_DA_ACK) {
+            return fail_da_ack(session, retval);
+        }
+    }
+
+    return 0;
+}
+
+static int resolve_partitions(struct session *session, uint8_t *current_part) {
+    struct operation *operations = session->operations;
+    size_t count = session->operations_count;
+
+    bool needed = false;
+    for (size_t i = 0; i < count; i++) {
+        needed |= operations[i].by_name;
+    }
+    if (!needed) {
+        return 0;
+    }
+
+    MTK_TRACE_SCOPE("gpt_load");
+
+    int err;
+    uint8_t retval;
+    err = mtk_da_sdmmc_switch_part(&session->device, MTK_DA_EMMC_PART_USER, &retval);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to switch partition to EMMC_USER");
+    }
+    if (retval != MTK_DA_ACK) {
+        return fail_da_ack(session, retval);
+    }
+    *current_part = MTK_DA_EMMC_PART_USER;
+
+    bool from_cache;
+    err = gpt_load(&session->device, session->emmc_id, &session->gpt, &from_cache);
+    if (err < 0) {
+        return fail_libusb(session, err, "Unable to read GPT");
+    }
+    session_printf(session, "GPT:      %zu partitions (%s)\n", session->gpt.count, from_cache ? "cached" : "read from device");
+
+    for (size_t i = 0; i < count; i++) {
+        struct operation *operation = &operations[i];
+        if (!operation->by_name) {
+            continue;
+        }
+
+        const struct gpt_partition *partition = gpt_find(&session->gpt, operation->name);
+        if (partition == NULL) {
+            return fail(session, 1, "Partition not found in GPT: %s", operation->name);
+        }
+
+        // named operations start at the partition, except patches, which are at an offset inside it
+        uint64_t length = gpt_partition_length(partition);
+        if (operation->length == 0) {
+            operation->length = length;
+        }
+        if (operation->address > length || operation->length > length - operation->address) {
+            return fail(session, 1, "Operation on %s is larger than the partition (0x%" PRIx64 " > 0x%" PRIx64 ")", operation->name,
+                operation->address + operation->length, length);
+        }
+
+        operation->address += gpt_partition_address(partition);
+        operation->by_name = false;
+    }
+
+    return 0;
+}
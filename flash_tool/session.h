@@ -0,0 +1,74 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "args.h"
+#include "container.h"
+#include "gpt.h"
+#include "package.h"
+#include "plan.h"
+#include "util.h"
+
+#include "mtk_da.h"
+#include "mtk_device.h"
+#include "mtk_emulator.h"
+
+#define SESSION_LABEL_MAX (32)
+#define SESSION_ERROR_MAX (256)
+
+/*
+ * Everything needed to take one device from its starting state through the
+ * operations. Failures are returned instead of exiting, so one device can fail
+ * while the others carry on.
+ */
+struct session {
+    const struct arguments *arguments;
+    const mtk_da_info *info;
+
+    // when set, DA and flash data come from these shared mappings instead of the argument fds
+    const struct mapped_file *download_agent;
+    const struct mapped_file *images;
+    // set with --package; download_agent then points at the package DA
+    const struct package *package;
+
+    mtk_device device;
+    // set when the device is emulated; closed by the owner after session_run
+    mtk_emulator *emulator;
+    // set while the session dumps into --container
+    struct container *container;
+    // "<bus>-<port path>", empty for the single device session
+    char label[SESSION_LABEL_MAX];
+
+    uint32_t emmc_id[4];
+    // from the DA flash info report, when this session booted DA Stage 2
+    mtk_da_emmc_info emmc;
+    bool emmc_known;
+    // WRITE_DATA commands by whether they started on a --align boundary, for the throughput report
+    uint64_t aligned_bytes;
+    uint64_t aligned_us;
+    uint64_t unaligned_bytes;
+    uint64_t unaligned_us;
+    // the DA refused FORMAT once; later erases are written from the host
+    bool no_format;
+    struct operation operations[MAX_OPERATIONS];
+    size_t operations_count;
+    struct plan plan;
+    struct gpt gpt;
+
+    int status;
+    char error[SESSION_ERROR_MAX];
+};
+
+void session_init(struct session *session, const struct arguments *arguments, const mtk_da_info *info);
+
+// Connects session->device to a new emulated device configured by the --emulate arguments.
+int session_attach_emulator(struct session *session);
+
+int session_run(struct session *session);
+
+void session_printf(const struct session *session, const char *format, ...);
+
+#endif /* SESSION_H */
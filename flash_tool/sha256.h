@@ -0,0 +1,26 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE (32)
+#define SHA256_BLOCK_SIZE (64)
+// lowercase hex digest plus terminator
+#define SHA256_HEX_SIZE (SHA256_DIGEST_SIZE * 2 + 1)
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[SHA256_BLOCK_SIZE];
+    size_t used;
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t length);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void sha256(const void *data, size_t length, uint8_t digest[SHA256_DIGEST_SIZE]);
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE]);
+
+#endif /* SHA256_H */
@@ -0,0 +1,749 @@
+#include "store.h"
+#include "progress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// normalized chunking: cut points are harder to hit before the average size and easier after it
+#define STORE_MASK_SMALL (~0ULL << (64 - 18))
+#define STORE_MASK_LARGE (~0ULL << (64 - 14))
+
+// chunks waiting for a worker, per writer
+#define STORE_QUEUE_SIZE (2 * STORE_MAX_WORKERS)
+
+#define STORE_PATH_MAX (4096)
+
+struct recipe_entry {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint32_t length;
+};
+
+struct job {
+    uint8_t *data;
+    size_t length;
+    size_t index;
+};
+
+struct store_writer {
+    char dir[STORE_PATH_MAX];
+    uint64_t length;
+    uint64_t position;
+
+    // chunk being cut and the rolling hash over it
+    uint8_t *pending;
+    size_t pending_length;
+    uint64_t hash;
+
+    // every chunk but the last is at least STORE_CHUNK_MIN long, so the recipe never outgrows this
+    struct recipe_entry *entries;
+    size_t entries_capacity;
+    size_t count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queue_not_empty;
+    pthread_cond_t queue_not_full;
+    pthread_cond_t idle;
+    struct job queue[STORE_QUEUE_SIZE];
+    size_t queue_head;
+    size_t queued;
+    size_t active;
+    bool stopping;
+
+    pthread_t workers[STORE_MAX_WORKERS];
+    size_t workers_count;
+
+    // digests already handled by this writer, so repeated chunks (erased areas) are looked up once
+    uint8_t (*seen)[SHA256_DIGEST_SIZE];
+    size_t seen_capacity;
+    size_t seen_count;
+
+    unsigned int temp_counter;
+    struct store_stats stats;
+    int err;
+};
+
+struct store_reader {
+    char dir[STORE_PATH_MAX];
+    uint64_t length;
+    struct recipe_entry *entries;
+    // start of each chunk in the stream, plus the stream length
+    uint64_t *offsets;
+    size_t count;
+
+    uint8_t *chunk;
+    size_t current;
+    int err;
+};
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Fixed seed: recipes and chunk boundaries must be the same for every build.
+static void gear_init(void) {
+    uint64_t x = 0x6d746b73746f7265;
+    for (size_t i = 0; i < 256; i++) {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static void put_le(uint8_t *data, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t get_le(const uint8_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = size; i > 0; i--) {
+        value = value << 8 | data[i - 1];
+    }
+    return value;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t count) {
+    while (count > 0) {
+        ssize_t n = write(fd, data, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        data += n;
+        count -= n;
+    }
+    return 0;
+}
+
+// Returns 0 at end of file before count bytes.
+static ssize_t read_all(int fd, uint8_t *data, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = read(fd, data + done, count - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// The open functions check that the store directory leaves room for this, so it only fails on a broken invariant.
+static int chunk_path(const char *dir, const uint8_t *digest, char *path, size_t size) {
+    char hex[SHA256_HEX_SIZE];
+    sha256_hex(digest, hex);
+    int n = snprintf(path, size, "%s/chunks/%.2s/%s", dir, hex, hex);
+    return n >= 0 && (size_t)n < size ? 0 : -ENAMETOOLONG;
+}
+
+static int make_dir(const char *path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+// Returns true when the digest was not seen before; the writer lock is held.
+static bool seen_insert(struct store_writer *writer, const uint8_t *digest) {
+    if ((writer->seen_count + 1) * 2 > writer->seen_capacity) {
+        size_t capacity = writer->seen_capacity * 2;
+        uint8_t(*seen)[SHA256_DIGEST_SIZE] = calloc(capacity, SHA256_DIGEST_SIZE);
+        if (seen != NULL) {
+            static const uint8_t empty[SHA256_DIGEST_SIZE];
+            for (size_t i = 0; i < writer->seen_capacity; i++) {
+                if (memcmp(writer->seen[i], empty, SHA256_DIGEST_SIZE) == 0) {
+                    continue;
+                }
+                size_t j = get_le(writer->seen[i], 8) & (capacity - 1);
+                while (memcmp(seen[j], empty, SHA256_DIGEST_SIZE) != 0) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                memcpy(seen[j], writer->seen[i], SHA256_DIGEST_SIZE);
+            }
+            free(writer->seen);
+            writer->seen = seen;
+            writer->seen_capacity = capacity;
+        } else if (writer->seen_count + 1 == writer->seen_capacity) {
+            // out of memory: the store lookup still deduplicates, only slower
+            return true;
+        }
+    }
+
+    static const uint8_t empty[SHA256_DIGEST_SIZE];
+    size_t i = get_le(digest, 8) & (writer->seen_capacity - 1);
+    while (memcmp(writer->seen[i], empty, SHA256_DIGEST_SIZE) != 0) {
+        if (memcmp(writer->seen[i], digest, SHA256_DIGEST_SIZE) == 0) {
+            return false;
+        }
+        i = (i + 1) & (writer->seen_capacity - 1);
+    }
+
+    memcpy(writer->seen[i], digest, SHA256_DIGEST_SIZE);
+    writer->seen_count++;
+    return true;
+}
+
+// Writes the chunk unless the store has it; a temporary name and a rename keep concurrent writers from seeing partial chunks.
+static int store_chunk(struct store_writer *writer, const uint8_t *digest, const uint8_t *data, size_t length, bool *written) {
+    *written = false;
+
+    int err;
+    char path[STORE_PATH_MAX];
+    if ((err = chunk_path(writer->dir, digest, path, sizeof(path))) < 0) {
+        return err;
+    }
+
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+
+    char subdir[STORE_PATH_MAX];
+    snprintf(subdir, sizeof(subdir), "%.*s", (int)(strrchr(path, '/') - path), path);
+    if ((err = make_dir(subdir)) < 0) {
+        return err;
+    }
+
+    char temp[STORE_PATH_MAX + 32];
+    snprintf(temp, sizeof(temp), "%s.tmp.%ld.%u", path, (long)getpid(), __atomic_fetch_add(&writer->temp_counter, 1, __ATOMIC_RELAXED));
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0444);
+    if (fd < 0) {
+        return -errno;
+    }
+    err = write_all(fd, data, length);
+    if (close(fd) < 0 && err == 0) {
+        err = -errno;
+    }
+    if (err == 0 && rename(temp, path) < 0) {
+        // another writer got there first
+        err = access(path, F_OK) == 0 ? 0 : -errno;
+        remove(temp);
+        return err;
+    }
+    if (err < 0) {
+        remove(temp);
+        return err;
+    }
+
+    *written = true;
+    return 0;
+}
+
+static void *worker_run(void *arg) {
+    struct store_writer *writer = arg;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queued == 0 && !writer->stopping) {
+            pthread_cond_wait(&writer->queue_not_empty, &writer->lock);
+        }
+        if (writer->queued == 0) {
+            break;
+        }
+
+        struct job job = writer->queue[writer->queue_head];
+        writer->queue_head = (writer->queue_head + 1) % STORE_QUEUE_SIZE;
+        writer->queued--;
+        writer->active++;
+        pthread_cond_signal(&writer->queue_not_full);
+        pthread_mutex_unlock(&writer->lock);
+
+        struct recipe_entry *entry = &writer->entries[job.index];
+        sha256(job.data, job.length, entry->digest);
+        entry->length = job.length;
+
+        pthread_mutex_lock(&writer->lock);
+        bool fresh = seen_insert(writer, entry->digest);
+        pthread_mutex_unlock(&writer->lock);
+
+        bool written = false;
+        int err = fresh ? store_chunk(writer, entry->digest, job.data, job.length, &written) : 0;
+        free(job.data);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->stats.chunks++;
+        writer->stats.bytes += job.length;
+        if (written) {
+            writer->stats.new_chunks++;
+            writer->stats.new_bytes += job.length;
+        }
+        if (err < 0 && writer->err == 0) {
+            writer->err = -err;
+            // the producer may be waiting for room that will not be made
+            pthread_cond_broadcast(&writer->queue_not_full);
+        }
+        writer->active--;
+        if (writer->queued == 0 && writer->active == 0) {
+            pthread_cond_broadcast(&writer->idle);
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+static int workers_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > STORE_MAX_WORKERS) {
+        return STORE_MAX_WORKERS;
+    }
+    return cpus > 0 ? cpus : 1;
+#else
+    return STORE_MAX_WORKERS / 2;
+#endif
+}
+
+int store_writer_open(struct store_writer **writer, const char *dir, uint64_t length) {
+    pthread_once(&gear_once, gear_init);
+
+    if (strlen(dir) + sizeof("/chunks/xx/") + SHA256_HEX_SIZE + 32 > STORE_PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+
+    int err;
+    char path[STORE_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/chunks", dir);
+    if ((err = make_dir(dir)) < 0 || (err = make_dir(path)) < 0) {
+        return err;
+    }
+
+    struct store_writer *w = calloc(1, sizeof(struct store_writer));
+    if (w == NULL) {
+        return -ENOMEM;
+    }
+
+    snprintf(w->dir, sizeof(w->dir), "%s", dir);
+    w->length = length;
+    w->entries_capacity = length / STORE_CHUNK_MIN + 1;
+    w->entries = calloc(w->entries_capacity, sizeof(struct recipe_entry));
+    w->pending = malloc(STORE_CHUNK_MAX);
+    w->seen_capacity = 1024;
+    w->seen = calloc(w->seen_capacity, SHA256_DIGEST_SIZE);
+    if (w->entries == NULL || w->pending == NULL || w->seen == NULL) {
+        free(w->entries);
+        free(w->pending);
+        free(w->seen);
+        free(w);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->queue_not_empty, NULL);
+    pthread_cond_init(&w->queue_not_full, NULL);
+    pthread_cond_init(&w->idle, NULL);
+
+    int count = workers_count();
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&w->workers[w->workers_count], NULL, worker_run, w) != 0) {
+            break;
+        }
+        w->workers_count++;
+    }
+    if (w->workers_count == 0) {
+        store_writer_close(w);
+        return -EAGAIN;
+    }
+
+    *writer = w;
+    return 0;
+}
+
+void store_writer_close(struct store_writer *writer) {
+    if (writer == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_broadcast(&writer->queue_not_empty);
+    pthread_mutex_unlock(&writer->lock);
+    for (size_t i = 0; i < writer->workers_count; i++) {
+        pthread_join(writer->workers[i], NULL);
+    }
+
+    for (size_t i = 0; i < writer->queued; i++) {
+        free(writer->queue[(writer->queue_head + i) % STORE_QUEUE_SIZE].data);
+    }
+
+    pthread_cond_destroy(&writer->idle);
+    pthread_cond_destroy(&writer->queue_not_full);
+    pthread_cond_destroy(&writer->queue_not_empty);
+    pthread_mutex_destroy(&writer->lock);
+
+    free(writer->seen);
+    free(writer->pending);
+    free(writer->entries);
+    free(writer);
+}
+
+// Hands the pending chunk to the workers; blocks while the queue is full.
+static int emit_chunk(struct store_writer *writer) {
+    uint8_t *next = malloc(STORE_CHUNK_MAX);
+    if (next == NULL) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued == STORE_QUEUE_SIZE && writer->err == 0) {
+        pthread_cond_wait(&writer->queue_not_full, &writer->lock);
+    }
+    int err = writer->err;
+    if (err == 0) {
+        struct job *job = &writer->queue[(writer->queue_head + writer->queued) % STORE_QUEUE_SIZE];
+        job->data = writer->pending;
+        job->length = writer->pending_length;
+        job->index = writer->count++;
+        writer->queued++;
+        pthread_cond_signal(&writer->queue_not_empty);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    if (err != 0) {
+        free(next);
+        return -err;
+    }
+
+    writer->pending = next;
+    writer->pending_length = 0;
+    writer->hash = 0;
+    return 0;
+}
+
+// Returns how many bytes belong to the pending chunk, and whether it ends there.
+static size_t find_cut(struct store_writer *writer, const uint8_t *data, size_t count, bool *cut) {
+    size_t length = writer->pending_length;
+    size_t limit = STORE_CHUNK_MAX - length < count ? STORE_CHUNK_MAX - length : count;
+    uint64_t hash = writer->hash;
+
+    // nothing is cut before the minimum size, so there is nothing to hash there either
+    size_t i = length < STORE_CHUNK_MIN ? STORE_CHUNK_MIN - length : 0;
+    if (i > limit) {
+        i = limit;
+    }
+
+    *cut = false;
+    for (; i < limit; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        uint64_t mask = length + i + 1 < STORE_CHUNK_AVG ? STORE_MASK_SMALL : STORE_MASK_LARGE;
+        if ((hash & mask) == 0) {
+            *cut = true;
+            i++;
+            break;
+        }
+    }
+
+    writer->hash = hash;
+    if (length + i == STORE_CHUNK_MAX) {
+        *cut = true;
+    }
+    return i;
+}
+
+int store_writer_add(struct store_writer *writer, uint64_t offset, const uint8_t *data, size_t count) {
+    if (offset > writer->position || count > writer->length - offset) {
+        return -EINVAL;
+    }
+
+    // a resent packet
+    size_t skip = writer->position - offset < count ? writer->position - offset : count;
+    data += skip;
+    count -= skip;
+
+    while (count > 0) {
+        bool cut;
+        size_t n = find_cut(writer, data, count, &cut);
+
+        memcpy(writer->pending + writer->pending_length, data, n);
+        writer->pending_length += n;
+        writer->position += n;
+        data += n;
+        count -= n;
+
+        int err;
+        if (cut && (err = emit_chunk(writer)) < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+int store_writer_finish(struct store_writer *writer, int fd, struct store_stats *stats) {
+    int err;
+
+    if (writer->position != writer->length) {
+        return -EIO;
+    }
+    if (writer->pending_length > 0 && (err = emit_chunk(writer)) < 0) {
+        return err;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued > 0 || writer->active > 0) {
+        pthread_cond_wait(&writer->idle, &writer->lock);
+    }
+    err = writer->err;
+    pthread_mutex_unlock(&writer->lock);
+    if (err != 0) {
+        return -err;
+    }
+
+    size_t size = STORE_RECIPE_HEADER_SIZE + writer->count * STORE_RECIPE_ENTRY_SIZE;
+    uint8_t *recipe = malloc(size);
+    if (recipe == NULL) {
+        return -ENOMEM;
+    }
+
+    memcpy(recipe, STORE_RECIPE_MAGIC, 8);
+    put_le(recipe + 8, writer->length, 8);
+    put_le(recipe + 16, writer->count, 8);
+    for (size_t i = 0; i < writer->count; i++) {
+        uint8_t *entry = recipe + STORE_RECIPE_HEADER_SIZE + i * STORE_RECIPE_ENTRY_SIZE;
+        memcpy(entry, writer->entries[i].digest, SHA256_DIGEST_SIZE);
+        put_le(entry + SHA256_DIGEST_SIZE, writer->entries[i].length, 4);
+    }
+
+    err = write_all(fd, recipe, size);
+    free(recipe);
+    if (err < 0) {
+        return err;
+    }
+
+    *stats = writer->stats;
+    return 0;
+}
+
+int store_recipe_probe(int fd, uint64_t *length) {
+    uint8_t header[STORE_RECIPE_HEADER_SIZE];
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+    ssize_t n = read_all(fd, header, sizeof(header));
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+    if (n < 0) {
+        return n;
+    }
+
+    if ((size_t)n < sizeof(header) || memcmp(header, STORE_RECIPE_MAGIC, 8) != 0) {
+        return 0;
+    }
+
+    *length = get_le(header + 8, 8);
+    return 1;
+}
+
+int store_reader_open(struct store_reader **reader, const char *dir, int fd) {
+    uint8_t header[STORE_RECIPE_HEADER_SIZE];
+    ssize_t n;
+
+    if (strlen(dir) + sizeof("/chunks/xx/") + SHA256_HEX_SIZE > STORE_PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+    if ((n = read_all(fd, header, sizeof(header))) < 0) {
+        return n;
+    }
+    if ((size_t)n < sizeof(header) || memcmp(header, STORE_RECIPE_MAGIC, 8) != 0) {
+        return -EINVAL;
+    }
+
+    uint64_t length = get_le(header + 8, 8);
+    uint64_t count = get_le(header + 16, 8);
+    if (count > length / STORE_CHUNK_MIN + 1) {
+        return -EINVAL;
+    }
+
+    struct store_reader *r = calloc(1, sizeof(struct store_reader));
+    if (r == NULL) {
+        return -ENOMEM;
+    }
+    snprintf(r->dir, sizeof(r->dir), "%s", dir);
+    r->length = length;
+    r->count = count;
+    r->current = SIZE_MAX;
+    r->entries = calloc(count + 1, sizeof(struct recipe_entry));
+    r->offsets = calloc(count + 1, sizeof(uint64_t));
+    r->chunk = malloc(STORE_CHUNK_MAX + 1);
+    uint8_t *entries = malloc(count * STORE_RECIPE_ENTRY_SIZE + 1);
+
+    int err = 0;
+    if (r->entries == NULL || r->offsets == NULL || r->chunk == NULL || entries == NULL) {
+        err = -ENOMEM;
+    } else if ((n = read_all(fd, entries, count * STORE_RECIPE_ENTRY_SIZE)) < 0) {
+        err = n;
+    } else if ((size_t)n != count * STORE_RECIPE_ENTRY_SIZE) {
+        err = -EINVAL;
+    }
+
+    uint64_t offset = 0;
+    for (size_t i = 0; i < count && err == 0; i++) {
+        const uint8_t *entry = entries + i * STORE_RECIPE_ENTRY_SIZE;
+        memcpy(r->entries[i].digest, entry, SHA256_DIGEST_SIZE);
+        r->entries[i].length = get_le(entry + SHA256_DIGEST_SIZE, 4);
+        if (r->entries[i].length == 0 || r->entries[i].length > STORE_CHUNK_MAX) {
+            err = -EINVAL;
+        }
+        r->offsets[i] = offset;
+        offset += r->entries[i].length;
+    }
+    r->offsets[count] = offset;
+    free(entries);
+
+    if (err == 0 && offset != length) {
+        err = -EINVAL;
+    }
+    if (err < 0) {
+        store_reader_close(r);
+        return err;
+    }
+
+    *reader = r;
+    return 0;
+}
+
+void store_reader_close(struct store_reader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+
+    free(reader->chunk);
+    free(reader->offsets);
+    free(reader->entries);
+    free(reader);
+}
+
+int store_reader_error(const struct store_reader *reader) { return reader->err; }
+
+// Reads and verifies one chunk; a chunk with the wrong size or hash is reported as EIO.
+static int load_chunk(struct store_reader *reader, size_t index) {
+    const struct recipe_entry *entry = &reader->entries[index];
+
+    int err;
+    char path[STORE_PATH_MAX];
+    if ((err = chunk_path(reader->dir, entry->digest, path, sizeof(path))) < 0) {
+        return err;
+    }
+
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -errno;
+    }
+    ssize_t n = read_all(fd, reader->chunk, entry->length + 1);
+    close(fd);
+    if (n < 0) {
+        return n;
+    }
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(reader->chunk, n, digest);
+    if ((size_t)n != entry->length || memcmp(digest, entry->digest, SHA256_DIGEST_SIZE) != 0) {
+        return -EIO;
+    }
+
+    reader->current = index;
+    return 0;
+}
+
+int store_restore_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    struct store_reader *reader = user_data;
+    (void)flashing;
+
+    if (offset + count > reader->length) {
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+
+    size_t done = 0;
+    while (done < count) {
+        uint64_t position = offset + done;
+
+        if (reader->current == SIZE_MAX || position < reader->offsets[reader->current] || position >= reader->offsets[reader->current + 1]) {
+            size_t low = 0;
+            size_t high = reader->count;
+            while (high - low > 1) {
+                size_t middle = low + (high - low) / 2;
+                if (reader->offsets[middle] <= position) {
+                    low = middle;
+                } else {
+                    high = middle;
+                }
+            }
+
+            int err;
+            if ((err = load_chunk(reader, low)) < 0) {
+                reader->err = -err;
+                return LIBUSB_ERROR_IO;
+            }
+        }
+
+        size_t start = position - reader->offsets[reader->current];
+        size_t n = reader->entries[reader->current].length - start;
+        if (n > count - done) {
+            n = count - done;
+        }
+        memcpy(buffer + done, reader->chunk + start, n);
+        done += n;
+    }
+
+    progress_update("Flashing", offset + count, total_length);
+    return 0;
+}
+
+int store_dump_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    struct store_dump_info *info = user_data;
+    const struct plan_step *step = info->step;
+
+    uint64_t chunk_start = step->address + offset;
+    uint64_t chunk_end = chunk_start + count;
+
+    for (size_t i = 0; i < step->operations_count; i++) {
+        const struct operation *operation = step->operations[i];
+
+        uint64_t start = operation->address > chunk_start ? operation->address : chunk_start;
+        uint64_t end = operation->address + operation->length < chunk_end ? operation->address + operation->length : chunk_end;
+        if (start >= end) {
+            continue;
+        }
+
+        int err;
+        if ((err = store_writer_add(info->writers[i], start - operation->address, buffer + (start - chunk_start), end - start)) < 0) {
+            info->err = -err;
+            return LIBUSB_ERROR_IO;
+        }
+    }
+
+    progress_update(flashing ? "Flashing" : "Dumping", offset + count, total_length);
+    return 0;
+}
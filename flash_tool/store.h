@@ -0,0 +1,71 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "plan.h"
+#include "sha256.h"
+
+/*
+ * Content-defined deduplicating chunk store. A dump is cut into chunks where
+ * a rolling gear hash of the data hits a mask (FastCDC with normalized
+ * chunking), so identical partitions of different units produce identical
+ * chunks even when they sit at different offsets. Chunks are stored once,
+ * under DIR/chunks/<first byte>/<SHA-256>, and each dump only leaves a
+ * recipe: the list of chunk hashes and lengths that rebuild it.
+ */
+
+#define STORE_CHUNK_MIN (16 * 1024)
+#define STORE_CHUNK_AVG (64 * 1024)
+#define STORE_CHUNK_MAX (256 * 1024)
+
+// hashing and chunk writes run on this many threads at most
+#define STORE_MAX_WORKERS (8)
+
+#define STORE_RECIPE_MAGIC "MTKRCP01"
+// magic, stream length, chunk count
+#define STORE_RECIPE_HEADER_SIZE (24)
+// digest, chunk length
+#define STORE_RECIPE_ENTRY_SIZE (SHA256_DIGEST_SIZE + 4)
+
+struct store_stats {
+    uint64_t chunks;
+    uint64_t bytes;
+    // chunks that were not in the store yet, and were written
+    uint64_t new_chunks;
+    uint64_t new_bytes;
+};
+
+struct store_writer;
+struct store_reader;
+
+// All store functions return 0 or a negative errno.
+int store_writer_open(struct store_writer **writer, const char *dir, uint64_t length);
+// Data has to arrive in order; already consumed bytes of a resent packet are skipped.
+int store_writer_add(struct store_writer *writer, uint64_t offset, const uint8_t *data, size_t count);
+// Stores the last chunk, waits for all writes and writes the recipe to fd.
+int store_writer_finish(struct store_writer *writer, int fd, struct store_stats *stats);
+void store_writer_close(struct store_writer *writer);
+
+// Returns 1 and the stream length when the file is a recipe, 0 when it is not.
+int store_recipe_probe(int fd, uint64_t *length);
+
+int store_reader_open(struct store_reader **reader, const char *dir, int fd);
+void store_reader_close(struct store_reader *reader);
+// errno of the failure that made store_restore_handler abort
+int store_reader_error(const struct store_reader *reader);
+
+struct store_dump_info {
+    const struct plan_step *step;
+    struct store_writer *writers[MAX_OPERATIONS];
+    int err;
+};
+
+// Feeds each chunk of a (merged) read to the writers of the operations it overlaps.
+int store_dump_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+// Rebuilds the stream of a recipe; user_data is a store_reader.
+int store_restore_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+#endif /* STORE_H */
@@ -1,8 +1,9 @@
 #ifndef FT_UTIL_H
 #define FT_UTIL_H
 
-#include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 extern bool interactive;
 
@@ -18,4 +19,15 @@ void verboseLog(const char* format, ...);
 
 void errx(int status, const char *format, ...);
 
+uint32_t crc32(uint32_t crc, const void *data, size_t length);
+
+// Read-only view of a whole file, shared between device sessions
+struct mapped_file {
+    const uint8_t *data;
+    size_t size;
+};
+
+int map_file(int fd, struct mapped_file *map);
+void unmap_file(struct mapped_file *map);
+
 #endif /* FT_UTIL_H */
@@ -0,0 +1,88 @@
+#ifndef MTK_ASYNC_H
+#define MTK_ASYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libusb.h>
+
+#include "mtk_device.h"
+
+/*
+ * Non-blocking variants of the preloader and DA operations. Each operation
+ * is a state machine that submits one transfer at a time through the
+ * device's mtk_transport and is resumed from the transfer's completion, so
+ * any number of devices can be driven from one thread. For USB devices, add
+ * the libusb context's pollfds to the caller's poll or epoll set, call
+ * mtk_async_handle_events whenever one of them is ready or
+ * mtk_async_next_timeout expires, and get the result of every operation
+ * through its callback. Transports with their own event handling, such as
+ * the emulator, are driven with mtk_async_wait instead.
+ *
+ * Starting an operation on a busy device fails with LIBUSB_ERROR_BUSY. The
+ * callback runs from the event handling (or from the start call when the
+ * operation finishes without a transfer) and may start the next operation.
+ * Output pointers and buffers passed to an operation must stay valid until
+ * its callback. Failed reads and writes are not retried.
+ */
+
+// DA Stage 2 and DA Stage 1 upload chunks, as in the blocking versions
+#define MTK_ASYNC_SEND_DA_CHUNK (0x1000)
+#define MTK_ASYNC_PRELOADER_CHUNK (0x400)
+
+typedef struct mtk_async mtk_async;
+
+// err is 0 or a negative libusb error code
+typedef void (*mtk_async_callback)(mtk_async *async, int err, void *user_data);
+
+// Fails with LIBUSB_ERROR_NOT_SUPPORTED when the device's transport has no asynchronous transfers.
+int mtk_async_open(mtk_async **async, const mtk_device *device);
+// The device must be idle; see mtk_async_cancel.
+void mtk_async_close(mtk_async *async);
+
+bool mtk_async_busy(const mtk_async *async);
+// The callback of the current operation is called with LIBUSB_ERROR_INTERRUPTED once the cancellation completed.
+int mtk_async_cancel(mtk_async *async);
+
+void mtk_async_set_timing(mtk_async *async, const mtk_soc_timing *timing);
+const mtk_device_stats *mtk_async_stats(const mtk_async *async);
+
+// event loop integration; ctx is the context the device handles were opened on
+const struct libusb_pollfd **mtk_async_get_pollfds(libusb_context *ctx);
+// Returns 1 and sets tv when libusb needs a call to mtk_async_handle_events by then, 0 when it has no timeout pending.
+int mtk_async_next_timeout(libusb_context *ctx, struct timeval *tv);
+// Completes whatever transfers are ready without blocking.
+int mtk_async_handle_events(libusb_context *ctx);
+// Runs the event handling of the device's transport for up to timeout_ms; LIBUSB_ERROR_NOT_SUPPORTED for libusb.
+int mtk_async_wait(mtk_async *async, unsigned int timeout_ms);
+
+// raw transfers, e.g. for the DA reports
+int mtk_async_read(mtk_async *async, uint8_t *buffer, size_t size, mtk_async_callback callback, void *user_data);
+int mtk_async_write(mtk_async *async, const uint8_t *buffer, size_t size, mtk_async_callback callback, void *user_data);
+
+int mtk_async_preloader_start(mtk_async *async, mtk_async_callback callback, void *user_data);
+int mtk_async_preloader_get_hw_code(mtk_async *async, uint16_t *hw_code, uint16_t *status, mtk_async_callback callback, void *user_data);
+int mtk_async_preloader_get_hw_sw_ver(mtk_async *async, uint16_t *hw_subcode, uint16_t *hw_ver, uint16_t *sw_ver, uint16_t *status,
+    mtk_async_callback callback, void *user_data);
+int mtk_async_preloader_get_tgt_config(mtk_async *async, uint32_t *tgt_config, uint16_t *status, mtk_async_callback callback, void *user_data);
+int mtk_async_preloader_write32(mtk_async *async, uint32_t base_addr, uint32_t len32, const uint32_t *data, uint16_t *status, mtk_async_callback callback,
+    void *user_data);
+int mtk_async_preloader_disable_wdt(mtk_async *async, uint16_t *status, mtk_async_callback callback, void *user_data);
+int mtk_async_preloader_send_da(mtk_async *async, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, uint16_t *status, const mtk_io_handler handler,
+    void *handler_data, mtk_async_callback callback, void *user_data);
+int mtk_async_preloader_jump_da(mtk_async *async, uint32_t da_addr, uint16_t *status, mtk_async_callback callback, void *user_data);
+
+int mtk_async_da_sync(mtk_async *async, uint32_t *nand_ret, uint32_t *emmc_ret, uint32_t *emmc_id, uint8_t *da_major_ver, uint8_t *da_minor_ver,
+    mtk_async_callback callback, void *user_data);
+int mtk_async_da_send_da(mtk_async *async, uint32_t da_addr, uint32_t da_len, uint8_t *retval, const mtk_io_handler handler, void *handler_data,
+    mtk_async_callback callback, void *user_data);
+int mtk_async_da_usb_check_status(mtk_async *async, uint8_t *usb_status, uint8_t *retval, mtk_async_callback callback, void *user_data);
+int mtk_async_da_switch_part(mtk_async *async, uint8_t part, uint8_t *retval, mtk_async_callback callback, void *user_data);
+int mtk_async_da_read(mtk_async *async, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *dest, uint8_t *retval, const mtk_io_handler handler,
+    void *handler_data, mtk_async_callback callback, void *user_data);
+int mtk_async_da_write_data(mtk_async *async, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler,
+    void *handler_data, mtk_async_callback callback, void *user_data);
+int mtk_async_da_enable_watchdog(mtk_async *async, uint16_t timeout_ms, bool async_mode, bool reboot, bool download_mode, bool no_reset_rtc_time,
+    uint8_t *retval, mtk_async_callback callback, void *user_data);
+
+#endif /* MTK_ASYNC_H */
@@ -25,14 +25,24 @@ enum {
     MTK_DA_SWITCH_PART_CMD      = 0x60,
     MTK_DA_SDMMC_WRITE_DATA_CMD = 0x62,
     MTK_DA_USB_CHECK_STATUS_CMD = 0x72,
+    MTK_DA_FORMAT_CMD           = 0xd4,
     MTK_DA_READ_CMD             = 0xd6,
     MTK_DA_ENABLE_WATCHDOG_CMD  = 0xdb,
 };
 
 #define MTK_DA_NAND_NOT_FOUND  (0xbc4)
 
+// READ and WRITE_DATA packet size; halved down to the minimum when the same chunk keeps failing
+#define MTK_DA_PACKET_SIZE     (0x100000)
+#define MTK_DA_MIN_PACKET_SIZE (0x10000)
+
 #define MTK_DA_FULL_REPORT_SIZE (235)
 
+// flash info reports DA Stage 2 sends after booting; the fifth describes the eMMC
+#define MTK_DA_FLASH_REPORTS   (7)
+#define MTK_DA_EMMC_REPORT     (4)
+#define MTK_DA_EMMC_REPORT_SIZE (0x5c)
+
 enum {
     MTK_DA_HW_STORAGE_NOR = 0,
     MTK_DA_HW_STORAGE_NAND,
@@ -93,8 +103,34 @@ typedef struct {
     mtk_da_entry DA[];
 } __attribute__((packed)) mtk_da_info;
 
+// one big-endian field of the config block sent before DA Stage 2
+typedef struct {
+    uint32_t value;
+    uint8_t size;
+} mtk_da_config_field;
+
+#define MTK_DA_DEVICE_CONFIG_FIELDS (11)
+#define MTK_DA_DEVICE_CONFIG_SIZE (18)
+
+// The config block, shared by the blocking and asynchronous DA Stage 2 uploads and the emulator.
+extern const mtk_da_config_field mtk_da_device_config[MTK_DA_DEVICE_CONFIG_FIELDS];
+
+// eMMC flash info report; area sizes in bytes, indexed by MTK_DA_EMMC_PART_* - 1
+typedef struct {
+    uint32_t ret;
+    uint64_t area_sizes[MTK_DA_EMMC_PART_USER];
+    uint32_t cid[4];
+    char fw_ver[8];
+} mtk_da_emmc_info;
+
 int mtk_da_info_load(int fd, const mtk_da_info **info);
 
+// Decodes the MTK_DA_EMMC_REPORT_SIZE bytes of the eMMC report, all fields big-endian.
+void mtk_da_parse_emmc_report(const uint8_t *report, mtk_da_emmc_info *info);
+
+// Continues a 16-bit additive checksum over count bytes, as the DA computes it for every data packet.
+uint16_t mtk_da_checksum(uint16_t chksum, const uint8_t *buffer, size_t count);
+
 int mtk_da_sync(mtk_device *device, uint32_t *nand_ret, uint32_t *emmc_ret, uint32_t *emmc_id, uint8_t *da_major_ver, uint8_t *da_minor_ver);
 int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint8_t *retval, const mtk_io_handler handler, void *user_data);
 
@@ -102,7 +138,19 @@ int mtk_da_usb_check_status(mtk_device *device, uint8_t *usb_status, uint8_t *re
 
 int mtk_da_sdmmc_switch_part(mtk_device *device, uint8_t part, uint8_t *retval);
 int mtk_da_sdmmc_write_data(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data);
+int mtk_da_sdmmc_write_data_from(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, const uint8_t *src,
+    const uint16_t *chksums, size_t chunk_size, uint8_t *retval, const mtk_io_handler handler, void *user_data);
+// Writes pattern to every byte of [addr, addr + len) from one packet built on the host; the optional handler observes each chunk.
+int mtk_da_sdmmc_fill(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t pattern, uint8_t *retval,
+    const mtk_io_handler handler, void *user_data);
+// Erases [addr, addr + len) of part on the device. *retval is not MTK_DA_ACK when the DA refuses the command byte, before anything
+// else was sent; a refused range returns LIBUSB_ERROR_INVALID_PARAM. *status is the DA's result otherwise. The optional handler is
+// called with a NULL buffer and the bytes done so far as the DA reports progress.
+int mtk_da_format(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint32_t *status, uint8_t *retval,
+    const mtk_io_handler handler, void *user_data);
 int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data);
+int mtk_da_read_into(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *dest, uint8_t *retval, const mtk_io_handler handler,
+    void *user_data);
 
 int mtk_da_enable_watchdog(mtk_device *device, uint16_t timeout_ms, bool async, bool reboot, bool download_mode, bool no_reset_rtc_time, uint8_t *retval);
 
@@ -11,6 +11,16 @@
 
 #define MTK_DEVICE_TMOUT (1000)
 
+// largest bulk IN request made directly into a caller's buffer; must be a multiple of MTK_DEVICE_PKTSIZE
+#define MTK_DEVICE_DIRECT_MAX (0x100000)
+
+// short timeout while discarding stale data after a failed transfer
+#define MTK_DEVICE_DRAIN_TMOUT (100)
+#define MTK_DEVICE_DRAIN_MAX_PACKETS (8192)
+
+// reissued DA commands per operation before giving up
+#define MTK_DEVICE_RETRIES (3)
+
 #define MTK_DEVICE_INTERFACE (0)
 
 #define MTK_DEVICE_EPIN  (0x1 | LIBUSB_ENDPOINT_IN)
@@ -19,22 +29,118 @@
 #define MTK_DEVICE_VID (0x0e8d)
 #define MTK_DEVICE_PID (0x2000)
 
+// USB 3.0 limits hub chains to 7 tiers
+#define MTK_DEVICE_MAX_PORTS (7)
+
 extern bool verbose;
 
+/*
+ * Per-SoC handshake timing. Replies are polled for on the bulk IN endpoint
+ * with the given upper bounds. The config delay is only non-zero for SoCs
+ * without a table entry; the boot delay precedes the ACK that starts the DA
+ * and is kept for every SoC.
+ */
+typedef struct {
+    uint16_t hw_code;
+    uint16_t config_delay_ms;
+    uint16_t config_timeout_ms;
+    uint16_t boot_delay_ms;
+    uint16_t boot_timeout_ms;
+    uint16_t preloader_timeout_ms;
+} mtk_soc_timing;
+
+typedef struct mtk_transfer mtk_transfer;
+
+typedef void (*mtk_transfer_callback)(mtk_transfer *transfer);
+
+// Asynchronous transfer: the caller fills in the request, the transport the result before calling back.
+struct mtk_transfer {
+    // MTK_DEVICE_EPIN, MTK_DEVICE_EPOUT, or 0 for a control request without a data stage
+    uint8_t endpoint;
+    uint8_t *buffer;
+    int length;
+    // like libusb, 0 waits forever
+    unsigned int timeout_ms;
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    mtk_transfer_callback callback;
+    void *user_data;
+
+    // 0 or a negative libusb error code; data received before a timeout is still counted
+    int status;
+    int actual_length;
+
+    // owned by the transport while the transfer is in flight
+    void *priv;
+};
+
+// Bulk pipe the protocol runs over; libusb by default, replaceable for benchmarks and emulation.
+typedef struct {
+    int (*bulk_in)(void *ctx, uint8_t *buffer, int length, int *transferred, unsigned int timeout_ms);
+    int (*bulk_out)(void *ctx, const uint8_t *buffer, int length, int *transferred, unsigned int timeout_ms);
+    int (*clear_halt)(void *ctx);
+    // class/vendor control request without a data stage
+    int (*control)(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index);
+
+    // Asynchronous transfers, NULL when not supported. The callback runs from the event handling, never from submit;
+    // a cancelled transfer completes with LIBUSB_ERROR_INTERRUPTED.
+    int (*submit)(void *ctx, mtk_transfer *transfer);
+    int (*cancel)(void *ctx, mtk_transfer *transfer);
+    // Completes what is ready, waiting up to timeout_ms for the first transfer to complete. NULL when the transfers
+    // complete from an event loop the caller runs itself, as libusb's on its context.
+    int (*handle_events)(void *ctx, unsigned int timeout_ms);
+} mtk_transport;
+
+typedef struct {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint32_t retries;
+    uint32_t timeouts;
+    uint32_t checksum_errors;
+} mtk_device_stats;
+
 typedef struct {
     libusb_device_handle *dev;
+    const mtk_transport *transport;
+    void *transport_ctx;
+    const mtk_soc_timing *timing;
+
+    unsigned int retry_budget;
+    mtk_device_stats stats;
+
+    // preloader commands send all their echoed words at once instead of one round trip per word
+    bool echo_pipeline;
 
     uint8_t buffer[MTK_DEVICE_PKTSIZE];
     size_t buffer_available;
     size_t buffer_offset;
 } mtk_device;
 
+/*
+ * Produces (flashing) or consumes one chunk of a transfer: (flashing, offset, total, buffer, count, user_data).
+ * Chunks are passed in increasing offset order and every byte is passed exactly once, also when a DA command
+ * is retried: a chunk is only handed over after it was verified, and a produced chunk is kept and resent.
+ */
 typedef int (*mtk_io_handler)(bool, size_t, size_t, uint8_t *, size_t, void *);
 
 int mtk_device_open(mtk_device *device, libusb_device_handle *dev);
 
+void mtk_device_open_transport(mtk_device *device, const mtk_transport *transport, void *ctx);
+
 int mtk_device_detect(mtk_device *device, libusb_context *ctx);
 
+int mtk_device_open_path(mtk_device *device, libusb_context *ctx, uint8_t bus, const uint8_t *ports, int ports_count);
+
+void mtk_device_close(mtk_device *device);
+
+const mtk_soc_timing *mtk_soc_timing_get(uint16_t hw_code);
+
+int mtk_device_wait(mtk_device *device, unsigned int timeout_ms, unsigned int *waited_ms);
+
+int mtk_device_recover(mtk_device *device);
+
 int mtk_device_read(mtk_device *device, uint8_t *buffer, size_t size);
 int mtk_device_write(mtk_device *device, const uint8_t *buffer, size_t size);
 
@@ -56,5 +162,7 @@ int mtk_device_echo8(mtk_device *device, uint8_t data);
 int mtk_device_echo16(mtk_device *device, uint16_t data);
 int mtk_device_echo32(mtk_device *device, uint32_t data);
 int mtk_device_echo64(mtk_device *device, uint64_t data);
+// Writes all of data, then reads and checks the echo of all of it.
+int mtk_device_echo(mtk_device *device, const uint8_t *data, size_t size);
 
 #endif /* MTK_DEVICE_H */
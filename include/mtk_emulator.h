@@ -0,0 +1,53 @@
+#ifndef MTK_EMULATOR_H
+#define MTK_EMULATOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+
+#define MTK_EMULATOR_HW_CODE (0x8590)
+// newest revision, so the first DA entry for the HW code is selected
+#define MTK_EMULATOR_HW_VER (0xffff)
+#define MTK_EMULATOR_SW_VER (0xffff)
+
+// boot and RPMB areas live in memory; GP areas are not present
+#define MTK_EMULATOR_BOOT_SIZE (4 * 1024 * 1024)
+#define MTK_EMULATOR_RPMB_SIZE (4 * 1024 * 1024)
+
+// largest READ/WRITE_DATA packet the emulated DA accepts
+#define MTK_EMULATOR_MAX_PACKET (16 * 1024 * 1024)
+
+// where the emulated device is when the host attaches
+typedef enum {
+    MTK_EMULATOR_STATE_NONE,
+    // start sequence already done
+    MTK_EMULATOR_STATE_PRELOADER,
+    MTK_EMULATOR_STATE_DA_STAGE2,
+} mtk_emulator_state;
+
+typedef struct {
+    // file backing the user area; its size is the user area size
+    const char *image;
+    uint16_t hw_code;
+    // link model shared by both directions: bytes per second (0 for unlimited) and a fixed cost per transfer
+    uint64_t bandwidth;
+    uint32_t latency_us;
+    mtk_emulator_state state;
+} mtk_emulator_config;
+
+typedef struct mtk_emulator mtk_emulator;
+
+/*
+ * Runs the device side of the preloader and DA protocol in a thread of its
+ * own, behind an mtk_transport. Everything the host sends is answered the
+ * way an MT8590 in download mode answers it, with reads and writes going to
+ * a virtual eMMC. Returns 0 or a negative errno.
+ */
+int mtk_emulator_open(mtk_emulator **emulator, const mtk_emulator_config *config);
+void mtk_emulator_close(mtk_emulator *emulator);
+
+// Points the device at the emulator; mtk_device_close is not needed afterwards.
+void mtk_emulator_attach(mtk_emulator *emulator, mtk_device *device);
+
+#endif /* MTK_EMULATOR_H */
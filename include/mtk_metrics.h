@@ -0,0 +1,56 @@
+#ifndef MTK_METRICS_H
+#define MTK_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Per-chunk latency histograms and transfer counters, shared by all devices
+ * of the process. Histograms are log-linear (HDR style): values below
+ * 2^MTK_METRICS_SUB_BITS ns get a bucket each, every power of two above is
+ * split into 2^MTK_METRICS_SUB_BITS buckets, so any recorded latency is
+ * known to within about 6%. Recording is a few relaxed atomic adds and
+ * nothing at all until mtk_metrics_enable() is called.
+ */
+
+#define MTK_METRICS_SUB_BITS (4)
+#define MTK_METRICS_BUCKETS ((64 - MTK_METRICS_SUB_BITS + 1) << MTK_METRICS_SUB_BITS)
+
+typedef enum {
+    // bulk IN transfer of a read chunk and its checksum
+    MTK_METRICS_READ_USB,
+    MTK_METRICS_READ_CHECKSUM,
+    // the host side consuming a verified read chunk
+    MTK_METRICS_READ_HANDLER,
+    // the host side producing a write chunk
+    MTK_METRICS_WRITE_HANDLER,
+    MTK_METRICS_WRITE_USB,
+    MTK_METRICS_WRITE_CHECKSUM,
+    // from the end of a write chunk until the DA answers with MTK_DA_CONT_CHAR
+    MTK_METRICS_WRITE_ACK,
+    MTK_METRICS_STAGES,
+} mtk_metrics_stage;
+
+typedef enum {
+    MTK_METRICS_BYTES_READ,
+    MTK_METRICS_BYTES_WRITTEN,
+    MTK_METRICS_RETRIES,
+    MTK_METRICS_TIMEOUTS,
+    MTK_METRICS_CHECKSUM_ERRORS,
+    MTK_METRICS_COUNTERS,
+} mtk_metrics_counter;
+
+void mtk_metrics_enable(void);
+bool mtk_metrics_enabled(void);
+
+// Start time for mtk_metrics_record, in ns; 0 while metrics are disabled.
+uint64_t mtk_metrics_now(void);
+// Adds the time since start to the histogram of stage.
+void mtk_metrics_record(mtk_metrics_stage stage, uint64_t start);
+void mtk_metrics_count(mtk_metrics_counter counter, uint64_t value);
+
+// Writes all metrics in the Prometheus text exposition format; returns 0 or a negative errno.
+int mtk_metrics_write(FILE *f);
+
+#endif /* MTK_METRICS_H */
@@ -15,6 +15,9 @@ enum {
     MTK_PRELOADER_CMD_GET_TARGET_CONFIG = 0xd8,
 };
 
+// data words echoed per batch when pipelining WRITE32
+#define MTK_PRELOADER_PIPELINE_WORDS (64)
+
 #pragma pack(push,1)
 struct passinfo {
     char ack;
@@ -26,16 +29,29 @@ struct passinfo {
 
 int mtk_preloader_start(mtk_device *device);
 
+// Continues the XOR of little-endian 16-bit words used to verify a DA upload; only the last block may have an odd count.
+uint16_t mtk_preloader_checksum(uint16_t chksum, const uint8_t *buffer, size_t count);
+
 int mtk_preloader_get_tgt_config(mtk_device *device, uint32_t *tgt_config, uint16_t *status);
 
 int mtk_preloader_get_hw_code(mtk_device *device, uint16_t *hw_code, uint16_t *status);
 int mtk_preloader_get_hw_sw_ver(mtk_device *device, uint16_t *hw_subcode, uint16_t *hw_ver, uint16_t *sw_ver, uint16_t *status);
 
+/*
+ * Checks whether the preloader keeps up with commands sent ahead of their
+ * echoes, by sending two GET_HW_CODE commands at once. Returns 1 and turns
+ * on device->echo_pipeline when both replies arrive; returns 0 and leaves
+ * lockstep echoes in place when the second one is dropped.
+ */
+int mtk_preloader_probe_pipeline(mtk_device *device);
+
 int mtk_preloader_write32(mtk_device *device, uint32_t base_addr, uint32_t len32, const uint32_t *data, uint16_t *status);
 
 int mtk_preloader_disable_wdt(mtk_device *device, uint16_t *status);
 
 int mtk_preloader_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, uint16_t *status, const mtk_io_handler handler, void *user_data);
+// Sends the DA straight from memory; chksum is mtk_preloader_checksum() of data, computed ahead of time.
+int mtk_preloader_send_da_from(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, const uint8_t *data, uint16_t chksum, uint16_t *status);
 int mtk_preloader_jump_da(mtk_device *device, uint32_t da_addr, uint16_t *status);
 
 #endif /* MTK_PRELOADER_H */
@@ -0,0 +1,32 @@
+#ifndef MTK_TRACE_H
+#define MTK_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MTK_TRACE_MAX_EVENTS (8192)
+
+typedef struct {
+    const char *name;
+    uint64_t start_us;
+    uint64_t addr;
+    uint64_t len;
+} mtk_trace_span;
+
+void mtk_trace_enable(void);
+void mtk_trace_set_thread(uint32_t tid);
+
+mtk_trace_span mtk_trace_begin(const char *name);
+mtk_trace_span mtk_trace_begin_range(const char *name, uint64_t addr, uint64_t len);
+void mtk_trace_end(mtk_trace_span *span);
+
+int mtk_trace_write(const char *path);
+
+// Records a span covering the rest of the enclosing scope.
+#define MTK_TRACE_SCOPE(name) \
+    mtk_trace_span _trace_span __attribute__((cleanup(mtk_trace_end))) = mtk_trace_begin(name)
+
+#define MTK_TRACE_SCOPE_RANGE(name, addr, len) \
+    mtk_trace_span _trace_span __attribute__((cleanup(mtk_trace_end))) = mtk_trace_begin_range(name, addr, len)
+
+#endif /* MTK_TRACE_H */
@@ -0,0 +1,941 @@
+#include "mtk_async.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mtk_da.h"
+#include "mtk_preloader.h"
+#include "util.h"
+
+/*
+ * Operations are written as straight-line code over ASYNC_AWAIT: the state is
+ * the line to resume at, and everything that has to survive a transfer lives
+ * in async->op. A step returns 1 when the operation is done, 0 while a
+ * transfer is in flight and a negative error code on failure.
+ */
+#define ASYNC_BEGIN(async) switch ((async)->state) { case 0:
+
+#define ASYNC_END(async) } return 1
+
+#define ASYNC_AWAIT_AT(async, call, id)     \
+    do {                                    \
+        (async)->state = (id);              \
+        int _err = (call);                  \
+        if (_err <= 0) {                    \
+            return _err;                    \
+        }                                   \
+        __attribute__((fallthrough));       \
+    case (id):;                             \
+    } while (0)
+
+#define ASYNC_AWAIT(async, call) ASYNC_AWAIT_AT(async, call, __LINE__ * 4)
+
+// Parameters of preloader commands are echoed back by the device.
+#define ASYNC_ECHO(async, value, size)                                                                     \
+    ASYNC_AWAIT_AT(async, async_write_be(async, value, size), __LINE__ * 4 + 1);                           \
+    ASYNC_AWAIT_AT(async, async_read(async, (async)->in, size, MTK_DEVICE_TMOUT), __LINE__ * 4 + 2);       \
+    if (get_be((async)->in, size) != (uint64_t)(value)) {                                                  \
+        return LIBUSB_ERROR_OTHER;                                                                         \
+    }
+
+#define ASYNC_READ_BE(async, size) ASYNC_AWAIT(async, async_read(async, (async)->in, size, MTK_DEVICE_TMOUT))
+
+struct mtk_async {
+    const mtk_transport *transport;
+    void *transport_ctx;
+    const mtk_soc_timing *timing;
+    mtk_device_stats stats;
+
+    mtk_transfer transfer;
+    bool in_flight;
+
+    // current operation
+    bool busy;
+    int (*step)(mtk_async *async);
+    int state;
+    mtk_async_callback callback;
+    void *user_data;
+
+    // read being filled across transfers; dest NULL discards
+    bool reading;
+    uint8_t *read_dest;
+    size_t read_size;
+    size_t read_done;
+    unsigned int read_timeout;
+    bool read_direct;
+    // an IN transfer used as a timer: a timeout completes it successfully
+    bool sleeping;
+
+    // write being sent across transfers
+    const uint8_t *write_data;
+    size_t write_size;
+    size_t write_done;
+
+    uint8_t buffer[MTK_DEVICE_PKTSIZE];
+    size_t buffer_offset;
+    size_t buffer_available;
+
+    uint8_t out[8];
+    uint8_t in[8];
+
+    // READ and WRITE_DATA packets, DA uploads
+    uint8_t *packet;
+
+    union {
+        struct {
+            size_t i;
+        } start;
+        struct {
+            uint8_t cmd;
+            uint16_t *out[4];
+            size_t count;
+            size_t i;
+        } query;
+        struct {
+            uint32_t *config;
+            uint16_t *status;
+        } tgt_config;
+        struct {
+            uint32_t base_addr;
+            uint32_t len32;
+            const uint32_t *data;
+            uint16_t *status;
+            uint32_t i;
+        } write32;
+        struct {
+            uint32_t addr;
+            uint32_t len;
+            uint32_t sig_len;
+            uint16_t *status;
+            mtk_io_handler handler;
+            void *handler_data;
+            uint32_t offset;
+            size_t count;
+            uint16_t chksum;
+        } send_da;
+        struct {
+            uint32_t addr;
+            uint16_t *status;
+        } jump_da;
+        struct {
+            uint32_t *nand_ret;
+            uint32_t *emmc_ret;
+            uint32_t *emmc_id;
+            uint8_t *da_major_ver;
+            uint8_t *da_minor_ver;
+            uint16_t nand_count;
+            size_t i;
+        } sync;
+        struct {
+            uint32_t addr;
+            uint32_t len;
+            uint8_t *retval;
+            mtk_io_handler handler;
+            void *handler_data;
+            size_t i;
+            uint32_t offset;
+            size_t count;
+        } da_send;
+        struct {
+            uint8_t *retval;
+            uint8_t *usb_status;
+            uint8_t part;
+        } simple;
+        struct {
+            uint8_t hw_storage;
+            uint8_t part;
+            uint64_t addr;
+            uint64_t len;
+            uint8_t *dest;
+            uint8_t *retval;
+            mtk_io_handler handler;
+            void *handler_data;
+            uint64_t offset;
+            size_t count;
+            uint8_t *buffer;
+        } data;
+        struct {
+            uint8_t params[8];
+            uint8_t *retval;
+        } watchdog;
+        struct {
+            uint8_t *buffer;
+            const uint8_t *data;
+            size_t size;
+        } raw;
+    } op;
+};
+
+static uint64_t get_be(const uint8_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value = value << 8 | data[i];
+    }
+    return value;
+}
+
+static void finish(mtk_async *async, int err) {
+    async->busy = false;
+    async->reading = false;
+    async->callback(async, err, async->user_data);
+}
+
+static void transfer_done(mtk_transfer *transfer);
+
+static int submit(mtk_async *async, uint8_t endpoint, uint8_t *data, size_t size, unsigned int timeout_ms) {
+    async->transfer = (mtk_transfer){
+        .endpoint = endpoint, .buffer = data, .length = size, .timeout_ms = timeout_ms, .callback = transfer_done, .user_data = async
+    };
+
+    int err = async->transport->submit(async->transport_ctx, &async->transfer);
+    if (err < 0) {
+        return err;
+    }
+
+    async->in_flight = true;
+    return 0;
+}
+
+// Copies what is buffered into the pending read and submits the next IN transfer while it is short; returns 1 once it is complete.
+static int read_continue(mtk_async *async) {
+    while (async->read_done < async->read_size) {
+        if (async->buffer_available > 0) {
+            size_t count = MIN(async->buffer_available, async->read_size - async->read_done);
+            if (async->read_dest != NULL) {
+                memcpy(async->read_dest + async->read_done, async->buffer + async->buffer_offset, count);
+            }
+            async->buffer_offset += count;
+            async->buffer_available -= count;
+            async->read_done += count;
+            continue;
+        }
+
+        // whole packets go straight to the destination, like mtk_device_read
+        size_t direct = (async->read_size - async->read_done) / MTK_DEVICE_PKTSIZE * MTK_DEVICE_PKTSIZE;
+        async->read_direct = async->read_dest != NULL && direct > 0;
+
+        int err;
+        if (async->read_direct) {
+            err = submit(async, MTK_DEVICE_EPIN, async->read_dest + async->read_done, MIN(direct, MTK_DEVICE_DIRECT_MAX), async->read_timeout);
+        } else {
+            err = submit(async, MTK_DEVICE_EPIN, async->buffer, MTK_DEVICE_PKTSIZE, async->read_timeout);
+        }
+        return err < 0 ? err : 0;
+    }
+
+    async->reading = false;
+    return 1;
+}
+
+static int async_read(mtk_async *async, uint8_t *dest, size_t size, unsigned int timeout_ms) {
+    async->reading = true;
+    async->read_dest = dest;
+    async->read_size = size;
+    async->read_done = 0;
+    async->read_timeout = timeout_ms;
+    return read_continue(async);
+}
+
+static int async_write(mtk_async *async, const uint8_t *data, size_t size) {
+    async->write_data = data;
+    async->write_size = size;
+    async->write_done = 0;
+
+    int err = submit(async, MTK_DEVICE_EPOUT, (uint8_t *)data, size, MTK_DEVICE_TMOUT);
+    return err < 0 ? err : 0;
+}
+
+static int async_write_be(mtk_async *async, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        async->out[i] = value >> (8 * (size - 1 - i));
+    }
+    return async_write(async, async->out, size);
+}
+
+// Waits up to timeout_ms for the device to send something, which is kept for the next read.
+static int async_sleep(mtk_async *async, unsigned int timeout_ms) {
+    if (timeout_ms == 0 || async->buffer_available > 0) {
+        return 1;
+    }
+
+    async->sleeping = true;
+    int err = submit(async, MTK_DEVICE_EPIN, async->buffer, MTK_DEVICE_PKTSIZE, timeout_ms);
+    return err < 0 ? err : 0;
+}
+
+static int async_control(mtk_async *async, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index) {
+    async->transfer = (mtk_transfer){
+        .request_type = request_type, .request = request, .value = value, .index = index, .callback = transfer_done, .user_data = async
+    };
+
+    int err = async->transport->submit(async->transport_ctx, &async->transfer);
+    if (err < 0) {
+        return err;
+    }
+
+    async->in_flight = true;
+    return 0;
+}
+
+static void resume(mtk_async *async) {
+    int err = async->reading ? read_continue(async) : 1;
+    if (err > 0) {
+        err = async->step(async);
+    }
+    if (err != 0) {
+        finish(async, err < 0 ? err : 0);
+    }
+}
+
+static void transfer_done(mtk_transfer *transfer) {
+    mtk_async *async = transfer->user_data;
+    async->in_flight = false;
+
+    int err = transfer->status;
+    if (err == LIBUSB_ERROR_TIMEOUT) {
+        async->stats.timeouts++;
+    }
+
+    if (transfer->endpoint == 0) {
+        // the start request is sent without checking the result, as in mtk_preloader_start
+        resume(async);
+        return;
+    }
+
+    if (transfer->endpoint == MTK_DEVICE_EPIN) {
+        size_t count = transfer->actual_length;
+        async->stats.bytes_read += count;
+
+        if (async->sleeping) {
+            async->sleeping = false;
+            async->buffer_offset = 0;
+            async->buffer_available = count;
+            err = err == LIBUSB_ERROR_TIMEOUT ? 0 : err;
+        } else if (async->read_direct) {
+            async->read_done += count;
+        } else {
+            async->buffer_offset = 0;
+            async->buffer_available = count;
+        }
+        // data that arrived before a timeout still counts
+        if (count > 0 && err == LIBUSB_ERROR_TIMEOUT) {
+            err = 0;
+        }
+    } else {
+        async->stats.bytes_written += transfer->actual_length;
+        async->write_done += transfer->actual_length;
+
+        if (err == 0 && async->write_done < async->write_size) {
+            err = submit(async, MTK_DEVICE_EPOUT, (uint8_t *)async->write_data + async->write_done, async->write_size - async->write_done, MTK_DEVICE_TMOUT);
+            if (err == 0) {
+                return;
+            }
+        }
+    }
+
+    if (err < 0) {
+        finish(async, err);
+        return;
+    }
+
+    resume(async);
+}
+
+static int start(mtk_async *async, int (*step)(mtk_async *), mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+
+    async->busy = true;
+    async->step = step;
+    async->state = 0;
+    async->callback = callback;
+    async->user_data = user_data;
+    async->reading = false;
+
+    int err = step(async);
+    if (err != 0) {
+        finish(async, err < 0 ? err : 0);
+    }
+
+    return 0;
+}
+
+int mtk_async_open(mtk_async **async, const mtk_device *device) {
+    if (device->transport->submit == NULL) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+
+    mtk_async *a = calloc(1, sizeof(mtk_async));
+    if (a == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    a->transport = device->transport;
+    a->transport_ctx = device->transport_ctx;
+    a->timing = mtk_soc_timing_get(0);
+    *async = a;
+    return 0;
+}
+
+void mtk_async_close(mtk_async *async) {
+    if (async == NULL) {
+        return;
+    }
+
+    free(async->packet);
+    free(async);
+}
+
+bool mtk_async_busy(const mtk_async *async) { return async->busy; }
+
+int mtk_async_cancel(mtk_async *async) {
+    if (!async->in_flight) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    return async->transport->cancel(async->transport_ctx, &async->transfer);
+}
+
+void mtk_async_set_timing(mtk_async *async, const mtk_soc_timing *timing) { async->timing = timing; }
+
+const mtk_device_stats *mtk_async_stats(const mtk_async *async) { return &async->stats; }
+
+const struct libusb_pollfd **mtk_async_get_pollfds(libusb_context *ctx) { return libusb_get_pollfds(ctx); }
+
+int mtk_async_next_timeout(libusb_context *ctx, struct timeval *tv) { return libusb_get_next_timeout(ctx, tv); }
+
+int mtk_async_handle_events(libusb_context *ctx) {
+    struct timeval zero = { 0, 0 };
+    return libusb_handle_events_timeout_completed(ctx, &zero, NULL);
+}
+
+int mtk_async_wait(mtk_async *async, unsigned int timeout_ms) {
+    if (async->transport->handle_events == NULL) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    return async->transport->handle_events(async->transport_ctx, timeout_ms);
+}
+
+static int packet_buffer(mtk_async *async) {
+    if (async->packet == NULL && (async->packet = malloc(MTK_DA_PACKET_SIZE)) == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    return 1;
+}
+
+// raw transfers
+
+static int raw_read_step(mtk_async *async) {
+    ASYNC_BEGIN(async);
+    ASYNC_AWAIT(async, async_read(async, async->op.raw.buffer, async->op.raw.size, MTK_DEVICE_TMOUT));
+    ASYNC_END(async);
+}
+
+int mtk_async_read(mtk_async *async, uint8_t *buffer, size_t size, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.raw.buffer = buffer;
+    async->op.raw.size = size;
+    return start(async, raw_read_step, callback, user_data);
+}
+
+static int raw_write_step(mtk_async *async) {
+    ASYNC_BEGIN(async);
+    ASYNC_AWAIT(async, async_write(async, async->op.raw.data, async->op.raw.size));
+    ASYNC_END(async);
+}
+
+int mtk_async_write(mtk_async *async, const uint8_t *buffer, size_t size, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.raw.data = buffer;
+    async->op.raw.size = size;
+    return start(async, raw_write_step, callback, user_data);
+}
+
+// preloader
+
+static int start_step(mtk_async *async) {
+    static const uint8_t start_command[] = { 0xa0, 0x0a, 0x50, 0x05 };
+
+    ASYNC_BEGIN(async);
+    ASYNC_AWAIT(async, async_control(async, LIBUSB_REQUEST_TYPE_CLASS, 0x20, 0, 0));
+
+    async->op.start.i = 0;
+    while (async->op.start.i < sizeof(start_command)) {
+        // ignore data read prior to start command
+        async->buffer_available = 0;
+
+        ASYNC_AWAIT(async, async_write_be(async, start_command[async->op.start.i], 1));
+        ASYNC_READ_BE(async, 1);
+
+        if (async->in[0] == (uint8_t)~start_command[async->op.start.i]) {
+            async->op.start.i++;
+        } else {
+            async->op.start.i = 0;
+        }
+    }
+    ASYNC_END(async);
+}
+
+int mtk_async_preloader_start(mtk_async *async, mtk_async_callback callback, void *user_data) { return start(async, start_step, callback, user_data); }
+
+// Commands that reply with a list of 16-bit values, the last one being the status.
+static int query_step(mtk_async *async) {
+    ASYNC_BEGIN(async);
+    ASYNC_ECHO(async, async->op.query.cmd, 1);
+
+    for (async->op.query.i = 0; async->op.query.i < async->op.query.count; async->op.query.i++) {
+        ASYNC_READ_BE(async, 2);
+        *async->op.query.out[async->op.query.i] = get_be(async->in, 2);
+    }
+    ASYNC_END(async);
+}
+
+static int query(mtk_async *async, uint8_t cmd, uint16_t **out, size_t count, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.query.cmd = cmd;
+    memcpy(async->op.query.out, out, count * sizeof(*out));
+    async->op.query.count = count;
+    return start(async, query_step, callback, user_data);
+}
+
+int mtk_async_preloader_get_hw_code(mtk_async *async, uint16_t *hw_code, uint16_t *status, mtk_async_callback callback, void *user_data) {
+    uint16_t *out[] = { hw_code, status };
+    return query(async, MTK_PRELOADER_CMD_GET_HW_CODE, out, 2, callback, user_data);
+}
+
+int mtk_async_preloader_get_hw_sw_ver(mtk_async *async, uint16_t *hw_subcode, uint16_t *hw_ver, uint16_t *sw_ver, uint16_t *status,
+    mtk_async_callback callback, void *user_data) {
+    uint16_t *out[] = { hw_subcode, hw_ver, sw_ver, status };
+    return query(async, MTK_PRELOADER_CMD_GET_HW_SW_VER, out, 4, callback, user_data);
+}
+
+static int tgt_config_step(mtk_async *async) {
+    ASYNC_BEGIN(async);
+    ASYNC_ECHO(async, MTK_PRELOADER_CMD_GET_TARGET_CONFIG, 1);
+    ASYNC_READ_BE(async, 4);
+    *async->op.tgt_config.config = get_be(async->in, 4);
+    ASYNC_READ_BE(async, 2);
+    *async->op.tgt_config.status = get_be(async->in, 2);
+    ASYNC_END(async);
+}
+
+int mtk_async_preloader_get_tgt_config(mtk_async *async, uint32_t *tgt_config, uint16_t *status, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.tgt_config.config = tgt_config;
+    async->op.tgt_config.status = status;
+    return start(async, tgt_config_step, callback, user_data);
+}
+
+static int write32_step(mtk_async *async) {
+    typeof(async->op.write32) *op = &async->op.write32;
+
+    ASYNC_BEGIN(async);
+    ASYNC_ECHO(async, MTK_PRELOADER_CMD_WRITE32, 1);
+    ASYNC_ECHO(async, op->base_addr, 4);
+    ASYNC_ECHO(async, op->len32, 4);
+    ASYNC_READ_BE(async, 2);
+    *op->status = get_be(async->in, 2);
+
+    if (*op->status == 0) {
+        for (op->i = 0; op->i < op->len32; op->i++) {
+            ASYNC_ECHO(async, op->data[op->i], 4);
+        }
+        ASYNC_READ_BE(async, 2);
+        *op->status = get_be(async->in, 2);
+    }
+    ASYNC_END(async);
+}
+
+int mtk_async_preloader_write32(mtk_async *async, uint32_t base_addr, uint32_t len32, const uint32_t *data, uint16_t *status, mtk_async_callback callback,
+    void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.write32.base_addr = base_addr;
+    async->op.write32.len32 = len32;
+    async->op.write32.data = data;
+    async->op.write32.status = status;
+    return start(async, write32_step, callback, user_data);
+}
+
+int mtk_async_preloader_disable_wdt(mtk_async *async, uint16_t *status, mtk_async_callback callback, void *user_data) {
+    static const uint32_t data32 = 0x22000064;
+    return mtk_async_preloader_write32(async, 0x10007000, 1, &data32, status, callback, user_data);
+}
+
+static int send_da_step(mtk_async *async) {
+    typeof(async->op.send_da) *op = &async->op.send_da;
+    int err;
+
+    ASYNC_BEGIN(async);
+    ASYNC_ECHO(async, MTK_PRELOADER_CMD_SEND_DA, 1);
+    ASYNC_ECHO(async, op->addr, 4);
+    ASYNC_ECHO(async, op->len, 4);
+    ASYNC_ECHO(async, op->sig_len, 4);
+    ASYNC_READ_BE(async, 2);
+    *op->status = get_be(async->in, 2);
+    if (*op->status != 0) {
+        return 1;
+    }
+
+    if ((err = packet_buffer(async)) < 0) {
+        return err;
+    }
+
+    op->chksum = 0;
+    for (op->offset = 0; op->offset < op->len; op->offset += op->count) {
+        op->count = MIN((uint32_t)MTK_ASYNC_PRELOADER_CHUNK, op->len - op->offset);
+        if ((err = op->handler(true, op->offset, op->len, async->packet, op->count, op->handler_data)) < 0) {
+            return err;
+        }
+        op->chksum = mtk_preloader_checksum(op->chksum, async->packet, op->count);
+
+        ASYNC_AWAIT(async, async_write(async, async->packet, op->count));
+    }
+
+    ASYNC_READ_BE(async, 2);
+    if (get_be(async->in, 2) != op->chksum) {
+        return LIBUSB_ERROR_OTHER;
+    }
+    ASYNC_READ_BE(async, 2);
+    *op->status = get_be(async->in, 2);
+    ASYNC_END(async);
+}
+
+int mtk_async_preloader_send_da(mtk_async *async, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, uint16_t *status, const mtk_io_handler handler,
+    void *handler_data, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.send_da.addr = da_addr;
+    async->op.send_da.len = da_len;
+    async->op.send_da.sig_len = sig_len;
+    async->op.send_da.status = status;
+    async->op.send_da.handler = handler;
+    async->op.send_da.handler_data = handler_data;
+    return start(async, send_da_step, callback, user_data);
+}
+
+static int jump_da_step(mtk_async *async) {
+    ASYNC_BEGIN(async);
+    ASYNC_ECHO(async, MTK_PRELOADER_CMD_JUMP_DA, 1);
+    ASYNC_ECHO(async, async->op.jump_da.addr, 4);
+    ASYNC_READ_BE(async, 2);
+    *async->op.jump_da.status = get_be(async->in, 2);
+    ASYNC_END(async);
+}
+
+int mtk_async_preloader_jump_da(mtk_async *async, uint32_t da_addr, uint16_t *status, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.jump_da.addr = da_addr;
+    async->op.jump_da.status = status;
+    return start(async, jump_da_step, callback, user_data);
+}
+
+// DA
+
+static int sync_step(mtk_async *async) {
+    typeof(async->op.sync) *op = &async->op.sync;
+
+    ASYNC_BEGIN(async);
+    ASYNC_READ_BE(async, 1);
+    if (async->in[0] != MTK_DA_SYNC_CHAR) {
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    ASYNC_READ_BE(async, 4);
+    *op->nand_ret = get_be(async->in, 4);
+    ASYNC_READ_BE(async, 2);
+    op->nand_count = get_be(async->in, 2);
+    for (op->i = 0; op->i < op->nand_count; op->i++) {
+        ASYNC_READ_BE(async, 2);
+    }
+
+    ASYNC_READ_BE(async, 4);
+    *op->emmc_ret = get_be(async->in, 4);
+    for (op->i = 0; op->i < 4; op->i++) {
+        ASYNC_READ_BE(async, 4);
+        op->emmc_id[op->i] = get_be(async->in, 4);
+    }
+
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_ACK, 1));
+
+    ASYNC_READ_BE(async, 1);
+    *op->da_major_ver = async->in[0];
+    ASYNC_READ_BE(async, 1);
+    *op->da_minor_ver = async->in[0];
+    ASYNC_READ_BE(async, 1);
+    ASYNC_END(async);
+}
+
+int mtk_async_da_sync(mtk_async *async, uint32_t *nand_ret, uint32_t *emmc_ret, uint32_t *emmc_id, uint8_t *da_major_ver, uint8_t *da_minor_ver,
+    mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.sync.nand_ret = nand_ret;
+    async->op.sync.emmc_ret = emmc_ret;
+    async->op.sync.emmc_id = emmc_id;
+    async->op.sync.da_major_ver = da_major_ver;
+    async->op.sync.da_minor_ver = da_minor_ver;
+    return start(async, sync_step, callback, user_data);
+}
+
+static int da_send_step(mtk_async *async) {
+    typeof(async->op.da_send) *op = &async->op.da_send;
+    int err;
+
+    ASYNC_BEGIN(async);
+    for (op->i = 0; op->i < MTK_DA_DEVICE_CONFIG_FIELDS; op->i++) {
+        ASYNC_AWAIT(async, async_write_be(async, mtk_da_device_config[op->i].value, mtk_da_device_config[op->i].size));
+    }
+
+    // the settle delay is spent waiting for the reply, which it would be queued behind anyway
+    ASYNC_AWAIT(async, async_read(async, async->in, 4, async->timing->config_delay_ms + async->timing->config_timeout_ms));
+
+    ASYNC_AWAIT(async, async_write_be(async, op->addr, 4));
+    ASYNC_AWAIT(async, async_write_be(async, op->len, 4));
+    ASYNC_AWAIT(async, async_write_be(async, MTK_ASYNC_SEND_DA_CHUNK, 4));
+    ASYNC_READ_BE(async, 1);
+    *op->retval = async->in[0];
+    if (*op->retval != MTK_DA_ACK) {
+        return 1;
+    }
+
+    if ((err = packet_buffer(async)) < 0) {
+        return err;
+    }
+
+    for (op->offset = 0; op->offset < op->len; op->offset += op->count) {
+        op->count = MIN((uint32_t)MTK_ASYNC_SEND_DA_CHUNK, op->len - op->offset);
+        if ((err = op->handler(true, op->offset, op->len, async->packet, op->count, op->handler_data)) < 0) {
+            return err;
+        }
+
+        ASYNC_AWAIT(async, async_write(async, async->packet, op->count));
+        ASYNC_READ_BE(async, 1);
+        *op->retval = async->in[0];
+        if (*op->retval != MTK_DA_ACK) {
+            return 1;
+        }
+    }
+
+    ASYNC_AWAIT(async, async_sleep(async, async->timing->boot_delay_ms));
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_ACK, 1));
+    ASYNC_AWAIT(async, async_read(async, async->in, 1, async->timing->boot_timeout_ms));
+    *op->retval = async->in[0];
+    ASYNC_END(async);
+}
+
+int mtk_async_da_send_da(mtk_async *async, uint32_t da_addr, uint32_t da_len, uint8_t *retval, const mtk_io_handler handler, void *handler_data,
+    mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.da_send.addr = da_addr;
+    async->op.da_send.len = da_len;
+    async->op.da_send.retval = retval;
+    async->op.da_send.handler = handler;
+    async->op.da_send.handler_data = handler_data;
+    return start(async, da_send_step, callback, user_data);
+}
+
+static int usb_check_status_step(mtk_async *async) {
+    ASYNC_BEGIN(async);
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_USB_CHECK_STATUS_CMD, 1));
+    ASYNC_READ_BE(async, 1);
+    *async->op.simple.retval = async->in[0];
+    if (async->in[0] == MTK_DA_ACK) {
+        ASYNC_READ_BE(async, 1);
+        *async->op.simple.usb_status = async->in[0];
+    }
+    ASYNC_END(async);
+}
+
+int mtk_async_da_usb_check_status(mtk_async *async, uint8_t *usb_status, uint8_t *retval, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.simple.usb_status = usb_status;
+    async->op.simple.retval = retval;
+    return start(async, usb_check_status_step, callback, user_data);
+}
+
+static int switch_part_step(mtk_async *async) {
+    ASYNC_BEGIN(async);
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_SWITCH_PART_CMD, 1));
+    ASYNC_READ_BE(async, 1);
+    *async->op.simple.retval = async->in[0];
+    if (async->in[0] == MTK_DA_ACK) {
+        ASYNC_AWAIT(async, async_write_be(async, async->op.simple.part, 1));
+        ASYNC_READ_BE(async, 1);
+        *async->op.simple.retval = async->in[0];
+    }
+    ASYNC_END(async);
+}
+
+int mtk_async_da_switch_part(mtk_async *async, uint8_t part, uint8_t *retval, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.simple.part = part;
+    async->op.simple.retval = retval;
+    return start(async, switch_part_step, callback, user_data);
+}
+
+static int read_step(mtk_async *async) {
+    typeof(async->op.data) *op = &async->op.data;
+    int err;
+
+    ASYNC_BEGIN(async);
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_READ_CMD, 1));
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_HOST_OS_LINUX, 1));
+    ASYNC_AWAIT(async, async_write_be(async, op->hw_storage, 1));
+    ASYNC_AWAIT(async, async_write_be(async, op->addr, 8));
+    ASYNC_AWAIT(async, async_write_be(async, op->len, 8));
+    ASYNC_READ_BE(async, 1);
+    *op->retval = async->in[0];
+    if (*op->retval != MTK_DA_ACK) {
+        return 1;
+    }
+
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_PACKET_SIZE, 4));
+
+    if (op->dest == NULL && (err = packet_buffer(async)) < 0) {
+        return err;
+    }
+
+    for (op->offset = 0; op->offset < op->len; op->offset += op->count) {
+        op->count = MIN((uint64_t)MTK_DA_PACKET_SIZE, op->len - op->offset);
+        op->buffer = op->dest != NULL ? op->dest + op->offset : async->packet;
+
+        ASYNC_AWAIT(async, async_read(async, op->buffer, op->count, MTK_DEVICE_TMOUT));
+        ASYNC_READ_BE(async, 2);
+
+        if (get_be(async->in, 2) != mtk_da_checksum(0, op->buffer, op->count)) {
+            async->stats.checksum_errors++;
+            ASYNC_AWAIT(async, async_write_be(async, MTK_DA_NACK, 1));
+            return LIBUSB_ERROR_OTHER;
+        }
+        ASYNC_AWAIT(async, async_write_be(async, MTK_DA_ACK, 1));
+
+        if (op->handler != NULL && (err = op->handler(false, op->offset, op->len, op->buffer, op->count, op->handler_data)) < 0) {
+            return err;
+        }
+    }
+    ASYNC_END(async);
+}
+
+int mtk_async_da_read(mtk_async *async, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *dest, uint8_t *retval, const mtk_io_handler handler,
+    void *handler_data, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.data.hw_storage = hw_storage;
+    async->op.data.addr = addr;
+    async->op.data.len = len;
+    async->op.data.dest = dest;
+    async->op.data.retval = retval;
+    async->op.data.handler = handler;
+    async->op.data.handler_data = handler_data;
+    return start(async, read_step, callback, user_data);
+}
+
+static int write_data_step(mtk_async *async) {
+    typeof(async->op.data) *op = &async->op.data;
+    int err;
+
+    ASYNC_BEGIN(async);
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_SDMMC_WRITE_DATA_CMD, 1));
+    ASYNC_AWAIT(async, async_write_be(async, op->hw_storage, 1));
+    ASYNC_AWAIT(async, async_write_be(async, op->part, 1));
+    ASYNC_AWAIT(async, async_write_be(async, op->addr, 8));
+    ASYNC_AWAIT(async, async_write_be(async, op->len, 8));
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_PACKET_SIZE, 4));
+    ASYNC_READ_BE(async, 1);
+    *op->retval = async->in[0];
+    if (*op->retval != MTK_DA_ACK) {
+        return 1;
+    }
+
+    if ((err = packet_buffer(async)) < 0) {
+        return err;
+    }
+
+    for (op->offset = 0; op->offset < op->len; op->offset += op->count) {
+        ASYNC_AWAIT(async, async_write_be(async, MTK_DA_ACK, 1));
+
+        op->count = MIN((uint64_t)MTK_DA_PACKET_SIZE, op->len - op->offset);
+        if ((err = op->handler(true, op->offset, op->len, async->packet, op->count, op->handler_data)) < 0) {
+            return err;
+        }
+
+        ASYNC_AWAIT(async, async_write(async, async->packet, op->count));
+        ASYNC_AWAIT(async, async_write_be(async, mtk_da_checksum(0, async->packet, op->count), 2));
+        ASYNC_READ_BE(async, 1);
+        *op->retval = async->in[0];
+        if (*op->retval == MTK_DA_NACK) {
+            async->stats.checksum_errors++;
+            return LIBUSB_ERROR_OTHER;
+        }
+        if (*op->retval != MTK_DA_CONT_CHAR) {
+            return 1;
+        }
+    }
+    ASYNC_END(async);
+}
+
+int mtk_async_da_write_data(mtk_async *async, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler,
+    void *handler_data, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    async->op.data.hw_storage = storage_type;
+    async->op.data.part = part;
+    async->op.data.addr = addr;
+    async->op.data.len = len;
+    async->op.data.retval = retval;
+    async->op.data.handler = handler;
+    async->op.data.handler_data = handler_data;
+    return start(async, write_data_step, callback, user_data);
+}
+
+static int watchdog_step(mtk_async *async) {
+    ASYNC_BEGIN(async);
+    ASYNC_AWAIT(async, async_write_be(async, MTK_DA_ENABLE_WATCHDOG_CMD, 1));
+    ASYNC_AWAIT(async, async_write(async, async->op.watchdog.params, sizeof(async->op.watchdog.params)));
+    ASYNC_READ_BE(async, 1);
+    *async->op.watchdog.retval = async->in[0];
+    ASYNC_END(async);
+}
+
+int mtk_async_da_enable_watchdog(mtk_async *async, uint16_t timeout_ms, bool async_mode, bool reboot, bool download_mode, bool no_reset_rtc_time,
+    uint8_t *retval, mtk_async_callback callback, void *user_data) {
+    if (async->busy) {
+        return LIBUSB_ERROR_BUSY;
+    }
+
+    // timeout as a 32-bit big-endian word, then the four flags
+    uint8_t *params = async->op.watchdog.params;
+    params[0] = 0;
+    params[1] = 0;
+    params[2] = timeout_ms >> 8;
+    params[3] = timeout_ms;
+    params[4] = async_mode;
+    params[5] = reboot;
+    params[6] = download_mode;
+    params[7] = no_reset_rtc_time;
+    async->op.watchdog.retval = retval;
+    return start(async, watchdog_step, callback, user_data);
+}
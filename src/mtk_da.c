@@ -1,13 +1,45 @@
 #include "mtk_da.h"
 #include "flash_tool/util.h"
+#include "mtk_metrics.h"
+#include "mtk_trace.h"
 #include "util.h"
 #include <errno.h>
+#include <inttypes.h>
 #include <libusb.h>
 #include <malloc.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
+uint16_t mtk_da_checksum(uint16_t chksum, const uint8_t *buffer, size_t count) {
+    // a wide accumulator keeps the loop free of 16-bit truncation so it vectorizes; only the low bits matter
+    uint32_t sum = chksum;
+    for (size_t i = 0; i < count; i++) {
+        sum += buffer[i];
+    }
+    return (uint16_t)sum;
+}
+
+static uint64_t get_be(const uint8_t *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value = value << 8 | data[i];
+    }
+    return value;
+}
+
+void mtk_da_parse_emmc_report(const uint8_t *report, mtk_da_emmc_info *info) {
+    info->ret = get_be(report, 4);
+    for (size_t i = 0; i < MTK_DA_EMMC_PART_USER; i++) {
+        info->area_sizes[i] = get_be(report + 4 + i * 8, 8);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        info->cid[i] = get_be(report + 68 + i * 4, 4);
+    }
+    memcpy(info->fw_ver, report + 84, sizeof(info->fw_ver));
+}
+
 int mtk_da_info_load(int fd, const mtk_da_info **info) {
     mtk_da_info tmp_info;
     if (read(fd, &tmp_info, sizeof(tmp_info)) != sizeof(tmp_info)) {
@@ -69,6 +101,8 @@ int mtk_da_info_load(int fd, const mtk_da_info **info) {
 }
 
 int mtk_da_sync(mtk_device *device, uint32_t *nand_ret, uint32_t *emmc_ret, uint32_t *emmc_id, uint8_t *da_major_ver, uint8_t *da_minor_ver) {
+    MTK_TRACE_SCOPE("da_sync");
+
     int err;
 
     uint8_t sync_char;
@@ -120,62 +154,48 @@ int mtk_da_sync(mtk_device *device, uint32_t *nand_ret, uint32_t *emmc_ret, uint
     return 0;
 }
 
-static int send_device_config(mtk_device *device) {
-    int err;
+const mtk_da_config_field mtk_da_device_config[MTK_DA_DEVICE_CONFIG_FIELDS] = {
+    { 0xff, 1 },       // bromver
+    { 1, 1 },          // blver
+    { 0x0008, 2 },     // nor chip
+    { 0x00, 1 },       // nor chip select
+    { 0x7007ffff, 4 }, // nand acccon
+    { 0x01, 1 },       // bmtflag
+    { 0, 4 },          // bmtpartsize
+    { 0x02, 1 },       // force charge
+    { 0x01, 1 },       // resetkeys
+    { 0x02, 1 },       // ext clock
+    { 0x00, 1 },       // msdc_boot_ch
+};
 
-    // bromver
-    if ((err = mtk_device_write8(device, 0xff)) < 0) {
-        return err;
-    }
-    // blver
-    if ((err = mtk_device_write8(device, 1)) < 0) {
-        return err;
-    }
-    // nor chip
-    if ((err = mtk_device_write16(device, 0x0008)) < 0) {
-        return err;
-    }
-    // nor chip select
-    if ((err = mtk_device_write8(device, 0x00)) < 0) {
-        return err;
-    }
-    // nand acccon
-    if ((err = mtk_device_write32(device, 0x7007ffff)) < 0) {
-        return err;
-    }
-    // bmtflag
-    if ((err = mtk_device_write8(device, 0x01)) < 0) {
-        return err;
-    }
-    // bmtpartsize
-    if ((err = mtk_device_write32(device, 0)) < 0) {
-        return err;
-    }
-    // force charge
-    if ((err = mtk_device_write8(device, 0x02)) < 0) {
-        return err;
-    }
-    // resetkeys
-    if ((err = mtk_device_write8(device, 0x01)) < 0) {
-        return err;
-    }
-    // ext clock
-    if ((err = mtk_device_write8(device, 0x02)) < 0) {
-        return err;
-    }
-    // msdc_boot_ch
-    if ((err = mtk_device_write8(device, 0x00)) < 0) {
-        return err;
+static int send_device_config(mtk_device *device) {
+    // one write per field, as the DA reads them
+    for (size_t i = 0; i < MTK_DA_DEVICE_CONFIG_FIELDS; i++) {
+        const mtk_da_config_field *field = &mtk_da_device_config[i];
+
+        int err;
+        switch (field->size) {
+        case 1:
+            err = mtk_device_write8(device, field->value);
+            break;
+        case 2:
+            err = mtk_device_write16(device, field->value);
+            break;
+        default:
+            err = mtk_device_write32(device, field->value);
+            break;
+        }
+        if (err < 0) {
+            return err;
+        }
     }
 
-    //    if ((err = mtk_device_write32(device, 1)) < 0) {
-    //        return err;
-    //    }
-
     return 0;
 }
 
 int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    MTK_TRACE_SCOPE_RANGE("da_send_da", da_addr, da_len);
+
     int err;
     verboseLog("send DA, addr: 0x%x, data: ", da_addr);
     verboseLog("send conf\n");
@@ -183,7 +203,15 @@ int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint8_
         return err;
     }
 
-    usleep(350 * 1000);
+    if (device->timing->config_delay_ms > 0) {
+        usleep(device->timing->config_delay_ms * 1000);
+    }
+
+    unsigned int waited;
+    if ((err = mtk_device_wait(device, device->timing->config_timeout_ms, &waited)) < 0) {
+        return err;
+    }
+    verboseLog("Config reply after %u ms\n", waited + device->timing->config_delay_ms);
 
     uint32_t data32;
     if ((err = mtk_device_read32(device, &data32)) < 0) {
@@ -253,12 +281,19 @@ int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint8_
     }
 
     verboseLog("Wait for write ack\n");
-    usleep(500 * 1000);
+    if (device->timing->boot_delay_ms > 0) {
+        usleep(device->timing->boot_delay_ms * 1000);
+    }
     verboseLog("Write another ack\n");
     if ((err = mtk_device_write8(device, MTK_DA_ACK)) < 0) {
         return err;
     }
 
+    if ((err = mtk_device_wait(device, device->timing->boot_timeout_ms, &waited)) < 0) {
+        return err;
+    }
+    verboseLog("Write ack reply after %u ms\n", waited + device->timing->boot_delay_ms);
+
     if ((err = mtk_device_read8(device, retval)) < 0) {
         return err;
     }
@@ -268,6 +303,8 @@ int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint8_
 }
 
 int mtk_da_usb_check_status(mtk_device *device, uint8_t *usb_status, uint8_t *retval) {
+    MTK_TRACE_SCOPE("da_usb_check_status");
+
     int err;
 
     if ((err = mtk_device_write8(device, MTK_DA_USB_CHECK_STATUS_CMD)) < 0) {
@@ -288,6 +325,8 @@ int mtk_da_usb_check_status(mtk_device *device, uint8_t *usb_status, uint8_t *re
 }
 
 int mtk_da_sdmmc_switch_part(mtk_device *device, uint8_t part, uint8_t *retval) {
+    MTK_TRACE_SCOPE("da_switch_part");
+
     int err;
 
     if ((err = mtk_device_write8(device, MTK_DA_SWITCH_PART_CMD)) < 0) {
@@ -309,9 +348,36 @@ int mtk_da_sdmmc_switch_part(mtk_device *device, uint8_t part, uint8_t *retval)
     return 0;
 }
 
-int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+// Transport failures worth reissuing the command for; an unplugged device is not one of them.
+static bool da_retryable(int err) {
+    return err == LIBUSB_ERROR_TIMEOUT || err == LIBUSB_ERROR_PIPE || err == LIBUSB_ERROR_OVERFLOW || err == LIBUSB_ERROR_IO || err == LIBUSB_ERROR_OTHER;
+}
+
+// Counts the retry, halves the packet size once the same offset failed twice, and resynchronizes the endpoints.
+static int da_prepare_retry(mtk_device *device, const char *what, uint64_t addr, int err, bool progressed, unsigned int *retries, unsigned int *stalled, size_t *packet) {
+    (*retries)++;
+    device->stats.retries++;
+    mtk_metrics_count(MTK_METRICS_RETRIES, 1);
+
+    *stalled = progressed ? 1 : *stalled + 1;
+    if (*stalled >= 2 && *packet > MTK_DA_MIN_PACKET_SIZE) {
+        *packet /= 2;
+    }
+
+    verboseLog("%s failed at 0x%" PRIx64 ": %s, retry %u/%u with 0x%zx byte packets\n", what, addr, libusb_strerror(err), *retries, device->retry_budget, *packet);
+
+    return mtk_device_recover(device);
+}
+
+// Reads [addr + *offset, addr + len); *offset is advanced past every chunk that was checked and handed to the handler, so a retry
+// never hands the same bytes to the handler twice.
+// Chunks are received into buffer, or in place at dest + *offset when dest is set.
+static int da_read_range(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint64_t *offset, size_t packet, uint8_t *buffer,
+    uint8_t *dest, uint8_t *retval, const mtk_io_handler handler, void *user_data, bool *retryable) {
     int err;
 
+    *retryable = true;
+
     if ((err = mtk_device_write8(device, MTK_DA_READ_CMD)) < 0) {
         return err;
     }
@@ -321,10 +387,10 @@ int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t
     if ((err = mtk_device_write8(device, hw_storage)) < 0) {
         return err;
     }
-    if ((err = mtk_device_write64(device, addr)) < 0) {
+    if ((err = mtk_device_write64(device, addr + *offset)) < 0) {
         return err;
     }
-    if ((err = mtk_device_write64(device, len)) < 0) {
+    if ((err = mtk_device_write64(device, len - *offset)) < 0) {
         return err;
     }
 
@@ -335,30 +401,36 @@ int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t
         return 0;
     }
 
-    uint8_t buffer[0x100000];
-    if ((err = mtk_device_write32(device, sizeof(buffer))) < 0) {
+    if ((err = mtk_device_write32(device, packet)) < 0) {
         return err;
     }
 
-    size_t offset = 0;
-    while (offset < len) {
-        size_t count = MIN(sizeof(buffer), len - offset);
+    while (*offset < len) {
+        size_t count = MIN(packet, len - *offset);
+        if (dest != NULL) {
+            buffer = dest + *offset;
+        }
 
+        uint64_t start = mtk_metrics_now();
         if ((err = mtk_device_read(device, buffer, count)) < 0) {
             return err;
         }
 
-        uint16_t chksum = 0;
-        for (size_t i = 0; i < count; i++) {
-            chksum += buffer[i];
-        }
-
         uint16_t chksum_device;
         if ((err = mtk_device_read16(device, &chksum_device)) < 0) {
             return err;
         }
+        mtk_metrics_record(MTK_METRICS_READ_USB, start);
+
+        start = mtk_metrics_now();
+        uint16_t chksum = mtk_da_checksum(0, buffer, count);
+        mtk_metrics_record(MTK_METRICS_READ_CHECKSUM, start);
 
         if (chksum != chksum_device) {
+            device->stats.checksum_errors++;
+            mtk_metrics_count(MTK_METRICS_CHECKSUM_ERRORS, 1);
+            // refuse the packet so the DA drops the command and goes back to waiting for the next one
+            mtk_device_write8(device, MTK_DA_NACK);
             return LIBUSB_ERROR_OTHER;
         }
 
@@ -366,20 +438,69 @@ int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t
             return err;
         }
 
-        if ((err = handler(false, offset, len, buffer, count, user_data)) < 0) {
+        start = mtk_metrics_now();
+        if (handler != NULL && (err = handler(false, *offset, len, buffer, count, user_data)) < 0) {
+            *retryable = false;
             return err;
         }
+        mtk_metrics_record(MTK_METRICS_READ_HANDLER, start);
 
-        offset += count;
+        *offset += count;
     }
 
     return 0;
 }
 
-int mtk_da_sdmmc_write_data(
-    mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+static int da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *buffer, uint8_t *dest, uint8_t *retval,
+    const mtk_io_handler handler, void *user_data) {
+    size_t packet = MTK_DA_PACKET_SIZE;
+    uint64_t offset = 0;
+    unsigned int retries = 0;
+    unsigned int stalled = 0;
+
+    for (;;) {
+        uint64_t start = offset;
+        bool retryable;
+
+        int err = da_read_range(device, hw_storage, addr, len, &offset, packet, buffer, dest, retval, handler, user_data, &retryable);
+        if (err == 0 || !retryable || !da_retryable(err) || retries == device->retry_budget) {
+            return err;
+        }
+
+        if ((err = da_prepare_retry(device, "Read", addr + offset, err, offset > start, &retries, &stalled, &packet)) < 0) {
+            return err;
+        }
+    }
+}
+
+int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    MTK_TRACE_SCOPE_RANGE("da_read", addr, len);
+
+    // page aligned so O_DIRECT output can be written from it without a bounce copy
+    uint8_t buffer[MTK_DA_PACKET_SIZE] __attribute__((aligned(4096)));
+    return da_read(device, hw_storage, addr, len, buffer, NULL, retval, handler, user_data);
+}
+
+// Receives the payload in place into dest[0, len); the optional handler sees each verified chunk where it landed, e.g. for progress.
+int mtk_da_read_into(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *dest, uint8_t *retval, const mtk_io_handler handler,
+    void *user_data) {
+    MTK_TRACE_SCOPE_RANGE("da_read_into", addr, len);
+
+    return da_read(device, hw_storage, addr, len, NULL, dest, retval, handler, user_data);
+}
+
+// Writes [addr + *offset, addr + len); *offset is advanced past every chunk the DA accepted.
+// Chunks are produced into buffer by the handler, or sent in place from src + *offset when src is set, or from src itself for every
+// chunk when repeat is set; chunks that line up with chunk_size take their checksum from chksums.
+// [*filled_start, *filled_end) is what the handler has been called for, and in buffer when src is not set; a retry resends it from there
+// without calling the handler again, in smaller packets if the packet size was halved meanwhile.
+static int da_write_range(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint64_t *offset, size_t packet,
+    uint8_t *buffer, const uint8_t *src, bool repeat, const uint16_t *chksums, size_t chunk_size, uint64_t *filled_start, uint64_t *filled_end,
+    uint8_t *retval, const mtk_io_handler handler, void *user_data, bool *retryable) {
     int err;
 
+    *retryable = true;
+
     if ((err = mtk_device_write8(device, MTK_DA_SDMMC_WRITE_DATA_CMD)) < 0) {
         return err;
     }
@@ -392,15 +513,14 @@ int mtk_da_sdmmc_write_data(
     if ((err = mtk_device_write8(device, part)) < 0) {
         return err;
     }
-    if ((err = mtk_device_write64(device, addr)) < 0) {
+    if ((err = mtk_device_write64(device, addr + *offset)) < 0) {
         return err;
     }
-    if ((err = mtk_device_write64(device, len)) < 0) {
+    if ((err = mtk_device_write64(device, len - *offset)) < 0) {
         return err;
     }
 
-    uint8_t buffer[0x100000];
-    if ((err = mtk_device_write32(device, sizeof(buffer))) < 0) {
+    if ((err = mtk_device_write32(device, packet)) < 0) {
         return err;
     }
 
@@ -411,45 +531,191 @@ int mtk_da_sdmmc_write_data(
         return 0;
     }
 
-    size_t offset = 0;
-    while (offset < len) {
+    while (*offset < len) {
         if ((err = mtk_device_write8(device, MTK_DA_ACK)) < 0) {
-            return 0;
+            return err;
         }
 
-        size_t count = MIN(sizeof(buffer), len - offset);
+        size_t count = MIN(packet, len - *offset);
+        uint64_t start = mtk_metrics_now();
+        if (*offset < *filled_end) {
+            count = MIN(count, *filled_end - *offset);
+        } else {
+            // with src the handler only observes the chunk, e.g. for progress
+            uint8_t *chunk = src == NULL ? buffer : (uint8_t *)(repeat ? src : src + *offset);
+            if (handler != NULL && (err = handler(true, *offset, len, chunk, count, user_data)) < 0) {
+                *retryable = false;
+                return err;
+            }
+            *filled_start = *offset;
+            *filled_end = *offset + count;
+        }
+        mtk_metrics_record(MTK_METRICS_WRITE_HANDLER, start);
+
+        const uint8_t *data = src == NULL ? buffer + (*offset - *filled_start) : repeat ? src : src + *offset;
+
+        start = mtk_metrics_now();
+        uint16_t chksum;
+        if (chksums != NULL && repeat && count == chunk_size) {
+            chksum = chksums[0];
+        } else if (chksums != NULL && !repeat && *offset % chunk_size == 0 && count == MIN(chunk_size, len - *offset)) {
+            chksum = chksums[*offset / chunk_size];
+        } else {
+            chksum = mtk_da_checksum(0, data, count);
+        }
+        mtk_metrics_record(MTK_METRICS_WRITE_CHECKSUM, start);
 
-        if ((err = handler(true, offset, len, buffer, count, user_data)) < 0) {
+        start = mtk_metrics_now();
+        if ((err = mtk_device_write(device, data, count)) < 0) {
+            return err;
+        }
+        if ((err = mtk_device_write16(device, chksum)) < 0) {
             return err;
         }
+        mtk_metrics_record(MTK_METRICS_WRITE_USB, start);
 
-        if ((err = mtk_device_write(device, buffer, count)) < 0) {
+        start = mtk_metrics_now();
+        if ((err = mtk_device_read8(device, retval)) < 0) {
             return err;
         }
+        mtk_metrics_record(MTK_METRICS_WRITE_ACK, start);
+        if (*retval == MTK_DA_NACK) {
+            device->stats.checksum_errors++;
+            mtk_metrics_count(MTK_METRICS_CHECKSUM_ERRORS, 1);
+            return LIBUSB_ERROR_OTHER;
+        }
+        if (*retval != MTK_DA_CONT_CHAR) {
+            return 0;
+        }
 
-        uint16_t chksum = 0;
-        for (size_t i = 0; i < count; i++) {
-            chksum += buffer[i];
+        *offset += count;
+    }
+
+    return 0;
+}
+
+static int da_write(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t *buffer, const uint8_t *src,
+    bool repeat, const uint16_t *chksums, size_t chunk_size, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    size_t packet = MTK_DA_PACKET_SIZE;
+    uint64_t offset = 0;
+    uint64_t filled_start = 0;
+    uint64_t filled_end = 0;
+    unsigned int retries = 0;
+    unsigned int stalled = 0;
+
+    for (;;) {
+        uint64_t start = offset;
+        bool retryable;
+
+        int err = da_write_range(device, storage_type, part, addr, len, &offset, packet, buffer, src, repeat, chksums, chunk_size, &filled_start,
+            &filled_end, retval, handler, user_data, &retryable);
+        if (err == 0 || !retryable || !da_retryable(err) || retries == device->retry_budget) {
+            return err;
         }
 
-        if ((err = mtk_device_write16(device, chksum)) < 0) {
+        if ((err = da_prepare_retry(device, "Write", addr + offset, err, offset > start, &retries, &stalled, &packet)) < 0) {
             return err;
         }
+    }
+}
 
-        if ((err = mtk_device_read8(device, retval)) < 0) {
+int mtk_da_sdmmc_write_data(
+    mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    MTK_TRACE_SCOPE_RANGE("da_write_data", addr, len);
+
+    uint8_t buffer[MTK_DA_PACKET_SIZE] __attribute__((aligned(4096)));
+    return da_write(device, storage_type, part, addr, len, buffer, NULL, false, NULL, 0, retval, handler, user_data);
+}
+
+// Sends src[0, len) in place; chksums[i] is the checksum of the chunk at i * chunk_size, used while packets are chunk_size long.
+int mtk_da_sdmmc_write_data_from(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, const uint8_t *src,
+    const uint16_t *chksums, size_t chunk_size, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    MTK_TRACE_SCOPE_RANGE("da_write_data_from", addr, len);
+
+    return da_write(device, storage_type, part, addr, len, NULL, src, false, chksums, chunk_size, retval, handler, user_data);
+}
+
+int mtk_da_sdmmc_fill(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t pattern, uint8_t *retval,
+    const mtk_io_handler handler, void *user_data) {
+    MTK_TRACE_SCOPE_RANGE("da_fill", addr, len);
+
+    // every full packet is the same, so its checksum is computed once
+    uint8_t packet[MTK_DA_PACKET_SIZE] __attribute__((aligned(4096)));
+    memset(packet, pattern, sizeof(packet));
+    uint16_t chksum = mtk_da_checksum(0, packet, sizeof(packet));
+
+    return da_write(device, storage_type, part, addr, len, NULL, packet, true, &chksum, sizeof(packet), retval, handler, user_data);
+}
+
+int mtk_da_format(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint32_t *status, uint8_t *retval,
+    const mtk_io_handler handler, void *user_data) {
+    MTK_TRACE_SCOPE_RANGE("da_format", addr, len);
+
+    int err;
+
+    *status = 0;
+
+    // acknowledged on its own, so a DA without the command refuses it before any parameter is taken for a command
+    if ((err = mtk_device_write8(device, MTK_DA_FORMAT_CMD)) < 0) {
+        return err;
+    }
+    if ((err = mtk_device_read8(device, retval)) < 0) {
+        return err;
+    }
+    if (*retval != MTK_DA_ACK) {
+        return 0;
+    }
+
+    if ((err = mtk_device_write8(device, storage_type)) < 0) {
+        return err;
+    }
+    if ((err = mtk_device_write8(device, part)) < 0) {
+        return err;
+    }
+    if ((err = mtk_device_write64(device, addr)) < 0) {
+        return err;
+    }
+    if ((err = mtk_device_write64(device, len)) < 0) {
+        return err;
+    }
+
+    // the DA took the command but not its parameters, and what it expects next is unknown, so this is not a plain refusal
+    if ((err = mtk_device_read8(device, retval)) < 0) {
+        return err;
+    }
+    if (*retval != MTK_DA_ACK) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+
+    // the DA reports status and percentage done until it reaches 100, each acknowledged by the host
+    uint8_t percent = 0;
+    while (percent < 100) {
+        if ((err = mtk_device_read32(device, status)) < 0) {
             return err;
         }
-        if (*retval != MTK_DA_CONT_CHAR) {
+        if ((err = mtk_device_read8(device, &percent)) < 0) {
+            return err;
+        }
+        if ((err = mtk_device_write8(device, MTK_DA_ACK)) < 0) {
+            return err;
+        }
+        if (*status != 0) {
+            verboseLog("Format failed at %" PRIu8 "%%: status 0x%08" PRIx32 "\n", percent, *status);
             return 0;
         }
 
-        offset += count;
+        uint64_t done = percent >= 100 ? len : len / 100 * percent;
+        if (handler != NULL && (err = handler(true, 0, len, NULL, done, user_data)) < 0) {
+            return err;
+        }
     }
 
-    return 0;
+    return mtk_device_read8(device, retval);
 }
 
 int mtk_da_enable_watchdog(mtk_device *device, uint16_t timeout_ms, bool async, bool bootup, bool dlbit, bool not_reset_rtc_time, uint8_t *retval) {
+    MTK_TRACE_SCOPE("da_enable_watchdog");
+
     int err;
 
     if ((err = mtk_device_write8(device, MTK_DA_ENABLE_WATCHDOG_CMD)) < 0) {
@@ -1,4 +1,6 @@
 #include "mtk_device.h"
+#include "mtk_metrics.h"
+#include <stdlib.h>
 #include <string.h>
 
 #include <libusb.h>
@@ -26,10 +28,144 @@ static inline uint64_t be64toh(uint64_t x) { return ((uint64_t)ntohl(x & 0xFFFFF
 
 bool verbose = false;
 
-int mtk_device_open(mtk_device *device, libusb_device_handle *dev) {
-    device->dev = dev;
+/*
+ * Only the config reply is polled for on MT8590. The boot delay runs before the
+ * host sends the ACK that starts the DA, so there is nothing to poll for yet and
+ * it keeps the original 500 ms.
+ */
+static const mtk_soc_timing soc_timings[] = {
+    { .hw_code = 0x8590, .config_delay_ms = 0, .config_timeout_ms = 1000, .boot_delay_ms = 500, .boot_timeout_ms = 2000, .preloader_timeout_ms = 1000 },
+};
+
+// unverified SoCs keep the settle times the handshake was originally written with
+static const mtk_soc_timing default_timing = {
+    .hw_code = 0, .config_delay_ms = 350, .config_timeout_ms = 1000, .boot_delay_ms = 500, .boot_timeout_ms = 2000, .preloader_timeout_ms = 1000
+};
+
+const mtk_soc_timing *mtk_soc_timing_get(uint16_t hw_code) {
+    for (size_t i = 0; i < sizeof(soc_timings) / sizeof(soc_timings[0]); i++) {
+        if (soc_timings[i].hw_code == hw_code) {
+            return &soc_timings[i];
+        }
+    }
+
+    return &default_timing;
+}
+
+static int usb_bulk_in(void *ctx, uint8_t *buffer, int length, int *transferred, unsigned int timeout_ms) {
+    return libusb_bulk_transfer(ctx, MTK_DEVICE_EPIN, buffer, length, transferred, timeout_ms);
+}
+
+static int usb_bulk_out(void *ctx, const uint8_t *buffer, int length, int *transferred, unsigned int timeout_ms) {
+    return libusb_bulk_transfer(ctx, MTK_DEVICE_EPOUT, (uint8_t *)buffer, length, transferred, timeout_ms);
+}
+
+static int usb_clear_halt(void *ctx) {
+    int err;
+
+    if ((err = libusb_clear_halt(ctx, MTK_DEVICE_EPIN)) < 0 && err != LIBUSB_ERROR_NOT_FOUND) {
+        return err;
+    }
+    if ((err = libusb_clear_halt(ctx, MTK_DEVICE_EPOUT)) < 0 && err != LIBUSB_ERROR_NOT_FOUND) {
+        return err;
+    }
+
+    return 0;
+}
+
+static int usb_control(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index) {
+    return libusb_control_transfer(ctx, request_type, request, value, index, NULL, 0, 0);
+}
+
+static int usb_transfer_status(enum libusb_transfer_status status) {
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return LIBUSB_ERROR_INTERRUPTED;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+static void LIBUSB_CALL usb_transfer_done(struct libusb_transfer *usb_transfer) {
+    mtk_transfer *transfer = usb_transfer->user_data;
+    transfer->priv = NULL;
+    transfer->status = usb_transfer_status(usb_transfer->status);
+    transfer->actual_length = usb_transfer->actual_length;
+    transfer->callback(transfer);
+}
+
+// A libusb transfer per submission, freed by libusb once the callback returned; control requests also own their setup packet.
+static int usb_submit(void *ctx, mtk_transfer *transfer) {
+    struct libusb_transfer *usb_transfer = libusb_alloc_transfer(0);
+    if (usb_transfer == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    usb_transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
+
+    if (transfer->endpoint == 0) {
+        uint8_t *setup = malloc(LIBUSB_CONTROL_SETUP_SIZE);
+        if (setup == NULL) {
+            libusb_free_transfer(usb_transfer);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        libusb_fill_control_setup(setup, transfer->request_type, transfer->request, transfer->value, transfer->index, 0);
+        libusb_fill_control_transfer(usb_transfer, ctx, setup, usb_transfer_done, transfer, transfer->timeout_ms);
+        usb_transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+    } else {
+        libusb_fill_bulk_transfer(usb_transfer, ctx, transfer->endpoint, transfer->buffer, transfer->length, usb_transfer_done, transfer, transfer->timeout_ms);
+    }
+
+    int err = libusb_submit_transfer(usb_transfer);
+    if (err < 0) {
+        // also frees the setup packet
+        libusb_free_transfer(usb_transfer);
+        return err;
+    }
+
+    transfer->priv = usb_transfer;
+    return 0;
+}
+
+static int usb_cancel(void *ctx, mtk_transfer *transfer) {
+    (void)ctx;
+    return transfer->priv == NULL ? LIBUSB_ERROR_NOT_FOUND : libusb_cancel_transfer(transfer->priv);
+}
+
+static const mtk_transport usb_transport = {
+    .bulk_in = usb_bulk_in,
+    .bulk_out = usb_bulk_out,
+    .clear_halt = usb_clear_halt,
+    .control = usb_control,
+    .submit = usb_submit,
+    .cancel = usb_cancel,
+};
+
+// Sets up a device that talks over the given transport instead of a USB handle.
+void mtk_device_open_transport(mtk_device *device, const mtk_transport *transport, void *ctx) {
+    device->dev = NULL;
+    device->transport = transport;
+    device->transport_ctx = ctx;
+    device->timing = &default_timing;
+    device->retry_budget = MTK_DEVICE_RETRIES;
+    memset(&device->stats, 0, sizeof(device->stats));
+    device->echo_pipeline = false;
     device->buffer_offset = 0;
     device->buffer_available = 0;
+}
+
+int mtk_device_open(mtk_device *device, libusb_device_handle *dev) {
+    mtk_device_open_transport(device, &usb_transport, dev);
+    device->dev = dev;
 
     int err;
 
@@ -131,18 +267,139 @@ int mtk_device_detect(mtk_device *device, libusb_context *ctx) {
     return mtk_device_open(device, devh);
 }
 
+// Opens the MediaTek device attached at the given bus and port path, for callers that track devices per port.
+int mtk_device_open_path(mtk_device *device, libusb_context *ctx, uint8_t bus, const uint8_t *ports, int ports_count) {
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    if (count < 0) {
+        return (int)count;
+    }
+
+    int err = LIBUSB_ERROR_NO_DEVICE;
+    for (ssize_t i = 0; i < count; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) < 0 || desc.idVendor != MTK_DEVICE_VID || desc.idProduct != MTK_DEVICE_PID) {
+            continue;
+        }
+        if (libusb_get_bus_number(list[i]) != bus) {
+            continue;
+        }
+
+        uint8_t path[MTK_DEVICE_MAX_PORTS];
+        int n = libusb_get_port_numbers(list[i], path, sizeof(path));
+        if (n != ports_count || memcmp(path, ports, n) != 0) {
+            continue;
+        }
+
+        libusb_device_handle *devh;
+        if ((err = libusb_open(list[i], &devh)) < 0) {
+            break;
+        }
+        if ((err = mtk_device_open(device, devh)) < 0) {
+            libusb_close(devh);
+        }
+        break;
+    }
+
+    libusb_free_device_list(list, 1);
+    return err;
+}
+
+void mtk_device_close(mtk_device *device) {
+    if (device->dev == NULL) {
+        return;
+    }
+
+    libusb_release_interface(device->dev, MTK_DEVICE_INTERFACE);
+    libusb_close(device->dev);
+    device->dev = NULL;
+}
+
+// Blocks until the device has data pending or timeout_ms elapses; the data is kept for the next read.
+int mtk_device_wait(mtk_device *device, unsigned int timeout_ms, unsigned int *waited_ms) {
+    uint64_t start = monotonic_us();
+    int err = 0;
+
+    if (device->buffer_available == 0) {
+        int transferred = 0;
+        err = device->transport->bulk_in(device->transport_ctx, device->buffer, MTK_DEVICE_PKTSIZE, &transferred, timeout_ms);
+        if (transferred > 0) {
+            device->buffer_offset = 0;
+            device->buffer_available = transferred;
+            err = 0;
+        }
+    }
+
+    if (waited_ms != NULL) {
+        *waited_ms = (monotonic_us() - start) / 1000;
+    }
+
+    return err < 0 ? err : 0;
+}
+
+// Clears stalled endpoints and discards whatever the device still had in flight, so a reissued command starts clean.
+int mtk_device_recover(mtk_device *device) {
+    int err;
+
+    device->buffer_available = 0;
+
+    if ((err = device->transport->clear_halt(device->transport_ctx)) < 0) {
+        return err;
+    }
+
+    for (int i = 0; i < MTK_DEVICE_DRAIN_MAX_PACKETS; i++) {
+        int transferred = 0;
+        err = device->transport->bulk_in(device->transport_ctx, device->buffer, MTK_DEVICE_PKTSIZE, &transferred, MTK_DEVICE_DRAIN_TMOUT);
+        if (err == LIBUSB_ERROR_NO_DEVICE) {
+            return err;
+        }
+        if (err < 0 || transferred == 0) {
+            break;
+        }
+        verboseLog("Drained %d bytes\n", transferred);
+    }
+
+    return 0;
+}
+
 int mtk_device_read(mtk_device *device, uint8_t *buffer, size_t size) {
     size_t offset = 0;
 
     while (offset < size) {
+        // whole packets go straight to the caller; only the tail goes through the packet buffer
+        size_t direct = (size - offset) / MTK_DEVICE_PKTSIZE * MTK_DEVICE_PKTSIZE;
+        if (device->buffer_available == 0 && buffer != NULL && direct > 0) {
+            int transferred;
+
+            int err;
+            if ((err = device->transport->bulk_in(device->transport_ctx, buffer + offset, MIN(direct, MTK_DEVICE_DIRECT_MAX), &transferred, MTK_DEVICE_TMOUT)) < 0) {
+                if (err == LIBUSB_ERROR_TIMEOUT) {
+                    device->stats.timeouts++;
+                    mtk_metrics_count(MTK_METRICS_TIMEOUTS, 1);
+                }
+                return err;
+            }
+
+            device->stats.bytes_read += transferred;
+            mtk_metrics_count(MTK_METRICS_BYTES_READ, transferred);
+            offset += transferred;
+            continue;
+        }
+
         if (device->buffer_available == 0) {
             int transferred;
 
             int err;
-            if ((err = libusb_bulk_transfer(device->dev, MTK_DEVICE_EPIN, device->buffer, MTK_DEVICE_PKTSIZE, &transferred, MTK_DEVICE_TMOUT)) < 0) {
+            if ((err = device->transport->bulk_in(device->transport_ctx, device->buffer, MTK_DEVICE_PKTSIZE, &transferred, MTK_DEVICE_TMOUT)) < 0) {
+                if (err == LIBUSB_ERROR_TIMEOUT) {
+                    device->stats.timeouts++;
+                    mtk_metrics_count(MTK_METRICS_TIMEOUTS, 1);
+                }
                 return err;
             }
 
+            device->stats.bytes_read += transferred;
+            mtk_metrics_count(MTK_METRICS_BYTES_READ, transferred);
             device->buffer_offset = 0;
             device->buffer_available = transferred;
         }
@@ -191,11 +448,17 @@ int mtk_device_write(mtk_device *device, const uint8_t *buffer, size_t size) {
         }
         int transferred;
 
-        int err = libusb_bulk_transfer(device->dev, MTK_DEVICE_EPOUT, (uint8_t *)buffer + offset, size - offset, &transferred, MTK_DEVICE_TMOUT);
+        int err = device->transport->bulk_out(device->transport_ctx, buffer + offset, size - offset, &transferred, MTK_DEVICE_TMOUT);
         if (err < 0) {
+            if (err == LIBUSB_ERROR_TIMEOUT) {
+                device->stats.timeouts++;
+                mtk_metrics_count(MTK_METRICS_TIMEOUTS, 1);
+            }
             return err;
         }
 
+        device->stats.bytes_written += transferred;
+        mtk_metrics_count(MTK_METRICS_BYTES_WRITTEN, transferred);
         offset += transferred;
     }
 
@@ -325,3 +588,24 @@ int mtk_device_echo64(mtk_device *device, uint64_t data) {
 
     return 0;
 }
+
+int mtk_device_echo(mtk_device *device, const uint8_t *data, size_t size) {
+    int err;
+
+    if ((err = mtk_device_write(device, data, size)) < 0) {
+        return err;
+    }
+
+    uint8_t reply[64];
+    for (size_t offset = 0; offset < size; offset += sizeof(reply)) {
+        size_t count = MIN(sizeof(reply), size - offset);
+        if ((err = mtk_device_read(device, reply, count)) < 0) {
+            return err;
+        }
+        if (memcmp(reply, data + offset, count) != 0) {
+            return LIBUSB_ERROR_OTHER;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,1033 @@
+#include "mtk_emulator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+#include "mtk_da.h"
+#include "mtk_preloader.h"
+#include "flash_tool/util.h"
+#include "util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// stage 2 flash info reports, sent right after the DA booted; the eMMC one is filled in, the rest are zero
+static const uint8_t report_sizes[MTK_DA_FLASH_REPORTS] = { 0x1c, 0x11, 0xe, 0x9, MTK_DA_EMMC_REPORT_SIZE, 0x1c, 0x26 };
+
+// erase group of the modelled card; a write packet that starts or ends inside one costs a read-modify-write of it
+#define EMU_ERASE_GROUP_SIZE (512 * 1024)
+
+#define EMU_STATUS_UNSUPPORTED (0x1d0c)
+
+// Byte stream in one direction; grows as needed, the protocol keeps it to about one packet.
+typedef struct {
+    uint8_t *data;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} emu_pipe;
+
+typedef struct {
+    uint8_t *data;
+    uint64_t size;
+} emu_area;
+
+// asynchronous transfer waiting for handle_events
+typedef struct emu_transfer {
+    mtk_transfer *transfer;
+    // 0 without a timeout
+    uint64_t deadline_us;
+    bool cancelled;
+    struct emu_transfer *next;
+} emu_transfer;
+
+struct mtk_emulator {
+    mtk_emulator_config config;
+
+    int fd;
+    uint64_t user_size;
+    emu_area areas[MTK_DA_EMMC_PART_USER];
+    uint8_t part;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    emu_pipe in;
+    emu_pipe out;
+    // the firmware has stopped (watchdog reboot or closing); transfers fail like on an unplugged device
+    bool gone;
+    bool closing;
+    // when the modelled link is free again
+    uint64_t link_busy_until;
+    // submitted asynchronous transfers in order; only touched by the host thread
+    emu_transfer *pending;
+
+    uint8_t *packet;
+};
+
+static const uint32_t emu_cid[4] = { 0x15010038, 0x474e4433, 0x52021f2b, 0x3e1a2c00 };
+
+static int pipe_push(emu_pipe *pipe, const uint8_t *data, size_t size) {
+    if (pipe->tail + size > pipe->capacity && pipe->head > 0) {
+        memmove(pipe->data, pipe->data + pipe->head, pipe->tail - pipe->head);
+        pipe->tail -= pipe->head;
+        pipe->head = 0;
+    }
+    if (pipe->tail + size > pipe->capacity) {
+        size_t capacity = pipe->capacity == 0 ? 0x10000 : pipe->capacity;
+        while (capacity < pipe->tail + size) {
+            capacity *= 2;
+        }
+        uint8_t *data = realloc(pipe->data, capacity);
+        if (data == NULL) {
+            return -ENOMEM;
+        }
+        pipe->data = data;
+        pipe->capacity = capacity;
+    }
+
+    memcpy(pipe->data + pipe->tail, data, size);
+    pipe->tail += size;
+    return 0;
+}
+
+static size_t pipe_pop(emu_pipe *pipe, uint8_t *data, size_t size) {
+    size = MIN(size, pipe->tail - pipe->head);
+    if (size == 0) {
+        return 0;
+    }
+    memcpy(data, pipe->data + pipe->head, size);
+    pipe->head += size;
+    if (pipe->head == pipe->tail) {
+        pipe->head = pipe->tail = 0;
+    }
+    return size;
+}
+
+static void sleep_until(uint64_t deadline_us) {
+    uint64_t now = monotonic_us();
+    if (deadline_us > now) {
+        uint64_t us = deadline_us - now;
+        struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Transfers queue up on the one modelled link; the caller returns once its transfer would have completed.
+static void link_transfer(mtk_emulator *emulator, size_t size) {
+    const mtk_emulator_config *config = &emulator->config;
+    if (config->bandwidth == 0 && config->latency_us == 0) {
+        return;
+    }
+
+    uint64_t cost = config->latency_us;
+    if (config->bandwidth > 0) {
+        cost += size * 1000000 / config->bandwidth;
+    }
+
+    pthread_mutex_lock(&emulator->lock);
+    uint64_t start = MAX(monotonic_us(), emulator->link_busy_until);
+    uint64_t done = start + cost;
+    emulator->link_busy_until = done;
+    pthread_mutex_unlock(&emulator->lock);
+
+    sleep_until(done);
+}
+
+// host side
+
+// pthread_cond_timedwait deadline us from now
+static struct timespec wait_deadline(uint64_t us) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += us / 1000000;
+    deadline.tv_nsec += (long)(us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+static int emu_bulk_in(void *ctx, uint8_t *buffer, int length, int *transferred, unsigned int timeout_ms) {
+    mtk_emulator *emulator = ctx;
+    *transferred = 0;
+
+    struct timespec deadline = wait_deadline((uint64_t)timeout_ms * 1000);
+
+    pthread_mutex_lock(&emulator->lock);
+    int err = 0;
+    while (emulator->out.head == emulator->out.tail && !emulator->gone && err == 0) {
+        // like libusb, a zero timeout waits forever
+        err = timeout_ms == 0 ? pthread_cond_wait(&emulator->cond, &emulator->lock) : pthread_cond_timedwait(&emulator->cond, &emulator->lock, &deadline);
+    }
+    size_t count = pipe_pop(&emulator->out, buffer, length);
+    bool gone = emulator->gone;
+    pthread_mutex_unlock(&emulator->lock);
+
+    if (count == 0) {
+        return gone ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_TIMEOUT;
+    }
+
+    link_transfer(emulator, count);
+    *transferred = count;
+    return 0;
+}
+
+static int emu_bulk_out(void *ctx, const uint8_t *buffer, int length, int *transferred, unsigned int timeout_ms) {
+    (void)timeout_ms;
+    mtk_emulator *emulator = ctx;
+    *transferred = 0;
+
+    link_transfer(emulator, length);
+
+    pthread_mutex_lock(&emulator->lock);
+    int err = emulator->gone ? LIBUSB_ERROR_NO_DEVICE : pipe_push(&emulator->in, buffer, length) < 0 ? LIBUSB_ERROR_NO_MEM : 0;
+    pthread_cond_broadcast(&emulator->cond);
+    pthread_mutex_unlock(&emulator->lock);
+
+    if (err == 0) {
+        *transferred = length;
+    }
+    return err;
+}
+
+static int emu_clear_halt(void *ctx) {
+    mtk_emulator *emulator = ctx;
+
+    pthread_mutex_lock(&emulator->lock);
+    bool gone = emulator->gone;
+    pthread_mutex_unlock(&emulator->lock);
+
+    return gone ? LIBUSB_ERROR_NO_DEVICE : 0;
+}
+
+static int emu_control(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index) {
+    (void)request_type;
+    (void)request;
+    (void)value;
+    (void)index;
+    return emu_clear_halt(ctx);
+}
+
+static int emu_submit(void *ctx, mtk_transfer *transfer) {
+    mtk_emulator *emulator = ctx;
+
+    emu_transfer *node = calloc(1, sizeof(emu_transfer));
+    if (node == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    node->transfer = transfer;
+    if (transfer->endpoint == MTK_DEVICE_EPIN && transfer->timeout_ms > 0) {
+        node->deadline_us = monotonic_us() + (uint64_t)transfer->timeout_ms * 1000;
+    }
+
+    emu_transfer **tail = &emulator->pending;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = node;
+
+    transfer->priv = node;
+    return 0;
+}
+
+static int emu_cancel(void *ctx, mtk_transfer *transfer) {
+    (void)ctx;
+    if (transfer->priv == NULL) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    emu_transfer *node = transfer->priv;
+    node->cancelled = true;
+    return 0;
+}
+
+// Runs the transfer through the blocking calls when it can complete now; an IN transfer is not ready while nothing arrived.
+static bool emu_try_complete(mtk_emulator *emulator, emu_transfer *node, uint64_t now) {
+    mtk_transfer *transfer = node->transfer;
+    transfer->actual_length = 0;
+
+    if (node->cancelled) {
+        transfer->status = LIBUSB_ERROR_INTERRUPTED;
+        return true;
+    }
+
+    if (transfer->endpoint == 0) {
+        transfer->status = emu_control(emulator, transfer->request_type, transfer->request, transfer->value, transfer->index);
+        return true;
+    }
+    if (transfer->endpoint == MTK_DEVICE_EPOUT) {
+        transfer->status = emu_bulk_out(emulator, transfer->buffer, transfer->length, &transfer->actual_length, transfer->timeout_ms);
+        return true;
+    }
+
+    pthread_mutex_lock(&emulator->lock);
+    size_t count = pipe_pop(&emulator->out, transfer->buffer, transfer->length);
+    bool gone = emulator->gone;
+    pthread_mutex_unlock(&emulator->lock);
+
+    if (count > 0) {
+        link_transfer(emulator, count);
+        transfer->actual_length = count;
+        transfer->status = 0;
+        return true;
+    }
+    if (gone || (node->deadline_us > 0 && now >= node->deadline_us)) {
+        transfer->status = gone ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_TIMEOUT;
+        return true;
+    }
+    return false;
+}
+
+// Completes the first pending transfer that is ready; otherwise lowers wake_us to the earliest IN timeout.
+static bool emu_complete_one(mtk_emulator *emulator, uint64_t *wake_us) {
+    uint64_t now = monotonic_us();
+    for (emu_transfer **link = &emulator->pending; *link != NULL; link = &(*link)->next) {
+        emu_transfer *node = *link;
+        if (!emu_try_complete(emulator, node, now)) {
+            if (node->deadline_us > 0) {
+                *wake_us = MIN(*wake_us, node->deadline_us);
+            }
+            continue;
+        }
+
+        // unlinked first: the callback may submit or cancel
+        *link = node->next;
+        mtk_transfer *transfer = node->transfer;
+        transfer->priv = NULL;
+        free(node);
+        transfer->callback(transfer);
+        return true;
+    }
+    return false;
+}
+
+// Completes everything that is ready, so a callback's next OUT transfer goes out in the same call.
+static int emu_handle_events(void *ctx, unsigned int timeout_ms) {
+    mtk_emulator *emulator = ctx;
+    uint64_t until = monotonic_us() + (uint64_t)timeout_ms * 1000;
+
+    bool completed = false;
+    while (emulator->pending != NULL) {
+        uint64_t wake_us = until;
+        if (emu_complete_one(emulator, &wake_us)) {
+            completed = true;
+            continue;
+        }
+
+        uint64_t now = monotonic_us();
+        if (completed || now >= wake_us) {
+            break;
+        }
+
+        // only IN transfers are left: wait for the device to send something
+        struct timespec deadline = wait_deadline(wake_us - now);
+        pthread_mutex_lock(&emulator->lock);
+        int err = 0;
+        while (emulator->out.head == emulator->out.tail && !emulator->gone && err == 0) {
+            err = pthread_cond_timedwait(&emulator->cond, &emulator->lock, &deadline);
+        }
+        pthread_mutex_unlock(&emulator->lock);
+    }
+
+    return 0;
+}
+
+static const mtk_transport emu_transport = {
+    .bulk_in = emu_bulk_in,
+    .bulk_out = emu_bulk_out,
+    .clear_halt = emu_clear_halt,
+    .control = emu_control,
+    .submit = emu_submit,
+    .cancel = emu_cancel,
+    .handle_events = emu_handle_events,
+};
+
+// device side; every helper fails with -ECANCELED once the emulator is closing
+
+static int dev_read(mtk_emulator *emulator, uint8_t *data, size_t size) {
+    pthread_mutex_lock(&emulator->lock);
+    while (emulator->in.tail - emulator->in.head < size && !emulator->closing) {
+        pthread_cond_wait(&emulator->cond, &emulator->lock);
+    }
+    int err = emulator->closing ? -ECANCELED : 0;
+    if (err == 0) {
+        pipe_pop(&emulator->in, data, size);
+    }
+    pthread_mutex_unlock(&emulator->lock);
+
+    return err;
+}
+
+static int dev_write(mtk_emulator *emulator, const uint8_t *data, size_t size) {
+    pthread_mutex_lock(&emulator->lock);
+    int err = emulator->closing ? -ECANCELED : pipe_push(&emulator->out, data, size);
+    pthread_cond_broadcast(&emulator->cond);
+    pthread_mutex_unlock(&emulator->lock);
+
+    return err;
+}
+
+static int dev_read_be(mtk_emulator *emulator, uint64_t *value, size_t size) {
+    uint8_t data[8];
+    int err;
+    if ((err = dev_read(emulator, data, size)) < 0) {
+        return err;
+    }
+
+    *value = 0;
+    for (size_t i = 0; i < size; i++) {
+        *value = *value << 8 | data[i];
+    }
+    return 0;
+}
+
+static int dev_write_be(mtk_emulator *emulator, uint64_t value, size_t size) {
+    uint8_t data[8];
+    for (size_t i = 0; i < size; i++) {
+        data[i] = value >> (8 * (size - 1 - i));
+    }
+    return dev_write(emulator, data, size);
+}
+
+static int dev_read8(mtk_emulator *emulator, uint8_t *value) { return dev_read(emulator, value, 1); }
+static int dev_write8(mtk_emulator *emulator, uint8_t value) { return dev_write(emulator, &value, 1); }
+static int dev_write16(mtk_emulator *emulator, uint16_t value) { return dev_write_be(emulator, value, 2); }
+static int dev_write32(mtk_emulator *emulator, uint32_t value) { return dev_write_be(emulator, value, 4); }
+
+static int dev_read32(mtk_emulator *emulator, uint32_t *value) {
+    uint64_t v;
+    int err = dev_read_be(emulator, &v, 4);
+    if (err < 0) {
+        return err;
+    }
+    *value = v;
+    return 0;
+}
+
+// Parameters of preloader commands are echoed back one by one.
+static int dev_echo32(mtk_emulator *emulator, uint32_t *value) {
+    int err;
+    if ((err = dev_read32(emulator, value)) < 0) {
+        return err;
+    }
+    return dev_write32(emulator, *value);
+}
+
+// virtual eMMC
+
+static uint64_t area_size(const mtk_emulator *emulator, uint8_t part) {
+    switch (part) {
+    case MTK_DA_EMMC_PART_BOOT1:
+    case MTK_DA_EMMC_PART_BOOT2:
+        return MTK_EMULATOR_BOOT_SIZE;
+    case MTK_DA_EMMC_PART_RPMB:
+        return MTK_EMULATOR_RPMB_SIZE;
+    case MTK_DA_EMMC_PART_USER:
+        return emulator->user_size;
+    default:
+        return 0;
+    }
+}
+
+static bool area_contains(const mtk_emulator *emulator, uint8_t part, uint64_t addr, uint64_t len) {
+    uint64_t size = area_size(emulator, part);
+    return addr <= size && len <= size - addr;
+}
+
+static int storage_transfer(mtk_emulator *emulator, bool writing, uint8_t part, uint64_t addr, uint8_t *data, size_t size) {
+    if (part != MTK_DA_EMMC_PART_USER) {
+        // in-memory areas are allocated on first write and read as zeroes before that
+        emu_area *area = &emulator->areas[part - 1];
+        if (area->data == NULL) {
+            if (!writing) {
+                memset(data, 0, size);
+                return 0;
+            }
+            area->size = area_size(emulator, part);
+            if ((area->data = calloc(1, area->size)) == NULL) {
+                return -ENOMEM;
+            }
+        }
+
+        if (writing) {
+            memcpy(area->data + addr, data, size);
+        } else {
+            memcpy(data, area->data + addr, size);
+        }
+        return 0;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+#ifdef _WIN32
+        if (lseek(emulator->fd, addr + done, SEEK_SET) < 0) {
+            return -errno;
+        }
+        ssize_t n = writing ? write(emulator->fd, data + done, size - done) : read(emulator->fd, data + done, size - done);
+#else
+        ssize_t n = writing ? pwrite(emulator->fd, data + done, size - done, addr + done) : pread(emulator->fd, data + done, size - done, addr + done);
+#endif
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+// preloader
+
+static int run_start(mtk_emulator *emulator) {
+    static const uint8_t start_command[] = { 0xa0, 0x0a, 0x50, 0x05 };
+
+    size_t i = 0;
+    while (i < sizeof(start_command)) {
+        uint8_t data;
+        int err;
+        if ((err = dev_read8(emulator, &data)) < 0) {
+            return err;
+        }
+
+        // a wrong byte is echoed uninverted, which makes the host start over
+        if (data == start_command[i]) {
+            data = ~data;
+            i++;
+        } else {
+            i = 0;
+        }
+        if ((err = dev_write8(emulator, data)) < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int run_send_da(mtk_emulator *emulator) {
+    uint32_t addr, len, sig_len;
+    int err;
+
+    if ((err = dev_echo32(emulator, &addr)) < 0 || (err = dev_echo32(emulator, &len)) < 0 || (err = dev_echo32(emulator, &sig_len)) < 0) {
+        return err;
+    }
+    if ((err = dev_write16(emulator, 0)) < 0) {
+        return err;
+    }
+
+    // the image is only checksummed; the emulated DA is built in
+    uint16_t chksum = 0;
+    uint32_t offset = 0;
+    while (offset < len) {
+        // even block sizes keep the 16-bit words aligned across blocks
+        uint32_t count = MIN((uint32_t)MTK_EMULATOR_MAX_PACKET, len - offset);
+        if ((err = dev_read(emulator, emulator->packet, count)) < 0) {
+            return err;
+        }
+        chksum = mtk_preloader_checksum(chksum, emulator->packet, count);
+        offset += count;
+    }
+
+    if ((err = dev_write16(emulator, chksum)) < 0) {
+        return err;
+    }
+    return dev_write16(emulator, 0);
+}
+
+// Answers preloader commands until JUMP_DA.
+static int run_preloader(mtk_emulator *emulator) {
+    int err;
+
+    for (;;) {
+        uint8_t cmd;
+        if ((err = dev_read8(emulator, &cmd)) < 0) {
+            return err;
+        }
+
+        uint32_t value;
+        switch (cmd) {
+        case MTK_PRELOADER_CMD_GET_HW_CODE:
+            if ((err = dev_write8(emulator, cmd)) < 0 || (err = dev_write16(emulator, emulator->config.hw_code)) < 0) {
+                return err;
+            }
+            err = dev_write16(emulator, 0);
+            break;
+
+        case MTK_PRELOADER_CMD_GET_HW_SW_VER:
+            if ((err = dev_write8(emulator, cmd)) < 0 || (err = dev_write16(emulator, 0x8a00)) < 0 || (err = dev_write16(emulator, MTK_EMULATOR_HW_VER)) < 0 ||
+                (err = dev_write16(emulator, MTK_EMULATOR_SW_VER)) < 0) {
+                return err;
+            }
+            err = dev_write16(emulator, 0);
+            break;
+
+        case MTK_PRELOADER_CMD_GET_TARGET_CONFIG:
+            if ((err = dev_write8(emulator, cmd)) < 0 || (err = dev_write32(emulator, 0)) < 0) {
+                return err;
+            }
+            err = dev_write16(emulator, 0);
+            break;
+
+        // preloader and BROM versions
+        case 0xfe:
+            err = dev_write8(emulator, 0x01);
+            break;
+        case 0xff:
+            err = dev_write8(emulator, 0xff);
+            break;
+
+        case MTK_PRELOADER_CMD_WRITE32: {
+            uint32_t addr, len32;
+            if ((err = dev_write8(emulator, cmd)) < 0 || (err = dev_echo32(emulator, &addr)) < 0 || (err = dev_echo32(emulator, &len32)) < 0 ||
+                (err = dev_write16(emulator, 0)) < 0) {
+                return err;
+            }
+            // register writes (the watchdog) have no effect
+            for (uint32_t i = 0; i < len32 && err == 0; i++) {
+                err = dev_echo32(emulator, &value);
+            }
+            if (err == 0) {
+                err = dev_write16(emulator, 0);
+            }
+            break;
+        }
+
+        case MTK_PRELOADER_CMD_SEND_DA:
+            if ((err = dev_write8(emulator, cmd)) < 0) {
+                return err;
+            }
+            err = run_send_da(emulator);
+            break;
+
+        case MTK_PRELOADER_CMD_JUMP_DA:
+            if ((err = dev_write8(emulator, cmd)) < 0 || (err = dev_echo32(emulator, &value)) < 0) {
+                return err;
+            }
+            return dev_write16(emulator, 0);
+
+        default:
+            if ((err = dev_write8(emulator, cmd)) < 0) {
+                return err;
+            }
+            err = dev_write16(emulator, EMU_STATUS_UNSUPPORTED);
+            break;
+        }
+
+        if (err < 0) {
+            return err;
+        }
+    }
+}
+
+// DA
+
+static void put_be(uint8_t *data, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = value >> (8 * (size - 1 - i));
+    }
+}
+
+// ret, boot1, boot2, rpmb, gp1-4 and user area sizes, CID and firmware version, all big-endian
+static void fill_emmc_report(const mtk_emulator *emulator, uint8_t *report) {
+    put_be(report, 0, 4);
+    for (uint8_t part = MTK_DA_EMMC_PART_BOOT1; part <= MTK_DA_EMMC_PART_USER; part++) {
+        put_be(report + 4 + (part - 1) * 8, area_size(emulator, part), 8);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        put_be(report + 68 + i * 4, emu_cid[i], 4);
+    }
+    memcpy(report + 84, "EMULATED", 8);
+}
+
+// Sync, then receive DA Stage 2 and send the flash info reports.
+static int run_da_stage1(mtk_emulator *emulator) {
+    int err;
+
+    if ((err = dev_write8(emulator, MTK_DA_SYNC_CHAR)) < 0 || (err = dev_write32(emulator, MTK_DA_NAND_NOT_FOUND)) < 0 ||
+        (err = dev_write16(emulator, 0)) < 0 || (err = dev_write32(emulator, 0)) < 0) {
+        return err;
+    }
+    for (size_t i = 0; i < 4; i++) {
+        if ((err = dev_write32(emulator, emu_cid[i])) < 0) {
+            return err;
+        }
+    }
+
+    uint8_t ack;
+    if ((err = dev_read8(emulator, &ack)) < 0) {
+        return err;
+    }
+    if ((err = dev_write8(emulator, 3)) < 0 || (err = dev_write8(emulator, 1)) < 0 || (err = dev_write8(emulator, 0)) < 0) {
+        return err;
+    }
+
+    uint8_t config[MTK_DA_DEVICE_CONFIG_SIZE];
+    if ((err = dev_read(emulator, config, sizeof(config))) < 0 || (err = dev_write32(emulator, 0)) < 0) {
+        return err;
+    }
+
+    uint32_t addr, len, packet;
+    if ((err = dev_read32(emulator, &addr)) < 0 || (err = dev_read32(emulator, &len)) < 0 || (err = dev_read32(emulator, &packet)) < 0) {
+        return err;
+    }
+    if (packet == 0 || packet > MTK_EMULATOR_MAX_PACKET) {
+        return dev_write8(emulator, MTK_DA_NACK);
+    }
+    if ((err = dev_write8(emulator, MTK_DA_ACK)) < 0) {
+        return err;
+    }
+
+    for (uint32_t offset = 0; offset < len; offset += packet) {
+        if ((err = dev_read(emulator, emulator->packet, MIN(packet, len - offset))) < 0 || (err = dev_write8(emulator, MTK_DA_ACK)) < 0) {
+            return err;
+        }
+    }
+
+    if ((err = dev_read8(emulator, &ack)) < 0 || (err = dev_write8(emulator, MTK_DA_ACK)) < 0) {
+        return err;
+    }
+
+    for (size_t i = 0; i < sizeof(report_sizes); i++) {
+        uint8_t report[0x100] = { 0 };
+        if (i == MTK_DA_EMMC_REPORT) {
+            fill_emmc_report(emulator, report);
+        }
+        if ((err = dev_write(emulator, report, report_sizes[i])) < 0) {
+            return err;
+        }
+    }
+
+    uint8_t passinfo[sizeof(struct passinfo)] = { MTK_DA_ACK };
+    passinfo[sizeof(passinfo) - 1] = MTK_DA_SOC_OK;
+    return dev_write(emulator, passinfo, sizeof(passinfo));
+}
+
+static int run_read(mtk_emulator *emulator) {
+    uint8_t host_os, hw_storage;
+    uint64_t addr, len;
+    uint32_t packet;
+    int err;
+
+    if ((err = dev_read8(emulator, &host_os)) < 0 || (err = dev_read8(emulator, &hw_storage)) < 0 || (err = dev_read_be(emulator, &addr, 8)) < 0 ||
+        (err = dev_read_be(emulator, &len, 8)) < 0) {
+        return err;
+    }
+    if (!area_contains(emulator, emulator->part, addr, len)) {
+        return dev_write8(emulator, MTK_DA_NACK);
+    }
+    if ((err = dev_write8(emulator, MTK_DA_ACK)) < 0 || (err = dev_read32(emulator, &packet)) < 0) {
+        return err;
+    }
+    if (packet == 0 || packet > MTK_EMULATOR_MAX_PACKET) {
+        return dev_write8(emulator, MTK_DA_NACK);
+    }
+
+    for (uint64_t offset = 0; offset < len;) {
+        size_t count = MIN((uint64_t)packet, len - offset);
+        if ((err = storage_transfer(emulator, false, emulator->part, addr + offset, emulator->packet, count)) < 0) {
+            return err;
+        }
+        if ((err = dev_write(emulator, emulator->packet, count)) < 0 || (err = dev_write16(emulator, mtk_da_checksum(0, emulator->packet, count))) < 0) {
+            return err;
+        }
+
+        uint8_t reply;
+        if ((err = dev_read8(emulator, &reply)) < 0) {
+            return err;
+        }
+        // a refused packet ends the command; the host reissues it from there
+        if (reply != MTK_DA_ACK) {
+            return 0;
+        }
+        offset += count;
+    }
+
+    return 0;
+}
+
+static int run_write_data(mtk_emulator *emulator) {
+    uint8_t storage_type, part;
+    uint64_t addr, len;
+    uint32_t packet;
+    int err;
+
+    if ((err = dev_read8(emulator, &storage_type)) < 0 || (err = dev_read8(emulator, &part)) < 0 || (err = dev_read_be(emulator, &addr, 8)) < 0 ||
+        (err = dev_read_be(emulator, &len, 8)) < 0 || (err = dev_read32(emulator, &packet)) < 0) {
+        return err;
+    }
+    if (!area_contains(emulator, part, addr, len) || packet == 0 || packet > MTK_EMULATOR_MAX_PACKET) {
+        return dev_write8(emulator, MTK_DA_NACK);
+    }
+    if ((err = dev_write8(emulator, MTK_DA_ACK)) < 0) {
+        return err;
+    }
+
+    for (uint64_t offset = 0; offset < len;) {
+        uint8_t ack;
+        if ((err = dev_read8(emulator, &ack)) < 0) {
+            return err;
+        }
+        if (ack != MTK_DA_ACK) {
+            return 0;
+        }
+
+        size_t count = MIN((uint64_t)packet, len - offset);
+        uint64_t chksum;
+        if ((err = dev_read(emulator, emulator->packet, count)) < 0 || (err = dev_read_be(emulator, &chksum, 2)) < 0) {
+            return err;
+        }
+        if (chksum != mtk_da_checksum(0, emulator->packet, count)) {
+            return dev_write8(emulator, MTK_DA_NACK);
+        }
+
+        if ((err = storage_transfer(emulator, true, part, addr + offset, emulator->packet, count)) < 0) {
+            return err;
+        }
+        // charged to the link model, which is the only clock the emulator has
+        if ((addr + offset) % EMU_ERASE_GROUP_SIZE != 0) {
+            link_transfer(emulator, EMU_ERASE_GROUP_SIZE);
+        }
+        if ((addr + offset + count) % EMU_ERASE_GROUP_SIZE != 0) {
+            link_transfer(emulator, EMU_ERASE_GROUP_SIZE);
+        }
+        if ((err = dev_write8(emulator, MTK_DA_CONT_CHAR)) < 0) {
+            return err;
+        }
+        offset += count;
+    }
+
+    return 0;
+}
+
+// Erases to zeroes, reporting status and percentage done whenever the percentage changes.
+static int run_format(mtk_emulator *emulator) {
+    uint8_t storage_type, part;
+    uint64_t addr, len;
+    int err;
+
+    if ((err = dev_read8(emulator, &storage_type)) < 0 || (err = dev_read8(emulator, &part)) < 0 || (err = dev_read_be(emulator, &addr, 8)) < 0 ||
+        (err = dev_read_be(emulator, &len, 8)) < 0) {
+        return err;
+    }
+    if (!area_contains(emulator, part, addr, len)) {
+        return dev_write8(emulator, MTK_DA_NACK);
+    }
+    if ((err = dev_write8(emulator, MTK_DA_ACK)) < 0) {
+        return err;
+    }
+
+    memset(emulator->packet, 0, MTK_EMULATOR_MAX_PACKET);
+
+    uint8_t reported = 0;
+    for (uint64_t offset = 0; reported < 100;) {
+        size_t count = MIN((uint64_t)MTK_EMULATOR_MAX_PACKET, len - offset);
+        if ((err = storage_transfer(emulator, true, part, addr + offset, emulator->packet, count)) < 0) {
+            return err;
+        }
+        offset += count;
+
+        uint8_t percent = offset == len ? 100 : offset * 100 / len;
+        if (percent == reported) {
+            continue;
+        }
+        uint8_t ack;
+        if ((err = dev_write32(emulator, 0)) < 0 || (err = dev_write8(emulator, percent)) < 0 || (err = dev_read8(emulator, &ack)) < 0) {
+            return err;
+        }
+        reported = percent;
+    }
+
+    return dev_write8(emulator, MTK_DA_ACK);
+}
+
+// Answers DA Stage 2 commands until the watchdog reboots the device.
+static int run_da_stage2(mtk_emulator *emulator) {
+    int err;
+
+    for (;;) {
+        uint8_t cmd;
+        if ((err = dev_read8(emulator, &cmd)) < 0) {
+            return err;
+        }
+
+        switch (cmd) {
+        case MTK_DA_USB_CHECK_STATUS_CMD:
+            if ((err = dev_write8(emulator, MTK_DA_ACK)) < 0) {
+                return err;
+            }
+            err = dev_write8(emulator, 1);
+            break;
+
+        case MTK_DA_SWITCH_PART_CMD: {
+            uint8_t part;
+            if ((err = dev_write8(emulator, MTK_DA_ACK)) < 0 || (err = dev_read8(emulator, &part)) < 0) {
+                return err;
+            }
+            bool valid = area_size(emulator, part) > 0;
+            if (valid) {
+                emulator->part = part;
+            }
+            err = dev_write8(emulator, valid ? MTK_DA_ACK : MTK_DA_NACK);
+            break;
+        }
+
+        case MTK_DA_READ_CMD:
+            err = run_read(emulator);
+            break;
+
+        case MTK_DA_SDMMC_WRITE_DATA_CMD:
+            err = run_write_data(emulator);
+            break;
+
+        case MTK_DA_FORMAT_CMD:
+            if ((err = dev_write8(emulator, MTK_DA_ACK)) < 0) {
+                return err;
+            }
+            err = run_format(emulator);
+            break;
+
+        case MTK_DA_ENABLE_WATCHDOG_CMD: {
+            uint8_t params[8];
+            if ((err = dev_read(emulator, params, sizeof(params))) < 0) {
+                return err;
+            }
+            return dev_write8(emulator, MTK_DA_ACK);
+        }
+
+        default:
+            err = dev_write8(emulator, MTK_DA_NACK);
+            break;
+        }
+
+        if (err < 0) {
+            return err;
+        }
+    }
+}
+
+static void *emulator_run(void *user_data) {
+    mtk_emulator *emulator = user_data;
+
+    int err = 0;
+    switch (emulator->config.state) {
+    case MTK_EMULATOR_STATE_NONE:
+        if ((err = run_start(emulator)) < 0) {
+            break;
+        }
+        /* fallthrough */
+    case MTK_EMULATOR_STATE_PRELOADER:
+        if ((err = run_preloader(emulator)) < 0) {
+            break;
+        }
+        err = run_da_stage1(emulator);
+        break;
+    case MTK_EMULATOR_STATE_DA_STAGE2:
+        break;
+    }
+    if (err == 0) {
+        err = run_da_stage2(emulator);
+    }
+    if (err < 0 && err != -ECANCELED) {
+        verboseLog("Emulator stopped: %s\n", strerror(-err));
+    }
+
+    pthread_mutex_lock(&emulator->lock);
+    emulator->gone = true;
+    pthread_cond_broadcast(&emulator->cond);
+    pthread_mutex_unlock(&emulator->lock);
+
+    return NULL;
+}
+
+int mtk_emulator_open(mtk_emulator **emulator, const mtk_emulator_config *config) {
+    mtk_emulator *e = calloc(1, sizeof(mtk_emulator));
+    if (e == NULL) {
+        return -ENOMEM;
+    }
+    e->config = *config;
+    if (e->config.hw_code == 0) {
+        e->config.hw_code = MTK_EMULATOR_HW_CODE;
+    }
+    e->part = MTK_DA_EMMC_PART_USER;
+
+    e->fd = open(config->image, O_RDWR | O_BINARY);
+    if (e->fd < 0) {
+        int err = -errno;
+        free(e);
+        return err;
+    }
+
+    struct stat st;
+    e->packet = malloc(MTK_EMULATOR_MAX_PACKET);
+    if (fstat(e->fd, &st) < 0 || e->packet == NULL) {
+        int err = e->packet == NULL ? -ENOMEM : -errno;
+        close(e->fd);
+        free(e->packet);
+        free(e);
+        return err;
+    }
+    e->user_size = st.st_size;
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+
+    int err = pthread_create(&e->thread, NULL, emulator_run, e);
+    if (err != 0) {
+        pthread_cond_destroy(&e->cond);
+        pthread_mutex_destroy(&e->lock);
+        close(e->fd);
+        free(e->packet);
+        free(e);
+        return -err;
+    }
+
+    *emulator = e;
+    return 0;
+}
+
+void mtk_emulator_close(mtk_emulator *emulator) {
+    if (emulator == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&emulator->lock);
+    emulator->closing = true;
+    pthread_cond_broadcast(&emulator->cond);
+    pthread_mutex_unlock(&emulator->lock);
+    pthread_join(emulator->thread, NULL);
+
+    // transfers still pending are dropped without a callback, like on a closed libusb device handle
+    while (emulator->pending != NULL) {
+        emu_transfer *node = emulator->pending;
+        emulator->pending = node->next;
+        node->transfer->priv = NULL;
+        free(node);
+    }
+
+    pthread_cond_destroy(&emulator->cond);
+    pthread_mutex_destroy(&emulator->lock);
+    close(emulator->fd);
+    for (size_t i = 0; i < sizeof(emulator->areas) / sizeof(emulator->areas[0]); i++) {
+        free(emulator->areas[i].data);
+    }
+    free(emulator->in.data);
+    free(emulator->out.data);
+    free(emulator->packet);
+    free(emulator);
+}
+
+void mtk_emulator_attach(mtk_emulator *emulator, mtk_device *device) { mtk_device_open_transport(device, &emu_transport, emulator); }
@@ -0,0 +1,174 @@
+#include "mtk_metrics.h"
+
+#include <errno.h>
+#include <inttypes.h>
+
+#include "util.h"
+
+typedef struct {
+    uint64_t buckets[MTK_METRICS_BUCKETS];
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} histogram;
+
+static const char *const stage_names[MTK_METRICS_STAGES] = {
+    [MTK_METRICS_READ_USB] = "read_usb",
+    [MTK_METRICS_READ_CHECKSUM] = "read_checksum",
+    [MTK_METRICS_READ_HANDLER] = "read_handler",
+    [MTK_METRICS_WRITE_HANDLER] = "write_handler",
+    [MTK_METRICS_WRITE_USB] = "write_usb",
+    [MTK_METRICS_WRITE_CHECKSUM] = "write_checksum",
+    [MTK_METRICS_WRITE_ACK] = "write_ack",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// histogram bounds exported as Prometheus buckets: powers of two from 1.024 us to 68.7 s
+#define EXPORT_FIRST_SHIFT (10)
+#define EXPORT_LAST_SHIFT (36)
+
+static bool metrics_enabled = false;
+static histogram histograms[MTK_METRICS_STAGES];
+static uint64_t counters[MTK_METRICS_COUNTERS];
+
+static size_t bucket_index(uint64_t value) {
+    if (value < (1 << MTK_METRICS_SUB_BITS)) {
+        return value;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - MTK_METRICS_SUB_BITS;
+    return ((size_t)(shift + 1) << MTK_METRICS_SUB_BITS) + (value >> shift) - (1 << MTK_METRICS_SUB_BITS);
+}
+
+// largest value that lands in the bucket
+static uint64_t bucket_highest(size_t index) {
+    if (index < (1 << MTK_METRICS_SUB_BITS)) {
+        return index;
+    }
+
+    int shift = (index >> MTK_METRICS_SUB_BITS) - 1;
+    uint64_t lowest = (uint64_t)((1 << MTK_METRICS_SUB_BITS) + (index & ((1 << MTK_METRICS_SUB_BITS) - 1))) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+void mtk_metrics_enable(void) { metrics_enabled = true; }
+
+bool mtk_metrics_enabled(void) { return metrics_enabled; }
+
+uint64_t mtk_metrics_now(void) { return metrics_enabled ? monotonic_ns() : 0; }
+
+void mtk_metrics_record(mtk_metrics_stage stage, uint64_t start) {
+    if (!metrics_enabled) {
+        return;
+    }
+
+    uint64_t elapsed = monotonic_ns() - start;
+    histogram *h = &histograms[stage];
+
+    __atomic_fetch_add(&h->buckets[bucket_index(elapsed)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, elapsed, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max && !__atomic_compare_exchange_n(&h->max_ns, &max, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void mtk_metrics_count(mtk_metrics_counter counter, uint64_t value) {
+    if (metrics_enabled) {
+        __atomic_fetch_add(&counters[counter], value, __ATOMIC_RELAXED);
+    }
+}
+
+// Snapshot of one histogram, so cumulative bucket counts stay consistent while other threads record.
+static uint64_t snapshot(const histogram *h, uint64_t buckets[MTK_METRICS_BUCKETS]) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < MTK_METRICS_BUCKETS; i++) {
+        buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        count += buckets[i];
+    }
+    return count;
+}
+
+static uint64_t quantile_value(const uint64_t buckets[MTK_METRICS_BUCKETS], uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(q * count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < MTK_METRICS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return bucket_highest(i);
+        }
+    }
+    return 0;
+}
+
+// not reentrant; callers serialize exports
+int mtk_metrics_write(FILE *f) {
+    static uint64_t buckets[MTK_METRICS_STAGES][MTK_METRICS_BUCKETS];
+    uint64_t counts[MTK_METRICS_STAGES];
+
+    for (int s = 0; s < MTK_METRICS_STAGES; s++) {
+        counts[s] = snapshot(&histograms[s], buckets[s]);
+    }
+
+    fprintf(f, "# HELP mtk_chunk_stage_seconds Time spent on one chunk in a stage of a DA read or write.\n");
+    fprintf(f, "# TYPE mtk_chunk_stage_seconds histogram\n");
+    for (int s = 0; s < MTK_METRICS_STAGES; s++) {
+        uint64_t cumulative = 0;
+        size_t i = 0;
+        for (int shift = EXPORT_FIRST_SHIFT; shift <= EXPORT_LAST_SHIFT; shift++) {
+            for (size_t end = bucket_index((uint64_t)1 << shift); i < end; i++) {
+                cumulative += buckets[s][i];
+            }
+            fprintf(f, "mtk_chunk_stage_seconds_bucket{stage=\"%s\",le=\"%.12g\"} %" PRIu64 "\n", stage_names[s], ((uint64_t)1 << shift) / 1e9, cumulative);
+        }
+        fprintf(f, "mtk_chunk_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", stage_names[s], counts[s]);
+        fprintf(f, "mtk_chunk_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], __atomic_load_n(&histograms[s].sum_ns, __ATOMIC_RELAXED) / 1e9);
+        fprintf(f, "mtk_chunk_stage_seconds_count{stage=\"%s\"} %" PRIu64 "\n", stage_names[s], counts[s]);
+    }
+
+    // full-resolution quantiles; the exported buckets above are coarser
+    fprintf(f, "# HELP mtk_chunk_stage_quantile_seconds Chunk stage latency quantiles, within about 6%%.\n");
+    fprintf(f, "# TYPE mtk_chunk_stage_quantile_seconds gauge\n");
+    for (int s = 0; s < MTK_METRICS_STAGES; s++) {
+        if (counts[s] == 0) {
+            continue;
+        }
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            fprintf(f, "mtk_chunk_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9g\n", stage_names[s], quantiles[q],
+                quantile_value(buckets[s], counts[s], quantiles[q]) / 1e9);
+        }
+    }
+
+    fprintf(f, "# HELP mtk_chunk_stage_max_seconds Slowest chunk seen in each stage.\n");
+    fprintf(f, "# TYPE mtk_chunk_stage_max_seconds gauge\n");
+    for (int s = 0; s < MTK_METRICS_STAGES; s++) {
+        fprintf(f, "mtk_chunk_stage_max_seconds{stage=\"%s\"} %.9g\n", stage_names[s], __atomic_load_n(&histograms[s].max_ns, __ATOMIC_RELAXED) / 1e9);
+    }
+
+    fprintf(f, "# HELP mtk_usb_bytes_total Bytes moved over the bulk endpoints.\n");
+    fprintf(f, "# TYPE mtk_usb_bytes_total counter\n");
+    fprintf(f, "mtk_usb_bytes_total{direction=\"in\"} %" PRIu64 "\n", __atomic_load_n(&counters[MTK_METRICS_BYTES_READ], __ATOMIC_RELAXED));
+    fprintf(f, "mtk_usb_bytes_total{direction=\"out\"} %" PRIu64 "\n", __atomic_load_n(&counters[MTK_METRICS_BYTES_WRITTEN], __ATOMIC_RELAXED));
+
+    fprintf(f, "# HELP mtk_retries_total DA reads and writes reissued after a transport error.\n");
+    fprintf(f, "# TYPE mtk_retries_total counter\n");
+    fprintf(f, "mtk_retries_total %" PRIu64 "\n", __atomic_load_n(&counters[MTK_METRICS_RETRIES], __ATOMIC_RELAXED));
+
+    fprintf(f, "# HELP mtk_timeouts_total Bulk transfers that timed out.\n");
+    fprintf(f, "# TYPE mtk_timeouts_total counter\n");
+    fprintf(f, "mtk_timeouts_total %" PRIu64 "\n", __atomic_load_n(&counters[MTK_METRICS_TIMEOUTS], __ATOMIC_RELAXED));
+
+    fprintf(f, "# HELP mtk_checksum_errors_total Chunks rejected for a checksum mismatch, in either direction.\n");
+    fprintf(f, "# TYPE mtk_checksum_errors_total counter\n");
+    fprintf(f, "mtk_checksum_errors_total %" PRIu64 "\n", __atomic_load_n(&counters[MTK_METRICS_CHECKSUM_ERRORS], __ATOMIC_RELAXED));
+
+    if (fflush(f) != 0 || ferror(f)) {
+        return -errno;
+    }
+
+    return 0;
+}
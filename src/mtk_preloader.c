@@ -2,18 +2,101 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <libusb.h>
 
+#include "mtk_trace.h"
 #include "util.h"
 
+uint16_t mtk_preloader_checksum(uint16_t chksum, const uint8_t *buffer, size_t count) {
+    // XOR whole 64-bit little-endian words, then fold the four 16-bit lanes together
+    uint64_t acc = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc ^= (uint64_t)buffer[i] | (uint64_t)buffer[i + 1] << 8 | (uint64_t)buffer[i + 2] << 16 | (uint64_t)buffer[i + 3] << 24 |
+            (uint64_t)buffer[i + 4] << 32 | (uint64_t)buffer[i + 5] << 40 | (uint64_t)buffer[i + 6] << 48 | (uint64_t)buffer[i + 7] << 56;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    chksum ^= (uint16_t)acc;
+
+    for (; i + 2 <= count; i += 2) {
+        chksum ^= buffer[i] | buffer[i + 1] << 8;
+    }
+    if (i < count) {
+        chksum ^= buffer[i];
+    }
+
+    return chksum;
+}
+
+// Sends a command byte and its 32-bit arguments, each echoed by the preloader.
+static int echo_command(mtk_device *device, uint8_t cmd, const uint32_t *args, size_t count) {
+    int err;
+
+    if (!device->echo_pipeline) {
+        if ((err = mtk_device_echo8(device, cmd)) < 0) {
+            return err;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if ((err = mtk_device_echo32(device, args[i])) < 0) {
+                return err;
+            }
+        }
+        return 0;
+    }
+
+    uint8_t batch[1 + 4 * 4];
+    size_t size = 0;
+    batch[size++] = cmd;
+    for (size_t i = 0; i < count; i++) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            batch[size++] = args[i] >> shift;
+        }
+    }
+
+    return mtk_device_echo(device, batch, size);
+}
+
+// Sends data words, each echoed by the preloader; pipelined in batches of MTK_PRELOADER_PIPELINE_WORDS.
+static int echo_words(mtk_device *device, const uint32_t *words, size_t count) {
+    int err;
+
+    if (!device->echo_pipeline) {
+        for (size_t i = 0; i < count; i++) {
+            if ((err = mtk_device_echo32(device, words[i])) < 0) {
+                return err;
+            }
+        }
+        return 0;
+    }
+
+    uint8_t batch[MTK_PRELOADER_PIPELINE_WORDS * 4];
+    for (size_t i = 0; i < count;) {
+        size_t size = 0;
+        for (; i < count && size < sizeof(batch); i++) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                batch[size++] = words[i] >> shift;
+            }
+        }
+        if ((err = mtk_device_echo(device, batch, size)) < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
 // handshake
 int mtk_preloader_start(mtk_device *device) {
+    MTK_TRACE_SCOPE("preloader_start");
+
     static const uint8_t start_command[] = { 0xa0, 0x0a, 0x50, 0x05 };
 
     int err;
 
-    if ((err = libusb_control_transfer(device->dev, LIBUSB_REQUEST_TYPE_CLASS, 0x20, 0, 0, NULL, 0, 0)) < 0) {
+    if ((err = device->transport->control(device->transport_ctx, LIBUSB_REQUEST_TYPE_CLASS, 0x20, 0, 0)) < 0) {
         return err;
     }
 
@@ -96,16 +179,49 @@ int mtk_preloader_get_hw_sw_ver(mtk_device *device, uint16_t *hw_subcode, uint16
     return 0;
 }
 
-int mtk_preloader_write32(mtk_device *device, uint32_t base_addr, uint32_t len32, const uint32_t *data, uint16_t *status) {
+int mtk_preloader_probe_pipeline(mtk_device *device) {
+    static const uint8_t probe[] = { MTK_PRELOADER_CMD_GET_HW_CODE, MTK_PRELOADER_CMD_GET_HW_CODE };
+
     int err;
 
-    if ((err = mtk_device_echo8(device, MTK_PRELOADER_CMD_WRITE32)) < 0) {
+    device->echo_pipeline = false;
+
+    if ((err = mtk_device_write(device, probe, sizeof(probe))) < 0) {
+        return err;
+    }
+
+    // echo, hw code and status for each command
+    uint8_t reply[2][5];
+    if ((err = mtk_device_read(device, reply[0], sizeof(reply[0]))) < 0) {
         return err;
     }
-    if ((err = mtk_device_echo32(device, base_addr)) < 0) {
+    if (reply[0][0] != probe[0]) {
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    // a preloader that dropped the second command has nothing more to say and is back at its command loop
+    err = mtk_device_read(device, reply[1], sizeof(reply[1]));
+    if (err == LIBUSB_ERROR_TIMEOUT) {
+        return 0;
+    }
+    if (err < 0) {
         return err;
     }
-    if ((err = mtk_device_echo32(device, len32)) < 0) {
+
+    if (memcmp(reply[0], reply[1], sizeof(reply[0])) != 0) {
+        // garbled second reply; start over from a drained pipe
+        return mtk_device_recover(device);
+    }
+
+    device->echo_pipeline = true;
+    return 1;
+}
+
+int mtk_preloader_write32(mtk_device *device, uint32_t base_addr, uint32_t len32, const uint32_t *data, uint16_t *status) {
+    int err;
+
+    const uint32_t args[] = { base_addr, len32 };
+    if ((err = echo_command(device, MTK_PRELOADER_CMD_WRITE32, args, 2)) < 0) {
         return err;
     }
     if ((err = mtk_device_read16(device, status)) < 0) {
@@ -113,10 +229,8 @@ int mtk_preloader_write32(mtk_device *device, uint32_t base_addr, uint32_t len32
     }
 
     if (*status == 0) {
-        for (size_t i = 0; i < len32; i++) {
-            if ((err = mtk_device_echo32(device, data[i])) < 0) {
-                return err;
-            }
+        if ((err = echo_words(device, data, len32)) < 0) {
+            return err;
         }
         if ((err = mtk_device_read16(device, status)) < 0) {
             return err;
@@ -131,22 +245,41 @@ int mtk_preloader_disable_wdt(mtk_device *device, uint16_t *status) {
     return mtk_preloader_write32(device, 0x10007000, 1, &data32, status);
 }
 
-int mtk_preloader_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, uint16_t *status, const mtk_io_handler handler, void *user_data) {
+static int send_da_command(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, uint16_t *status) {
     int err;
 
-    if ((err = mtk_device_echo8(device, MTK_PRELOADER_CMD_SEND_DA)) < 0) {
+    const uint32_t args[] = { da_addr, da_len, sig_len };
+    if ((err = echo_command(device, MTK_PRELOADER_CMD_SEND_DA, args, 3)) < 0) {
         return err;
     }
-    if ((err = mtk_device_echo32(device, da_addr)) < 0) {
+
+    return mtk_device_read16(device, status);
+}
+
+static int send_da_finish(mtk_device *device, uint16_t chksum, uint16_t *status) {
+    int err;
+
+    uint16_t chksum_device;
+    if ((err = mtk_device_read16(device, &chksum_device)) < 0) {
         return err;
     }
-    if ((err = mtk_device_echo32(device, da_len)) < 0) {
+    if ((err = mtk_device_read16(device, status)) < 0) {
         return err;
     }
-    if ((err = mtk_device_echo32(device, sig_len)) < 0) {
-        return err;
+
+    if (chksum != chksum_device) {
+        return LIBUSB_ERROR_OTHER;
     }
-    if ((err = mtk_device_read16(device, status)) < 0) {
+
+    return 0;
+}
+
+int mtk_preloader_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, uint16_t *status, const mtk_io_handler handler, void *user_data) {
+    MTK_TRACE_SCOPE_RANGE("preloader_send_da", da_addr, da_len);
+
+    int err;
+
+    if ((err = send_da_command(device, da_addr, da_len, sig_len, status)) < 0) {
         return err;
     }
 
@@ -166,40 +299,43 @@ int mtk_preloader_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len,
                 return err;
             }
 
-            for (size_t i = 0; i < (count >> 1); i++) {
-                chksum ^= buffer[(i << 1)];
-                chksum ^= buffer[(i << 1) + 1] << 8;
-            }
-            if (count & 1) {
-                chksum ^= buffer[count - 1];
-            }
+            chksum = mtk_preloader_checksum(chksum, buffer, count);
 
             offset += count;
         }
 
-        uint16_t chksum_device;
-        if ((err = mtk_device_read16(device, &chksum_device)) < 0) {
-            return err;
-        }
-        if ((err = mtk_device_read16(device, status)) < 0) {
+        return send_da_finish(device, chksum, status);
+    }
+
+    return 0;
+}
+
+int mtk_preloader_send_da_from(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, const uint8_t *data, uint16_t chksum, uint16_t *status) {
+    MTK_TRACE_SCOPE_RANGE("preloader_send_da", da_addr, da_len);
+
+    int err;
+
+    if ((err = send_da_command(device, da_addr, da_len, sig_len, status)) < 0) {
+        return err;
+    }
+
+    if (*status == 0) {
+        if ((err = mtk_device_write(device, data, da_len)) < 0) {
             return err;
         }
 
-        if (chksum != chksum_device) {
-            return LIBUSB_ERROR_OTHER;
-        }
+        return send_da_finish(device, chksum, status);
     }
 
     return 0;
 }
 
 int mtk_preloader_jump_da(mtk_device *device, uint32_t da_addr, uint16_t *status) {
+    MTK_TRACE_SCOPE("preloader_jump_da");
+
     int err;
 
-    if ((err = mtk_device_echo8(device, MTK_PRELOADER_CMD_JUMP_DA)) < 0) {
-        return err;
-    }
-    if ((err = mtk_device_echo32(device, da_addr)) < 0) {
+    if ((err = echo_command(device, MTK_PRELOADER_CMD_JUMP_DA, &da_addr, 1)) < 0) {
         return err;
     }
     if ((err = mtk_device_read16(device, status)) < 0) {
@@ -0,0 +1,92 @@
+#include "mtk_trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "util.h"
+
+typedef struct {
+    const char *name;
+    uint64_t start_us;
+    uint64_t dur_us;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t tid;
+} trace_event;
+
+static bool trace_enabled = false;
+static uint64_t trace_origin_us;
+static trace_event trace_events[MTK_TRACE_MAX_EVENTS];
+static size_t trace_count;
+static size_t trace_dropped;
+static __thread uint32_t trace_tid = 1;
+
+void mtk_trace_enable(void) {
+    trace_origin_us = monotonic_us();
+    trace_enabled = true;
+}
+
+// Events recorded by the calling thread are shown on their own track.
+void mtk_trace_set_thread(uint32_t tid) { trace_tid = tid; }
+
+mtk_trace_span mtk_trace_begin(const char *name) { return mtk_trace_begin_range(name, 0, 0); }
+
+mtk_trace_span mtk_trace_begin_range(const char *name, uint64_t addr, uint64_t len) {
+    mtk_trace_span span = {
+        .name = name,
+        .start_us = trace_enabled ? monotonic_us() : 0,
+        .addr = addr,
+        .len = len,
+    };
+    return span;
+}
+
+void mtk_trace_end(mtk_trace_span *span) {
+    if (!trace_enabled) {
+        return;
+    }
+
+    uint64_t now = monotonic_us();
+
+    size_t i = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED);
+    if (i >= MTK_TRACE_MAX_EVENTS) {
+        __atomic_fetch_add(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    trace_events[i].name = span->name;
+    trace_events[i].start_us = span->start_us - trace_origin_us;
+    trace_events[i].dur_us = now - span->start_us;
+    trace_events[i].addr = span->addr;
+    trace_events[i].len = span->len;
+    trace_events[i].tid = trace_tid;
+}
+
+// Chrome trace-event format, loadable in chrome://tracing and Perfetto
+int mtk_trace_write(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -errno;
+    }
+
+    size_t count = MIN(trace_count, (size_t)MTK_TRACE_MAX_EVENTS);
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%zu},\"traceEvents\":[\n", trace_dropped);
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"flash_tool\"}}");
+    for (size_t i = 0; i < count; i++) {
+        const trace_event *ev = &trace_events[i];
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"mtk\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu32 ",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64, ev->name, ev->tid, ev->start_us, ev->dur_us);
+        if (ev->len != 0) {
+            fprintf(f, ",\"args\":{\"addr\":\"0x%" PRIx64 "\",\"len\":%" PRIu64 "}", ev->addr, ev->len);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}